@@ -26,6 +26,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -42,12 +43,15 @@
 
 
 struct globalargs_t {
-    char *cmd;        /* build|combine|info|query|queryd */ 
+    char *cmd;        /* build|bulk|combine|info|query|queryd */ 
     char *dir_name;   /* directory or file name */
     char *server_addr;/*  meta data db server address - e.g. "tcp://localhost:4000 */ 
     char *index_name; /* name of index to operate on */
     char *dest_index; /* -d destination index to which to add entries from source index */ 
     char *src_index;  /* -s source index to add into the destination index*/ 
+    char *tmp_dir;    /* -w dir for the sorted runs of a bulk build */ 
+    char **src_files; /* index files to fold into index for combine, ids for delete */
+    int nbsrcs;       
     int P;            /* -p number of bits to toggle in creating more candidates to lookup */
     int sr;          
     int blocksize;    /* -b block size for query operation */
@@ -55,11 +59,13 @@ struct globalargs_t {
     int help;         /* -h */
     float nbsecs;     /* -n number seconds of audio to hash from file*/
     float threshold;  /* -t query threshold 0.0-0.10 */ 
+    int mem_mb;       /* -m MB of memory for sorting in a bulk build */ 
+    int nbhot;        /* -k number of hot keys listed by analyze */
     int port;         
 }GlobalArgs;
 
 
-static const char *opt_string = "l:p:t:n:b:d:s:vh?";
+static const char *opt_string = "l:p:t:n:b:d:s:m:w:k:vh?";
 
 static const struct option longOpts[] = {
     { "dbserver", required_argument, NULL, 's'},
@@ -67,6 +73,9 @@ static const struct option longOpts[] = {
     { "blocksize", required_argument,  NULL, 'b'},
     { "nbsecs", required_argument,    NULL, 'n'},
     { "threshold", required_argument, NULL, 't'},
+    { "memory", required_argument,    NULL, 'm'},
+    { "workdir", required_argument,   NULL, 'w'},
+    { "hotkeys", required_argument,   NULL, 'k'},
     { "verbose", no_argument,         NULL, 'v'},
     { "help", no_argument,            NULL, 'h'},
     { "port", required_argument,      NULL,  0},
@@ -89,6 +98,14 @@ int addtoaudioindex(const char *dir_name, const char *idx_name, const int sr, \
 	return -1;
     }
 
+    /* the hashes are kept whole too, to check matches and rebuild from */
+    AudioHashStore hash_store = open_audiohash_store(idx_name, 1, 0);
+    if (hash_store == NULL){
+	fprintf(stderr,"unable to open hash store %s\n", idx_name);
+	close_audioindex(index_table, 1);
+	return -1;
+    }
+
     void *ctx = zmq_init(1);
     if (ctx == NULL){
 	fprintf(stderr,"unable to init zeromq\n");
@@ -156,6 +173,8 @@ int addtoaudioindex(const char *dir_name, const char *idx_name, const int sr, \
 
 	if (insert_into_audioindex(index_table, hash_id, phash, nbframes) < 0){
 	    fprintf(stderr,"fatal error: unable to insert %u into hash\n", hash_id);
+	} else if (add_to_audiohash_store(hash_store, hash_id, phash, nbframes) < 0){
+	    fprintf(stderr,"unable to store hash of %u\n", hash_id);
 	}
 
 
@@ -184,27 +203,368 @@ int addtoaudioindex(const char *dir_name, const char *idx_name, const int sr, \
     if (close_audioindex(index_table, 1) < 0){
 	fprintf(stdout,"error closing audio index\n");
     }
+    if (close_audiohash_store(hash_store) < 0){
+	fprintf(stdout,"error closing hash store\n");
+    }
     close_audiodata_db(mdatastore);
 
     return 0;
 }
 
+int bulkaudioindex(const char *dir_name, const char *idx_name, const int sr, \
+                   const float nbsecs, const unsigned int P){
+
+    char indexfile[FILENAME_MAX];
+    snprintf(indexfile, FILENAME_MAX, "%s.idx", idx_name);
+
+    fprintf(stdout, "build sorted index %s, %d MB sort memory, runs in %s\n",\
+	    indexfile, GlobalArgs.mem_mb, GlobalArgs.tmp_dir);
+    AudioIndexBuilder builder = open_audioindex_builder(GlobalArgs.tmp_dir, GlobalArgs.mem_mb);
+    if (builder == NULL){
+	fprintf(stderr,"unable to get index builder\n");
+	return -1;
+    }
+
+    AudioHashStore hash_store = open_audiohash_store(idx_name, 1, 0);
+    if (hash_store == NULL){
+	fprintf(stderr,"unable to open hash store %s\n", idx_name);
+	close_audioindex_builder(builder, NULL);
+	return -1;
+    }
+
+    void *ctx = zmq_init(1);
+    if (ctx == NULL){
+	fprintf(stderr,"unable to init zeromq\n");
+	close_audioindex_builder(builder, NULL);
+	return -1;
+    }
+
+    AudioDataDB mdatastore = open_audiodata_db(ctx, GlobalArgs.server_addr);
+    if (mdatastore == NULL) {
+	fprintf(stderr,"unable to connect to metadata server\n");
+	close_audioindex_builder(builder, NULL);
+	return -2;
+    }
+
+    unsigned int nbfiles;
+    char **files = readfilenames(dir_name, &nbfiles);
+    if (files == NULL){
+	close_audioindex_builder(builder, NULL);
+	return -3;
+    }
+    printf("number files %u\n", nbfiles);
+
+    float *sigbuf = (float*)malloc(1<<25);
+    unsigned int buflen = (1<<25)/sizeof(float);
+    if (sigbuf == NULL){
+	close_audioindex_builder(builder, NULL);
+	return -4;
+    }
+
+    AudioMetaData mdata;
+    AudioHashStInfo *hash_st = NULL;
+    char inlinestr[512];
+    uint32_t hash_id;
+    unsigned int i;
+    int ret = 0;
+    for (i=0;i<nbfiles;i++){
+        fprintf(stdout,"file[%d]: %s\n", i, files[i]);
+
+	unsigned int tmpbuflen = buflen;
+	int err;
+	float *buf = readaudio(files[i], sr, sigbuf, &tmpbuflen, nbsecs, &mdata, &err);
+	if (buf == NULL){
+	  fprintf(stderr,"unable to read audio, err = %d\n", err);
+	  continue;
+	}
+
+	if (metadata_to_inlinestr(&mdata, inlinestr, 512) < 0){
+	    fprintf(stderr, "ERROR: cannot parse metadata struct\n");
+	    break;
+	}
+	if (store_audiodata(mdatastore, inlinestr, &hash_id)<0){
+	    fprintf(stderr,"ERROR: cannot store metadata\n");
+	    break;
+	}
+
+	uint32_t *phash = NULL;
+	unsigned int nbframes;
+	if (audiohash(buf, &phash, NULL, NULL, NULL, &nbframes,\
+		      NULL, NULL, tmpbuflen,  P, sr, &hash_st) < 0){
+  	    fprintf(stderr,"ERROR:  unable to get audio hash\n");
+	    continue;
+	}
+	fprintf(stdout,"uid = %u, nbframes %u\n", hash_id, nbframes);
+
+	if (add_to_audioindex_builder(builder, hash_id, phash, nbframes) < 0){
+	    fprintf(stderr,"fatal error: unable to add %u to build\n", hash_id);
+	    ret = -5;
+	} else if (add_to_audiohash_store(hash_store, hash_id, phash, nbframes) < 0){
+	    fprintf(stderr,"unable to store hash of %u\n", hash_id);
+	}
+
+	if (buf != sigbuf) ph_free(buf);
+	ph_free(phash);
+	free_mdata(&mdata);
+	if (ret < 0) break;
+    }
+
+    fprintf(stdout,"merge runs into %s\n", indexfile);
+    if (close_audioindex_builder(builder, (ret < 0) ? NULL : indexfile) < 0){
+	fprintf(stdout,"error writing index\n");
+	ret = -6;
+    }
+
+    if (close_audiohash_store(hash_store) < 0){
+	fprintf(stdout,"error closing hash store\n");
+    }
+    ph_hashst_free(hash_st);
+    free(sigbuf);
+    for (i=0;i<nbfiles;i++){
+	free(files[i]);
+    }
+    free(files);
+    close_audiodata_db(mdatastore);
+
+    return ret;
+}
+
+static int add_stored_hash(void *arg, uint32_t id, const uint32_t *hash, int nbframes){
+    return add_to_audioindex_builder((AudioIndexBuilder)arg, id, (uint32_t*)hash, nbframes);
+}
+
+/* build a sorted index from the hashes kept in the store, */
+/* no audio read.  the ids deleted from the index, from the */
+/* tmp index of tblservd or from its segments are left out  */
+int rebuildaudioindex(const char *idx_name){
+
+    char indexfile[FILENAME_MAX], tmpindexfile[FILENAME_MAX];
+    snprintf(indexfile, FILENAME_MAX, "%s.idx", idx_name);
+    snprintf(tmpindexfile, FILENAME_MAX, "%s.tmp", idx_name);
+    const char *del_files[3] = { indexfile, tmpindexfile, idx_name };
+
+    AudioHashStore hash_store = open_audiohash_store(idx_name, 0, 0);
+    if (hash_store == NULL){
+	fprintf(stderr,"no hash store %s\n", idx_name);
+	return -1;
+    }
+    fprintf(stdout, "rebuild sorted index %s, %d MB sort memory, runs in %s\n",\
+	    indexfile, GlobalArgs.mem_mb, GlobalArgs.tmp_dir);
+    AudioIndexBuilder builder = open_audioindex_builder(GlobalArgs.tmp_dir, GlobalArgs.mem_mb);
+    if (builder == NULL){
+	fprintf(stderr,"unable to get index builder\n");
+	close_audiohash_store(hash_store);
+	return -2;
+    }
+    int ret = 0;
+    if (foreach_undeleted_audiohash_store(hash_store, del_files, 3, add_stored_hash, builder) < 0){
+	fprintf(stderr,"unable to add the stored hashes to the build\n");
+	ret = -3;
+    }
+    if (close_audioindex_builder(builder, (ret < 0) ? NULL : indexfile) < 0){
+	fprintf(stdout,"error writing index\n");
+	ret = -4;
+    }
+    close_audiohash_store(hash_store);
+    return ret;
+}
+
+int combineaudioindex(const char *idx_name, char **src_files, const int nbsrcs){
+
+    char indexfile[FILENAME_MAX];
+    snprintf(indexfile, FILENAME_MAX, "%s.idx", idx_name);
+
+    const char **srcs = (const char**)malloc((nbsrcs+1)*sizeof(char*));
+    if (srcs == NULL){
+	return -1;
+    }
+
+    /* fold the sources into the existing index, if any */ 
+    int i, n = 0;
+    struct stat idx_info;
+    if (!stat(indexfile, &idx_info) && idx_info.st_size > 0){
+	srcs[n++] = indexfile;
+    }
+    for (i=0;i<nbsrcs;i++){
+	srcs[n++] = src_files[i];
+    }
+
+    for (i=0;i<n;i++){
+	fprintf(stdout,"source[%d]: %s\n", i, srcs[i]);
+    }
+    int err = combine_audioindex(indexfile, srcs, n);
+    free(srcs);
+    if (err < 0){
+	fprintf(stderr,"unable to combine into %s, err = %d\n", indexfile, err);
+	return -2;
+    }
+    fprintf(stdout,"combined %d files into %s\n", n, indexfile);
+
+    return 0;
+}
+
+int deletefromaudioindex(const char *idx_name, char **ids, const int nbids){
+
+    char indexfile[FILENAME_MAX];
+    snprintf(indexfile, FILENAME_MAX, "%s.idx", idx_name);
+
+    /* every id is checked before any is deleted */
+    int i, ret = 0;
+    uint32_t *delids = (uint32_t*)malloc((nbids > 0 ? nbids : 1)*sizeof(uint32_t));
+    if (delids == NULL) return -1;
+    for (i=0;i<nbids;i++){
+	char *end;
+	errno = 0;
+	unsigned long val = strtoul(ids[i], &end, 10);
+	if (ids[i][0] == '-' || end == ids[i] || *end != '\0' || errno || val > UINT32_MAX){
+	    fprintf(stderr,"bad id %s\n", ids[i]);
+	    free(delids);
+	    return -3;
+	}
+	delids[i] = (uint32_t)val;
+    }
+
+    struct stat idx_info;
+    if (stat(indexfile, &idx_info) || idx_info.st_size == 0){
+	fprintf(stderr,"no index %s\n", indexfile);
+	free(delids);
+	return -1;
+    }
+    AudioIndex index_table = open_audioindex(indexfile, 0, 0);
+    if (index_table == NULL){
+	fprintf(stderr,"unable to open %s\n", indexfile);
+	free(delids);
+	return -1;
+    }
+
+    for (i=0;i<nbids;i++){
+	uint32_t id = delids[i];
+	if (delete_from_audioindex(index_table, id) < 0){
+	    fprintf(stderr,"unable to delete %u from %s (combine a table into a sorted index first)\n",\
+		    id, indexfile);
+	    ret = -2;
+	    break;
+	}
+	fprintf(stdout,"deleted %u\n", id);
+    }
+
+    free(delids);
+    close_audioindex(index_table, 0);
+    return ret;
+}
+
 void print_audioindex_info(const char *idx_name){
 
     char indexfile[FILENAME_MAX];
     snprintf(indexfile, FILENAME_MAX, "%s.idx", idx_name);
 
     AudioIndex index_table = open_audioindex(indexfile, 1, 0);
+    if (index_table == NULL){
+	/* sorted index, only opens read only */ 
+	index_table = open_audioindex(indexfile, 0, 0);
+    }
+    if (index_table == NULL){
+	fprintf(stderr,"unable to open %s\n", indexfile);
+	return;
+    }
     
     int nbbkts, nbentries;
     stat_audioindex(index_table, &nbbkts, &nbentries);
     
-    double load = (double)nbbkts/(double)nbentries;
+    double load = (nbbkts > 0) ? (double)nbentries/(double)nbbkts : 0.0;
     fprintf(stdout,"buckets %d, entries %d, load %f\n", nbbkts,nbentries, load);
 
     close_audioindex(index_table, 1);
 }
 
+/* bins of an AudioIndexStats histogram that are not empty, as a json array */
+static void print_hist_json(const char *name, const uint64_t *hist){
+    int i, first = 1;
+    fprintf(stdout,"  \"%s\": [", name);
+    for (i=0;i<AUDIOINDEX_HIST_BINS;i++){
+	if (hist[i] == 0) continue;
+	uint64_t lo = (i == 0) ? 0 : (uint64_t)1 << (i-1);
+	uint64_t hi = (i == 0) ? 0 : ((uint64_t)1 << (i-1))*2 - 1;
+	fprintf(stdout,"%s\n    {\"min\": %llu, \"max\": %llu, \"count\": %llu}", (first) ? "" : ",",\
+		(unsigned long long)lo, (unsigned long long)hi, (unsigned long long)hist[i]);
+	first = 0;
+    }
+    fprintf(stdout,"\n  ],\n");
+}
+
+/* print the key distribution of the index as json, with the expected */
+/* cost of a lookup of one frame for 0 up to P toggles                 */
+int analyzeaudioindex(const char *idx_name, const unsigned int P, const int nbhot){
+
+    char indexfile[FILENAME_MAX];
+    snprintf(indexfile, FILENAME_MAX, "%s.idx", idx_name);
+
+    struct stat idx_info;
+    if (stat(indexfile, &idx_info) || idx_info.st_size == 0){
+	fprintf(stderr,"no index %s\n", indexfile);
+	return -1;
+    }
+    AudioIndex index_table = open_audioindex(indexfile, 0, 0);
+    if (index_table == NULL){
+	fprintf(stderr,"unable to open %s\n", indexfile);
+	return -1;
+    }
+
+    AudioIndexStats stats;
+    if (analyze_audioindex(index_table, nbhot, &stats) < 0){
+	fprintf(stderr,"unable to analyze %s\n", indexfile);
+	close_audioindex(index_table, 0);
+	return -2;
+    }
+
+    double nbkeys = (stats.nbkeys > 0) ? (double)stats.nbkeys : 1.0;
+    double nbpostings = (stats.nbpostings > 0) ? (double)stats.nbpostings : 1.0;
+    double probes = stats.key_probes/nbkeys;
+    double postings = stats.sq_postings/nbpostings;
+    unsigned int p;
+    int i;
+
+    fprintf(stdout,"{\n");
+    fprintf(stdout,"  \"index\": \"%s\",\n", indexfile);
+    fprintf(stdout,"  \"buckets\": %llu,\n", (unsigned long long)stats.nbbuckets);
+    fprintf(stdout,"  \"keys\": %llu,\n", (unsigned long long)stats.nbkeys);
+    fprintf(stdout,"  \"postings\": %llu,\n", (unsigned long long)stats.nbpostings);
+    fprintf(stdout,"  \"bytes\": %llu,\n", (unsigned long long)stats.nbbytes);
+    fprintf(stdout,"  \"bytes_per_posting\": %.3f,\n", (double)stats.nbbytes/nbpostings);
+    fprintf(stdout,"  \"keys_per_bucket\": %.3f,\n",\
+	    (stats.nbbuckets > 0) ? (double)stats.nbkeys/(double)stats.nbbuckets : 0.0);
+    fprintf(stdout,"  \"postings_per_key\": %.3f,\n", (double)stats.nbpostings/nbkeys);
+    fprintf(stdout,"  \"max_chain\": %llu,\n", (unsigned long long)stats.max_chain);
+    print_hist_json("chain_lengths", stats.chain_hist);
+    fprintf(stdout,"  \"max_postings\": %llu,\n", (unsigned long long)stats.max_list);
+    print_hist_json("posting_lengths", stats.list_hist);
+    fprintf(stdout,"  \"zero_word_postings\": %llu,\n", (unsigned long long)stats.zero_postings);
+    fprintf(stdout,"  \"ones_word_postings\": %llu,\n", (unsigned long long)stats.ones_postings);
+
+    /* 2^p keys per frame, each found after probes entries and */
+    /* voting with postings postings on average                */
+    fprintf(stdout,"  \"lookup_per_frame\": [");
+    for (p=0;p<=P;p++){
+	double nbcands = (double)((uint64_t)1 << p);
+	fprintf(stdout,"%s\n    {\"P\": %u, \"keys\": %.0f, \"probes\": %.3f, \"postings\": %.3f}",\
+		(p == 0) ? "" : ",", p, nbcands, nbcands*probes, nbcands*postings);
+    }
+    fprintf(stdout,"\n  ],\n");
+
+    fprintf(stdout,"  \"hot_keys\": [");
+    for (i=0;i<stats.nbhot;i++){
+	fprintf(stdout,"%s\n    {\"key\": \"0x%08x\", \"postings\": %llu, \"share\": %.6f}",\
+		(i == 0) ? "" : ",", stats.hot[i].key, (unsigned long long)stats.hot[i].count,\
+		(double)stats.hot[i].count/nbpostings);
+    }
+    fprintf(stdout,"\n  ]\n");
+    fprintf(stdout,"}\n");
+
+    free_audioindex_stats(&stats);
+    close_audioindex(index_table, 0);
+    return 0;
+}
+
 int queryaudioindex(const char *dir_name, const char *idx_name, const int sr,\
                     const int block_size, const float nbsecs, const float confidence_lvl,\
                     const unsigned int P){
@@ -316,7 +676,14 @@ void display_usage(){
     fprintf(stdout,"commands:\n");
     fprintf(stdout,"help  or ?                               print usage information\n");
     fprintf(stdout,"build <index> <dir|file>                 build or add to index\n");
+    fprintf(stdout,"bulk -m|w <index> <dir|file>             build sorted index with bounded memory\n");
+    fprintf(stdout,"                                             (replaces an existing index)\n");
+    fprintf(stdout,"rebuild -m|w <index>                     build sorted index from the hashes kept\n");
+    fprintf(stdout,"                                             by build and bulk (replaces it)\n");
+    fprintf(stdout,"combine <index> <idxfile> [idxfile ...]  merge index files into sorted index\n");
+    fprintf(stdout,"delete <index> <id> [id ...]             delete ids from sorted index\n");
     fprintf(stdout,"stat  <index>                            print number bins and entries\n");
+    fprintf(stdout,"analyze -p|k <index>                     print key distribution of index as json\n");
     fprintf(stdout,"query -p|t|n|b  <index> <dir|file>       query index for files in dir\n");
     fprintf(stdout,"\n");
     fprintf(stdout,"options:\n");
@@ -326,6 +693,9 @@ void display_usage(){
     fprintf(stdout,"  -t --threshold <real>                  threshold in query\n");
     fprintf(stdout,"  -n --nbsecs <real>                     secs to hash from signal\n");
     fprintf(stdout,"  -b --blocksize <integer>               block size\n");
+    fprintf(stdout,"  -m --memory <integer>                  MB of memory for sorting (bulk)\n");
+    fprintf(stdout,"  -w --workdir <dir>                     dir for tmp sorted runs (bulk)\n");
+    fprintf(stdout,"  -k --hotkeys <integer>                 number of hot keys to list (analyze)\n");
     fprintf(stdout,"\n\n\n");
 }
 
@@ -336,6 +706,9 @@ void init_options(){
     GlobalArgs.server_addr = NULL;
     GlobalArgs.dest_index = NULL;
     GlobalArgs.src_index = NULL;
+    GlobalArgs.tmp_dir = ".";
+    GlobalArgs.src_files = NULL;
+    GlobalArgs.nbsrcs = 0;
     GlobalArgs.P = 0;
     GlobalArgs.sr = 6000;
     GlobalArgs.blocksize = 256;
@@ -343,6 +716,8 @@ void init_options(){
     GlobalArgs.help = 0;
     GlobalArgs.nbsecs = 0.0f;
     GlobalArgs.threshold = 0.015;
+    GlobalArgs.mem_mb = 1024;
+    GlobalArgs.nbhot = 20;
 }
 
 void parse_options(int argc, char **argv){
@@ -377,6 +752,15 @@ void parse_options(int argc, char **argv){
 	case 's':
 	    GlobalArgs.server_addr = optarg;
 	    break;
+	case 'm':
+	    GlobalArgs.mem_mb = atoi(optarg);
+	    break;
+	case 'w':
+	    GlobalArgs.tmp_dir = optarg;
+	    break;
+	case 'k':
+	    GlobalArgs.nbhot = atoi(optarg);
+	    break;
 	case 'v':
 	    GlobalArgs.verbosity = 1;
 	case 'h':
@@ -393,8 +777,13 @@ void parse_options(int argc, char **argv){
 
     /* get remaining args */ 
     char **filenames = (char**)(argv + 1 + optind);
+    int nbfilenames = argc - 1 - optind;
     if (!strcmp(GlobalArgs.cmd, "queryd")){
 	GlobalArgs.index_name = filenames[0];
+    } else if (!strcmp(GlobalArgs.cmd, "combine") || !strcmp(GlobalArgs.cmd, "delete")){
+	GlobalArgs.index_name = filenames[0];
+	GlobalArgs.src_files = filenames + 1;
+	GlobalArgs.nbsrcs = (nbfilenames > 1) ? nbfilenames - 1 : 0;
     } else {
 	GlobalArgs.index_name = filenames[0];
 	GlobalArgs.dir_name = filenames[1];
@@ -420,9 +809,12 @@ int main(int argc, char **argv){
 	exit(1);
     }
     
-    fprintf(stdout,"p = %d\n", GlobalArgs.P);
-    fprintf(stdout,"t = %f\n", GlobalArgs.threshold);
-    fprintf(stdout,"n = %f\n", GlobalArgs.nbsecs);
+    /* analyze writes nothing but its json */
+    if (strcmp(GlobalArgs.cmd, "analyze")){
+	fprintf(stdout,"p = %d\n", GlobalArgs.P);
+	fprintf(stdout,"t = %f\n", GlobalArgs.threshold);
+	fprintf(stdout,"n = %f\n", GlobalArgs.nbsecs);
+    }
 
     if (!strcmp(GlobalArgs.cmd, "build")){
       if (GlobalArgs.dir_name == NULL || GlobalArgs.index_name == NULL){
@@ -437,9 +829,45 @@ int main(int argc, char **argv){
 	    fprintf(stdout,"unable to complete command\n");
 	}
 
+    } else if (!strcmp(GlobalArgs.cmd, "bulk")){
+      if (GlobalArgs.dir_name == NULL || GlobalArgs.index_name == NULL){
+	fprintf(stderr,"not enough input args\n");
+	exit(1);
+      }
+
+	fprintf(stdout,"bulk build index %s from files in %s\n",\
+		GlobalArgs.index_name, GlobalArgs.dir_name);
+	if (bulkaudioindex(GlobalArgs.dir_name,GlobalArgs.index_name,GlobalArgs.sr,\
+			   GlobalArgs.nbsecs,GlobalArgs.P) < 0){
+	    fprintf(stdout,"unable to complete command\n");
+	}
+
+    } else if (!strcmp(GlobalArgs.cmd, "rebuild")){
+      if (GlobalArgs.index_name == NULL){
+	fprintf(stderr,"no index name given\n");
+	exit(1);
+      }
+	if (rebuildaudioindex(GlobalArgs.index_name) < 0){
+	    fprintf(stdout,"unable to complete command\n");
+	}
+
     } else if (!strcmp(GlobalArgs.cmd, "combine")){
+      if (GlobalArgs.index_name == NULL || GlobalArgs.nbsrcs == 0){
+	fprintf(stderr,"not enough input args\n");
+	exit(1);
+      }
+	if (combineaudioindex(GlobalArgs.index_name, GlobalArgs.src_files, GlobalArgs.nbsrcs) < 0){
+	    fprintf(stdout,"unable to complete command\n");
+	}
 
-	fprintf(stdout,"not yet implemented\n");
+    } else if (!strcmp(GlobalArgs.cmd, "delete")){
+      if (GlobalArgs.index_name == NULL || GlobalArgs.nbsrcs == 0){
+	fprintf(stderr,"not enough input args\n");
+	exit(1);
+      }
+	if (deletefromaudioindex(GlobalArgs.index_name, GlobalArgs.src_files, GlobalArgs.nbsrcs) < 0){
+	    fprintf(stdout,"unable to complete command\n");
+	}
 
     } else if (!strcmp(GlobalArgs.cmd, "stat")){
       if (GlobalArgs.index_name == NULL){
@@ -449,6 +877,15 @@ int main(int argc, char **argv){
 	fprintf(stdout,"information on table");
 	print_audioindex_info(GlobalArgs.index_name);
 
+    } else if (!strcmp(GlobalArgs.cmd, "analyze")){
+      if (GlobalArgs.index_name == NULL){
+	fprintf(stderr,"no index name given\n");
+	exit(1);
+      }
+	if (analyzeaudioindex(GlobalArgs.index_name, GlobalArgs.P, GlobalArgs.nbhot) < 0){
+	    fprintf(stderr,"unable to complete command\n");
+	}
+
     } else if (!strcmp(GlobalArgs.cmd, "query")){
       if (GlobalArgs.dir_name == NULL || GlobalArgs.index_name == NULL){
 	fprintf(stderr,"not enough inptu args\n");
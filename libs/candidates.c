@@ -0,0 +1,147 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "candidates.h"
+
+static inline uint32_t hash_key(uint32_t key){
+    key ^= key >> 16;
+    key *= 0x7feb352d;
+    key ^= key >> 15;
+    key *= 0x846ca68b;
+    key ^= key >> 16;
+    return key;
+}
+
+int cands_init(CandBatch *batch){
+    memset(batch, 0, sizeof(CandBatch));
+    batch->max_keys = 1 << CAND_MIN_SLOT_BITS;
+    batch->keys = (uint32_t*)malloc(batch->max_keys*sizeof(uint32_t));
+    batch->frames = (uint32_t*)malloc(batch->max_keys*sizeof(uint32_t));
+    batch->seen = (uint32_t*)malloc(((size_t)1 << CAND_MIN_SLOT_BITS)*sizeof(uint32_t));
+    batch->stamps = (uint32_t*)calloc((size_t)1 << CAND_MIN_SLOT_BITS, sizeof(uint32_t));
+    if (batch->keys == NULL || batch->frames == NULL || batch->seen == NULL || batch->stamps == NULL){
+	cands_free(batch);
+	return -1;
+    }
+    batch->mask = (1 << CAND_MIN_SLOT_BITS) - 1;
+    batch->stamp = 1;
+    return 0;
+}
+
+void cands_free(CandBatch *batch){
+    free(batch->keys);
+    free(batch->frames);
+    free(batch->seen);
+    free(batch->stamps);
+    free(batch->found);
+    memset(batch, 0, sizeof(CandBatch));
+}
+
+void cands_forget(CandBatch *batch){
+    if (++batch->stamp == 0){
+	memset(batch->stamps, 0, (batch->mask + 1)*sizeof(uint32_t));
+	batch->stamp = 1;
+    }
+    batch->nbseen = 0;
+}
+
+void cands_clear(CandBatch *batch){
+    cands_forget(batch);
+    batch->nbkeys = 0;
+}
+
+/* double the slots of the seen set once half of them are in use */
+static int grow_seen(CandBatch *batch){
+    uint32_t i, j, mask = 2*batch->mask + 1;
+    uint32_t *seen = (uint32_t*)malloc(((size_t)mask + 1)*sizeof(uint32_t));
+    uint32_t *stamps = (uint32_t*)calloc((size_t)mask + 1, sizeof(uint32_t));
+    if (seen == NULL || stamps == NULL){
+	free(seen);
+	free(stamps);
+	return -1;
+    }
+    for (i = 0;i <= batch->mask;i++){
+	if (batch->stamps[i] != batch->stamp) continue;
+	for (j = hash_key(batch->seen[i]) & mask;stamps[j] == batch->stamp;j = (j + 1) & mask);
+	seen[j] = batch->seen[i];
+	stamps[j] = batch->stamp;
+    }
+    free(batch->seen);
+    free(batch->stamps);
+    batch->seen = seen;
+    batch->stamps = stamps;
+    batch->mask = mask;
+    return 0;
+}
+
+/* add key unless already seen, 0 on success */
+static int add_key(CandBatch *batch, uint32_t key, uint32_t frame){
+    uint32_t i;
+    if (2*(batch->nbseen + 1) > batch->mask + 1 && grow_seen(batch) < 0) return -1;
+    for (i = hash_key(key) & batch->mask;batch->stamps[i] == batch->stamp;i = (i + 1) & batch->mask){
+	if (batch->seen[i] == key) return 0;
+    }
+    batch->seen[i] = key;
+    batch->stamps[i] = batch->stamp;
+    batch->nbseen++;
+
+    if (batch->nbkeys == batch->max_keys){
+	uint32_t size = 2*batch->max_keys;
+	uint32_t *keys = (uint32_t*)realloc(batch->keys, size*sizeof(uint32_t));
+	if (keys == NULL) return -1;
+	batch->keys = keys;
+	uint32_t *frames = (uint32_t*)realloc(batch->frames, size*sizeof(uint32_t));
+	if (frames == NULL) return -1;
+	batch->frames = frames;
+	batch->max_keys = size;
+    }
+    batch->keys[batch->nbkeys] = key;
+    batch->frames[batch->nbkeys] = frame;
+    batch->nbkeys++;
+    return 0;
+}
+
+int cands_expand(CandBatch *batch, uint32_t hashvalue, const uint8_t *toggles, int P, uint32_t frame){
+    uint32_t i, n, key = hashvalue;
+    if (toggles == NULL || P <= 0) P = 0;
+    if (P > 31) P = 31;
+    n = (uint32_t)1 << P;
+    if (add_key(batch, key, frame) < 0) return -1;
+    /* the i'th Gray code differs from the one before in the lowest set bit of i */
+    for (i = 1;i < n;i++){
+	key ^= 0x80000000 >> toggles[__builtin_ctz(i)];
+	if (add_key(batch, key, frame) < 0) return -1;
+    }
+    return 0;
+}
+
+const void** cands_found(CandBatch *batch, int nbsegments){
+    uint64_t size = (uint64_t)batch->nbkeys*(nbsegments > 0 ? nbsegments : 1);
+    if (size > batch->max_found){
+	const void **found = (const void**)realloc(batch->found, size*sizeof(void*));
+	if (found == NULL) return NULL;
+	batch->found = found;
+	batch->max_found = size;
+    }
+    return batch->found;
+}
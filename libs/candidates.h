@@ -0,0 +1,75 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the expansion of hash frames into the keys a */
+/* lookup probes - not installed                                     */
+
+#ifndef CANDIDATES_H
+#define CANDIDATES_H
+
+#include <stdint.h>
+
+/*
+ * A frame of a query is looked up as 2^P keys: the frame with every subset
+ * of its P most likely to flip bits toggled.  The subsets are enumerated in
+ * Gray code order, so each key is the one before with one bit toggled.
+ *
+ * The keys of a batch of frames go to buffers that are kept from batch to
+ * batch, with a set of the keys already in the batch to drop the repeats.
+ * The set is cleared by bumping a stamp, like a VoteMap.  The keys are
+ * then resolved a batch at a time, which leaves room to overlap the
+ * cache misses of the probes.
+ */
+
+#define CAND_MIN_SLOT_BITS 10
+
+typedef struct cand_batch_t {
+    uint32_t *keys;               /* keys to probe */
+    uint32_t *frames;             /* query frame of each key */
+    uint32_t nbkeys, max_keys;
+    uint32_t *seen;               /* keys of the batch so far, by hash */
+    uint32_t *stamps;             /* slot of seen in use if equal to stamp */
+    uint32_t mask, stamp, nbseen;
+    const void **found;           /* what the keys were resolved to */
+    uint64_t max_found;
+} CandBatch;
+
+/* set up an empty batch, 0 on success */
+int cands_init(CandBatch *batch);
+
+void cands_free(CandBatch *batch);
+
+/* start a new batch, with no keys and none seen */
+void cands_clear(CandBatch *batch);
+
+/* forget the keys seen without dropping the keys of the batch, so */
+/* those of the next frames are not checked against them           */
+void cands_forget(CandBatch *batch);
+
+/* add the keys of frame hashvalue, toggling the bits of toggles - if */
+/* NULL only the frame itself.  0 on success, less than 0 on error    */
+int cands_expand(CandBatch *batch, uint32_t hashvalue, const uint8_t *toggles, int P, uint32_t frame);
+
+/* room to resolve the keys of the batch in nbsegments segments, */
+/* nbsegments slots per key.  NULL on error                       */
+const void** cands_found(CandBatch *batch, int nbsegments);
+
+#endif /* CANDIDATES_H */
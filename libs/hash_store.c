@@ -0,0 +1,350 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hash_store.h"
+
+static uint32_t entry_check(const HStoreEntry *e){
+    uint32_t h = 2166136261u;
+    h = (h ^ e->id)*16777619u;
+    h = (h ^ e->nbframes)*16777619u;
+    h = (h ^ (uint32_t)e->offset)*16777619u;
+    h = (h ^ (uint32_t)(e->offset >> 32))*16777619u;
+    return h;
+}
+
+static inline uint32_t hash_id(uint32_t id){
+    id ^= id >> 16;
+    id *= 0x7feb352d;
+    id ^= id >> 15;
+    id *= 0x846ca68b;
+    id ^= id >> 16;
+    return id;
+}
+
+/* slot of id, or the empty slot it goes in */
+static HStoreEntry* find_slot(HStoreEntry *slots, uint32_t mask, uint32_t id){
+    uint32_t i = hash_id(id) & mask;
+    while (slots[i].magic == HSTORE_MAGIC && slots[i].id != id){
+	i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+/* put e in its slot, over an older entry of the same id */
+static int put_entry(HashStore *store, const HStoreEntry *e){
+    uint32_t i, mask;
+    HStoreEntry *slot;
+    if (2*(store->nbids + 1) > store->mask + 1){
+	mask = 2*store->mask + 1;
+	HStoreEntry *slots = (HStoreEntry*)calloc((size_t)mask + 1, sizeof(HStoreEntry));
+	if (slots == NULL) return -1;
+	for (i = 0;i <= store->mask;i++){
+	    if (store->slots[i].magic != HSTORE_MAGIC) continue;
+	    *find_slot(slots, mask, store->slots[i].id) = store->slots[i];
+	}
+	free(store->slots);
+	store->slots = slots;
+	store->mask = mask;
+    }
+    slot = find_slot(store->slots, store->mask, e->id);
+    if (slot->magic != HSTORE_MAGIC) store->nbids++;
+    *slot = *e;
+    return 0;
+}
+
+/* map the words up to at least end, 0 on success */
+static int map_words(HashStore *store, uint64_t end){
+    size_t size = (store->map) ? 2*store->map->size : HSTORE_MIN_MAP;
+    while (size < end) size *= 2;
+    HStoreMap *map = (HStoreMap*)malloc(sizeof(HStoreMap));
+    if (map == NULL) return -1;
+    /* past the end of the file until it grows into it, never read there */
+    map->addr = mmap(NULL, size, PROT_READ, MAP_SHARED, store->words_fd, 0);
+    if (map->addr == MAP_FAILED){
+	free(map);
+	return -1;
+    }
+    map->size = size;
+    map->prev = store->map;
+    store->map = map;
+    return 0;
+}
+
+/* read back the entries, dropping them from the first one that does not */
+/* add up.  return the length of the entries kept, less than 0 on error, */
+/* and the end of the words of the last one in *words_end                 */
+static off_t load_entries(HashStore *store, int fd, uint64_t *words_end){
+    HStoreEntry entries[256];
+    ssize_t n, i;
+    off_t len = 0;
+    *words_end = 0;
+    while ((n = read(fd, entries, sizeof(entries))) > 0){
+	for (i = 0;i < n/(ssize_t)sizeof(HStoreEntry);i++){
+	    const HStoreEntry *e = &entries[i];
+	    uint64_t end = e->offset + (uint64_t)e->nbframes*sizeof(uint32_t);
+	    if (e->magic != HSTORE_MAGIC || e->check != entry_check(e) || end > store->words_size){
+		return len;
+	    }
+	    if (put_entry(store, e) < 0) return -1;
+	    if (end > *words_end) *words_end = end;
+	    len += sizeof(HStoreEntry);
+	}
+	if (n % sizeof(HStoreEntry)) break;
+    }
+    return (n < 0) ? -1 : len;
+}
+
+/* wait for the writes to fd done so far to be on disk, with the mutex   */
+/* held.  the first one to wait syncs for all of them, with the mutex    */
+/* let go, the others wait for it.  0 on success                         */
+static int group_sync(HashStore *store, HStoreSync *s, int fd){
+    uint64_t upto, n = ++s->written;
+    int err;
+    while (s->synced < n && s->failed < n){
+	if (s->syncing){
+	    pthread_cond_wait(&store->cond, &store->mutex);
+	    continue;
+	}
+	upto = s->written;
+	s->syncing = 1;
+	pthread_mutex_unlock(&store->mutex);
+	err = fdatasync(fd);
+	pthread_mutex_lock(&store->mutex);
+	s->syncing = 0;
+	if (err < 0){
+	    s->failed = upto;
+	} else {
+	    s->synced = upto;
+	}
+	pthread_cond_broadcast(&store->cond);
+    }
+    return (s->failed >= n) ? -1 : 0;
+}
+
+HashStore* hstore_open(const char *name, int add, int sync){
+    char path[FILENAME_MAX];
+    struct stat info;
+    uint64_t words_end;
+    off_t len;
+    int fd;
+
+    HashStore *store = (HashStore*)calloc(1, sizeof(HashStore));
+    if (store == NULL) return NULL;
+    snprintf(store->name, FILENAME_MAX, "%s", name);
+    store->words_fd = store->entries_fd = -1;
+    store->sync = sync;
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->cond, NULL);
+    store->mask = (1 << HSTORE_MIN_SLOT_BITS) - 1;
+    store->slots = (HStoreEntry*)calloc((size_t)store->mask + 1, sizeof(HStoreEntry));
+    if (store->slots == NULL){
+	hstore_close(store);
+	return NULL;
+    }
+
+    snprintf(path, FILENAME_MAX, "%s.fph", name);
+    store->words_fd = (add) ? open(path, O_RDWR|O_CREAT, 0644) : open(path, O_RDONLY);
+    if (store->words_fd < 0 || fstat(store->words_fd, &info) < 0){
+	hstore_close(store);
+	return NULL;
+    }
+    store->words_size = info.st_size;
+
+    snprintf(path, FILENAME_MAX, "%s.fpx", name);
+    fd = (add) ? open(path, O_RDWR|O_CREAT, 0644) : open(path, O_RDONLY);
+    if (fd < 0){
+	hstore_close(store);
+	return NULL;
+    }
+    len = load_entries(store, fd, &words_end);
+    /* the entries are appended after what was kept, the words after */
+    /* those of the last entry                                       */
+    if (len < 0 || (add && (ftruncate(fd, len) < 0 || lseek(fd, len, SEEK_SET) < 0 ||\
+			    ftruncate(store->words_fd, words_end) < 0))){
+	close(fd);
+	hstore_close(store);
+	return NULL;
+    }
+    if (add) store->words_size = words_end;
+    if (add){
+	store->entries_fd = fd;
+    } else {
+	close(fd);
+    }
+    if (map_words(store, store->words_size) < 0){
+	hstore_close(store);
+	return NULL;
+    }
+    return store;
+}
+
+int hstore_add(HashStore *store, uint32_t id, const uint32_t *hash, uint32_t nbframes){
+    HStoreEntry e;
+    size_t len = (size_t)nbframes*sizeof(uint32_t), done;
+    ssize_t n;
+    int err = 0;
+
+    if (store->entries_fd < 0) return -1;
+    pthread_mutex_lock(&store->mutex);
+    e.offset = store->words_size;
+    store->words_size += len;
+    pthread_mutex_unlock(&store->mutex);
+
+    /* the words are on disk before the entry that points at them */
+    for (done = 0;done < len;done += n){
+	n = pwrite(store->words_fd, (const char*)hash + done, len - done, e.offset + done);
+	if (n <= 0) break;
+    }
+    pthread_mutex_lock(&store->mutex);
+    if (done < len || (store->sync && group_sync(store, &store->words_sync, store->words_fd) < 0)){
+	/* the room is given back, unless another add took some after it */
+	if (store->words_size == e.offset + len) store->words_size = e.offset;
+	pthread_mutex_unlock(&store->mutex);
+	return -2;
+    }
+
+    e.magic = HSTORE_MAGIC;
+    e.id = id;
+    e.nbframes = nbframes;
+    e.check = entry_check(&e);
+    if (write(store->entries_fd, &e, sizeof(HStoreEntry)) != sizeof(HStoreEntry) ||\
+	(store->sync && group_sync(store, &store->entries_sync, store->entries_fd) < 0)){
+	err = -3;
+    } else if (put_entry(store, &e) < 0){
+	err = -4;
+    }
+    pthread_mutex_unlock(&store->mutex);
+    return err;
+}
+
+const uint32_t* hstore_get(HashStore *store, uint32_t id, uint32_t *nbframes){
+    const uint32_t *hash = NULL;
+    pthread_mutex_lock(&store->mutex);
+    HStoreEntry *slot = find_slot(store->slots, store->mask, id);
+    if (slot->magic == HSTORE_MAGIC){
+	uint64_t end = slot->offset + (uint64_t)slot->nbframes*sizeof(uint32_t);
+	if (end <= store->map->size || map_words(store, end) == 0){
+	    hash = (const uint32_t*)((const char*)store->map->addr + slot->offset);
+	    *nbframes = slot->nbframes;
+	}
+    }
+    pthread_mutex_unlock(&store->mutex);
+    return hash;
+}
+
+static int by_offset(const void *a, const void *b){
+    uint64_t x = ((const HStoreEntry*)a)->offset, y = ((const HStoreEntry*)b)->offset;
+    return (x > y) - (x < y);
+}
+
+int hstore_foreach(HashStore *store, int (*fn)(void *arg, uint32_t id, const uint32_t *hash,\
+					       uint32_t nbframes), void *arg){
+    HStoreEntry *entries;
+    const char *addr;
+    uint64_t end = 0;
+    uint32_t i, n = 0;
+    int err = 0;
+
+    /* the entries as they are now, read through the words in file order */
+    pthread_mutex_lock(&store->mutex);
+    entries = (HStoreEntry*)malloc(((size_t)store->nbids + 1)*sizeof(HStoreEntry));
+    if (entries == NULL){
+	pthread_mutex_unlock(&store->mutex);
+	return -1;
+    }
+    for (i = 0;i <= store->mask;i++){
+	if (store->slots[i].magic != HSTORE_MAGIC) continue;
+	entries[n] = store->slots[i];
+	if (entries[n].offset + (uint64_t)entries[n].nbframes*sizeof(uint32_t) > end){
+	    end = entries[n].offset + (uint64_t)entries[n].nbframes*sizeof(uint32_t);
+	}
+	n++;
+    }
+    if (end > store->map->size && map_words(store, end) < 0) err = -1;
+    addr = (const char*)store->map->addr;
+    pthread_mutex_unlock(&store->mutex);
+
+    qsort(entries, n, sizeof(HStoreEntry), by_offset);
+    for (i = 0;i < n && err == 0;i++){
+	int res = fn(arg, entries[i].id, (const uint32_t*)(addr + entries[i].offset), entries[i].nbframes);
+	if (res < 0) err = res;
+    }
+    free(entries);
+    return err;
+}
+
+int hstore_close(HashStore *store){
+    int err = 0;
+    if (store == NULL) return -1;
+    if (store->entries_fd >= 0 && (fdatasync(store->words_fd) < 0 || fdatasync(store->entries_fd) < 0)){
+	err = -1;
+    }
+    while (store->map){
+	HStoreMap *prev = store->map->prev;
+	munmap(store->map->addr, store->map->size);
+	free(store->map);
+	store->map = prev;
+    }
+    if (store->entries_fd >= 0 && close(store->entries_fd) < 0) err = -1;
+    if (store->words_fd >= 0 && close(store->words_fd) < 0) err = -1;
+    pthread_mutex_destroy(&store->mutex);
+    pthread_cond_destroy(&store->cond);
+    free(store->slots);
+    free(store);
+    return err;
+}
+
+/* the words two at a time, for a 64 bit popcount */
+#define DISTANCE_LOOP(a, b, nbwords, d)					\
+    do {								\
+	uint32_t i_;							\
+	for (i_ = 0;i_ + 1 < (nbwords);i_ += 2){			\
+	    uint64_t x_ = ((uint64_t)((a)[i_] ^ (b)[i_]) << 32) | ((a)[i_+1] ^ (b)[i_+1]); \
+	    (d) += __builtin_popcountll(x_);				\
+	}								\
+	if (i_ < (nbwords)) (d) += __builtin_popcount((a)[i_] ^ (b)[i_]); \
+    } while (0)
+
+#if defined(__x86_64__) || defined(__i386__)
+/* built for the popcnt instruction, only called where there is one */
+__attribute__((target("popcnt")))
+static uint64_t distance_popcnt(const uint32_t *a, const uint32_t *b, uint32_t nbwords){
+    uint64_t d = 0;
+    DISTANCE_LOOP(a, b, nbwords, d);
+    return d;
+}
+#endif
+
+uint64_t hstore_distance(const uint32_t *a, const uint32_t *b, uint32_t nbwords){
+    uint64_t d = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("popcnt")) return distance_popcnt(a, b, nbwords);
+#endif
+    DISTANCE_LOOP(a, b, nbwords, d);
+    return d;
+}
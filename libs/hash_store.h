@@ -0,0 +1,122 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the store of the hashes of indexed tracks - not installed */
+
+#ifndef HASH_STORE_H
+#define HASH_STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * The whole hash of each track, kept to check the matches of a lookup
+ * against and to build indexes of another layout from.  <name>.fph holds
+ * the hash words of one track after the other, <name>.fpx the entries
+ * giving the id, nb of frames and offset of each.  Both are only ever
+ * appended to: the words of a track are written before its entry, so an
+ * entry torn or past the end of the words after a crash is dropped on
+ * open along with what follows it.  A track added again is looked up by
+ * its last entry.
+ *
+ * A store opened with sync puts each hash on disk before its add returns,
+ * words then entry.  The syncs are grouped: the first add to wait syncs the
+ * file for all the writes done by then, outside the mutex, and the adds that
+ * come in meanwhile wait for the next one.  Otherwise it is only synced when
+ * closed, and after a crash of the machine an entry may be back with words
+ * that never made it.
+ *
+ * The room for the words of an add is taken before they are written.  An add
+ * that fails gives it back if no other add took room after it, and the words
+ * past the last entry are cut off on the next open to add to; the room of a
+ * failed add in between others stays unused in the .fph file.
+ *
+ * The words are mapped read only.  The mapping is made larger than the
+ * file, and once the file outgrows it a mapping twice the size is made;
+ * the older ones stay until the store is closed, so a pointer handed out
+ * by hstore_get is good for as long as the store is open.
+ */
+
+#define HSTORE_MAGIC 0x53504641              /* "AFPS" */
+#define HSTORE_MIN_MAP (1 << 20)
+#define HSTORE_MIN_SLOT_BITS 10
+
+typedef struct hstore_entry_t {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t nbframes;
+    uint32_t check;                          /* of id, nbframes and offset */
+    uint64_t offset;                         /* of the first word in the .fph file */
+} HStoreEntry;
+
+/* grouped syncs of one file */
+typedef struct hstore_sync_t {
+    uint64_t written;                        /* nb writes done */
+    uint64_t synced;                         /* nb writes on disk */
+    uint64_t failed;                         /* writes up to this one failed to sync */
+    int syncing;                             /* an add is syncing the file */
+} HStoreSync;
+
+typedef struct hstore_map_t {
+    void *addr;
+    size_t size;
+    struct hstore_map_t *prev;               /* older mappings, kept till close */
+} HStoreMap;
+
+typedef struct hash_store_t {
+    char name[FILENAME_MAX];
+    int words_fd, entries_fd;                /* entries_fd -1 if read only */
+    int sync;                                /* fdatasync the words before the entry */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                     /* a sync is done */
+    HStoreSync words_sync, entries_sync;
+    uint64_t words_size;                     /* bytes of the .fph file handed out */
+    HStoreMap *map;                          /* newest mapping of the words */
+    HStoreEntry *slots;                      /* by id, magic 0 for an empty slot */
+    uint32_t mask;                           /* nb slots - 1 */
+    uint32_t nbids;
+} HashStore;
+
+/* open the store of name, made if add and it does not exist.  a store  */
+/* opened to add to syncs each track if sync.  NULL on error            */
+HashStore* hstore_open(const char *name, int add, int sync);
+
+/* add the hash of id, safe with any number of concurrent callers.  0 on */
+/* success, less than 0 on error                                         */
+int hstore_add(HashStore *store, uint32_t id, const uint32_t *hash, uint32_t nbframes);
+
+/* the hash of id, NULL if it is not in the store */
+const uint32_t* hstore_get(HashStore *store, uint32_t id, uint32_t *nbframes);
+
+/* call fn on the hash of each id of the store, in the order they were */
+/* added, until it returns less than 0 - that value is returned, 0 once */
+/* all have been seen.  hashes added meanwhile may be missed            */
+int hstore_foreach(HashStore *store, int (*fn)(void *arg, uint32_t id, const uint32_t *hash,\
+					       uint32_t nbframes), void *arg);
+
+/* close the store, syncing it first if opened to add to */
+int hstore_close(HashStore *store);
+
+/* nb of bits that differ between the nbwords words of a and b */
+uint64_t hstore_distance(const uint32_t *a, const uint32_t *b, uint32_t nbwords);
+
+#endif /* HASH_STORE_H */
@@ -0,0 +1,133 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "id_set.h"
+
+#define IDSET_PAGE_WORDS ((1u << IDSET_PAGE_BITS)/64)
+
+/* set the bit of id, under the mutex.  1 if it was set already */
+static int set_bit(IdSet *set, uint32_t id){
+    uint64_t *page = set->pages[id >> IDSET_PAGE_BITS];
+    uint32_t bit = id & ((1u << IDSET_PAGE_BITS) - 1);
+    if (page == NULL){
+	page = (uint64_t*)calloc(IDSET_PAGE_WORDS, sizeof(uint64_t));
+	if (page == NULL) return -1;
+	__atomic_store_n(&set->pages[id >> IDSET_PAGE_BITS], page, __ATOMIC_RELEASE);
+    }
+    if (page[bit >> 6] & ((uint64_t)1 << (bit & 63))) return 1;
+    __atomic_or_fetch(&page[bit >> 6], (uint64_t)1 << (bit & 63), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&set->count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* read back the ids of the file - a torn id at the end is ignored */
+static int load(IdSet *set){
+    uint32_t ids[1024];
+    ssize_t n, i;
+    int fd = open(set->path, O_RDONLY);
+    if (fd < 0) return 0;
+    while ((n = read(fd, ids, sizeof(ids))) > 0){
+	for (i = 0;i < n/(ssize_t)sizeof(uint32_t);i++){
+	    if (set_bit(set, ids[i]) < 0){
+		close(fd);
+		return -1;
+	    }
+	}
+    }
+    close(fd);
+    return (n < 0) ? -1 : 0;
+}
+
+IdSet* idset_open(const char *path){
+    IdSet *set = (IdSet*)calloc(1, sizeof(IdSet));
+    if (set == NULL) return NULL;
+    set->pages = (uint64_t**)calloc(IDSET_NB_PAGES, sizeof(uint64_t*));
+    if (set->pages == NULL){
+	free(set);
+	return NULL;
+    }
+    set->fd = -1;
+    pthread_mutex_init(&set->mutex, NULL);
+    if (path){
+	snprintf(set->path, FILENAME_MAX, "%s", path);
+	if (load(set) < 0){
+	    idset_close(set);
+	    return NULL;
+	}
+    }
+    return set;
+}
+
+void idset_close(IdSet *set){
+    uint32_t i;
+    if (set == NULL) return;
+    for (i = 0;i < IDSET_NB_PAGES;i++){
+	free(set->pages[i]);
+    }
+    free(set->pages);
+    if (set->fd >= 0) close(set->fd);
+    pthread_mutex_destroy(&set->mutex);
+    free(set);
+}
+
+int idset_add(IdSet *set, uint32_t id){
+    int ret;
+    if (set == NULL) return -1;
+    pthread_mutex_lock(&set->mutex);
+    if (idset_has(set, id)){
+	pthread_mutex_unlock(&set->mutex);
+	return 1;
+    }
+    /* on disk before it is visible, so a delete that was seen is never lost */
+    if (set->path[0]){
+	if (set->fd < 0){
+	    set->fd = open(set->path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	}
+	if (set->fd < 0 || write(set->fd, &id, sizeof(uint32_t)) != sizeof(uint32_t) ||\
+	    fdatasync(set->fd) < 0){
+	    pthread_mutex_unlock(&set->mutex);
+	    return -2;
+	}
+    }
+    ret = set_bit(set, id);
+    pthread_mutex_unlock(&set->mutex);
+    return (ret < 0) ? -3 : 0;
+}
+
+void idset_path(const char *idx_file, char *path){
+    snprintf(path, FILENAME_MAX, "%s.del", idx_file);
+}
+
+int idset_filter_next(void *arg, SortedPosting *p){
+    IdSetFilter *f = (IdSetFilter*)arg;
+    int res;
+    while ((res = f->src.next(f->src.arg, p)) > 0){
+	if (f->sets[0] && idset_has(f->sets[0], p->id)) continue;
+	if (f->sets[1] && idset_has(f->sets[1], p->id)) continue;
+	break;
+    }
+    return res;
+}
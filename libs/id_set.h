@@ -0,0 +1,84 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the set of deleted ids - not installed */
+
+#ifndef ID_SET_H
+#define ID_SET_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "sorted_index.h"
+
+/*
+ * Ids of deleted tracks, as a bitmap split in pages of 2^16 ids that are only
+ * allocated once an id in their range is added - 8KB per page, so a few
+ * thousand deletes spread over the whole id space cost a few MB at most.
+ * A page is published with an atomic store and bits are only ever set, so
+ * idset_has takes no lock and may run while ids are added.
+ *
+ * A set may be backed by a file of the ids added to it, appended to as they are
+ * added and read back on open.  An index file keeps its deletes in <file>.del,
+ * since the index itself is never written in place.
+ */
+
+#define IDSET_PAGE_BITS 16
+#define IDSET_NB_PAGES  (1u << (32 - IDSET_PAGE_BITS))
+
+typedef struct idset_t {
+    uint64_t **pages;                   /* IDSET_NB_PAGES, NULL until used */
+    uint64_t count;                     /* nb of distinct ids in the set   */
+    int fd;                             /* log file, -1 until first add    */
+    char path[FILENAME_MAX];            /* log file, empty for memory only */
+    pthread_mutex_t mutex;              /* adds */
+} IdSet;
+
+/* set backed by the file at path, loaded if it exists, or in memory only */
+/* if path is NULL.  NULL on error                                        */
+IdSet* idset_open(const char *path);
+
+/* free the set - no other thread may be using it */
+void idset_close(IdSet *set);
+
+/* add id, and append it to the file.  0 on success, 1 if id was already */
+/* in, less than 0 on error                                              */
+int idset_add(IdSet *set, uint32_t id);
+
+/* fill path with the name of the deletes file of the index file idx_file */
+void idset_path(const char *idx_file, char *path);
+
+static inline int idset_has(const IdSet *set, uint32_t id){
+    const uint64_t *page = __atomic_load_n(&set->pages[id >> IDSET_PAGE_BITS], __ATOMIC_ACQUIRE);
+    uint32_t bit = id & ((1u << IDSET_PAGE_BITS) - 1);
+    if (page == NULL) return 0;
+    return (int)((__atomic_load_n(&page[bit >> 6], __ATOMIC_RELAXED) >> (bit & 63)) & 1);
+}
+
+/* source passing on the postings of src whose id is in neither set, */
+/* for dropping deleted postings in a merge - either set may be NULL */
+typedef struct idset_filter_t {
+    SortedSource src;
+    const IdSet *sets[2];
+} IdSetFilter;
+
+int idset_filter_next(void *arg, SortedPosting *p);
+
+#endif /* ID_SET_H */
@@ -0,0 +1,296 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "index_mem.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+/* memory policy modes and flags, from linux/mempolicy.h */
+#define MEMPOLICY_BIND       2
+#define MEMPOLICY_INTERLEAVE 3
+#define MEMPOLICY_MF_MOVE    (1<<1)
+
+#define MAX_NUMA_NODES 1024
+#define BITS_PER_LONG  (8*sizeof(unsigned long))
+
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define SIZE_2MB ((size_t)1 << 21)
+#define SIZE_1GB ((size_t)1 << 30)
+
+/* warm-up is handed out to threads in chunks, progress reported in steps */
+#define WARMUP_CHUNK_SIZE   ((size_t)1 << 26)
+#define WARMUP_REPORT_STEPS 20
+
+/* set the bits of a list like "0-3,8,10-11" in mask, return nb bits set */
+static int parse_list(const char *str, unsigned long *mask, int maxbits){
+    int count = 0;
+    char *end;
+    while (*str){
+	long lo = strtol(str, &end, 10), hi;
+	if (end == str) break;
+	hi = lo;
+	str = end;
+	if (*str == '-'){
+	    hi = strtol(str + 1, &end, 10);
+	    str = end;
+	}
+	for ( ;lo <= hi && lo < maxbits;lo++){
+	    if (lo < 0) continue;
+	    mask[lo/BITS_PER_LONG] |= 1UL << (lo % BITS_PER_LONG);
+	    count++;
+	}
+	while (*str == ',' || *str == '\n' || *str == ' ') str++;
+    }
+    return count;
+}
+
+/* read a sysfs list file into mask, return nb bits set or less than 0 on error */
+static int read_list(const char *path, unsigned long *mask, int maxbits){
+    char buf[4096];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    if (fgets(buf, sizeof(buf), fp) == NULL){
+	fclose(fp);
+	return -1;
+    }
+    fclose(fp);
+    return parse_list(buf, mask, maxbits);
+}
+
+static int set_policy(void *addr, size_t len, int numa_node, unsigned int flags){
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[MAX_NUMA_NODES/BITS_PER_LONG];
+    int mode;
+
+    if (numa_node == INDEX_NUMA_NONE) return 0;
+    memset(mask, 0, sizeof(mask));
+    if (numa_node == INDEX_NUMA_INTERLEAVE){
+	mode = MEMPOLICY_INTERLEAVE;
+	if (read_list("/sys/devices/system/node/online", mask, MAX_NUMA_NODES) <= 0) return -1;
+    } else if (numa_node >= 0 && numa_node < MAX_NUMA_NODES){
+	mode = MEMPOLICY_BIND;
+	mask[numa_node/BITS_PER_LONG] |= 1UL << (numa_node % BITS_PER_LONG);
+    } else {
+	return -1;
+    }
+    if (syscall(SYS_mbind, addr, len, mode, mask, (unsigned long)MAX_NUMA_NODES + 1, flags) < 0){
+	return -1;
+    }
+    return 0;
+#else
+    return (numa_node == INDEX_NUMA_NONE) ? 0 : -1;
+#endif
+}
+
+int idxmem_advise(void *addr, size_t len, const AudioIndexOpts *opts){
+    int err = 0;
+    if (opts == NULL) return 0;
+#ifdef MADV_HUGEPAGE
+    if (opts->pages != INDEX_PAGES_DEFAULT && madvise(addr, len, MADV_HUGEPAGE) < 0) err = -1;
+#else
+    if (opts->pages != INDEX_PAGES_DEFAULT) err = -1;
+#endif
+    if (set_policy(addr, len, opts->numa_node, MEMPOLICY_MF_MOVE) < 0) err = -2;
+    return err;
+}
+
+/* anonymous mapping of at least size bytes in the given page mode, falling */
+/* back to smaller pages when none of the asked size are available         */
+static void* map_anonymous(size_t size, int pages, size_t *maplen){
+    void *addr;
+#if defined(MAP_HUGETLB)
+    if (pages == INDEX_PAGES_HUGE_1GB){
+	*maplen = (size + SIZE_1GB - 1) & ~(SIZE_1GB - 1);
+	addr = mmap(NULL, *maplen, PROT_READ|PROT_WRITE,\
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|(30 << MAP_HUGE_SHIFT), -1, 0);
+	if (addr != MAP_FAILED) return addr;
+	pages = INDEX_PAGES_HUGE_2MB;
+    }
+    if (pages == INDEX_PAGES_HUGE_2MB){
+	*maplen = (size + SIZE_2MB - 1) & ~(SIZE_2MB - 1);
+	addr = mmap(NULL, *maplen, PROT_READ|PROT_WRITE,\
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|(21 << MAP_HUGE_SHIFT), -1, 0);
+	if (addr != MAP_FAILED) return addr;
+    }
+#endif
+    *maplen = (size + SIZE_2MB - 1) & ~(SIZE_2MB - 1);
+    addr = mmap(NULL, *maplen, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(addr, *maplen, MADV_HUGEPAGE);
+#endif
+    return addr;
+}
+
+void* idxmem_map(int fd, size_t size, const AudioIndexOpts *opts, size_t *maplen){
+    void *addr;
+    int pages = (opts) ? opts->pages : INDEX_PAGES_DEFAULT;
+
+    if (pages == INDEX_PAGES_DEFAULT || pages == INDEX_PAGES_ADVISE){
+	addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) return NULL;
+	*maplen = size;
+	idxmem_advise(addr, size, opts);
+	return addr;
+    }
+
+    addr = map_anonymous(size, pages, maplen);
+    if (addr == NULL) return NULL;
+
+    /* place before the first touch, so pages are allocated where they belong */
+    set_policy(addr, *maplen, opts->numa_node, 0);
+
+    size_t got = 0;
+    while (got < size){
+	ssize_t res = pread(fd, (char*)addr + got, size - got, got);
+	if (res < 0 && errno == EINTR) continue;
+	if (res <= 0){
+	    munmap(addr, *maplen);
+	    return NULL;
+	}
+	got += res;
+    }
+    mprotect(addr, *maplen, PROT_READ);
+    return addr;
+}
+
+void idxmem_unmap(void *addr, size_t maplen){
+    if (addr) munmap(addr, maplen);
+}
+
+/* warm-up state shared by its threads, chunks are handed out in order */
+typedef struct idxmem_warmup_t {
+    char *addr;
+    size_t len;
+    size_t next;                   /* offset of the next chunk to hand out */
+    size_t done;                   /* bytes faulted in so far */
+    size_t reported;
+    int lock;
+    int err;
+    AudioIndexProgress progress;
+    void *arg;
+    pthread_mutex_t mutex;
+} IdxMemWarmup;
+
+static void* warmup_worker(void *arg){
+    IdxMemWarmup *w = (IdxMemWarmup*)arg;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    volatile unsigned char sum = 0;
+    size_t off, end, i;
+
+    for (;;){
+	pthread_mutex_lock(&w->mutex);
+	off = w->next;
+	w->next += WARMUP_CHUNK_SIZE;
+	pthread_mutex_unlock(&w->mutex);
+	if (off >= w->len) break;
+	end = (off + WARMUP_CHUNK_SIZE < w->len) ? off + WARMUP_CHUNK_SIZE : w->len;
+
+	/* start the read ahead, then wait on it a page at a time */
+	madvise(w->addr + off, end - off, MADV_WILLNEED);
+	for (i=off;i<end;i+=pagesize){
+	    sum += ((volatile unsigned char*)w->addr)[i];
+	}
+	int err = (w->lock && mlock(w->addr + off, end - off) < 0) ? -2 : 0;
+
+	pthread_mutex_lock(&w->mutex);
+	w->done += end - off;
+	if (err < 0) w->err = err;
+	/* report each 1/WARMUP_REPORT_STEPS of the whole, and the end */
+	if (w->progress && (w->done - w->reported >= w->len/WARMUP_REPORT_STEPS || w->done == w->len)){
+	    w->reported = w->done;
+	    w->progress(w->done, w->len, w->arg);
+	}
+	pthread_mutex_unlock(&w->mutex);
+    }
+    return NULL;
+}
+
+int idxmem_warmup(void *addr, size_t len, int nbthreads, int lock,\
+		  AudioIndexProgress progress, void *arg){
+    IdxMemWarmup w;
+    pthread_t *threads;
+    int i, nbstarted = 0;
+
+    if (addr == NULL || len == 0) return 0;
+    if (nbthreads < 1) nbthreads = 1;
+
+    w.addr = (char*)addr;
+    w.len = len;
+    w.next = w.done = w.reported = 0;
+    w.lock = lock;
+    w.err = 0;
+    w.progress = progress;
+    w.arg = arg;
+    pthread_mutex_init(&w.mutex, NULL);
+
+    threads = (pthread_t*)malloc(nbthreads*sizeof(pthread_t));
+    if (threads){
+	for (i=0;i<nbthreads;i++){
+	    if (pthread_create(&threads[nbstarted], NULL, warmup_worker, &w) == 0) nbstarted++;
+	}
+    }
+    /* do it all here if no thread could be started */
+    if (nbstarted == 0) warmup_worker(&w);
+    for (i=0;i<nbstarted;i++){
+	pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&w.mutex);
+    return w.err;
+}
+
+PHASH_EXPORT
+int audioindex_pin_thread(int numa_node){
+#if defined(__linux__) && defined(CPU_SETSIZE)
+    char path[FILENAME_MAX];
+    unsigned long mask[CPU_SETSIZE/BITS_PER_LONG];
+    cpu_set_t cpus;
+    int cpu;
+
+    if (numa_node < 0) return -1;
+    memset(mask, 0, sizeof(mask));
+    snprintf(path, FILENAME_MAX, "/sys/devices/system/node/node%d/cpulist", numa_node);
+    if (read_list(path, mask, CPU_SETSIZE) <= 0) return -1;
+
+    CPU_ZERO(&cpus);
+    for (cpu = 0;cpu < CPU_SETSIZE;cpu++){
+	if (mask[cpu/BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG))) CPU_SET(cpu, &cpus);
+    }
+    return (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus)) ? -2 : 0;
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,46 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for mapping and placing index memory - not installed */
+
+#ifndef INDEX_MEM_H
+#define INDEX_MEM_H
+
+#include <stddef.h>
+#include "phash_audio.h"
+
+/* map size bytes of the open file fd read only, as the options say.          */
+/* *maplen is set to the length to pass to idxmem_unmap.  NULL on error        */
+void* idxmem_map(int fd, size_t size, const AudioIndexOpts *opts, size_t *maplen);
+
+/* unmap memory from idxmem_map */
+void idxmem_unmap(void *addr, size_t maplen);
+
+/* advise huge pages and apply the NUMA policy to an existing mapping,  */
+/* best effort - 0 if all was applied, less than 0 if something was not */
+int idxmem_advise(void *addr, size_t len, const AudioIndexOpts *opts);
+
+/* fault len bytes at addr in with nbthreads threads, optionally mlock them. */
+/* 0 on success, -1 on error, -2 if the pages could not be locked           */
+int idxmem_warmup(void *addr, size_t len, int nbthreads, int lock,\
+		  AudioIndexProgress progress, void *arg);
+
+#endif /* INDEX_MEM_H */
@@ -0,0 +1,158 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "index_stats.h"
+
+/* the hot keys are kept in a min heap on count while they are added */
+
+static int hist_bin(uint64_t len){
+    int bin = 0;
+    while (len){
+	bin++;
+	len >>= 1;
+    }
+    return bin;
+}
+
+static void heap_down(AudioIndexHotKey *heap, int n, int i){
+    AudioIndexHotKey tmp;
+    int child;
+    while ((child = 2*i + 1) < n){
+	if (child + 1 < n && heap[child+1].count < heap[child].count) child++;
+	if (heap[i].count <= heap[child].count) break;
+	tmp = heap[i];
+	heap[i] = heap[child];
+	heap[child] = tmp;
+	i = child;
+    }
+}
+
+static void heap_up(AudioIndexHotKey *heap, int i){
+    AudioIndexHotKey tmp;
+    while (i > 0 && heap[(i-1)/2].count > heap[i].count){
+	tmp = heap[i];
+	heap[i] = heap[(i-1)/2];
+	heap[(i-1)/2] = tmp;
+	i = (i-1)/2;
+    }
+}
+
+static int compare_hot(const void *a, const void *b){
+    const AudioIndexHotKey *x = (const AudioIndexHotKey*)a, *y = (const AudioIndexHotKey*)b;
+    if (x->count != y->count) return (x->count > y->count) ? -1 : 1;
+    return (x->key < y->key) ? -1 : (x->key > y->key);
+}
+
+int stats_init(AudioIndexStats *stats, int nbhot){
+    memset(stats, 0, sizeof(AudioIndexStats));
+    if (nbhot > 0){
+	stats->hot = (AudioIndexHotKey*)malloc(nbhot*sizeof(AudioIndexHotKey));
+	if (stats->hot == NULL) return -1;
+	stats->max_hot = nbhot;
+    }
+    return 0;
+}
+
+void stats_add_chains(AudioIndexStats *stats, uint64_t len, uint64_t nb){
+    stats->chain_hist[hist_bin(len)] += nb;
+    if (nb > 0 && len > stats->max_chain) stats->max_chain = len;
+}
+
+void stats_add_key(AudioIndexStats *stats, uint32_t key, uint64_t count, double probes){
+    stats->nbkeys++;
+    stats->nbpostings += count;
+    stats->list_hist[hist_bin(count)]++;
+    if (count > stats->max_list) stats->max_list = count;
+    stats->key_probes += probes;
+    stats->sq_postings += (double)count*(double)count;
+    if (key == 0) stats->zero_postings += count;
+    if (key == 0xffffffff) stats->ones_postings += count;
+
+    if (stats->nbhot < stats->max_hot){
+	stats->hot[stats->nbhot].key = key;
+	stats->hot[stats->nbhot].count = count;
+	heap_up(stats->hot, stats->nbhot++);
+    } else if (stats->max_hot > 0 && count > stats->hot[0].count){
+	stats->hot[0].key = key;
+	stats->hot[0].count = count;
+	heap_down(stats->hot, stats->nbhot, 0);
+    }
+}
+
+void stats_finish(AudioIndexStats *stats){
+    if (stats->nbhot > 0) qsort(stats->hot, stats->nbhot, sizeof(AudioIndexHotKey), compare_hot);
+}
+
+int stats_merge(AudioIndexStats *dst, const AudioIndexStats *src){
+    int i, j, n = dst->nbhot;
+    AudioIndexHotKey *hot = NULL;
+
+    dst->nbbuckets += src->nbbuckets;
+    dst->nbkeys += src->nbkeys;
+    dst->nbpostings += src->nbpostings;
+    dst->nbbytes += src->nbbytes;
+    for (i = 0;i < AUDIOINDEX_HIST_BINS;i++){
+	dst->chain_hist[i] += src->chain_hist[i];
+	dst->list_hist[i] += src->list_hist[i];
+    }
+    if (src->max_chain > dst->max_chain) dst->max_chain = src->max_chain;
+    if (src->max_list > dst->max_list) dst->max_list = src->max_list;
+    dst->key_probes += src->key_probes;
+    dst->sq_postings += src->sq_postings;
+    dst->zero_postings += src->zero_postings;
+    dst->ones_postings += src->ones_postings;
+
+    if (dst->max_hot == 0 || src->nbhot == 0) return 0;
+    hot = (AudioIndexHotKey*)malloc((dst->nbhot + src->nbhot)*sizeof(AudioIndexHotKey));
+    if (hot == NULL) return -1;
+    memcpy(hot, dst->hot, dst->nbhot*sizeof(AudioIndexHotKey));
+    for (i = 0;i < src->nbhot;i++){
+	for (j = 0;j < dst->nbhot && hot[j].key != src->hot[i].key;j++);
+	if (j < dst->nbhot){
+	    hot[j].count += src->hot[i].count;
+	} else {
+	    hot[n++] = src->hot[i];
+	}
+    }
+    qsort(hot, n, sizeof(AudioIndexHotKey), compare_hot);
+    dst->nbhot = (n < dst->max_hot) ? n : dst->max_hot;
+    memcpy(dst->hot, hot, dst->nbhot*sizeof(AudioIndexHotKey));
+    free(hot);
+    return 0;
+}
+
+uint32_t stats_search_probes(uint64_t n, uint64_t i){
+    uint64_t lo = 0, hi = n;
+    uint32_t probes = 0;
+    while (lo < hi){
+	uint64_t mid = lo + (hi - lo)/2;
+	probes++;
+	if (mid == i) break;
+	if (mid < i){
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return probes;
+}
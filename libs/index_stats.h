@@ -0,0 +1,49 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local helpers filling in an AudioIndexStats - not installed */
+
+#ifndef INDEX_STATS_H
+#define INDEX_STATS_H
+
+#include <stdint.h>
+#include "phash_audio.h"
+
+/* clear stats, with room for nbhot hot keys.  0 on success */
+int stats_init(AudioIndexStats *stats, int nbhot);
+
+/* count nb buckets holding len entries each */
+void stats_add_chains(AudioIndexStats *stats, uint64_t len, uint64_t nb);
+
+/* count a key with count postings, found after looking at probes entries */
+void stats_add_key(AudioIndexStats *stats, uint32_t key, uint64_t count, double probes);
+
+/* put the hot keys in order, most postings first */
+void stats_finish(AudioIndexStats *stats);
+
+/* add the finished stats src to the finished stats dst, the counts */
+/* of a hot key in both are summed.  0 on success                   */
+int stats_merge(AudioIndexStats *dst, const AudioIndexStats *src);
+
+/* nb of keys looked at by a binary search of n keys finding the i'th */
+uint32_t stats_search_probes(uint64_t n, uint64_t i);
+
+#endif /* INDEX_STATS_H */
@@ -0,0 +1,498 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "live_index.h"
+#include "id_set.h"
+#include "index_stats.h"
+
+#define SEGMENT_SIZE    ((size_t)1 << LIVE_INDEX_SEGMENT_BITS)
+#define NB_SEGMENTS     ((size_t)1 << (LIVE_INDEX_MAX_BUCKET_BITS - LIVE_INDEX_SEGMENT_BITS))
+
+/* init states of a dummy node, kept in its key field */
+#define BUCKET_UNUSED   0
+#define BUCKET_BUSY     1
+#define BUCKET_READY    2
+
+/* spread the bits of the key, a bijection so equal hashes mean equal keys */
+static inline uint32_t mix(uint32_t h){
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint32_t reverse_bits(uint32_t x){
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/* sort order of a posting, odd so it never equals that of a dummy node */
+static inline uint32_t posting_order(uint32_t h){
+    return reverse_bits(h | 0x80000000);
+}
+
+/* link node into the list after start, before the first node not less than it */
+static void list_insert(LiveNode *start, LiveNode *node){
+    LiveNode *prev = start;
+    LiveNode *curr = __atomic_load_n(&prev->next, __ATOMIC_ACQUIRE);
+    while (1){
+	while (curr != NULL && curr->order < node->order){
+	    prev = curr;
+	    curr = __atomic_load_n(&prev->next, __ATOMIC_ACQUIRE);
+	}
+	node->next = curr;
+	if (__atomic_compare_exchange_n(&prev->next, &curr, node, 0,\
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)){
+	    return;
+	}
+	/* curr now holds what was linked in after prev, go on from there */
+    }
+}
+
+/* dummy node of a bucket, split off from its parent bucket on first use */
+static LiveNode* get_bucket(LiveGeneration *gen, uint32_t bucket){
+    LiveNode **segp = &gen->segments[bucket >> LIVE_INDEX_SEGMENT_BITS];
+    LiveNode *seg = __atomic_load_n(segp, __ATOMIC_ACQUIRE);
+    if (seg == NULL){
+	LiveNode *fresh = (LiveNode*)calloc(SEGMENT_SIZE, sizeof(LiveNode));
+	if (fresh == NULL) return NULL;
+	if (__atomic_compare_exchange_n(segp, &seg, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+	    seg = fresh;
+	} else {
+	    free(fresh);
+	}
+    }
+
+    LiveNode *dummy = &seg[bucket & (SEGMENT_SIZE - 1)];
+    uint32_t state = __atomic_load_n(&dummy->key, __ATOMIC_ACQUIRE);
+    if (state == BUCKET_READY) return dummy;
+
+    if (state == BUCKET_UNUSED &&\
+	__atomic_compare_exchange_n(&dummy->key, &state, BUCKET_BUSY, 0,\
+				    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+	/* parent is the bucket with the top bit cleared */
+	uint32_t parent_bucket = bucket;
+	uint32_t top = 1;
+	while (top <= (bucket >> 1)) top <<= 1;
+	parent_bucket &= ~top;
+	LiveNode *parent = get_bucket(gen, parent_bucket);
+	if (parent == NULL){
+	    __atomic_store_n(&dummy->key, BUCKET_UNUSED, __ATOMIC_RELEASE);
+	    return NULL;
+	}
+	dummy->order = reverse_bits(bucket);
+	list_insert(parent, dummy);
+	__atomic_store_n(&dummy->key, BUCKET_READY, __ATOMIC_RELEASE);
+	return dummy;
+    }
+
+    /* another thread is linking it in, a few list steps at most */
+    while (__atomic_load_n(&dummy->key, __ATOMIC_ACQUIRE) != BUCKET_READY){
+	sched_yield();
+    }
+    return dummy;
+}
+
+/* double the buckets until nbpostings fit under the max load */
+static void grow(LiveGeneration *gen, uint64_t nbpostings){
+    uint32_t bits = __atomic_load_n(&gen->bucket_bits, __ATOMIC_RELAXED);
+    while (bits < LIVE_INDEX_MAX_BUCKET_BITS &&\
+	   nbpostings > ((uint64_t)LIVE_INDEX_MAX_LOAD << bits)){
+	if (__atomic_compare_exchange_n(&gen->bucket_bits, &bits, bits + 1, 0,\
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+	    bits++;
+	}
+    }
+}
+
+static LiveGeneration* gen_alloc(uint32_t bits){
+    LiveGeneration *gen = (LiveGeneration*)calloc(1, sizeof(LiveGeneration));
+    if (gen == NULL) return NULL;
+    gen->bucket_bits = bits;
+    gen->segments = (LiveNode**)calloc(NB_SEGMENTS, sizeof(LiveNode*));
+    if (gen->segments == NULL){
+	free(gen);
+	return NULL;
+    }
+    gen->segments[0] = (LiveNode*)calloc(SEGMENT_SIZE, sizeof(LiveNode));
+    if (gen->segments[0] == NULL){
+	free(gen->segments);
+	free(gen);
+	return NULL;
+    }
+    /* bucket 0 heads the whole list */
+    gen->segments[0][0].key = BUCKET_READY;
+    return gen;
+}
+
+static void gen_free(LiveGeneration *gen){
+    size_t i;
+    LiveBlock *blk = gen->blocks;
+    while (blk){
+	LiveBlock *next = blk->next;
+	free(blk);
+	blk = next;
+    }
+    for (i = 0;i < NB_SEGMENTS;i++){
+	free(gen->segments[i]);
+    }
+    free(gen->segments);
+    free(gen);
+}
+
+static void chain_free(LiveGeneration *gen){
+    while (gen){
+	LiveGeneration *older = gen->older;
+	gen_free(gen);
+	gen = older;
+    }
+}
+
+static LiveBlock* block_alloc(size_t nbnodes){
+    LiveBlock *blk = (LiveBlock*)malloc(sizeof(LiveBlock) + nbnodes*sizeof(LiveNode));
+    if (blk == NULL) return NULL;
+    blk->next = NULL;
+    blk->nbnodes = nbnodes;
+    return blk;
+}
+
+/* publish a filled block into gen - all nodes are linked into their buckets */
+static void gen_publish(LiveGeneration *gen, LiveBlock *blk){
+    size_t i;
+    uint64_t total = __atomic_add_fetch(&gen->nbpostings, blk->nbnodes, __ATOMIC_RELAXED);
+    grow(gen, total);
+
+    LiveBlock *head = __atomic_load_n(&gen->blocks, __ATOMIC_RELAXED);
+    do {
+	blk->next = head;
+    } while (!__atomic_compare_exchange_n(&gen->blocks, &head, blk, 1,\
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    for (i = 0;i < blk->nbnodes;i++){
+	LiveNode *node = &blk->nodes[i];
+	uint32_t h = mix(node->key);
+	uint32_t bits = __atomic_load_n(&gen->bucket_bits, __ATOMIC_ACQUIRE);
+	LiveNode *dummy = get_bucket(gen, h & (((uint32_t)1 << bits) - 1));
+	if (dummy == NULL) dummy = get_bucket(gen, 0);
+	node->order = posting_order(h);
+	list_insert(dummy, node);
+    }
+}
+
+LiveIndex* liveidx_create(uint32_t nbbuckets){
+    uint32_t bits = LIVE_INDEX_MIN_BUCKET_BITS;
+    while (bits < LIVE_INDEX_MAX_BUCKET_BITS && ((uint32_t)1 << bits) < nbbuckets) bits++;
+
+    LiveIndex *idx = (LiveIndex*)calloc(1, sizeof(LiveIndex));
+    if (idx == NULL) return NULL;
+    idx->current = gen_alloc(bits);
+    if (idx->current == NULL){
+	free(idx);
+	return NULL;
+    }
+    idx->magic = LIVE_INDEX_MAGIC;
+    idx->bucket_bits = bits;
+    pthread_mutex_init(&idx->flush_mutex, NULL);
+    return idx;
+}
+
+void liveidx_destroy(LiveIndex *idx){
+    if (idx == NULL) return;
+    chain_free(idx->current);
+    pthread_mutex_destroy(&idx->flush_mutex);
+    idx->magic = 0;
+    free(idx);
+}
+
+unsigned long liveidx_enter(LiveIndex *idx){
+    while (1){
+	unsigned long epoch = __atomic_load_n(&idx->epoch, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&idx->active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&idx->epoch, __ATOMIC_SEQ_CST) == epoch) return epoch;
+	__atomic_fetch_sub(&idx->active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void liveidx_exit(LiveIndex *idx, unsigned long epoch){
+    __atomic_fetch_sub(&idx->active[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+/* wait for every operation that entered before the call to leave. */
+/* only called with the flush mutex held                           */
+static void synchronize(LiveIndex *idx){
+    unsigned long epoch = __atomic_load_n(&idx->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&idx->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&idx->active[epoch & 1], __ATOMIC_ACQUIRE) > 0){
+	sched_yield();
+    }
+}
+
+int liveidx_insert(LiveIndex *idx, uint32_t id, const uint32_t *hash, int nbframes){
+    int i;
+    if (idx == NULL || idx->magic != LIVE_INDEX_MAGIC || nbframes < 0) return -1;
+    if (nbframes == 0) return 0;
+
+    LiveBlock *blk = block_alloc(nbframes);
+    if (blk == NULL) return -2;
+    for (i = 0;i < nbframes;i++){
+	blk->nodes[i].key = hash[i];
+	blk->nodes[i].val.id = id;
+	blk->nodes[i].val.pos = (uint32_t)i;
+    }
+
+    unsigned long epoch = liveidx_enter(idx);
+    gen_publish(__atomic_load_n(&idx->current, __ATOMIC_ACQUIRE), blk);
+    liveidx_exit(idx, epoch);
+    return 0;
+}
+
+int liveidx_add_postings(LiveIndex *idx, const SortedPosting *postings, size_t nbpostings){
+    size_t i;
+    if (idx == NULL || idx->magic != LIVE_INDEX_MAGIC) return -1;
+    if (nbpostings == 0) return 0;
+
+    LiveBlock *blk = block_alloc(nbpostings);
+    if (blk == NULL) return -2;
+    for (i = 0;i < nbpostings;i++){
+	blk->nodes[i].key = postings[i].key;
+	blk->nodes[i].val.id = postings[i].id;
+	blk->nodes[i].val.pos = postings[i].pos;
+    }
+
+    unsigned long epoch = liveidx_enter(idx);
+    gen_publish(__atomic_load_n(&idx->current, __ATOMIC_ACQUIRE), blk);
+    liveidx_exit(idx, epoch);
+    return 0;
+}
+
+int liveidx_lookup(LiveIndex *idx, uint32_t key, TableValue **buf, int *bufsize){
+    int n = 0;
+    uint32_t h = mix(key), order = posting_order(h);
+    LiveGeneration *gen = __atomic_load_n(&idx->current, __ATOMIC_ACQUIRE);
+    while (gen){
+	uint32_t bits = __atomic_load_n(&gen->bucket_bits, __ATOMIC_ACQUIRE);
+	LiveNode *node = get_bucket(gen, h & (((uint32_t)1 << bits) - 1));
+	if (node == NULL) node = get_bucket(gen, 0);
+
+	/* postings of the key are together, ahead of any greater order */
+	node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	for ( ;node != NULL && node->order <= order;node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)){
+	    if (node->order != order || node->key != key) continue;
+	    if (n == *bufsize){
+		int size = (*bufsize) ? 2*(*bufsize) : 64;
+		TableValue *tmp = (TableValue*)realloc(*buf, size*sizeof(TableValue));
+		if (tmp == NULL) return -1;
+		*buf = tmp;
+		*bufsize = size;
+	    }
+	    (*buf)[n++] = node->val;
+	}
+	gen = __atomic_load_n(&gen->older, __ATOMIC_ACQUIRE);
+    }
+    return n;
+}
+
+uint64_t liveidx_count(LiveIndex *idx){
+    uint64_t count = 0;
+    unsigned long epoch = liveidx_enter(idx);
+    LiveGeneration *gen = __atomic_load_n(&idx->current, __ATOMIC_ACQUIRE);
+    while (gen){
+	count += __atomic_load_n(&gen->nbpostings, __ATOMIC_RELAXED);
+	gen = __atomic_load_n(&gen->older, __ATOMIC_ACQUIRE);
+    }
+    liveidx_exit(idx, epoch);
+    return count;
+}
+
+uint64_t liveidx_buckets(LiveIndex *idx){
+    unsigned long epoch = liveidx_enter(idx);
+    LiveGeneration *gen = __atomic_load_n(&idx->current, __ATOMIC_ACQUIRE);
+    uint64_t nbbuckets = (uint64_t)1 << __atomic_load_n(&gen->bucket_bits, __ATOMIC_RELAXED);
+    liveidx_exit(idx, epoch);
+    return nbbuckets;
+}
+
+/* a node as it sits in the list, for liveidx_analyze */
+typedef struct liveidx_keyorder_t {
+    uint32_t order;
+    uint32_t key;
+} LiveKeyOrder;
+
+static int compare_keyorder(const void *a, const void *b){
+    const LiveKeyOrder *x = (const LiveKeyOrder*)a, *y = (const LiveKeyOrder*)b;
+    if (x->order != y->order) return (x->order < y->order) ? -1 : 1;
+    return (x->key < y->key) ? -1 : (x->key > y->key);
+}
+
+/* the nodes of the generation in list order: a bucket is a run of   */
+/* them, and a lookup walks its bucket up to the last node of the    */
+/* same order as the key                                             */
+static int gen_analyze(LiveGeneration *gen, AudioIndexStats *stats){
+    LiveBlock *head = __atomic_load_n(&gen->blocks, __ATOMIC_ACQUIRE), *blk;
+    uint32_t bits = __atomic_load_n(&gen->bucket_bits, __ATOMIC_ACQUIRE);
+    uint32_t mask = ((uint32_t)1 << bits) - 1, bucket;
+    size_t i, j, k, n = 0, start, nbsegs = 0, nonempty = 0;
+
+    for (blk = head;blk != NULL;blk = blk->next){
+	n += blk->nbnodes;
+    }
+    LiveKeyOrder *nodes = (LiveKeyOrder*)malloc((n + 1)*sizeof(LiveKeyOrder));
+    if (nodes == NULL) return -1;
+    n = 0;
+    for (blk = head;blk != NULL;blk = blk->next){
+	for (i = 0;i < blk->nbnodes;i++){
+	    nodes[n].key = blk->nodes[i].key;
+	    nodes[n].order = posting_order(mix(nodes[n].key));
+	    n++;
+	}
+    }
+    qsort(nodes, n, sizeof(LiveKeyOrder), compare_keyorder);
+
+    for (i = 0;i < n;i = j){
+	/* the bucket is in the low bits of the hash, the top bits of the order */
+	bucket = reverse_bits(nodes[i].order) & mask;
+	for (j = i;j < n && (reverse_bits(nodes[j].order) & mask) == bucket;j++);
+	stats_add_chains(stats, j - i, 1);
+	nonempty++;
+	for (start = i;start < j;start = k){
+	    for (k = start;k < j && nodes[k].key == nodes[start].key;k++);
+	    stats_add_key(stats, nodes[start].key, k - start, (double)(k - i));
+	}
+    }
+    free(nodes);
+
+    stats_add_chains(stats, 0, ((uint64_t)1 << bits) - nonempty);
+    stats->nbbuckets += (uint64_t)1 << bits;
+    for (i = 0;i < NB_SEGMENTS;i++){
+	if (__atomic_load_n(&gen->segments[i], __ATOMIC_ACQUIRE)) nbsegs++;
+    }
+    stats->nbbytes += (n + nbsegs*SEGMENT_SIZE)*sizeof(LiveNode) + NB_SEGMENTS*sizeof(LiveNode*);
+    return 0;
+}
+
+int liveidx_analyze(LiveIndex *idx, AudioIndexStats *stats){
+    int err = 0;
+    unsigned long epoch = liveidx_enter(idx);
+    LiveGeneration *gen = __atomic_load_n(&idx->current, __ATOMIC_ACQUIRE);
+    while (gen && err == 0){
+	err = gen_analyze(gen, stats);
+	gen = __atomic_load_n(&gen->older, __ATOMIC_ACQUIRE);
+    }
+    liveidx_exit(idx, epoch);
+    return err;
+}
+
+/* postings of the frozen chain sorted by (key, id, pos), NULL on error */
+static SortedPosting* collect_postings(LiveGeneration *gen, size_t *nbpostings){
+    LiveGeneration *g;
+    LiveBlock *blk;
+    size_t i, n = 0;
+
+    for (g = gen;g != NULL;g = g->older){
+	n += g->nbpostings;
+    }
+    SortedPosting *postings = (SortedPosting*)malloc((n + 1)*sizeof(SortedPosting));
+    if (postings == NULL) return NULL;
+
+    n = 0;
+    for (g = gen;g != NULL;g = g->older){
+	for (blk = g->blocks;blk != NULL;blk = blk->next){
+	    for (i = 0;i < blk->nbnodes;i++){
+		postings[n].key = blk->nodes[i].key;
+		postings[n].id  = blk->nodes[i].val.id;
+		postings[n].pos = blk->nodes[i].val.pos;
+		n++;
+	    }
+	}
+    }
+    qsort(postings, n, sizeof(SortedPosting), sortidx_compare_postings);
+    *nbpostings = n;
+    return postings;
+}
+
+int liveidx_flush(LiveIndex *idx, const char *path){
+    size_t i, n = 0;
+    int err = 0;
+    if (idx == NULL || idx->magic != LIVE_INDEX_MAGIC || path == NULL) return -1;
+
+    pthread_mutex_lock(&idx->flush_mutex);
+
+    /* freeze - new inserts go to a fresh generation in front of the old ones */
+    LiveGeneration *gen = gen_alloc(idx->bucket_bits);
+    if (gen == NULL){
+	pthread_mutex_unlock(&idx->flush_mutex);
+	return -2;
+    }
+    gen->older = idx->current;
+    __atomic_store_n(&idx->current, gen, __ATOMIC_RELEASE);
+    synchronize(idx);
+
+    /* everything behind gen is now immutable */
+    LiveGeneration *frozen = gen->older;
+    SortedPosting *postings = collect_postings(frozen, &n);
+    if (postings == NULL){
+	pthread_mutex_unlock(&idx->flush_mutex);
+	return -3;
+    }
+
+    SortedIndexWriter *w = sortidx_writer_open(path, sortidx_dir_bits(n));
+    if (w == NULL) err = -4;
+    for (i = 0;i < n && err == 0;i++){
+	/* deleted tracks are not written out */
+	if (idx->deleted && idset_has(idx->deleted, postings[i].id)) continue;
+	if (sortidx_writer_add(w, postings[i].key, postings[i].id, postings[i].pos) < 0){
+	    sortidx_writer_abort(w);
+	    err = -5;
+	}
+    }
+    if (err == 0 && sortidx_writer_close(w) < 0) err = -6;
+
+    /* fold the frozen generations into one, so lookups stay at two chains */
+    if (frozen->older != NULL){
+	LiveGeneration *merged = gen_alloc(idx->bucket_bits);
+	LiveBlock *blk = (merged) ? block_alloc(n) : NULL;
+	if (blk){
+	    for (i = 0;i < n;i++){
+		blk->nodes[i].key = postings[i].key;
+		blk->nodes[i].val.id = postings[i].id;
+		blk->nodes[i].val.pos = postings[i].pos;
+	    }
+	    gen_publish(merged, blk);
+	    __atomic_store_n(&gen->older, merged, __ATOMIC_RELEASE);
+	    synchronize(idx);
+	    chain_free(frozen);
+	} else if (merged){
+	    gen_free(merged);
+	}
+    }
+
+    free(postings);
+    pthread_mutex_unlock(&idx->flush_mutex);
+    return err;
+}
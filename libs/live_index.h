@@ -0,0 +1,131 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the concurrent in-memory index - not installed */
+
+#ifndef LIVE_INDEX_H
+#define LIVE_INDEX_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "phash_audio.h"
+#include "sorted_index.h"
+
+/* magic number of the in-memory handle, first field like table_t and SortedIndex */
+#define LIVE_INDEX_MAGIC 0x56494c41          /* "ALIV" */
+
+/*
+ * Postings are kept in a split-ordered list: one linked list of nodes sorted on
+ * their bit reversed hash, with a dummy node per bucket marking where the bucket
+ * starts.  Nodes are linked in with compare and swap, so inserts never take a lock
+ * and lookups run at the same time.  Doubling the nb of buckets moves no nodes, it
+ * only bumps bucket_bits - each new bucket is split off its parent the first time
+ * it is used, by linking in its dummy node.  So the cost of growing is spread over
+ * the inserts and lookups, a few list steps at a time.
+ *
+ * The lists live in generations.  Inserts go to the newest generation, lookups
+ * walk all of them.  A flush swaps in a fresh generation and waits for the
+ * operations already inside the old one to leave, which makes the old one
+ * immutable so it can be written out while inserts go on.
+ *
+ * Memory is reclaimed with two epoch counters: every operation enters the index
+ * by counting itself in the slot of the current epoch, and a writer that wants to
+ * free something no longer reachable bumps the epoch and waits for the old slot
+ * to drain.
+ */
+
+/* bounds on log2 of the nb of buckets, and the load at which they are doubled */
+#define LIVE_INDEX_MIN_BUCKET_BITS 10
+#define LIVE_INDEX_MAX_BUCKET_BITS 30
+#define LIVE_INDEX_MAX_LOAD 4
+
+/* buckets are allocated in segments as they are first used */
+#define LIVE_INDEX_SEGMENT_BITS 14
+
+typedef struct liveidx_node_t {
+    uint32_t key;                       /* hash value, init state for a dummy node */
+    uint32_t order;                     /* bit reversed hash, odd for postings     */
+    TableValue val;
+    struct liveidx_node_t *next;
+} LiveNode;
+
+/* nodes of one insert, allocated together */
+typedef struct liveidx_block_t {
+    struct liveidx_block_t *next;
+    size_t nbnodes;
+    LiveNode nodes[];
+} LiveBlock;
+
+typedef struct liveidx_gen_t {
+    LiveNode **segments;                /* dummy nodes, by bucket   */
+    uint32_t bucket_bits;               /* log2 of nb buckets in use */
+    LiveBlock *blocks;                  /* all nodes, for free  */
+    uint64_t nbpostings;
+    struct liveidx_gen_t *older;        /* next generation to look in */
+} LiveGeneration;
+
+typedef struct liveidx_t {
+    uint32_t magic;                     /* LIVE_INDEX_MAGIC, must be first */
+    uint32_t bucket_bits;               /* initial log2 of nb buckets */
+    LiveGeneration *current;            /* generation taking inserts */
+    unsigned long epoch;
+    long active[2];                     /* operations inside, by epoch parity */
+    pthread_mutex_t flush_mutex;        /* one flush at a time */
+    struct idset_t *deleted;            /* ids left out of lookups and flushes, */
+                                        /* or NULL - not owned by the index     */
+} LiveIndex;
+
+/* new empty index starting with at least nbbuckets buckets, NULL on error */
+LiveIndex* liveidx_create(uint32_t nbbuckets);
+
+/* free everything - no other thread may be using the index */
+void liveidx_destroy(LiveIndex *idx);
+
+/* enter/leave the index around any access to its generations */
+unsigned long liveidx_enter(LiveIndex *idx);
+void liveidx_exit(LiveIndex *idx, unsigned long epoch);
+
+/* insert the frames of a hash, safe with any number of concurrent callers */
+int liveidx_insert(LiveIndex *idx, uint32_t id, const uint32_t *hash, int nbframes);
+
+/* insert a batch of postings, as read from an index file */
+int liveidx_add_postings(LiveIndex *idx, const SortedPosting *postings, size_t nbpostings);
+
+/* copy the postings of key into *buf, grown as needed.  call between   */
+/* liveidx_enter and liveidx_exit.  return nb postings, less than 0 on error */
+int liveidx_lookup(LiveIndex *idx, uint32_t key, TableValue **buf, int *bufsize);
+
+/* nb of postings in all generations */
+uint64_t liveidx_count(LiveIndex *idx);
+
+/* nb of buckets in use by the generation taking inserts */
+uint64_t liveidx_buckets(LiveIndex *idx);
+
+/* add the key distribution of each generation to stats, see */
+/* analyze_audioindex.  0 on success, less than 0 on error    */
+int liveidx_analyze(LiveIndex *idx, AudioIndexStats *stats);
+
+/* write all postings inserted so far, less those of deleted ids, as a   */
+/* sorted index file, without holding up inserts or lookups.  0 on      */
+/* success, less than 0 on error                                        */
+int liveidx_flush(LiveIndex *idx, const char *path);
+
+#endif /* LIVE_INDEX_H */
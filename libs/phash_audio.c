@@ -20,6 +20,7 @@
 */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
 #include <sys/types.h>
@@ -28,6 +29,16 @@
 #include "./table-4.3.0phmodified/table.h"
 #include "fft.h"
 #include "phash_audio.h"
+#include "sorted_index.h"
+#include "live_index.h"
+#include "segment_index.h"
+#include "id_set.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "index_stats.h"
+#include "votes.h"
+#include "index_mem.h"
+#include "hash_store.h"
 #include <stdio.h>
 
 #ifdef __unix__
@@ -39,6 +50,14 @@
 
 #define TOGGLE_BIT(word,b)     (0x80000000 >> b)^word
 
+/* an AudioIndex is a table_t, a SortedIndex or a LiveIndex, told apart by the magic in the first word */
+#define IS_SORTED_INDEX(idx)   (*(uint32_t*)(idx) == SORTED_INDEX_MAGIC)
+#define IS_LIVE_INDEX(idx)     (*(uint32_t*)(idx) == LIVE_INDEX_MAGIC)
+#define IS_SEGMENTED_INDEX(idx) (*(uint32_t*)(idx) == SEGMENTED_INDEX_MAGIC)
+
+/* nb postings read at a time when loading a live index from a file */
+#define LIVE_LOAD_CHUNK 65536
+
 static const unsigned int nfilts = 33;
 static const double BarkWidth = 1.06;
 
@@ -53,9 +72,29 @@ static const double BarkFreqs[33] = {   50.0,  75.0,  100.0,  125.0,  150.0,   2
 
 PHASH_EXPORT
 AudioIndex open_audioindex(const char *idx_file, int add, int nbbuckets){
+    return open_audioindex_opts(idx_file, add, nbbuckets, NULL);
+}
+
+PHASH_EXPORT
+AudioIndex open_audioindex_opts(const char *idx_file, int add, int nbbuckets, const AudioIndexOpts *opts){
 
     int error;
+    void *region;
+    unsigned long region_size;
     AudioIndex audio_index = NULL;
+    if (sortidx_probe(idx_file)){
+	/* sorted index files are read only, deletes go to a file of their own */
+	char del_file[FILENAME_MAX];
+	SortedIndex *idx = (add) ? NULL : sortidx_open(idx_file, opts);
+	if (idx == NULL) return NULL;
+	idset_path(idx_file, del_file);
+	idx->deleted = idset_open(del_file);
+	if (idx->deleted == NULL){
+	    sortidx_close(idx);
+	    return NULL;
+	}
+	return (AudioIndex)idx;
+    }
     if (add){
 	audio_index = (AudioIndex)table_read(idx_file, &error);
 	if (error != TABLE_ERROR_NONE){
@@ -80,11 +119,327 @@ AudioIndex open_audioindex(const char *idx_file, int add, int nbbuckets){
 		return NULL;
 	    }
 	}
+	/* a table stays mmapped, only advise and place it */
+	if (opts && table_mmap_region(audio_index, &region, &region_size) == TABLE_ERROR_NONE){
+	    idxmem_advise(region, region_size, opts);
+	}
     }
 
     return audio_index;
 }
 
+PHASH_EXPORT
+int warmup_audioindex(AudioIndex index, int nbthreads, int lock, AudioIndexProgress progress, void *arg){
+    void *region;
+    unsigned long region_size;
+    if (index == NULL) return -1;
+    if (IS_LIVE_INDEX(index)) return 0;
+    if (IS_SEGMENTED_INDEX(index)){
+	int i, err = 0;
+	SegmentedIndex *idx = (SegmentedIndex*)index;
+	SegmentList *list = segidx_acquire(idx);
+	for (i = 0;i < list->nbsegments && err == 0;i++){
+	    err = warmup_audioindex((AudioIndex)list->segments[i]->idx, nbthreads, lock, progress, arg);
+	}
+	segidx_release(idx, list);
+	return err;
+    }
+    if (IS_SORTED_INDEX(index)){
+	SortedIndex *idx = (SortedIndex*)index;
+	return idxmem_warmup((void*)idx->map, idx->map_size, nbthreads, lock, progress, arg);
+    }
+    if (table_mmap_region((table_t*)index, &region, &region_size) != TABLE_ERROR_NONE){
+	/* read in, not mapped - nothing to fault in */
+	return 0;
+    }
+    return idxmem_warmup(region, region_size, nbthreads, lock, progress, arg);
+}
+
+/* one input of a streaming merge - a sorted index is read with a cursor, */
+/* a table has to be read in whole and its entries sorted.  the postings  */
+/* of ids deleted from the input file are dropped on the way              */
+typedef struct merge_input_t {
+    SortedSource src;
+    SortedIndexCursor *cursor;
+    SortedArray array;
+    uint64_t nbkeys;
+    IdSet *deleted;
+    IdSetFilter filter;
+} MergeInput;
+
+static int table_to_sorted_array(const char *path, SortedArray *arr){
+    int err, key_size, data_size, i;
+    size_t maxpostings = 0;
+    void *pkey, *pdata;
+    table_linear_t linear_st;
+
+    arr->postings = NULL;
+    arr->nbpostings = arr->curr = 0;
+
+    table_t *tbl = table_read(path, &err);
+    if (err != TABLE_ERROR_NONE) return -1;
+
+    err = table_first_r(tbl, &linear_st, &pkey, &key_size, &pdata, &data_size);
+    while (err == TABLE_ERROR_NONE){
+	int nbvals = data_size/sizeof(TableValue);
+	if (key_size == sizeof(uint32_t)){
+	    if (arr->nbpostings + nbvals > maxpostings){
+		size_t newmax = (maxpostings) ? 2*maxpostings : 1024;
+		while (newmax < arr->nbpostings + nbvals) newmax *= 2;
+		SortedPosting *tmp = (SortedPosting*)realloc(arr->postings, newmax*sizeof(SortedPosting));
+		if (tmp == NULL){
+		    table_free(tbl);
+		    return -2;
+		}
+		arr->postings = tmp;
+		maxpostings = newmax;
+	    }
+	    for (i = 0;i < nbvals;i++){
+		SortedPosting *p = &(arr->postings[arr->nbpostings++]);
+		memcpy(&(p->key), pkey, sizeof(uint32_t));
+		p->id  = ((TableValue*)pdata)[i].id;
+		p->pos = ((TableValue*)pdata)[i].pos;
+	    }
+	}
+	err = table_next_r(tbl, &linear_st, &pkey, &key_size, &pdata, &data_size);
+    }
+    table_free(tbl);
+
+    qsort(arr->postings, arr->nbpostings, sizeof(SortedPosting), sortidx_compare_postings);
+    return 0;
+}
+
+static int open_merge_input(const char *path, MergeInput *in){
+    char del_file[FILENAME_MAX];
+    struct stat info;
+    memset(in, 0, sizeof(MergeInput));
+    if (sortidx_probe(path)){
+	in->cursor = sortidx_cursor_open(path);
+	if (in->cursor == NULL) return -1;
+	in->src.next = sortidx_cursor_next;
+	in->src.arg = in->cursor;
+	in->nbkeys = in->cursor->header.nbkeys;
+    } else {
+	if (table_to_sorted_array(path, &(in->array)) < 0) return -1;
+	in->src.next = sortidx_array_next;
+	in->src.arg = &(in->array);
+	in->nbkeys = in->array.nbpostings;
+    }
+    idset_path(path, del_file);
+    if (!stat(del_file, &info)){
+	in->deleted = idset_open(del_file);
+	if (in->deleted == NULL) return -1;
+    }
+    in->filter.src = in->src;
+    in->filter.sets[0] = in->deleted;
+    in->src.next = idset_filter_next;
+    in->src.arg = &(in->filter);
+    return 0;
+}
+
+static void close_merge_input(MergeInput *in){
+    sortidx_cursor_close(in->cursor);
+    free(in->array.postings);
+    idset_close(in->deleted);
+    memset(in, 0, sizeof(MergeInput));
+}
+
+static int merge_inputs(const char *dst_idxfile, MergeInput *inputs, int nbinputs){
+    int i;
+    uint64_t nbkeys = 0;
+    SortedSource *srcs = (SortedSource*)malloc(nbinputs*sizeof(SortedSource));
+    if (srcs == NULL) return -1;
+    for (i = 0;i < nbinputs;i++){
+	srcs[i] = inputs[i].src;
+	nbkeys += inputs[i].nbkeys;
+    }
+    int err = sortidx_merge(srcs, nbinputs, dst_idxfile, sortidx_dir_bits(nbkeys));
+    free(srcs);
+    return err;
+}
+
+PHASH_EXPORT
+int combine_audioindex(const char *dst_idxfile, const char **src_idxfiles, int nbsrcs){
+    int i, ret = 0;
+    if (!dst_idxfile || !src_idxfiles || nbsrcs <= 0) return -1;
+
+    MergeInput *inputs = (MergeInput*)calloc(nbsrcs, sizeof(MergeInput));
+    if (inputs == NULL) return -1;
+
+    for (i = 0;i < nbsrcs;i++){
+	if (open_merge_input(src_idxfiles[i], &inputs[i]) < 0){
+	    ret = -2;
+	    break;
+	}
+    }
+    if (ret == 0 && merge_inputs(dst_idxfile, inputs, nbsrcs) < 0){
+	ret = -3;
+    }
+
+    for (i = 0;i < nbsrcs;i++){
+	close_merge_input(&inputs[i]);
+    }
+    free(inputs);
+    return ret;
+}
+
+/* merge a tmp table into a sorted index without reading the sorted index into memory */
+static int merge_into_sorted(const char *dst_idxfile, const char *src_idxfile){
+    MergeInput inputs[2];
+    int err;
+    table_t *srctbl;
+
+    if (open_merge_input(src_idxfile, &inputs[1]) < 0) return -3;
+    if (inputs[1].nbkeys == 0){
+	close_merge_input(&inputs[1]);
+	return 1;
+    }
+    if (open_merge_input(dst_idxfile, &inputs[0]) < 0){
+	close_merge_input(&inputs[1]);
+	return -2;
+    }
+    /* ids deleted from the index may still be in the tmp index */
+    inputs[1].filter.sets[1] = inputs[0].deleted;
+
+    err = merge_inputs(dst_idxfile, inputs, 2);
+    close_merge_input(&inputs[0]);
+    close_merge_input(&inputs[1]);
+    if (err < 0) return -4;
+
+    /* clear source */
+    if (sortidx_probe(src_idxfile)){
+	unlink(src_idxfile);
+    } else {
+	srctbl = table_read(src_idxfile, &err);
+	if (err == TABLE_ERROR_NONE){
+	    table_clear(srctbl);
+	    table_write(srctbl, src_idxfile, 0755);
+	    table_free(srctbl);
+	}
+    }
+    return 0;
+}
+
+/* a live index, with its deletes kept in <idx_file>.del and the entries */
+/* of idx_file loaded if load                                           */
+static AudioIndex open_live(const char *idx_file, int nbbuckets, int load){
+    char del_file[FILENAME_MAX];
+    struct stat info;
+    MergeInput in;
+    SortedPosting *chunk;
+    size_t n;
+    int res = 0;
+
+    LiveIndex *idx = liveidx_create((nbbuckets > 0) ? (uint32_t)nbbuckets : 0);
+    if (idx == NULL) return NULL;
+    if (idx_file) idset_path(idx_file, del_file);
+    idx->deleted = idset_open((idx_file) ? del_file : NULL);
+    if (idx->deleted == NULL){
+	liveidx_destroy(idx);
+	return NULL;
+    }
+    if (!load || idx_file == NULL || stat(idx_file, &info) || info.st_size == 0){
+	return (AudioIndex)idx;
+    }
+
+    /* load the entries already flushed */
+    chunk = (SortedPosting*)malloc(LIVE_LOAD_CHUNK*sizeof(SortedPosting));
+    if (chunk == NULL || open_merge_input(idx_file, &in) < 0){
+	free(chunk);
+	close_audioindex((AudioIndex)idx, 0);
+	return NULL;
+    }
+    do {
+	n = 0;
+	while (n < LIVE_LOAD_CHUNK && (res = in.src.next(in.src.arg, &chunk[n])) > 0) n++;
+	if (res >= 0 && liveidx_add_postings(idx, chunk, n) < 0) res = -1;
+    } while (res > 0);
+    close_merge_input(&in);
+    free(chunk);
+
+    if (res < 0){
+	close_audioindex((AudioIndex)idx, 0);
+	return NULL;
+    }
+    return (AudioIndex)idx;
+}
+
+PHASH_EXPORT
+AudioIndex open_live_audioindex(const char *idx_file, int nbbuckets){
+    return open_live(idx_file, nbbuckets, 1);
+}
+
+PHASH_EXPORT
+AudioIndex open_empty_live_audioindex(const char *idx_file, int nbbuckets){
+    return open_live(idx_file, nbbuckets, 0);
+}
+
+/* write a table next to path and rename it over path, so a mapping */
+/* of the old file stays valid for whoever is still using it         */
+static int replace_table_file(table_t *tbl, const char *path){
+    char part[FILENAME_MAX];
+    snprintf(part, FILENAME_MAX, "%s.part", path);
+    if (table_write(tbl, part, 0755) != TABLE_ERROR_NONE){
+	unlink(part);
+	return -1;
+    }
+    if (rename(part, path) < 0){
+	unlink(part);
+	return -1;
+    }
+    return 0;
+}
+
+PHASH_EXPORT
+AudioIndex open_segmented_audioindex(const char *name, int memtable_size, const AudioIndexOpts *opts){
+    /* the log is replayed with a thread per cpu */
+    return (AudioIndex)segidx_open(name, (memtable_size > 0) ? (uint64_t)memtable_size : 0, opts,\
+				   (int)sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/* fold a sorted index file into a table - for a table main index */
+static int merge_sorted_into_table(const char *dst_idxfile, const char *src_idxfile){
+    MergeInput in;
+    SortedPosting p;
+    TableValue val;
+    int err, res, ret = 0;
+
+    /* the table keeps no deletes, those of the src are dropped on the way in */
+    if (open_merge_input(src_idxfile, &in) < 0) return -3;
+    if (in.nbkeys == 0){
+	close_merge_input(&in);
+	return 1;
+    }
+    table_t *dsttbl = open_audioindex(dst_idxfile, 1, 0);
+    if (dsttbl == NULL){
+	close_merge_input(&in);
+	return -2;
+    }
+    table_attr(dsttbl, 0);
+
+    while ((res = in.src.next(in.src.arg, &p)) > 0){
+	val.id = p.id;
+	val.pos = p.pos;
+	err = table_insert_kd(dsttbl, &p.key, sizeof(uint32_t), &val, sizeof(TableValue), NULL, NULL, 0);
+	if (err != TABLE_ERROR_NONE && err != TABLE_ERROR_OVERWRITE){
+	    ret = -4;
+	    break;
+	}
+    }
+    if (res < 0) ret = -4;
+    close_merge_input(&in);
+
+    if (ret == 0){
+	if (replace_table_file(dsttbl, dst_idxfile) < 0){
+	    ret = -5;
+	} else {
+	    unlink(src_idxfile);
+	}
+    }
+    table_free(dsttbl);
+    return ret;
+}
+
 PHASH_EXPORT
 int merge_audioindex(const char *dst_idxfile, const char *src_idxfile){
     /* merge table in src_idxfile into dst_idxfile - clear source */ 
@@ -95,7 +450,13 @@ int merge_audioindex(const char *dst_idxfile, const char *src_idxfile){
     table_linear_t linear_st;
 
     if (!dst_idxfile || !src_idxfile) return -1;
-    stat(src_idxfile, &src_info);
+
+    if (!stat(src_idxfile, &src_info) && src_info.st_size > 0 && sortidx_probe(dst_idxfile)){
+	return merge_into_sorted(dst_idxfile, src_idxfile);
+    }
+    if (!stat(src_idxfile, &src_info) && src_info.st_size > 0 && sortidx_probe(src_idxfile)){
+	return merge_sorted_into_table(dst_idxfile, src_idxfile);
+    }
 
     if (!stat(src_idxfile, &src_info) && src_info.st_size > 0) {
 	/* open source  table */
@@ -124,9 +485,11 @@ int merge_audioindex(const char *dst_idxfile, const char *src_idxfile){
 		}
 		err = table_next_r(srctbl, &linear_st, &pkey, &key_size, &pdata,&data_size);
 	    }
-	    table_clear(srctbl);
-	    table_write(srctbl, src_idxfile, 0755);
-	    table_write(dsttbl, dst_idxfile, 0755);
+	    if (ret == 0 && replace_table_file(dsttbl, dst_idxfile) < 0) ret = -5;
+	    if (ret == 0){
+		table_clear(srctbl);
+		table_write(srctbl, src_idxfile, 0755);
+	    }
 	    table_free(dsttbl);
 	}
 	table_free(srctbl);
@@ -140,6 +503,19 @@ int merge_audioindex(const char *dst_idxfile, const char *src_idxfile){
 PHASH_EXPORT
 int close_audioindex(AudioIndex audioindex, int add){
     int error;
+    if (audioindex == NULL) return -1;
+    if (IS_SORTED_INDEX(audioindex)){
+	return sortidx_close((SortedIndex*)audioindex);
+    }
+    if (IS_LIVE_INDEX(audioindex)){
+	IdSet *deleted = ((LiveIndex*)audioindex)->deleted;
+	liveidx_destroy((LiveIndex*)audioindex);
+	idset_close(deleted);
+	return 0;
+    }
+    if (IS_SEGMENTED_INDEX(audioindex)){
+	return (segidx_close((SegmentedIndex*)audioindex) < 0) ? -1 : 0;
+    }
     if (add){
 	error = table_free((table_t*)audioindex);
     } else {
@@ -157,6 +533,14 @@ int insert_into_audioindex(AudioIndex audio_index, uint32_t id, uint32_t *hash,
 	TableValue entry;
 	int err, i;
 
+	if (IS_SORTED_INDEX(audio_index)) return -1;
+	if (IS_LIVE_INDEX(audio_index)){
+	    return liveidx_insert((LiveIndex*)audio_index, id, hash, nbframes);
+	}
+	if (IS_SEGMENTED_INDEX(audio_index)){
+	    return segidx_insert((SegmentedIndex*)audio_index, id, hash, nbframes);
+	}
+
 	entry.id = id;
 	for (i=0;i<nbframes;i++){
 	    entry.pos = (uint32_t)i;
@@ -170,14 +554,316 @@ int insert_into_audioindex(AudioIndex audio_index, uint32_t id, uint32_t *hash,
 	return 0;
 }
 
+PHASH_EXPORT
+int delete_from_audioindex(AudioIndex audio_index, uint32_t id){
+    if (audio_index == NULL) return -1;
+    if (IS_SORTED_INDEX(audio_index)){
+	return (idset_add(((SortedIndex*)audio_index)->deleted, id) < 0) ? -2 : 0;
+    }
+    if (IS_LIVE_INDEX(audio_index)){
+	return (idset_add(((LiveIndex*)audio_index)->deleted, id) < 0) ? -2 : 0;
+    }
+    if (IS_SEGMENTED_INDEX(audio_index)){
+	return (segidx_delete((SegmentedIndex*)audio_index, id) < 0) ? -2 : 0;
+    }
+    /* a table has no room for deletes, combine it into a sorted index first */
+    return -1;
+}
+
+PHASH_EXPORT
+int snapshot_audioindex(AudioIndex *indexes, const char **names, int nbindexes,\
+			const char *dir, const char *prev_dir){
+    char part[FILENAME_MAX], path[FILENAME_MAX], del_file[FILENAME_MAX], del_copy[FILENAME_MAX];
+    struct stat info;
+    int i, err = 0;
+
+    if (indexes == NULL || names == NULL || nbindexes <= 0) return -1;
+    if (snap_begin(dir, part) < 0) return -2;
+
+    for (i = 0;i < nbindexes && err == 0;i++){
+	if (indexes[i] == NULL) continue;
+	int n = snprintf(path, FILENAME_MAX, "%s/%s", part, snap_basename(names[i]));
+	if (n < 0 || n >= FILENAME_MAX){
+	    err = -3;
+	    break;
+	}
+	if (IS_SEGMENTED_INDEX(indexes[i])){
+	    if (segidx_snapshot((SegmentedIndex*)indexes[i], part) < 0) err = -3;
+	} else if (IS_LIVE_INDEX(indexes[i])){
+	    /* written out while inserts go on, its deletes may be for ids */
+	    /* in a table next to it                                      */
+	    if (liveidx_flush((LiveIndex*)indexes[i], path) < 0) err = -3;
+	    idset_path(names[i], del_file);
+	    if (err == 0 && !stat(del_file, &info)){
+		idset_path(path, del_copy);
+		if (snap_copy(del_file, del_copy) < 0) err = -3;
+	    }
+	} else {
+	    /* a sorted index or table is the file it was opened from */
+	    if (snap_link(names[i], path) < 0) err = -3;
+	    idset_path(names[i], del_file);
+	    if (err == 0 && IS_SORTED_INDEX(indexes[i]) && !stat(del_file, &info)){
+		idset_path(path, del_copy);
+		if (snap_copy(del_file, del_copy) < 0) err = -3;
+	    }
+	}
+    }
+    if (err == 0 && snap_commit(dir, part, prev_dir) < 0) err = -4;
+    if (err < 0) snap_abort(part);
+    return err;
+}
+
+/* wal_insert_fn replaying into an AudioIndex */
+static int replay_into_audioindex(void *arg, uint32_t id, const uint32_t *hash, int nbframes){
+    return insert_into_audioindex((AudioIndex)arg, id, (uint32_t*)hash, nbframes);
+}
+
+PHASH_EXPORT
+AudioWal open_audiowal(const char *name, AudioIndex index, int nbthreads){
+    /* only a live index takes inserts from many threads */
+    if (index && !IS_LIVE_INDEX(index) && !IS_SEGMENTED_INDEX(index)) nbthreads = 1;
+    return (AudioWal)wal_open(name, nbthreads, (index) ? replay_into_audioindex : NULL, index);
+}
+
+PHASH_EXPORT
+int append_audiowal(AudioWal wal, uint32_t id, uint32_t *hash, int nbframes){
+    return (wal_append((Wal*)wal, id, hash, nbframes) < 0) ? -1 : 0;
+}
+
+PHASH_EXPORT
+int rotate_audiowal(AudioWal wal, uint32_t *upto){
+    return (wal_rotate((Wal*)wal, upto) < 0) ? -1 : 0;
+}
+
+PHASH_EXPORT
+int trim_audiowal(AudioWal wal, uint32_t upto){
+    return (wal_trim((Wal*)wal, upto) < 0) ? -1 : 0;
+}
+
+PHASH_EXPORT
+int close_audiowal(AudioWal wal, int trim){
+    return (wal_close((Wal*)wal, trim) < 0) ? -1 : 0;
+}
+
+PHASH_EXPORT
+AudioHashStore open_audiohash_store(const char *name, int add, int sync){
+    if (name == NULL) return NULL;
+    return (AudioHashStore)hstore_open(name, add, sync);
+}
+
+PHASH_EXPORT
+int add_to_audiohash_store(AudioHashStore store, uint32_t id, uint32_t *hash, int nbframes){
+    if (store == NULL || hash == NULL || nbframes <= 0) return -1;
+    return (hstore_add((HashStore*)store, id, hash, (uint32_t)nbframes) < 0) ? -2 : 0;
+}
+
+PHASH_EXPORT
+const uint32_t* get_from_audiohash_store(AudioHashStore store, uint32_t id, int *nbframes){
+    uint32_t n;
+    const uint32_t *hash;
+    if (store == NULL) return NULL;
+    hash = hstore_get((HashStore*)store, id, &n);
+    if (hash && nbframes) *nbframes = (int)n;
+    return hash;
+}
+
+typedef struct store_walk_t {
+    AudioHashFn fn;
+    void *arg;
+} StoreWalk;
+
+static int store_walk_fn(void *arg, uint32_t id, const uint32_t *hash, uint32_t nbframes){
+    StoreWalk *walk = (StoreWalk*)arg;
+    return walk->fn(walk->arg, id, hash, (int)nbframes);
+}
+
+PHASH_EXPORT
+int foreach_audiohash_store(AudioHashStore store, AudioHashFn fn, void *arg){
+    StoreWalk walk = { fn, arg };
+    if (store == NULL || fn == NULL) return -1;
+    return hstore_foreach((HashStore*)store, store_walk_fn, &walk);
+}
+
+typedef struct undeleted_walk_t {
+    AudioHashFn fn;
+    void *arg;
+    IdSet **sets;
+    int nbsets;
+} UndeletedWalk;
+
+static int undeleted_walk_fn(void *arg, uint32_t id, const uint32_t *hash, int nbframes){
+    UndeletedWalk *walk = (UndeletedWalk*)arg;
+    int i;
+    for (i = 0;i < walk->nbsets;i++){
+	if (idset_has(walk->sets[i], id)) return 0;
+    }
+    return walk->fn(walk->arg, id, hash, nbframes);
+}
+
+PHASH_EXPORT
+int foreach_undeleted_audiohash_store(AudioHashStore store, const char **idx_files, int nbfiles,\
+				      AudioHashFn fn, void *arg){
+    char del_file[FILENAME_MAX];
+    struct stat info;
+    UndeletedWalk walk = { fn, arg, NULL, 0 };
+    int i, err = 0;
+
+    if (store == NULL || fn == NULL || (nbfiles > 0 && idx_files == NULL)) return -1;
+    if (nbfiles > 0 && (walk.sets = (IdSet**)calloc(nbfiles, sizeof(IdSet*))) == NULL) return -1;
+    for (i = 0;i < nbfiles && err == 0;i++){
+	idset_path(idx_files[i], del_file);
+	if (stat(del_file, &info)) continue;
+	if ((walk.sets[walk.nbsets] = idset_open(del_file)) == NULL){
+	    err = -1;
+	} else {
+	    walk.nbsets++;
+	}
+    }
+    if (err == 0) err = foreach_audiohash_store(store, undeleted_walk_fn, &walk);
+    for (i = 0;i < walk.nbsets;i++){
+	idset_close(walk.sets[i]);
+    }
+    free(walk.sets);
+    return err;
+}
+
+PHASH_EXPORT
+int close_audiohash_store(AudioHashStore store){
+    return (hstore_close((HashStore*)store) < 0) ? -1 : 0;
+}
+
 PHASH_EXPORT
 int stat_audioindex(AudioIndex audio_index, int *nbbuckets, int *nbentries){
+    if (IS_SORTED_INDEX(audio_index)){
+	const SortedIndexHeader *hdr = ((SortedIndex*)audio_index)->header;
+	if (nbbuckets) *nbbuckets = 1 << hdr->dir_bits;
+	if (nbentries) *nbentries = (hdr->nbpostings > INT_MAX) ? INT_MAX : (int)hdr->nbpostings;
+	return 0;
+    }
+    if (IS_LIVE_INDEX(audio_index)){
+	LiveIndex *idx = (LiveIndex*)audio_index;
+	uint64_t count = liveidx_count(idx), nbbkts = liveidx_buckets(idx);
+	if (nbbuckets) *nbbuckets = (nbbkts > INT_MAX) ? INT_MAX : (int)nbbkts;
+	if (nbentries) *nbentries = (count > INT_MAX) ? INT_MAX : (int)count;
+	return 0;
+    }
+    if (IS_SEGMENTED_INDEX(audio_index)){
+	/* the buckets of the memtables and of every segment's directory */
+	SegmentedIndex *idx = (SegmentedIndex*)audio_index;
+	uint64_t count = segidx_count(idx), nbbkts;
+	SegmentList *list = segidx_acquire(idx);
+	int i;
+	nbbkts = liveidx_buckets(list->memtable);
+	if (list->frozen) nbbkts += liveidx_buckets(list->frozen);
+	for (i = 0;i < list->nbsegments;i++){
+	    nbbkts += (uint64_t)1 << list->segments[i]->idx->header->dir_bits;
+	}
+	segidx_release(idx, list);
+	if (nbbuckets) *nbbuckets = (nbbkts > INT_MAX) ? INT_MAX : (int)nbbkts;
+	if (nbentries) *nbentries = (count > INT_MAX) ? INT_MAX : (int)count;
+	return 0;
+    }
     table_info((table_t*)audio_index, nbbuckets, nbentries);
     return 0;
 }
 
+/* the chains of a table are counted by where the linear walk is in them */
+static int table_analyze(table_t *tbl, AudioIndexStats *stats){
+    table_linear_t linear;
+    void *key, *data, *region;
+    unsigned long region_size;
+    int key_size, data_size, nbbuckets, nbentries, err;
+    uint64_t nbbytes = 0;
+    uint32_t b, *chains;
+
+    table_info(tbl, &nbbuckets, &nbentries);
+    chains = (uint32_t*)calloc((nbbuckets > 0) ? nbbuckets : 1, sizeof(uint32_t));
+    if (chains == NULL) return -1;
+    err = table_first_r(tbl, &linear, &key, &key_size, &data, &data_size);
+    while (err == TABLE_ERROR_NONE){
+	chains[linear.tl_bucket_c]++;
+	stats_add_key(stats, *(uint32_t*)key, data_size/sizeof(TableValue), linear.tl_entry_c + 1);
+	nbbytes += 2*sizeof(unsigned int) + sizeof(void*) + key_size + data_size;
+	err = table_next_r(tbl, &linear, &key, &key_size, &data, &data_size);
+    }
+    for (b = 0;b < (uint32_t)nbbuckets;b++){
+	stats_add_chains(stats, chains[b], 1);
+    }
+    free(chains);
+    stats->nbbuckets += nbbuckets;
+    if (table_mmap_region(tbl, &region, &region_size) == TABLE_ERROR_NONE){
+	stats->nbbytes += region_size;
+    } else {
+	stats->nbbytes += nbbytes + nbbuckets*sizeof(void*);
+    }
+    return (err == TABLE_ERROR_NOT_FOUND) ? 0 : -1;
+}
+
+/* the memtables and segments of a segmented index, each on its own and */
+/* then summed, as a key in several of them is looked up in each        */
+static int segmented_analyze(SegmentedIndex *idx, int nbhot, AudioIndexStats *stats){
+    AudioIndexStats part;
+    int i, err = 0;
+    SegmentList *list = segidx_acquire(idx);
+    for (i = -2;i < list->nbsegments && err == 0;i++){
+	if (stats_init(&part, nbhot) < 0){
+	    err = -1;
+	    break;
+	}
+	if (i == -2 || i == -1){
+	    LiveIndex *live = (i == -2) ? list->memtable : list->frozen;
+	    if (live) err = liveidx_analyze(live, &part);
+	} else {
+	    sortidx_analyze(list->segments[i]->idx, &part);
+	}
+	stats_finish(&part);
+	if (err == 0) err = stats_merge(stats, &part);
+	free_audioindex_stats(&part);
+    }
+    segidx_release(idx, list);
+    return err;
+}
+
+PHASH_EXPORT
+int analyze_audioindex(AudioIndex audio_index, int nbhot, AudioIndexStats *stats){
+    int err = 0;
+    if (audio_index == NULL || stats == NULL) return -1;
+    if (stats_init(stats, nbhot) < 0) return -1;
+    if (IS_SORTED_INDEX(audio_index)){
+	sortidx_analyze((SortedIndex*)audio_index, stats);
+    } else if (IS_LIVE_INDEX(audio_index)){
+	err = liveidx_analyze((LiveIndex*)audio_index, stats);
+    } else if (IS_SEGMENTED_INDEX(audio_index)){
+	err = segmented_analyze((SegmentedIndex*)audio_index, nbhot, stats);
+    } else {
+	err = table_analyze((table_t*)audio_index, stats);
+    }
+    if (err < 0){
+	free_audioindex_stats(stats);
+	return -1;
+    }
+    stats_finish(stats);
+    return 0;
+}
+
+PHASH_EXPORT
+void free_audioindex_stats(AudioIndexStats *stats){
+    if (stats == NULL) return;
+    free(stats->hot);
+    stats->hot = NULL;
+    stats->nbhot = stats->max_hot = 0;
+}
+
 PHASH_EXPORT
 int flush_audioindex(AudioIndex audio_index, const char *filename){
+    if (IS_SORTED_INDEX(audio_index)) return -1;
+    if (IS_LIVE_INDEX(audio_index)){
+	return (liveidx_flush((LiveIndex*)audio_index, filename) < 0) ? -1 : 0;
+    }
+    if (IS_SEGMENTED_INDEX(audio_index)){
+	/* written to a segment of its own, filename is not used */
+	return (segidx_flush((SegmentedIndex*)audio_index) < 0) ? -1 : 0;
+    }
     int error = table_write((table_t*)audio_index, filename, 00755);
     if (error != TABLE_ERROR_NONE){
 	return -1;
@@ -190,6 +876,8 @@ int grow_audioindex(AudioIndex audio_index, const float load){
     int nbbuckets, nbentries, error;
     double current_load;
 
+    if (IS_SORTED_INDEX(audio_index) || IS_LIVE_INDEX(audio_index) ||\
+	IS_SEGMENTED_INDEX(audio_index)) return 0;
     stat_audioindex(audio_index, &nbbuckets, &nbentries);
     current_load = (double)nbentries/(double)nbbuckets;
     if (current_load > load) {
@@ -493,132 +1181,466 @@ int audiohash(float *buf, uint32_t **hash, double ***coeffs, uint8_t ***toggles,
 
 #ifndef JUST_AUDIOHASH
 
-static int GetCandidates2(uint32_t hashvalue, uint8_t *toggles, const unsigned int P, uint32_t **pcands, int *nbcandidates){
-    const int NbCandidates = 32;
-    *nbcandidates = NbCandidates + 1;
-    *pcands = (uint32_t*)malloc((NbCandidates+1)*sizeof(uint32_t));
-    (*pcands)[0] = hashvalue;
-    
-    uint32_t mask = 0x80000000;
-    int i;
-    for (i = 0;i < NbCandidates;i++){
-	uint32_t currentValue = hashvalue;
-	currentValue = TOGGLE_BIT(currentValue, i);
-	(*pcands)[i+1] = currentValue;
+/* get the postings stored for a hash value.  a table holds one TableValue */
+/* per key, a sorted index the whole list of (id, pos) for the key, which  */
+/* is unpacked as it is read.  a live index copies its postings into buf, */
+/* so it is only entered for the time of the copy                          */
+static int retrieve_postings(AudioIndex index_table, uint32_t key, SortedPostingList *list,\
+			     TableValue **buf, int *bufsize){
+    memset(list, 0, sizeof(SortedPostingList));
+    if (IS_LIVE_INDEX(index_table)){
+	unsigned long epoch = liveidx_enter((LiveIndex*)index_table);
+	int n = liveidx_lookup((LiveIndex*)index_table, key, buf, bufsize);
+	liveidx_exit((LiveIndex*)index_table, epoch);
+	if (n < 0) return TABLE_ERROR_ALLOC;
+	if (n == 0) return TABLE_ERROR_NOT_FOUND;
+	list->ptr = (const unsigned char*)(*buf);
+	list->left = n;
+	return TABLE_ERROR_NONE;
     }
+    if (IS_SORTED_INDEX(index_table)){
+	SortedIndex *idx = (SortedIndex*)index_table;
+	const SortedIndexKey *k = sortidx_find(idx, key);
+	if (k == NULL) return TABLE_ERROR_NOT_FOUND;
+	sortidx_postings(idx, k, list);
+	return TABLE_ERROR_NONE;
+    }
+
+    int size = 0;
+    void *vals = NULL;
+    int error = table_retrieve((table_t*)index_table, &key, sizeof(uint32_t), &vals, &size);
+    if (error == TABLE_ERROR_NONE && vals != NULL){
+	list->ptr = (const unsigned char*)vals;
+	list->left = size/sizeof(TableValue);
+    }
+    return error;
+}
+
+/* the deleted ids of a segment, or NULL */
+static const IdSet* deleted_ids(AudioIndex index){
+    if (index == NULL) return NULL;
+    if (IS_SORTED_INDEX(index)) return ((SortedIndex*)index)->deleted;
+    if (IS_LIVE_INDEX(index)) return ((LiveIndex*)index)->deleted;
+    return NULL;
+}
 
+static int is_deleted(const IdSet **sets, int nbsets, uint32_t id){
+    int i;
+    for (i = 0;i < nbsets;i++){
+	if (idset_has(sets[i], id)) return 1;
+    }
     return 0;
 }
 
-static int GetCandidates(uint32_t hashvalue, uint8_t *toggles, const unsigned int P, uint32_t **pcands, int *nbcandidates){
-    int n = 1 << P;
-    n = (n > 0) ? n : 1;
-    *nbcandidates = n;
+PHASH_EXPORT
+int lookupaudiohash(AudioIndex index_table,uint32_t *hash,uint8_t **toggles, int nbframes,\
+                    int P, int blocksize,float threshold, uint32_t *id, float *cs){
+    return lookupaudiohash_segments(&index_table, 1, hash, toggles, nbframes, P, blocksize,\
+				    threshold, id, cs);
+}
 
-    *pcands = (uint32_t*)malloc(n*sizeof(uint32_t));
+PHASH_EXPORT
+AudioVoter open_audiovoter(AudioVoteScore score, void *arg){
+    AudioVoterOpts opts;
+    memset(&opts, 0, sizeof(AudioVoterOpts));
+    opts.mode = AUDIO_VOTE_TRACKS;
+    opts.score = score;
+    opts.arg = arg;
+    return (AudioVoter)votemap_create(&opts);
+}
 
-    (*pcands)[0] = hashvalue;
-    int index;
-    for (index = 1;index < n;index++){
-	uint32_t currentvalue = hashvalue;
-	int perms = index;
-	int bitnum = 0;
-	while (perms != 0) {
-	    if (perms & 0x00000001){
-		currentvalue = TOGGLE_BIT(currentvalue, toggles[bitnum]);
+PHASH_EXPORT
+AudioVoter open_audiovoter_opts(const AudioVoterOpts *opts){
+    if (opts && opts->mode != AUDIO_VOTE_TRACKS && opts->mode != AUDIO_VOTE_OFFSETS) return NULL;
+    return (AudioVoter)votemap_create(opts);
+}
+
+PHASH_EXPORT
+void close_audiovoter(AudioVoter voter){
+    votemap_destroy((VoteMap*)voter);
+}
+
+PHASH_EXPORT
+int audiovoter_top(AudioVoter voter, AudioVote *votes, int nbvotes){
+    if (voter == NULL || votes == NULL) return -1;
+    return votemap_top((VoteMap*)voter, votes, nbvotes);
+}
+
+PHASH_EXPORT
+int audiovoter_frames(AudioVoter voter){
+    if (voter == NULL) return -1;
+    return (int)((VoteMap*)voter)->nbframes;
+}
+
+static int lookup_votes(VoteMap *map, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			uint8_t **toggles, int nbframes, int P, int blocksize, float threshold,\
+			AudioMatch *matches, int nbmatches, uint32_t qbase, int *cancel);
+
+/* look up over segments with each segmented index in it replaced by its */
+/* memtables and segments, held for the time of the lookup               */
+static int lookup_expanded(VoteMap *map, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			   uint8_t **toggles, int nbframes, int P, int blocksize,\
+			   float threshold, AudioMatch *matches, int nbmatches){
+    SegmentList **lists = (SegmentList**)calloc(nbsegments, sizeof(SegmentList*));
+    int i, j, n = 0, total = 0, err;
+    if (lists == NULL) return -1;
+    for (i = 0;i < nbsegments;i++){
+	if (segments[i] && IS_SEGMENTED_INDEX(segments[i])){
+	    lists[i] = segidx_acquire((SegmentedIndex*)segments[i]);
+	    total += lists[i]->nbsegments + 2;
+	} else {
+	    total++;
+	}
+    }
+    AudioIndex *expanded = (AudioIndex*)malloc(total*sizeof(AudioIndex));
+    if (expanded){
+	for (i = 0;i < nbsegments;i++){
+	    if (lists[i] == NULL){
+		expanded[n++] = segments[i];
+		continue;
+	    }
+	    expanded[n++] = (AudioIndex)lists[i]->memtable;
+	    expanded[n++] = (AudioIndex)lists[i]->frozen;
+	    for (j = 0;j < lists[i]->nbsegments;j++){
+		expanded[n++] = (AudioIndex)lists[i]->segments[j]->idx;
 	    }
-	    bitnum++;
-	    perms >>= 1;
 	}
-
-	(*pcands)[index] = currentvalue;
+	err = lookup_votes(map, expanded, n, hash, toggles, nbframes, P, blocksize, threshold,\
+			   matches, nbmatches, 0, NULL);
+	free(expanded);
+    } else {
+	err = -1;
     }
-
-    return 0;
+    for (i = 0;i < nbsegments;i++){
+	if (lists[i]) segidx_release((SegmentedIndex*)segments[i], lists[i]);
+    }
+    free(lists);
+    return err;
 }
 
 PHASH_EXPORT
-int lookupaudiohash(AudioIndex index_table,uint32_t *hash,uint8_t **toggles, int nbframes,\
-                    int P, int blocksize,float threshold, uint32_t *id, float *cs){
+int lookupaudiohash_segments(AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			     uint8_t **toggles, int nbframes, int P, int blocksize,\
+			     float threshold, uint32_t *id, float *cs){
+    VoteMap *map = votemap_create(NULL);
+    if (map == NULL) return -1;
+    int err = lookupaudiohash_voter((AudioVoter)map, segments, nbsegments, hash, toggles,\
+				    nbframes, P, blocksize, threshold, id, cs);
+    votemap_destroy(map);
+    return err;
+}
 
-    int max_results = 3*blocksize, nbresults = 0, max_cnt = 0, max_pos = 0, total = 0, error = 0;
-    int i,j,k,m, nbcandidates, already_added;
-    uint32_t *results = (uint32_t*)malloc(max_results*sizeof(uint32_t));
-    uint32_t *last_positions = (uint32_t*)malloc(max_results*sizeof(uint32_t));
-    uint32_t *subhash, *candidates;
-    uint8_t *curr_toggles;
-    int *result_cnts = (int*)malloc(max_results*sizeof(int));
-    float lvl;
-    TableValue *lookup_val;
+/* a run of the blocks of a query, voted in a part of the voter */
+typedef struct lookup_task_t {
+    VoteMap *map;
+    AudioIndex *segments;
+    int nbsegments;
+    uint32_t *hash;
+    uint8_t **toggles;
+    int nbframes, P, blocksize;
+    float threshold;
+    AudioMatch *matches;
+    int nbmatches;
+    uint32_t qbase;                /* query frame of hash[0] */
+    int *cancel;
+    int err;
+} LookupTask;
+
+static void lookup_task(void *arg){
+    LookupTask *task = (LookupTask*)arg;
+    task->err = lookup_votes(task->map, task->segments, task->nbsegments, task->hash,\
+			     task->toggles, task->nbframes, task->P, task->blocksize,\
+			     task->threshold, task->matches, task->nbmatches, task->qbase,\
+			     task->cancel);
+}
 
-    if (results == NULL || last_positions == NULL || result_cnts == NULL){
+/* split the blocks of the query into runs voted at once in the parts of */
+/* the map, and merge them back.  a run that finds what it takes to stop */
+/* the lookup stops the others - the votes they had are kept              */
+static int lookup_parallel(VoteMap *map, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			   uint8_t **toggles, int nbframes, int P, int blocksize, float threshold,\
+			   int nbmatches){
+    int i, nbtasks, nbblocks = nbframes/blocksize, start = 0, cancel = 0, err = 0, nomatch = 1;
+    int64_t accepted = -1;
+    const AudioVote *best;
+
+    nbtasks = (nbblocks < map->opts.nbthreads) ? nbblocks : map->opts.nbthreads;
+    LookupTask *tasks = (LookupTask*)calloc(nbtasks, sizeof(LookupTask));
+    AudioMatch *matches = (AudioMatch*)malloc((size_t)nbtasks*nbmatches*sizeof(AudioMatch));
+    if (tasks == NULL || matches == NULL){
+	free(tasks);
+	free(matches);
 	return -1;
     }
-    *id = 0;
-    *cs = 0.0;
-    for (i=0;i<nbframes-blocksize+1;i+=blocksize){
+    for (i = 0;i < nbtasks;i++){
+	int n = nbblocks/nbtasks + (i < nbblocks%nbtasks);
+	tasks[i].map = map->parts[i];
+	tasks[i].segments = segments;
+	tasks[i].nbsegments = nbsegments;
+	tasks[i].hash = hash + start;
+	tasks[i].toggles = (toggles) ? toggles + start : NULL;
+	tasks[i].nbframes = n*blocksize;
+	tasks[i].P = P;
+	tasks[i].blocksize = blocksize;
+	tasks[i].threshold = threshold;
+	tasks[i].matches = matches + (size_t)i*nbmatches;
+	tasks[i].nbmatches = nbmatches;
+	tasks[i].qbase = (uint32_t)start;
+	tasks[i].cancel = &cancel;
+	start += n*blocksize;
+    }
+    pool_run(map->pool, lookup_task, tasks, sizeof(LookupTask), nbtasks);
+
+    votemap_clear(map, blocksize);
+    for (i = 0;i < nbtasks && err == 0;i++){
+	if (tasks[i].err < 0 || votemap_merge(map, tasks[i].map, 2*blocksize) < 0) err = -1;
+	if (tasks[i].map->verdict != VOTE_NO_MATCH) nomatch = 0;
+	if (tasks[i].map->verdict == VOTE_MATCH && accepted < 0){
+	    accepted = votemap_best(tasks[i].map)->id;
+	}
+    }
+    /* no run can tell there is no match for all of them, and a match */
+    /* holds if it is still the best one with all the votes in         */
+    best = votemap_best(map);
+    if (nomatch){
+	map->verdict = VOTE_NO_MATCH;
+    } else if (accepted >= 0 && best && best->id == (uint32_t)accepted){
+	map->verdict = VOTE_MATCH;
+    }
+    free(tasks);
+    free(matches);
+    return err;
+}
+
+/* vote over segments until the nbmatches best ids are over the threshold, */
+/* or a single one dominates - matches is used to keep track of them.     */
+/* the frames are numbered from qbase, and cancel, if any, is set on      */
+/* stopping that way and stops the lookup once another run set it         */
+static int lookup_votes(VoteMap *map, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			uint8_t **toggles, int nbframes, int P, int blocksize, float threshold,\
+			AudioMatch *matches, int nbmatches, uint32_t qbase, int *cancel){
+    int i,j,m,s, error = 0, done = 0, verdict, stop, stoplist;
+    uint32_t k, *subhash;
+    uint64_t df, nbids = 0;
+    CandBatch *cands;
+    const SortedIndexKey **found;
+    uint8_t *curr_toggles;
+    SortedPostingList list;
+    TableValue val, *lookup_val = &val, *live_buf = NULL;
+    int live_bufsize = 0, nbsets = 0;
+    const IdSet **sets;
+
+    for (s = 0;s < nbsegments;s++){
+	if (segments[s] && IS_SEGMENTED_INDEX(segments[s])){
+	    return lookup_expanded(map, segments, nbsegments, hash, toggles, nbframes, P, blocksize,\
+				   threshold, matches, nbmatches);
+	}
+    }
+    if (map->pool && nbframes >= 2*blocksize){
+	return lookup_parallel(map, segments, nbsegments, hash, toggles, nbframes, P, blocksize,\
+			       threshold, nbmatches);
+    }
+    sets = (const IdSet**)malloc((nbsegments+1)*sizeof(IdSet*));
+    if (sets == NULL) return -1;
+    /* an id deleted from any segment is deleted from all of them */
+    for (s = 0;s < nbsegments;s++){
+	const IdSet *set = deleted_ids(segments[s]);
+	if (set == NULL || __atomic_load_n(&set->count, __ATOMIC_RELAXED) == 0) continue;
+	for (m = 0;m < nbsets && sets[m] != set;m++);
+	if (m == nbsets) sets[nbsets++] = set;
+    }
+    /* how common a key is, is judged over the ids of all the sorted */
+    /* segments together, so a small one next to a big one does not  */
+    /* make all of its keys look common                              */
+    for (s = 0;s < nbsegments;s++){
+	if (segments[s] && IS_SORTED_INDEX(segments[s]) && ((SortedIndex*)segments[s])->df){
+	    nbids += ((SortedIndex*)segments[s])->nbids;
+	}
+    }
+    stoplist = (map->opts.max_df > 0.0f && nbids >= SORTIDX_STOP_MIN_IDS);
+    votemap_clear(map, blocksize);
+    cands = &map->cands;
+    for (i=0;i<nbframes-blocksize+1 && error == 0 && !done;i+=blocksize){
 	subhash = hash+i;
+	cands_clear(cands);
 	for (j=0;j<blocksize;j++){
 	    curr_toggles = (toggles) ? toggles[i+j] : NULL;
 
-	    /* expand hash candidates */
-	    GetCandidates(subhash[j], curr_toggles, P, &candidates, &nbcandidates); 
-	    /* GetCandidates2(subhash[j], curr_toggles, P, &candidates, &nbcandidates); */ 
-
-	    for (k = 0;k < nbcandidates; k++){
-		lookup_val = NULL;
-		error = table_retrieve((table_t*)index_table, &candidates[k],sizeof(uint32_t),\
-                                           (void*)&lookup_val,NULL); 
-		if (lookup_val != NULL){
-		    already_added = 0;
-		    for (m=0;m<nbresults;m++){
-			if (results[m] == lookup_val->id &&\
-			    lookup_val->pos > last_positions[m] &&\
-                            lookup_val->pos <= last_positions[m]+ 2*blocksize ){
-			    result_cnts[m]++;
-			    last_positions[m] = lookup_val->pos;
-			    total++;
-			    if (result_cnts[m] > max_cnt){
-				max_cnt = result_cnts[m];
-				max_pos = m;
-			    }
-			    already_added = 1;
-			    break;
-			}
-		    }
-		    if (!already_added && nbresults < max_results){
-			results[nbresults] = (uint32_t)lookup_val->id;
-			last_positions[nbresults] = (uint32_t)lookup_val->pos;
-			result_cnts[nbresults] = 1;
-			total++;
-			if (result_cnts[nbresults] > max_cnt){
-			    max_cnt = result_cnts[nbresults];
-			    max_pos = nbresults;
-			}
-			nbresults++;
+	    /* a key read again in the block brings nothing new to a track, but */
+	    /* votes for another offset when read for another frame             */
+	    if (map->opts.mode == AUDIO_VOTE_OFFSETS) cands_forget(cands);
+	    if (cands_expand(cands, subhash[j], curr_toggles, P, qbase+i+j) < 0){
+		error = -1;
+		break;
+	    }
+	}
+	if (error < 0) break;
+
+	/* the keys of the block are looked up in the sorted segments all at */
+	/* once, to overlap the cache misses, before any of them votes        */
+	found = (const SortedIndexKey**)cands_found(cands, nbsegments);
+	if (found == NULL){
+	    error = -1;
+	    break;
+	}
+	for (s = 0;s < nbsegments;s++){
+	    if (segments[s] && IS_SORTED_INDEX(segments[s])){
+		sortidx_find_batch((SortedIndex*)segments[s], cands->keys, cands->nbkeys,\
+				   found + (uint64_t)s*cands->nbkeys);
+	    }
+	}
+
+	for (k = 0;k < cands->nbkeys && error == 0 && !done; k++){
+	    /* the postings of a key in every segment vote together, unless */
+	    /* it is too common in all of them                              */
+	    df = 0;
+	    for (s = 0;s < nbsegments && stoplist; s++){
+		const SortedIndexKey *key;
+		if (segments[s] == NULL || !IS_SORTED_INDEX(segments[s])) continue;
+		key = found[(uint64_t)s*cands->nbkeys + k];
+		if (key) df += sortidx_df((SortedIndex*)segments[s], key);
+	    }
+	    stop = (stoplist && (double)df > (double)map->opts.max_df*(double)nbids);
+	    for (s = 0;s < nbsegments && !stop; s++){
+		if (segments[s] == NULL) continue;
+		if (IS_SORTED_INDEX(segments[s])){
+		    const SortedIndexKey *key = found[(uint64_t)s*cands->nbkeys + k];
+		    if (key == NULL) continue;
+		    sortidx_postings((SortedIndex*)segments[s], key, &list);
+		} else {
+		    retrieve_postings(segments[s], cands->keys[k], &list, &live_buf, &live_bufsize);
+		}
+		while (sortidx_postings_next(&list, lookup_val)){
+		    if (nbsets > 0 && is_deleted(sets, nbsets, lookup_val->id)) continue;
+		    if (votemap_vote(map, lookup_val->id, lookup_val->pos, cands->frames[k],\
+				     2*blocksize) < 0){
+			error = -1;
+			break;
 		    }
 		}
 	    }
 
-	    free(candidates);
-
+	    /* no need to wait for the end of the block if it is that clear - */
+	    /* that there is no match holds for any nb of matches, but only   */
+	    /* for the run of a parallel lookup it is found in                */
+	    if (k + 1 == cands->nbkeys || cands->frames[k+1] != cands->frames[k]){
+		verdict = votemap_frame_done(map);
+		if (verdict == VOTE_NO_MATCH) done = 1;
+		if (nbmatches == 1 && (verdict == VOTE_MATCH || votemap_dominated(map, threshold))){
+		    done = 2;
+		}
+		if (cancel && !done && __atomic_load_n(cancel, __ATOMIC_RELAXED)) done = 1;
+	    }
 	}
-	lvl = (float)max_cnt/(float)blocksize;
-	if (lvl >= threshold){
-	    break;
+	if (done == 0){
+	    if (nbmatches <= 1){
+		if (map->best_score >= threshold) done = 2;
+	    } else {
+		m = votemap_top_ids(map, matches, nbmatches);
+		if (m == nbmatches && matches[m-1].cs >= threshold) done = 2;
+	    }
 	}
+	if (done == 2 && cancel) __atomic_store_n(cancel, 1, __ATOMIC_RELAXED);
     }
 
-    if (nbresults > 0 && lvl >= threshold){
-	*id = results[max_pos];
-	*cs = lvl;
+    free(live_buf);
+    free(sets);
+    return (error < 0) ? -1 : 0;
+}
+
+PHASH_EXPORT
+int lookupaudiohash_voter(AudioVoter voter, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			  uint8_t **toggles, int nbframes, int P, int blocksize,\
+			  float threshold, uint32_t *id, float *cs){
+    VoteMap *map = (VoteMap*)voter;
+    const AudioVote *best;
+
+    if (map == NULL || blocksize <= 0) return -1;
+    *id = 0;
+    *cs = 0.0;
+    if (lookup_votes(map, segments, nbsegments, hash, toggles, nbframes, P, blocksize, threshold,\
+		     NULL, 1, 0, NULL) < 0){
+	return -1;
+    }
+    best = votemap_best(map);
+    if (best && map->verdict != VOTE_NO_MATCH &&\
+	(map->best_score >= threshold || map->verdict == VOTE_MATCH)){
+	*id = best->id;
+	*cs = map->best_score;
     } 
-    
-    free(results);
-    free(result_cnts);
-    free(last_positions);
 
     return 0;
 }
 
+PHASH_EXPORT
+int lookupaudiohash_topk(AudioVoter voter, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			 uint8_t **toggles, int nbframes, int P, int blocksize, float threshold,\
+			 AudioMatch *matches, int nbmatches){
+    VoteMap *map = (VoteMap*)voter;
+    int n;
+
+    if (map == NULL || blocksize <= 0 || matches == NULL || nbmatches <= 0) return -1;
+    if (lookup_votes(map, segments, nbsegments, hash, toggles, nbframes, P, blocksize, threshold,\
+		     matches, nbmatches, 0, NULL) < 0){
+	return -1;
+    }
+    if (map->verdict == VOTE_NO_MATCH) return 0;
+    n = votemap_top_ids(map, matches, nbmatches);
+    while (n > 0 && matches[n-1].cs < threshold) n--;
+    /* the one match the test accepted */
+    if (n == 0 && nbmatches == 1 && map->verdict == VOTE_MATCH) n = votemap_top_ids(map, matches, 1);
+    return n;
+}
+
+PHASH_EXPORT
+float audiohash_ber(const uint32_t *query, int nbquery, const uint32_t *stored, int nbstored,\
+		    int32_t offset, int *nbcompared){
+    /* frames q of the query with q + offset in stored */
+    int64_t first = (offset < 0) ? -(int64_t)offset : 0;
+    int64_t last = (int64_t)nbstored - offset;
+    if (last > nbquery) last = nbquery;
+    if (nbcompared) *nbcompared = (last > first) ? (int)(last - first) : 0;
+    if (last <= first) return 1.0f;
+    uint64_t d = hstore_distance(query + first, stored + first + offset, (uint32_t)(last - first));
+    return (float)d/(32.0f*(float)(last - first));
+}
+
+PHASH_EXPORT
+int verify_audiomatches(AudioHashStore store, uint32_t *hash, int nbframes, AudioMatch *matches,\
+			int nbmatches, int slack, float max_ber, float *bers){
+    int i, j, n = 0, nbstored, compared, min_compared;
+    float ber, best_ber;
+    int32_t offset, best_offset;
+    const uint32_t *stored;
+
+    if (store == NULL || hash == NULL || matches == NULL || nbmatches < 0) return -1;
+    if (slack < 0) slack = 0;
+    for (i = 0;i < nbmatches;i++){
+	stored = get_from_audiohash_store(store, matches[i].id, &nbstored);
+	if (stored == NULL){
+	    if (bers) bers[n] = -1.0f;
+	    matches[n++] = matches[i];
+	    continue;
+	}
+	min_compared = (nbframes < nbstored) ? nbframes/2 : nbstored/2;
+	if (min_compared < 1) min_compared = 1;
+	best_ber = 1.0f;
+	best_offset = matches[i].offset;
+	/* outward from the voted offset, the nearer one kept on a tie */
+	for (j = 0;j <= 2*slack;j++){
+	    offset = matches[i].offset + ((j & 1) ? (j + 1)/2 : -(j/2));
+	    ber = audiohash_ber(hash, nbframes, stored, nbstored, offset, &compared);
+	    if (compared >= min_compared && ber < best_ber){
+		best_ber = ber;
+		best_offset = offset;
+	    }
+	}
+	if (best_ber > max_ber) continue;
+	if (bers) bers[n] = best_ber;
+	matches[n] = matches[i];
+	matches[n++].offset = best_offset;
+    }
+    return n;
+}
+
 #endif /* JUST_AUDIOHASH*/
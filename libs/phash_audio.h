@@ -81,20 +81,158 @@ typedef struct table_val_t {
 
 /*         nbbuckets- int value for number of buckets (only for first time)        */
 
+/*  A sorted index file (see open_audioindex_builder) is always mmapped read only, */
+/*  so it can only be opened for querying.                                         */
+
 /*  RETURN the AudioIndex ptr   (NULL on failure)                                  */ 
 
 PHASH_EXPORT
 AudioIndex open_audioindex(const char *idx_file, int add, int nbbuckets);
 
+/* placement of an index opened for querying, see open_audioindex_opts */
+
+#define INDEX_PAGES_DEFAULT  0   /* mmap the file                                   */
+#define INDEX_PAGES_ADVISE   1   /* mmap the file and advise transparent huge pages */
+#define INDEX_PAGES_ANON     2   /* copy into anonymous memory, with transparent    */
+                                 /* huge pages                                      */
+#define INDEX_PAGES_HUGE_2MB 3   /* copy into 2 MiB hugetlb pages                   */
+#define INDEX_PAGES_HUGE_1GB 4   /* copy into 1 GiB hugetlb pages                   */
+
+#define INDEX_NUMA_NONE       -1 /* leave placement to the kernel               */
+#define INDEX_NUMA_INTERLEAVE -2 /* interleave the index pages over all nodes   */
+
+PHASH_EXPORT
+typedef struct audioindex_opts_t {
+    int pages;       /* INDEX_PAGES_ value                                        */
+    int numa_node;   /* node to bind the index pages to, or an INDEX_NUMA_ value */
+} AudioIndexOpts;
+
+/*  open_audioindex_opts                                                            */
+/*                                                                                  */
+/*  like open_audioindex, with placement options for an index opened for querying.  */
+/*  the copy modes read the whole file into memory at open, and fall back from      */
+/*  1 GiB to 2 MiB hugetlb pages to transparent huge pages if none are reserved.     */
+/*  a table index is always left mmapped, so it only gets the advice and placement. */
+/*  a NUMA node binding of a file mapping is only honored where the kernel applies  */
+/*  memory policy to the page cache - use a copy mode to be sure of it.             */
+/*                                                                                  */
+/*  PARAMS idx_file, add, nbbuckets - as for open_audioindex                        */
+/*         opts      - ptr to the placement options, NULL for the defaults           */
+/*  RETURN the AudioIndex ptr   (NULL on failure)                                   */
+
+PHASH_EXPORT
+AudioIndex open_audioindex_opts(const char *idx_file, int add, int nbbuckets, const AudioIndexOpts *opts);
+
+/* audioindex_pin_thread                                                    */
+/*                                                                          */
+/* pin the calling thread to the cpus of a NUMA node, to keep lookups local */
+/* to an index bound to that node                                           */
+/*                                                                          */
+/* PARAMS numa_node - the node                                              */
+/* RETURN int value - 0 on success, less than 0 on error                    */
+
+PHASH_EXPORT
+int audioindex_pin_thread(int numa_node);
+
+/* progress of warmup_audioindex, done out of total bytes */
+typedef void (*AudioIndexProgress)(uint64_t done, uint64_t total, void *arg);
+
+/* warmup_audioindex                                                                */
+/*                                                                                  */
+/* fault the pages of an index opened for querying into memory, so the first        */
+/* lookups do not wait on the disk.  the mapping is cut in chunks that nbthreads     */
+/* threads read ahead (MADV_WILLNEED) and touch a page at a time.  with lock, the   */
+/* pages are also locked in memory, which needs a large enough RLIMIT_MEMLOCK.       */
+/* an in-memory index has nothing to warm.                                          */
+/*                                                                                  */
+/* PARAMS index     - the AudioIndex                                                */
+/*        nbthreads - nb of threads to fault pages in with                          */
+/*        lock      - if non-zero, mlock the index                                  */
+/*        progress  - called as chunks are done, may be NULL                        */
+/*        arg       - passed to progress                                            */
+/* RETURN int value - 0 on success, -1 on error, -2 if the pages could not be locked */
+
+PHASH_EXPORT
+int warmup_audioindex(AudioIndex index, int nbthreads, int lock, AudioIndexProgress progress, void *arg);
+
+/* open_live_audioindex                                                            */
+/*                                                                                 */
+/* open an in-memory index that any number of threads can insert into and look up */
+/* in at the same time.  entries already in idx_file (a table or a sorted index)   */
+/* are loaded.  flush_audioindex writes a sorted index file while inserts go on.   */
+/* ids deleted from it are kept in <idx_file>.del, and those already there loaded. */
+/*                                                                                 */
+/*  PARAMS idx_file - string for the name of the file (may not exist yet)          */
+/*         nbbuckets- int value for number of buckets to start with.  the index   */
+/*                    doubles them as it fills, a bucket at a time, so there is no */
+/*                    need to call grow_audioindex on it                           */
+/*  RETURN the AudioIndex ptr (NULL on failure), close with close_audioindex(.., 1) */
+
+PHASH_EXPORT
+AudioIndex open_live_audioindex(const char *idx_file, int nbbuckets);
+
+/* open_empty_live_audioindex                                                      */
+/*                                                                                 */
+/* as open_live_audioindex, but the entries in idx_file are not loaded, only its   */
+/* deleted ids - for a new index whose entries go to idx_file when written out,   */
+/* while the one before it still holds what is in idx_file now                     */
+/*                                                                                 */
+/*  PARAMS idx_file - string for the name of the file (may not exist yet)          */
+/*         nbbuckets- int value for number of buckets to start with                */
+/*  RETURN the AudioIndex ptr (NULL on failure), close with close_audioindex(.., 1) */
+
+PHASH_EXPORT
+AudioIndex open_empty_live_audioindex(const char *idx_file, int nbbuckets);
+
+/* open_segmented_audioindex                                                        */
+/*                                                                                  */
+/* open a log structured index: inserts go to an in-memory memtable that is written */
+/* out as an immutable sorted segment when full, and a background thread merges    */
+/* segments of about the same size into bigger ones.  lookups go over the memtable */
+/* and all segments.  the segments are listed in <name>.segs, with files named      */
+/* <name>.<seqno>.seg.  the memtable is only written out by flush_audioindex,       */
+/* close_audioindex or when full, inserts are logged in <name>.wal.<seqno> until    */
+/* then and replayed on open.                                                       */
+/*                                                                                  */
+/*  PARAMS name          - path prefix of the manifest and segment files            */
+/*         memtable_size - nb of postings at which the memtable is written out,     */
+/*                         0 for the default                                        */
+/*         opts          - placement of the segments, as for open_audioindex_opts,  */
+/*                         NULL for the defaults                                    */
+/*  RETURN the AudioIndex ptr (NULL on failure), close with close_audioindex         */
+
+PHASH_EXPORT
+AudioIndex open_segmented_audioindex(const char *name, int memtable_size, const AudioIndexOpts *opts);
+
 /* merge_audioindex */
 /* merge the entries in src_idxfile into the entries in dst_idxfile*/
+/* if dst_idxfile is a sorted index, it is streamed through a      */
+/* merge into a new file instead of being read into memory         */
+/* the new dst_idxfile is renamed over the old one, so an index     */
+/* still open on the old file can be used until it is closed        */
+/* postings of ids deleted from dst_idxfile are dropped, and those */
+/* in <src_idxfile>.del unless both are tables                     */
 /* PARAMS dst_idxfile - the main index file                        */
 /* PARAMS src_idxfile - the tmp file containing new entries        */
-/* RETURN int - 0 on success, -1 on error                          */    
+/* RETURN int - 0 on success, 1 if nothing to merge, <0 on error   */    
 
 PHASH_EXPORT
 int merge_audioindex(const char *dst_idxfile, const char *src_idxfile);
 
+/* combine_audioindex                                                         */
+/* k-way merge of any number of index files into a new sorted index.  sorted */
+/* index sources are read sequentially with constant memory, table files are */
+/* read in whole.  the result is written aside and renamed over dst_idxfile, */
+/* which may also be one of the sources.  the postings of ids deleted from a */
+/* source are left out.                                                       */
+/* PARAMS dst_idxfile  - name of the resulting sorted index                   */
+/*        src_idxfiles - array of names of the index files to merge           */
+/*        nbsrcs       - nb of names in src_idxfiles                          */
+/* RETURN int - 0 on success, less than 0 on error                            */
+
+PHASH_EXPORT
+int combine_audioindex(const char *dst_idxfile, const char **src_idxfiles, int nbsrcs);
+
 /* close_audioindex                                                        */
 /*                                                                         */
 /* close the audio index                                                   */ 
@@ -123,6 +261,158 @@ int close_audioindex(AudioIndex audioindex, int add);
 PHASH_EXPORT
 int insert_into_audioindex(AudioIndex audio_index, uint32_t id, uint32_t *hash, int nbframes);
 
+/* delete_from_audioindex                                                    */
+/*                                                                           */
+/* delete all the postings of an id.  the id is put in a bitmap of deleted   */
+/* ids that lookups skip from then on, and the postings are dropped when the */
+/* index is next merged or compacted.  for a sorted index file the ids are   */
+/* kept in <idx_file>.del next to it, for a segmented index in <name>.del,   */
+/* for a live index in <idx_file>.del of the file it was opened with, or in  */
+/* memory only without one.  a deleted id stays deleted, so ids must not be  */
+/* reused.  a table has no room for deletes: an id deleted from a live index */
+/* looked up together with it is skipped in the table as well.              */
+/*                                                                           */
+/* PARAMS audio_index - ptr to the audio index                               */
+/*        id          - id of the audio unit to delete                       */
+/* RETURN int value (0 on success, -1 for a table, less than -1 on error)    */
+
+PHASH_EXPORT
+int delete_from_audioindex(AudioIndex audio_index, uint32_t id);
+
+/* write-ahead log of the inserts into an in-memory index, so they can be   */
+/* replayed after a crash.  appends from many threads are written and synced */
+/* in batches, one fdatasync for all appends waiting.  the log is a series  */
+/* of files <name>.wal.<seqno>: once the index has been written out, the    */
+/* log is cut by rotating it before the index is replaced and trimming the  */
+/* files up to the rotation once the write is done.  a segmented index      */
+/* keeps a log of its own                                                   */
+
+typedef void* AudioWal;
+
+/* open_audiowal                                                            */
+/*                                                                          */
+/* replay the log files of name into index, with nbthreads threads if it is */
+/* a live index, then start a new file after them.  the files replayed stay */
+/* until trimmed.                                                           */
+/*                                                                          */
+/* PARAMS name      - path prefix of the log files                          */
+/*        index     - index to replay into, NULL not to replay              */
+/*        nbthreads - nb of threads to replay with                          */
+/* RETURN the log (NULL on failure), close with close_audiowal               */
+
+PHASH_EXPORT
+AudioWal open_audiowal(const char *name, AudioIndex index, int nbthreads);
+
+/* append_audiowal                                                          */
+/* log the insert of a hash, safe with any number of concurrent callers.    */
+/* returns once it is on disk - 0, less than 0 if it could not be written   */
+
+PHASH_EXPORT
+int append_audiowal(AudioWal wal, uint32_t id, uint32_t *hash, int nbframes);
+
+/* rotate_audiowal                                                          */
+/* finish the current log file and log to a new one.  *upto is set to the   */
+/* seqno of the finished file, for trim_audiowal.  0 on success             */
+
+PHASH_EXPORT
+int rotate_audiowal(AudioWal wal, uint32_t *upto);
+
+/* trim_audiowal                                                            */
+/* remove the log files up to and including upto.  0 on success             */
+
+PHASH_EXPORT
+int trim_audiowal(AudioWal wal, uint32_t upto);
+
+/* close_audiowal                                                           */
+/* close the log, and remove all of its files if trim.  0 on success        */
+
+PHASH_EXPORT
+int close_audiowal(AudioWal wal, int trim);
+
+/* snapshot_audioindex                                                        */
+/*                                                                            */
+/* put a point in time copy of indexes in the new directory dir, safe to     */
+/* call while lookups and inserts go on.  sorted index files and segments    */
+/* are never changed once written, so they are hard linked in; live indexes  */
+/* and memtables are written out as sorted index files, deleted ids copied.  */
+/* the copy is made in <dir>.part and renamed to dir when all of it is on    */
+/* disk.  dir/SNAPSHOT_NEW_FILES lists the files that are not in prev_dir,   */
+/* the only ones to ship to a replica that already has prev_dir - the rest   */
+/* can be hard linked from there.  each index keeps the base name of its    */
+/* name in dir, so reopening dir/<base> gives it back.                       */
+/*                                                                            */
+/* PARAMS indexes   - the indexes, NULL entries are skipped                   */
+/*        names     - file each sorted index or table was opened from (a      */
+/*                    table is taken as its file), name of a segmented        */
+/*                    index, file name to write a live index under (and      */
+/*                    whose deletes file it keeps)                            */
+/*        nbindexes - nb of indexes                                           */
+/*        dir       - directory to create, must not exist                     */
+/*        prev_dir  - previous snapshot on the same file system, or NULL      */
+/* RETURN int value (0 on success, less than 0 on error)                      */
+
+PHASH_EXPORT
+int snapshot_audioindex(AudioIndex *indexes, const char **names, int nbindexes,\
+			const char *dir, const char *prev_dir);
+
+/* the whole hash of each indexed track, to check the matches of a lookup    */
+/* against.  <name>.fph holds the hash words and <name>.fpx an entry of id,  */
+/* nb of frames and offset for each track, both only appended to.  a track   */
+/* added again is read back as last added                                    */
+
+typedef void* AudioHashStore;
+
+/* open_audiohash_store                                                      */
+/*                                                                           */
+/* PARAMS name - path prefix of the store files                              */
+/*        add  - 1 to add to the store, made if it does not exist, 0 to only */
+/*               read it                                                     */
+/*        sync - with add, each hash is on disk before its add returns,      */
+/*               or only once the store is closed if 0                       */
+/* RETURN the store (NULL on failure), close with close_audiohash_store      */
+
+PHASH_EXPORT
+AudioHashStore open_audiohash_store(const char *name, int add, int sync);
+
+/* add_to_audiohash_store                                                    */
+/* keep the hash of id, safe with any number of concurrent callers.          */
+/* 0 on success, less than 0 on error                                        */
+
+PHASH_EXPORT
+int add_to_audiohash_store(AudioHashStore store, uint32_t id, uint32_t *hash, int nbframes);
+
+/* get_from_audiohash_store                                                  */
+/* the hash of id, good until the store is closed, nb of frames put in      */
+/* nbframes.  NULL if id is not in the store                                 */
+
+PHASH_EXPORT
+const uint32_t* get_from_audiohash_store(AudioHashStore store, uint32_t id, int *nbframes);
+
+/* foreach_audiohash_store                                                   */
+/* call fn on the hash of each id of the store, read in the order added, to */
+/* build an index of any kind from - fn stops it by returning less than 0,  */
+/* and that value is returned.  0 once all ids have been seen                */
+
+typedef int (*AudioHashFn)(void *arg, uint32_t id, const uint32_t *hash, int nbframes);
+
+PHASH_EXPORT
+int foreach_audiohash_store(AudioHashStore store, AudioHashFn fn, void *arg);
+
+/* foreach_undeleted_audiohash_store                                         */
+/* foreach_audiohash_store, skipping the ids deleted from any of idx_files - */
+/* those in their <idx_file>.del, for the files that have one.  a segmented  */
+/* index is given by its name.  -1 if the deletes could not be read          */
+
+PHASH_EXPORT
+int foreach_undeleted_audiohash_store(AudioHashStore store, const char **idx_files, int nbfiles,\
+				      AudioHashFn fn, void *arg);
+
+/* close_audiohash_store                                                     */
+/* close the store, syncing what was added first.  0 on success              */
+
+PHASH_EXPORT
+int close_audiohash_store(AudioHashStore store);
+
 
 
 /* stat_audioindex                                                                      */
@@ -140,6 +430,58 @@ int stat_audioindex(AudioIndex audio_index, int *nbbuckets, int *nbentries);
 
 
 
+/* nb of bins of the histograms of AudioIndexStats - bin 0 counts the empty ones,  */
+/* bin i > 0 the ones of length 2^(i-1) up to 2^i - 1                              */
+#define AUDIOINDEX_HIST_BINS 34
+
+PHASH_EXPORT
+typedef struct audioindex_hotkey_t {
+    uint32_t key;
+    uint64_t count;          /* nb postings of the key */
+} AudioIndexHotKey;
+
+PHASH_EXPORT
+typedef struct audioindex_stats_t {
+    uint64_t nbbuckets;      /* hash buckets, directory buckets of a sorted index    */
+    uint64_t nbkeys;         /* distinct hash values                                 */
+    uint64_t nbpostings;     /* (id, pos) entries                                    */
+    uint64_t nbbytes;        /* size in memory or on disk                            */
+    uint64_t chain_hist[AUDIOINDEX_HIST_BINS];  /* nb buckets by nb of entries      */
+    uint64_t list_hist[AUDIOINDEX_HIST_BINS];   /* nb keys by nb of postings        */
+    uint64_t max_chain, max_list;
+    double key_probes;       /* sum over the keys of the entries looked at to find it */
+    double sq_postings;      /* sum over the keys of the square of its nb postings   */
+    uint64_t zero_postings;  /* postings of the all 0 and all 1 hash words - silence */
+    uint64_t ones_postings;  /* and clipping                                          */
+    AudioIndexHotKey *hot;   /* keys with the most postings, most first              */
+    int nbhot, max_hot;
+} AudioIndexStats;
+
+/* analyze_audioindex                                                                   */
+/*                                                                                      */
+/* walk the whole index for the distribution of its keys: how long the bucket chains   */
+/* and posting lists are and which keys have the most postings.  a segmented index is  */
+/* the sum of its memtables and segments - a key in several of them is counted in each,*/
+/* and its hot key counts are summed from the hot keys of each.  a live index counts   */
+/* each generation apart the same way.                                                  */
+/*                                                                                      */
+/* a lookup of a frame at P toggles looks up 2^P keys.  for frames that are            */
+/* distributed like the postings of the index each key costs on average               */
+/* key_probes/nbkeys entries to find and sq_postings/nbpostings postings to read.     */
+/*                                                                                      */
+/* PARAMS audio_index - ptr to an opened index                                          */
+/*        nbhot       - nb of hot keys to keep                                          */
+/*        stats       - filled in, release with free_audioindex_stats                  */
+/* RETURN 0 on success, less than 0 on error                                            */
+
+PHASH_EXPORT
+int analyze_audioindex(AudioIndex audio_index, int nbhot, AudioIndexStats *stats);
+
+PHASH_EXPORT
+void free_audioindex_stats(AudioIndexStats *stats);
+
+
+
 /* flush_audioindex                                                      */
 /*                                                                       */
 /* flush the audio index to storage                                      */
@@ -165,6 +507,50 @@ PHASH_EXPORT
 int grow_audioindex(AudioIndex audio_index, const float load);
 
 
+/* type to use for an AudioIndexBuilder object, for building a sorted index offline */
+
+PHASH_EXPORT
+typedef void* AudioIndexBuilder;
+
+/* open_audioindex_builder                                                          */
+/*                                                                                  */
+/* start an offline build of a sorted index.  postings are buffered in memory and   */
+/* spilled as sorted runs to tmp files, which are merged when the builder is closed */
+/* into an index file that open_audioindex can mmap for queries.                    */
+/*                                                                                  */
+/* PARAMS tmpdir - directory for the sorted runs (NULL for current dir)             */
+/*        mem_mb - int value for the MB of memory to use for sorting                */
+/* RETURN the AudioIndexBuilder ptr (NULL on failure)                               */
+
+PHASH_EXPORT
+AudioIndexBuilder open_audioindex_builder(const char *tmpdir, unsigned int mem_mb);
+
+/* add_to_audioindex_builder                                  */
+/*                                                            */
+/* add the hash from an audio unit to the build               */
+/*                                                            */
+/* PARAMS builder  - ptr to the index builder                 */
+/*        id       - id that is unique to the audio unit      */
+/*        hash     - ptr to the hash array                    */
+/*        nbframes - length of the hash array                 */
+/* RETURN int value (0 on success, less than 0 on error)      */
+
+PHASH_EXPORT
+int add_to_audioindex_builder(AudioIndexBuilder builder, uint32_t id, uint32_t *hash, int nbframes);
+
+/* close_audioindex_builder                                                    */
+/*                                                                             */
+/* merge all runs and write the index file in one sequential pass.  the file   */
+/* is written aside and renamed to idx_file when complete.  frees the builder. */
+/*                                                                             */
+/* PARAMS builder  - ptr to the index builder                                  */
+/*        idx_file - name of the index file (NULL to discard the build)        */
+/* RETURN int value (0 on success, less than 0 on error)                       */
+
+PHASH_EXPORT
+int close_audioindex_builder(AudioIndexBuilder builder, const char *idx_file);
+
+
 /* readfilenames                                                                           */
 /*                                                                                         */
 /* read file names from given directory. The resulting array of strings                    */
@@ -257,6 +643,166 @@ PHASH_EXPORT
 int lookupaudiohash(AudioIndex index_table, uint32_t *hash, uint8_t **toggles, int nbframes,\
                     int P, int blocksize, float threshold, uint32_t *id, float *cs);
 
+/* lookupaudiohash_segments                                                                      */
+/* like lookupaudiohash, over a stack of indexes that vote as one - e.g. the main index and the  */
+/* live indexes taking new submissions.  a live index is only entered for the time it takes to   */
+/* copy the postings of one key, so a flush of it is never held up for a whole lookup            */
+/* PARAMS segments    - array of opened indexes, NULL entries are skipped                        */
+/*        nbsegments  - nb of indexes in segments                                                */
+/*        others      - as for lookupaudiohash                                                   */
+/* RETURN int value - 0 on success, less than 0 on failure                                      */
+
+PHASH_EXPORT
+int lookupaudiohash_segments(AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			     uint8_t **toggles, int nbframes, int P, int blocksize,\
+			     float threshold, uint32_t *id, float *cs);
+
+/* the votes of a lookup.  a posting read for a frame votes for its id.  by default it  */
+/* adds to the first track of the id whose last pos it follows by at most 2*blocksize,  */
+/* or starts a track of its own.  with AUDIO_VOTE_OFFSETS it adds to the bin of its     */
+/* offset from the query frame instead - the frames of a match all line up at the same */
+/* offset, where chance hits spread over all of them.  the id of the track or bin with */
+/* the best score is the match                                                          */
+
+#define AUDIO_VOTE_TRACKS  0
+#define AUDIO_VOTE_OFFSETS 1
+
+PHASH_EXPORT
+typedef struct audio_vote_t {
+    uint32_t id;
+    uint32_t count;          /* nb postings in the track */
+    uint32_t first_pos;      /* of the first and last posting, in the indexed hash */
+    uint32_t last_pos;
+    int32_t offset;          /* frame of the indexed hash at frame 0 of the query -   */
+                             /* the start of the bin, or that of the first posting of */
+                             /* a track                                               */
+} AudioVote;
+
+/* an id matched by a lookup, with the score and offset of its best track or bin */
+PHASH_EXPORT
+typedef struct audio_match_t {
+    uint32_t id;
+    float cs;
+    int32_t offset;
+} AudioMatch;
+
+/* score of a track, compared against the threshold - the default is count/blocksize */
+typedef float (*AudioVoteScore)(const AudioVote *vote, int blocksize, void *arg);
+
+typedef void* AudioVoter;
+
+PHASH_EXPORT
+typedef struct audio_voter_opts_t {
+    int mode;                /* AUDIO_VOTE_ value                                      */
+    int binwidth;            /* frames of offset in a bin, for AUDIO_VOTE_OFFSETS      */
+    float dominance;         /* stop a lookup as soon as the best score is over the    */
+                             /* threshold and this many times that of any other id -   */
+                             /* 0 to only stop at the end of a block                    */
+    AudioVoteScore score;    /* NULL for the default                                   */
+    void *arg;               /* passed to score                                        */
+    float sprt_error;        /* after each frame, test whether the best id is a match  */
+                             /* or no id is, with this rate of errors either way, and  */
+                             /* stop once it is decided - 0 for no test.  a match the  */
+                             /* test accepts is one whatever its score                 */
+    float hit_rate;          /* fraction of the frames of a match that vote for it,    */
+                             /* for the test                                           */
+    float background;        /* least fraction of the frames voting for an id by       */
+                             /* chance - the rate of the runner-up is used if higher   */
+    float max_df;            /* skip the keys found in the hashes of more than this    */
+                             /* fraction of the ids of the sorted indexes looked up in */
+                             /* together - silence and the like - 0 to use all keys.   */
+                             /* not applied while they hold less than 100 ids          */
+    int nbthreads;           /* split the blocks of a lookup into this many runs voted */
+                             /* at once by threads of the voter, for long queries - 0  */
+                             /* or 1 to vote in the calling thread only                */
+} AudioVoterOpts;
+
+/* open_audiovoter                                                                         */
+/* votes of one lookup at a time, kept from one lookup to the next so a thread doing many  */
+/* lookups only allocates when a lookup touches more ids than any before                  */
+/* PARAMS score - scoring function, NULL for the default                                  */
+/*        arg   - passed to score                                                          */
+/* RETURN the voter, NULL on failure                                                       */
+
+PHASH_EXPORT
+AudioVoter open_audiovoter(AudioVoteScore score, void *arg);
+
+/* open_audiovoter_opts                                                                    */
+/* like open_audiovoter, voting as opts say                                                */
+
+PHASH_EXPORT
+AudioVoter open_audiovoter_opts(const AudioVoterOpts *opts);
+
+PHASH_EXPORT
+void close_audiovoter(AudioVoter voter);
+
+/* audiovoter_top                                                                          */
+/* the best tracks or bins of the last lookup of the voter, with the offsets they match at */
+/* PARAMS voter   - voter of the lookup                                                    */
+/*        votes   - array filled in, best first                                            */
+/*        nbvotes - nb of entries in votes                                                 */
+/* RETURN nb filled in, less than 0 on failure                                             */
+
+PHASH_EXPORT
+int audiovoter_top(AudioVoter voter, AudioVote *votes, int nbvotes);
+
+/* audiovoter_frames                                                                       */
+/* nb of query frames the last lookup of the voter read before it stopped                 */
+
+PHASH_EXPORT
+int audiovoter_frames(AudioVoter voter);
+
+/* lookupaudiohash_voter                                                                   */
+/* lookupaudiohash_segments voting with voter, which must not be used by another thread   */
+/* at the same time                                                                        */
+
+PHASH_EXPORT
+int lookupaudiohash_voter(AudioVoter voter, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			  uint8_t **toggles, int nbframes, int P, int blocksize,\
+			  float threshold, uint32_t *id, float *cs);
+
+/* lookupaudiohash_topk                                                                    */
+/* lookupaudiohash_voter for the nbmatches best ids over the threshold instead of the one */
+/* best.  the lookup goes on until that many ids are over the threshold, so it can read  */
+/* more of the query than a lookup for one.  the dominance of the voter is only used   */
+/* for one match                                                                          */
+/* PARAMS matches   - array filled in, best first - one entry per id                      */
+/*        nbmatches - nb of entries in matches                                            */
+/*        others    - as for lookupaudiohash_voter                                        */
+/* RETURN nb of matches filled in, less than 0 on failure                                 */
+
+PHASH_EXPORT
+int lookupaudiohash_topk(AudioVoter voter, AudioIndex *segments, int nbsegments, uint32_t *hash,\
+			 uint8_t **toggles, int nbframes, int P, int blocksize, float threshold,\
+			 AudioMatch *matches, int nbmatches);
+
+/* audiohash_ber                                                                          */
+/* bit error rate of a query against a stored hash it matches at offset, over the frames */
+/* they share                                                                             */
+/* PARAMS offset - frame of stored at frame 0 of query, as in AudioMatch                 */
+/*        nbcompared - set to the nb of frames compared, may be NULL                      */
+/* RETURN fraction of the bits that differ, 1.0 if no frame is shared                     */
+
+PHASH_EXPORT
+float audiohash_ber(const uint32_t *query, int nbquery, const uint32_t *stored, int nbstored,\
+		    int32_t offset, int *nbcompared);
+
+/* verify_audiomatches                                                                    */
+/* check the matches of a lookup against the hashes of their tracks in store, aligned at */
+/* their offsets or up to slack frames away.  a match is kept if its bit error rate is   */
+/* at most max_ber over at least half the frames of the shorter of the two, with its     */
+/* offset moved to where the rate is lowest.  a match with no hash in the store cannot   */
+/* be checked and is kept, with a rate of -1                                              */
+/* PARAMS hash, nbframes - the query                                                      */
+/*        matches        - from lookupaudiohash_topk, the ones kept moved to the front,   */
+/*                         in the same order                                              */
+/*        bers           - rate of each match kept, may be NULL                           */
+/* RETURN nb of matches kept, less than 0 on failure                                      */
+
+PHASH_EXPORT
+int verify_audiomatches(AudioHashStore store, uint32_t *hash, int nbframes, AudioMatch *matches,\
+			int nbmatches, int slack, float max_ber, float *bers);
+
 
 #endif /* JUST_AUDIOHASH */
 
@@ -0,0 +1,659 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "segment_index.h"
+#include "snapshot.h"
+
+/* the paths return -1 rather than truncate a name too long for FILENAME_MAX */
+static int segment_path(SegmentedIndex *idx, uint32_t seqno, char *path){
+    int n = snprintf(path, FILENAME_MAX, "%s.%08u.seg", idx->name, seqno);
+    return (n < 0 || n >= FILENAME_MAX) ? -1 : 0;
+}
+
+static int manifest_path(SegmentedIndex *idx, char *path){
+    int n = snprintf(path, FILENAME_MAX, "%s.segs", idx->name);
+    return (n < 0 || n >= FILENAME_MAX) ? -1 : 0;
+}
+
+static Segment* segment_open(SegmentedIndex *idx, uint32_t seqno){
+    Segment *seg = (Segment*)calloc(1, sizeof(Segment));
+    if (seg == NULL) return NULL;
+    seg->seqno = seqno;
+    if (segment_path(idx, seqno, seg->path) < 0){
+	free(seg);
+	return NULL;
+    }
+    seg->idx = sortidx_open(seg->path, &idx->opts);
+    if (seg->idx == NULL){
+	free(seg);
+	return NULL;
+    }
+    seg->nbpostings = seg->idx->header->nbpostings;
+    return seg;
+}
+
+/* a list let go of seg - close it when it was the last */
+static void segment_drop(Segment *seg){
+    if (--seg->nblists > 0) return;
+    sortidx_close(seg->idx);
+    if (seg->obsolete) unlink(seg->path);
+    free(seg);
+}
+
+static SegmentList* list_alloc(int nbsegments){
+    SegmentList *list = (SegmentList*)calloc(1, sizeof(SegmentList));
+    if (list == NULL) return NULL;
+    list->segments = (Segment**)malloc((nbsegments + 1)*sizeof(Segment*));
+    if (list->segments == NULL){
+	free(list);
+	return NULL;
+    }
+    return list;
+}
+
+static void list_add(SegmentList *list, Segment *seg){
+    seg->nblists++;
+    list->segments[list->nbsegments++] = seg;
+}
+
+/* inserts held back by a frozen memtable wait on cond for the list after it */
+static SegmentList* publish_list(SegmentedIndex *idx, SegmentList *list){
+    pthread_mutex_lock(&idx->mutex);
+    SegmentList *old = idx->current;
+    idx->current = list;
+    pthread_cond_broadcast(&idx->cond);
+    pthread_mutex_unlock(&idx->mutex);
+    return old;
+}
+
+/* wait for the threads using a list swapped out to be done with it, */
+/* then drop its segments and free it - the memtables are left alone */
+static void retire_list(SegmentedIndex *idx, SegmentList *list){
+    int i;
+    pthread_mutex_lock(&idx->mutex);
+    while (list->nbrefs > 0){
+	pthread_cond_wait(&idx->cond, &idx->mutex);
+    }
+    pthread_mutex_unlock(&idx->mutex);
+    for (i = 0;i < list->nbsegments;i++){
+	segment_drop(list->segments[i]);
+    }
+    free(list->segments);
+    free(list);
+}
+
+static int write_manifest(SegmentedIndex *idx, SegmentList *list){
+    char path[FILENAME_MAX], part[FILENAME_MAX];
+    int i, err = 0;
+
+    if (manifest_path(idx, path) < 0) return -1;
+    i = snprintf(part, FILENAME_MAX, "%s.part", path);
+    if (i < 0 || i >= FILENAME_MAX) return -1;
+    FILE *fp = fopen(part, "w");
+    if (fp == NULL) return -1;
+    for (i = 0;i < list->nbsegments;i++){
+	if (fprintf(fp, "%u\n", list->segments[i]->seqno) < 0) err = -1;
+    }
+    if (fflush(fp) || fsync(fileno(fp))) err = -1;
+    if (fclose(fp)) err = -1;
+    if (err == 0 && rename(part, path) < 0) err = -1;
+    if (err < 0) unlink(part);
+    return err;
+}
+
+static int read_manifest(SegmentedIndex *idx, SegmentList *list, int maxsegments){
+    char path[FILENAME_MAX];
+    unsigned int seqno;
+    Segment *seg;
+
+    if (manifest_path(idx, path) < 0) return -1;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return 0;               /* new index */
+    while (list->nbsegments < maxsegments && fscanf(fp, "%u", &seqno) == 1){
+	seg = segment_open(idx, seqno);
+	if (seg == NULL){
+	    fclose(fp);
+	    return -1;
+	}
+	list_add(list, seg);
+	if (seqno >= idx->next_seqno) idx->next_seqno = seqno + 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int count_manifest(SegmentedIndex *idx){
+    char path[FILENAME_MAX];
+    unsigned int seqno;
+    int n = 0;
+
+    if (manifest_path(idx, path) < 0) return 0;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return 0;
+    while (fscanf(fp, "%u", &seqno) == 1) n++;
+    fclose(fp);
+    return n;
+}
+
+static LiveIndex* memtable_create(SegmentedIndex *idx){
+    uint64_t nbbuckets = idx->memtable_size/LIVE_INDEX_MAX_LOAD;
+    LiveIndex *memtable = liveidx_create((nbbuckets > (1u << 24)) ? (1u << 24) : (uint32_t)nbbuckets);
+    if (memtable) memtable->deleted = idx->deleted;
+    return memtable;
+}
+
+/* swap a fresh memtable in and write the full one out as a new segment -  */
+/* unless force, only if it is full.  a memtable left frozen by an earlier */
+/* failed write is written out first                                       */
+static int flush_locked(SegmentedIndex *idx, int force){
+    SegmentList *list, *old;
+    Segment *seg;
+    int i;
+
+    pthread_mutex_lock(&idx->mutex);
+    list = idx->current;
+    pthread_mutex_unlock(&idx->mutex);
+
+    if (list->frozen == NULL){
+	uint64_t count = liveidx_count(list->memtable);
+	if (count == 0 || (!force && count < idx->memtable_size)) return 0;
+
+	SegmentList *next = list_alloc(list->nbsegments);
+	LiveIndex *memtable = memtable_create(idx);
+	if (next == NULL || memtable == NULL){
+	    if (next) retire_list(idx, next);
+	    if (memtable) liveidx_destroy(memtable);
+	    return -1;
+	}
+	next->memtable = memtable;
+	next->frozen = list->memtable;
+	for (i = 0;i < list->nbsegments;i++){
+	    list_add(next, list->segments[i]);
+	}
+	/* inserts from here on are logged in a new file, before any can */
+	/* reach the new memtable                                        */
+	if (wal_rotate(idx->wal, &idx->frozen_wal) < 0){
+	    retire_list(idx, next);
+	    liveidx_destroy(memtable);
+	    return -1;
+	}
+	/* once the old list is let go of, no insert is left in the frozen memtable */
+	old = publish_list(idx, next);
+	retire_list(idx, old);
+	list = next;
+    }
+
+    char path[FILENAME_MAX];
+    uint32_t seqno = idx->next_seqno++;
+    if (segment_path(idx, seqno, path) < 0) return -2;
+    if (liveidx_flush(list->frozen, path) < 0) return -2;
+    seg = segment_open(idx, seqno);
+    if (seg == NULL) return -3;
+
+    SegmentList *next = list_alloc(list->nbsegments + 1);
+    if (next == NULL){
+	seg->obsolete = 1;
+	seg->nblists = 1;
+	segment_drop(seg);
+	return -4;
+    }
+    next->memtable = list->memtable;
+    for (i = 0;i < list->nbsegments;i++){
+	list_add(next, list->segments[i]);
+    }
+    list_add(next, seg);
+    LiveIndex *frozen = list->frozen;
+
+    old = publish_list(idx, next);
+    int err = write_manifest(idx, next);
+    retire_list(idx, old);
+    liveidx_destroy(frozen);
+    if (err < 0) return -5;
+    /* the frozen memtable is in a segment now */
+    return (wal_trim(idx->wal, idx->frozen_wal) < 0) ? -6 : 0;
+}
+
+/* size class of a segment - 0 below FANOUT memtables worth of postings, */
+/* and one more for each factor of SEGMENTED_INDEX_FANOUT above that      */
+static int size_class(SegmentedIndex *idx, uint64_t nbpostings){
+    uint64_t limit = idx->memtable_size*SEGMENTED_INDEX_FANOUT;
+    int c = 0;
+    while (nbpostings >= limit && c < 63){
+	limit *= SEGMENTED_INDEX_FANOUT;
+	c++;
+    }
+    return c;
+}
+
+/* merge the segments of the smallest class that has SEGMENTED_INDEX_FANOUT */
+/* of them.  maint_mutex is only held to pick them and to swap the merged   */
+/* segment in, so memtables are written out while the merge goes on.       */
+/* return 1 if segments were merged, 0 if there was nothing to do, less     */
+/* than 0 on error                                                          */
+static int compact(SegmentedIndex *idx){
+    SegmentList *list, *next, *old;
+    Segment *merging[SEGMENTED_INDEX_FANOUT*4];
+    SortedIndexCursor *cursors[SEGMENTED_INDEX_FANOUT*4];
+    SortedSource srcs[SEGMENTED_INDEX_FANOUT*4];
+    IdSetFilter filters[SEGMENTED_INDEX_FANOUT*4];
+    int counts[64], i, j, c, nbmerge = 0, err = 0;
+    uint64_t nbkeys = 0;
+
+    /* only holders of maint_mutex publish lists */
+    pthread_mutex_lock(&idx->maint_mutex);
+    list = idx->current;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0;i < list->nbsegments;i++){
+	counts[size_class(idx, list->segments[i]->nbpostings)]++;
+    }
+    for (c = 0;c < 64 && counts[c] < SEGMENTED_INDEX_FANOUT;c++);
+    if (c == 64){
+	pthread_mutex_unlock(&idx->maint_mutex);
+	return 0;
+    }
+
+    /* the oldest of the class, bounded so a pile up is taken a bit at a time. */
+    /* each is held as if listed, so it stays open whatever lists come and go  */
+    for (i = 0;i < list->nbsegments && nbmerge < SEGMENTED_INDEX_FANOUT*4;i++){
+	Segment *seg = list->segments[i];
+	if (size_class(idx, seg->nbpostings) != c) continue;
+	cursors[nbmerge] = sortidx_cursor_open(seg->path);
+	if (cursors[nbmerge] == NULL){
+	    err = -1;
+	    break;
+	}
+	seg->nblists++;
+	merging[nbmerge] = seg;
+	/* postings of deleted ids are dropped here */
+	filters[nbmerge].src.next = sortidx_cursor_next;
+	filters[nbmerge].src.arg = cursors[nbmerge];
+	filters[nbmerge].sets[0] = idx->deleted;
+	filters[nbmerge].sets[1] = NULL;
+	srcs[nbmerge].next = idset_filter_next;
+	srcs[nbmerge].arg = &filters[nbmerge];
+	nbkeys += cursors[nbmerge]->header.nbkeys;
+	nbmerge++;
+    }
+    uint32_t seqno = idx->next_seqno++;
+    pthread_mutex_unlock(&idx->maint_mutex);
+
+    char path[FILENAME_MAX];
+    Segment *merged = NULL;
+    if (err == 0 && segment_path(idx, seqno, path) < 0) err = -2;
+    if (err == 0 && sortidx_merge(srcs, nbmerge, path, sortidx_dir_bits(nbkeys)) < 0) err = -2;
+    for (i = 0;i < nbmerge;i++){
+	sortidx_cursor_close(cursors[i]);
+    }
+    if (err == 0 && (merged = segment_open(idx, seqno)) == NULL){
+	unlink(path);
+	err = -3;
+    }
+
+    pthread_mutex_lock(&idx->maint_mutex);
+    list = idx->current;
+    next = (err == 0) ? list_alloc(list->nbsegments + 1) : NULL;
+    if (err == 0 && next == NULL){
+	merged->obsolete = 1;
+	merged->nblists = 1;
+	segment_drop(merged);
+	err = -4;
+    }
+
+    if (err == 0){
+	/* flushes may have added segments since, the merged segment */
+	/* takes the place of the first one it replaces              */
+	next->memtable = list->memtable;
+	next->frozen = list->frozen;
+	int placed = 0;
+	for (i = 0;i < list->nbsegments;i++){
+	    Segment *seg = list->segments[i];
+	    for (j = 0;j < nbmerge && merging[j] != seg;j++);
+	    if (j < nbmerge){
+		seg->obsolete = 1;
+		if (!placed){
+		    list_add(next, merged);
+		    placed = 1;
+		}
+		continue;
+	    }
+	    list_add(next, seg);
+	}
+	old = publish_list(idx, next);
+	if (write_manifest(idx, next) < 0) err = -5;
+	retire_list(idx, old);
+    }
+    for (i = 0;i < nbmerge;i++){
+	segment_drop(merging[i]);
+    }
+    pthread_mutex_unlock(&idx->maint_mutex);
+    return (err < 0) ? err : 1;
+}
+
+/* writes out full memtables, and again every SEGMENTED_INDEX_RETRY_SECS */
+/* after a failure, then hands over to the compaction thread             */
+static void* maintenance(void *arg){
+    SegmentedIndex *idx = (SegmentedIndex*)arg;
+    struct timespec deadline;
+    int err = 0;
+
+    pthread_mutex_lock(&idx->mutex);
+    for (;;){
+	while (!idx->flush_wanted && !idx->stop){
+	    if (err == 0){
+		pthread_cond_wait(&idx->cond, &idx->mutex);
+		continue;
+	    }
+	    clock_gettime(CLOCK_REALTIME, &deadline);
+	    deadline.tv_sec += SEGMENTED_INDEX_RETRY_SECS;
+	    if (pthread_cond_timedwait(&idx->cond, &idx->mutex, &deadline) == ETIMEDOUT) break;
+	}
+	if (idx->stop) break;
+	idx->flush_wanted = 0;
+	pthread_mutex_unlock(&idx->mutex);
+
+	pthread_mutex_lock(&idx->maint_mutex);
+	err = flush_locked(idx, 0);
+	pthread_mutex_unlock(&idx->maint_mutex);
+	if (err < 0){
+	    syslog(LOG_ERR, "SEGMENTS: unable to write out memtable of %s, err = %d, retry in %d s",\
+		   idx->name, err, SEGMENTED_INDEX_RETRY_SECS);
+	}
+
+	pthread_mutex_lock(&idx->mutex);
+	idx->compact_wanted = 1;
+	pthread_cond_broadcast(&idx->cond);
+    }
+    pthread_mutex_unlock(&idx->mutex);
+    return NULL;
+}
+
+/* merges segments after each flush, while the next flushes go on */
+static void* compaction(void *arg){
+    SegmentedIndex *idx = (SegmentedIndex*)arg;
+    int err;
+
+    pthread_mutex_lock(&idx->mutex);
+    for (;;){
+	while (!idx->compact_wanted && !idx->stop){
+	    pthread_cond_wait(&idx->cond, &idx->mutex);
+	}
+	if (idx->stop) break;
+	idx->compact_wanted = 0;
+	pthread_mutex_unlock(&idx->mutex);
+
+	err = 0;
+	while (!__atomic_load_n(&idx->stop, __ATOMIC_ACQUIRE) && (err = compact(idx)) > 0);
+	if (err < 0){
+	    syslog(LOG_ERR, "SEGMENTS: unable to merge segments of %s, err = %d", idx->name, err);
+	}
+
+	pthread_mutex_lock(&idx->mutex);
+    }
+    pthread_mutex_unlock(&idx->mutex);
+    return NULL;
+}
+
+/* stop the threads of idx, the number of them started */
+static void stop_threads(SegmentedIndex *idx, int nbthreads){
+    pthread_mutex_lock(&idx->mutex);
+    __atomic_store_n(&idx->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&idx->cond);
+    pthread_mutex_unlock(&idx->mutex);
+    if (nbthreads > 0) pthread_join(idx->thread, NULL);
+    if (nbthreads > 1) pthread_join(idx->compact_thread, NULL);
+}
+
+/* wal_insert_fn replaying into the first memtable */
+static int replay_insert(void *arg, uint32_t id, const uint32_t *hash, int nbframes){
+    return liveidx_insert((LiveIndex*)arg, id, hash, nbframes);
+}
+
+SegmentedIndex* segidx_open(const char *name, uint64_t memtable_size, const AudioIndexOpts *opts,\
+			    int nbthreads){
+    SegmentedIndex *idx;
+    SegmentList *list;
+    int i;
+
+    if (name == NULL) return NULL;
+    /* the longest name derived from it is a segment's, .%08u.seg */
+    if (strlen(name) + 16 >= FILENAME_MAX) return NULL;
+    idx = (SegmentedIndex*)calloc(1, sizeof(SegmentedIndex));
+    if (idx == NULL) return NULL;
+    idx->magic = SEGMENTED_INDEX_MAGIC;
+    snprintf(idx->name, FILENAME_MAX, "%s", name);
+    idx->memtable_size = (memtable_size > 0) ? memtable_size : SEGMENTED_INDEX_MEMTABLE_SIZE;
+    idx->opts.pages = (opts) ? opts->pages : INDEX_PAGES_DEFAULT;
+    idx->opts.numa_node = (opts) ? opts->numa_node : INDEX_NUMA_NONE;
+    pthread_mutex_init(&idx->mutex, NULL);
+    pthread_mutex_init(&idx->maint_mutex, NULL);
+    pthread_cond_init(&idx->cond, NULL);
+
+    char path[FILENAME_MAX];
+    idset_path(name, path);
+    idx->deleted = idset_open(path);
+    int nbsegments = count_manifest(idx);
+    list = (idx->deleted) ? list_alloc(nbsegments) : NULL;
+    if (list == NULL){
+	idset_close(idx->deleted);
+	free(idx);
+	return NULL;
+    }
+    idx->current = list;
+    list->memtable = memtable_create(idx);
+    if (list->memtable == NULL || read_manifest(idx, list, nbsegments) < 0){
+	goto error;
+    }
+    idx->wal = wal_open(name, nbthreads, replay_insert, list->memtable);
+    if (idx->wal == NULL){
+	goto error;
+    }
+    idx->flush_wanted = (liveidx_count(list->memtable) >= idx->memtable_size);
+    if (pthread_create(&idx->thread, NULL, maintenance, idx)){
+	goto error;
+    }
+    if (pthread_create(&idx->compact_thread, NULL, compaction, idx)){
+	stop_threads(idx, 1);
+	goto error;
+    }
+    return idx;
+
+ error:
+    for (i = 0;i < list->nbsegments;i++){
+	segment_drop(list->segments[i]);
+    }
+    if (list->memtable) liveidx_destroy(list->memtable);
+    if (idx->wal) wal_close(idx->wal, 0);
+    free(list->segments);
+    free(list);
+    idset_close(idx->deleted);
+    free(idx);
+    return NULL;
+}
+
+int segidx_close(SegmentedIndex *idx){
+    int i, err;
+    if (idx == NULL || idx->magic != SEGMENTED_INDEX_MAGIC) return -1;
+
+    stop_threads(idx, 2);
+
+    pthread_mutex_lock(&idx->maint_mutex);
+    err = flush_locked(idx, 1);
+    pthread_mutex_unlock(&idx->maint_mutex);
+    /* all of it is in segments, unless the flush failed */
+    wal_close(idx->wal, (err == 0));
+
+    SegmentList *list = idx->current;
+    for (i = 0;i < list->nbsegments;i++){
+	segment_drop(list->segments[i]);
+    }
+    liveidx_destroy(list->memtable);
+    if (list->frozen) liveidx_destroy(list->frozen);
+    free(list->segments);
+    free(list);
+    idset_close(idx->deleted);
+
+    pthread_cond_destroy(&idx->cond);
+    pthread_mutex_destroy(&idx->mutex);
+    pthread_mutex_destroy(&idx->maint_mutex);
+    idx->magic = 0;
+    free(idx);
+    return (err < 0) ? -2 : 0;
+}
+
+SegmentList* segidx_acquire(SegmentedIndex *idx){
+    SegmentList *list;
+    pthread_mutex_lock(&idx->mutex);
+    list = idx->current;
+    list->nbrefs++;
+    pthread_mutex_unlock(&idx->mutex);
+    return list;
+}
+
+void segidx_release(SegmentedIndex *idx, SegmentList *list){
+    pthread_mutex_lock(&idx->mutex);
+    if (--list->nbrefs == 0) pthread_cond_broadcast(&idx->cond);
+    pthread_mutex_unlock(&idx->mutex);
+}
+
+int segidx_insert(SegmentedIndex *idx, uint32_t id, const uint32_t *hash, int nbframes){
+    /* a full memtable waits for the one before it to be written out, */
+    /* so memtables do not pile up in memory when the disk is behind  */
+    pthread_mutex_lock(&idx->mutex);
+    while (idx->current->frozen && !idx->stop\
+	   && liveidx_count(idx->current->memtable) >= idx->memtable_size){
+	pthread_cond_wait(&idx->cond, &idx->mutex);
+    }
+    pthread_mutex_unlock(&idx->mutex);
+
+    SegmentList *list = segidx_acquire(idx);
+    int err = wal_append(idx->wal, id, hash, nbframes);
+    if (err < 0){
+	segidx_release(idx, list);
+	return err;
+    }
+    err = liveidx_insert(list->memtable, id, hash, nbframes);
+    int full = (liveidx_count(list->memtable) >= idx->memtable_size);
+    segidx_release(idx, list);
+
+    if (full){
+	pthread_mutex_lock(&idx->mutex);
+	if (!idx->flush_wanted){
+	    idx->flush_wanted = 1;
+	    pthread_cond_broadcast(&idx->cond);
+	}
+	pthread_mutex_unlock(&idx->mutex);
+    }
+    return err;
+}
+
+int segidx_delete(SegmentedIndex *idx, uint32_t id){
+    if (idx == NULL || idx->magic != SEGMENTED_INDEX_MAGIC) return -1;
+    return (idset_add(idx->deleted, id) < 0) ? -2 : 0;
+}
+
+int segidx_flush(SegmentedIndex *idx){
+    pthread_mutex_lock(&idx->maint_mutex);
+    int err = flush_locked(idx, 1);
+    pthread_mutex_unlock(&idx->maint_mutex);
+
+    /* leave the merges to the compaction thread */
+    pthread_mutex_lock(&idx->mutex);
+    idx->flush_wanted = 1;
+    pthread_cond_broadcast(&idx->cond);
+    pthread_mutex_unlock(&idx->mutex);
+    return err;
+}
+
+int segidx_snapshot(SegmentedIndex *idx, const char *dir){
+    char path[FILENAME_MAX], del_file[FILENAME_MAX];
+    struct stat info;
+    int i, n = 0, err = 0;
+    const char *base = snap_basename(idx->name);
+
+    /* the names in dir are at most a segment's, no longer than in the index */
+    if (strlen(dir) + 1 + strlen(base) + 16 >= FILENAME_MAX) return -1;
+
+    /* no segment comes or goes until the manifest is written */
+    pthread_mutex_lock(&idx->maint_mutex);
+    SegmentList *list = segidx_acquire(idx);
+    uint32_t *seqnos = (uint32_t*)malloc((list->nbsegments + 2)*sizeof(uint32_t));
+    if (seqnos == NULL) err = -1;
+
+    for (i = 0;i < list->nbsegments && err == 0;i++){
+	Segment *seg = list->segments[i];
+	snprintf(path, FILENAME_MAX, "%s/%s.%08u.seg", dir, base, seg->seqno);
+	if (snap_link(seg->path, path) < 0) err = -2;
+	seqnos[n++] = seg->seqno;
+    }
+
+    /* the memtables, newest last like the segments */
+    LiveIndex *memtables[2] = { list->frozen, list->memtable };
+    for (i = 0;i < 2 && err == 0;i++){
+	if (memtables[i] == NULL || liveidx_count(memtables[i]) == 0) continue;
+	uint32_t seqno = idx->next_seqno++;
+	snprintf(path, FILENAME_MAX, "%s/%s.%08u.seg", dir, base, seqno);
+	if (liveidx_flush(memtables[i], path) < 0) err = -3;
+	seqnos[n++] = seqno;
+    }
+
+    if (err == 0){
+	snprintf(path, FILENAME_MAX, "%s/%s.segs", dir, base);
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) err = -4;
+	for (i = 0;i < n && err == 0;i++){
+	    if (fprintf(fp, "%u\n", seqnos[i]) < 0) err = -4;
+	}
+	if (fp && (fflush(fp) || fsync(fileno(fp)))) err = -4;
+	if (fp && fclose(fp)) err = -4;
+    }
+
+    idset_path(idx->name, del_file);
+    if (err == 0 && !stat(del_file, &info)){
+	snprintf(path, FILENAME_MAX, "%s/%s.del", dir, base);
+	if (snap_copy(del_file, path) < 0) err = -5;
+    }
+
+    free(seqnos);
+    segidx_release(idx, list);
+    pthread_mutex_unlock(&idx->maint_mutex);
+    return err;
+}
+
+uint64_t segidx_count(SegmentedIndex *idx){
+    int i;
+    SegmentList *list = segidx_acquire(idx);
+    uint64_t count = liveidx_count(list->memtable);
+    if (list->frozen) count += liveidx_count(list->frozen);
+    for (i = 0;i < list->nbsegments;i++){
+	count += list->segments[i]->nbpostings;
+    }
+    segidx_release(idx, list);
+    return count;
+}
@@ -0,0 +1,142 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the log structured index of segments - not installed */
+
+#ifndef SEGMENT_INDEX_H
+#define SEGMENT_INDEX_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "phash_audio.h"
+#include "sorted_index.h"
+#include "live_index.h"
+#include "id_set.h"
+#include "wal.h"
+
+/* magic number of the handle, first field like table_t and SortedIndex */
+#define SEGMENTED_INDEX_MAGIC 0x47455341     /* "ASEG" */
+
+/*
+ * Inserts go to a memtable, a live index.  When it holds memtable_size postings
+ * a maintenance thread swaps in a fresh one and writes the full one out as a
+ * sorted index file - a segment.  Segments are never changed once written.
+ * Should the fresh one fill up before that is done, inserts wait for it.
+ * A compaction thread merges segments of about the same size: segment sizes are put
+ * in classes a factor of SEGMENTED_INDEX_FANOUT apart, the first one below FANOUT
+ * memtables, and once a class holds SEGMENTED_INDEX_FANOUT segments they are
+ * merged into one of the next class.  So each posting is written about
+ * log(N/memtable_size) times, with FANOUT as base.
+ *
+ * The memtables and segments in use are listed in a SegmentList that is never
+ * changed either - a flush or merge publishes a new list and waits for the
+ * threads still using the old one to let go of it before freeing what is no
+ * longer listed.  The segments of the current list are named in a manifest file
+ * <name>.segs, rewritten with a rename after each change, and their files are
+ * <name>.<seqno>.seg.
+ *
+ * Deleted ids are kept in <name>.del, shared by the memtables.  Their postings
+ * are left out when a memtable is written and when segments are merged.
+ *
+ * Inserts are logged in <name>.wal.<seqno> before they go in the memtable.  The
+ * log is rotated as a memtable is frozen and cut once it is written out, and
+ * replayed into the memtable on open.
+ */
+
+#define SEGMENTED_INDEX_FANOUT 4
+
+/* secs between tries to write out a memtable after a failure */
+#define SEGMENTED_INDEX_RETRY_SECS 1
+
+/* default nb of postings in the memtable that starts a flush */
+#define SEGMENTED_INDEX_MEMTABLE_SIZE (1<<22)
+
+typedef struct segidx_segment_t {
+    SortedIndex *idx;
+    uint32_t seqno;
+    uint64_t nbpostings;
+    int nblists;                        /* lists and merges holding it, under maint_mutex */
+    int obsolete;                       /* merged away, unlink when no list holds it */
+    char path[FILENAME_MAX];
+} Segment;
+
+typedef struct segidx_list_t {
+    int nbrefs;                         /* threads using the list, under the index mutex */
+    LiveIndex *memtable;                /* takes inserts */
+    LiveIndex *frozen;                  /* full memtable being written out, or NULL */
+    int nbsegments;
+    Segment **segments;                 /* oldest first */
+} SegmentList;
+
+typedef struct segidx_t {
+    uint32_t magic;                     /* SEGMENTED_INDEX_MAGIC, must be first */
+    char name[FILENAME_MAX];
+    uint64_t memtable_size;
+    uint32_t next_seqno;
+    AudioIndexOpts opts;                /* to open segments with */
+    IdSet *deleted;
+    Wal *wal;
+    uint32_t frozen_wal;                /* last log file of the frozen memtable */
+    SegmentList *current;
+    pthread_mutex_t mutex;              /* current, list refs, flags below */
+    pthread_cond_t cond;                /* a list let go of or published, or work to do */
+    int flush_wanted;
+    int compact_wanted;
+    int stop;
+    pthread_mutex_t maint_mutex;        /* one change of the list at a time - a flush, */
+                                        /* the start or end of a merge, a snapshot     */
+    pthread_t thread;                   /* maintenance, writes out memtables */
+    pthread_t compact_thread;           /* merges segments */
+} SegmentedIndex;
+
+/* open the segments named in the manifest of name, with the logged inserts */
+/* replayed into the memtable with nbthreads threads, and start its         */
+/* maintenance and compaction threads.  NULL on error                       */
+SegmentedIndex* segidx_open(const char *name, uint64_t memtable_size, const AudioIndexOpts *opts,\
+			    int nbthreads);
+
+/* write the memtable out, stop the thread and free everything */
+int segidx_close(SegmentedIndex *idx);
+
+/* take/drop a reference to the current list, to read from it */
+SegmentList* segidx_acquire(SegmentedIndex *idx);
+void segidx_release(SegmentedIndex *idx, SegmentList *list);
+
+/* insert the frames of a hash, safe with any number of concurrent callers */
+int segidx_insert(SegmentedIndex *idx, uint32_t id, const uint32_t *hash, int nbframes);
+
+/* delete the postings of id - left out of lookups from now on, and */
+/* dropped as the segments holding them are merged                   */
+int segidx_delete(SegmentedIndex *idx, uint32_t id);
+
+/* write the memtable out as a segment now.  0 on success, less than 0 on error */
+int segidx_flush(SegmentedIndex *idx);
+
+/* put a copy of the index as of now in dir, as <dir>/<base of name>: the */
+/* segments hard linked, the memtables written out as segments of their   */
+/* own, a manifest naming them all and a copy of the deleted ids.  holds  */
+/* up flushes and merges, not inserts or lookups                          */
+int segidx_snapshot(SegmentedIndex *idx, const char *dir);
+
+/* nb of postings in the memtables and segments */
+uint64_t segidx_count(SegmentedIndex *idx);
+
+#endif /* SEGMENT_INDEX_H */
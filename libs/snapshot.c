@@ -0,0 +1,164 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "snapshot.h"
+
+#define SNAPSHOT_COPY_BUFSIZE (1<<20)
+
+const char* snap_basename(const char *path){
+    const char *sep = strrchr(path, '/');
+    return (sep) ? sep + 1 : path;
+}
+
+/* fsync a directory, so the names in it are on disk */
+static int sync_dir(const char *dir){
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return -1;
+    int err = fsync(fd);
+    close(fd);
+    return err;
+}
+
+/* directory part of a path, "." if none */
+static void parent_of(const char *path, char *dir){
+    const char *sep = strrchr(path, '/');
+    if (sep == NULL){
+	snprintf(dir, FILENAME_MAX, ".");
+    } else if (sep == path){
+	snprintf(dir, FILENAME_MAX, "/");
+    } else {
+	snprintf(dir, FILENAME_MAX, "%.*s", (int)(sep - path), path);
+    }
+}
+
+int snap_begin(const char *dir, char *part){
+    struct stat info;
+    if (dir == NULL || !stat(dir, &info)) return -1;
+    snprintf(part, FILENAME_MAX, "%s.part", dir);
+    snap_abort(part);
+    return (mkdir(part, 0755) < 0) ? -2 : 0;
+}
+
+void snap_abort(const char *part){
+    char path[FILENAME_MAX];
+    struct dirent *entry;
+    DIR *d = opendir(part);
+    if (d == NULL) return;
+    while ((entry = readdir(d)) != NULL){
+	if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+	snprintf(path, FILENAME_MAX, "%s/%s", part, entry->d_name);
+	unlink(path);
+    }
+    closedir(d);
+    rmdir(part);
+}
+
+/* write the names of the files of part not in prev_dir as the same file */
+static int write_new_files(const char *part, const char *prev_dir){
+    char path[FILENAME_MAX], prev[FILENAME_MAX];
+    struct stat info, prev_info;
+    struct dirent *entry;
+    int err = 0;
+
+    snprintf(path, FILENAME_MAX, "%s/%s", part, SNAPSHOT_NEW_FILES);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return -1;
+    DIR *d = opendir(part);
+    if (d == NULL){
+	fclose(fp);
+	return -1;
+    }
+    while ((entry = readdir(d)) != NULL){
+	if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||\
+	    !strcmp(entry->d_name, SNAPSHOT_NEW_FILES)) continue;
+	snprintf(path, FILENAME_MAX, "%s/%s", part, entry->d_name);
+	if (stat(path, &info) < 0){
+	    err = -1;
+	    break;
+	}
+	if (prev_dir){
+	    snprintf(prev, FILENAME_MAX, "%s/%s", prev_dir, entry->d_name);
+	    if (!stat(prev, &prev_info) && prev_info.st_dev == info.st_dev &&\
+		prev_info.st_ino == info.st_ino) continue;
+	}
+	if (fprintf(fp, "%s\n", entry->d_name) < 0) err = -1;
+    }
+    closedir(d);
+    if (fflush(fp) || fsync(fileno(fp))) err = -1;
+    if (fclose(fp)) err = -1;
+    return err;
+}
+
+int snap_commit(const char *dir, const char *part, const char *prev_dir){
+    char parent[FILENAME_MAX];
+    if (write_new_files(part, prev_dir) < 0) return -1;
+    if (sync_dir(part) < 0) return -2;
+    if (rename(part, dir) < 0) return -3;
+    parent_of(dir, parent);
+    return (sync_dir(parent) < 0) ? -4 : 0;
+}
+
+int snap_link(const char *src, const char *dst){
+    if (link(src, dst) == 0) return 0;
+    if (errno != EXDEV && errno != EPERM && errno != EMLINK) return -1;
+    return snap_copy(src, dst);
+}
+
+int snap_copy(const char *src, const char *dst){
+    struct stat info;
+    ssize_t n;
+    off_t left;
+    int err = 0;
+
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+    if (fstat(in, &info) < 0){
+	close(in);
+	return -1;
+    }
+    int out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    char *buf = (char*)malloc(SNAPSHOT_COPY_BUFSIZE);
+    if (out < 0 || buf == NULL){
+	if (out >= 0) close(out);
+	free(buf);
+	close(in);
+	return -2;
+    }
+    for (left = info.st_size;left > 0 && err == 0;left -= n){
+	n = read(in, buf, (left < SNAPSHOT_COPY_BUFSIZE) ? (size_t)left : SNAPSHOT_COPY_BUFSIZE);
+	if (n <= 0 || write(out, buf, n) != n) err = -3;
+    }
+    if (err == 0 && fsync(out) < 0) err = -4;
+    free(buf);
+    close(out);
+    close(in);
+    if (err < 0) unlink(dst);
+    return err;
+}
@@ -0,0 +1,63 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for taking snapshots of index files - not installed */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * A snapshot is put together in <dir>.part and renamed to <dir> once all of
+ * it is on disk, so a crash leaves either a whole snapshot or a .part to throw
+ * away.  Files that are never changed once written - sorted index files and
+ * segments - are hard linked in, which costs nothing and keeps them alive if
+ * the index drops them later.  The rest is copied or written out.
+ *
+ * Files hard linked from the same file as the one in the previous snapshot
+ * share its inode, so the files a replica holding the previous snapshot is
+ * missing are found by comparing inodes.  Their names are listed in
+ * <dir>/SNAPSHOT_NEW_FILES, one per line.
+ */
+
+#define SNAPSHOT_NEW_FILES "SNAPSHOT_NEW_FILES"
+
+/* last component of path */
+const char* snap_basename(const char *path);
+
+/* start a snapshot: make the empty dir <dir>.part, name put in part.  */
+/* less than 0 if dir already exists or part cannot be made            */
+int snap_begin(const char *dir, char *part);
+
+/* list the files new since prev_dir (may be NULL, all are new), sync */
+/* part and rename it to dir.  0 on success, less than 0 on error     */
+int snap_commit(const char *dir, const char *part, const char *prev_dir);
+
+/* throw away a snapshot not committed */
+void snap_abort(const char *part);
+
+/* hard link src as dst, or copy it if that cannot be done */
+int snap_link(const char *src, const char *dst);
+
+/* copy src to dst and sync it, a file that is only appended to */
+/* is copied up to where it was when the copy started            */
+int snap_copy(const char *src, const char *dst);
+
+#endif /* SNAPSHOT_H */
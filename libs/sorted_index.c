@@ -0,0 +1,964 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sorted_index.h"
+#include "index_mem.h"
+#include "id_set.h"
+#include "index_stats.h"
+#include "phash_audio.h"
+
+/* buffered reader/writer of a run of sorted postings in an unlinked tmp file */
+typedef struct sortidx_run_t {
+    int fd;
+    uint64_t nbpostings;
+    int level;                /* nb of merge passes that produced the run */
+} SortedRun;
+
+typedef struct sortidx_runreader_t {
+    int fd;
+    off_t offset;
+    uint64_t remaining;
+    SortedPosting *buf;
+    size_t nbbuf, curr;
+} SortedRunReader;
+
+typedef struct sortidx_runwriter_t {
+    int fd;
+    SortedPosting *buf;
+    size_t nbbuf;
+    uint64_t nbpostings;
+} SortedRunWriter;
+
+/* the object behind an AudioIndexBuilder */
+typedef struct sortidx_builder_t {
+    char tmpdir[FILENAME_MAX];
+    SortedPosting *buf;       /* in memory postings not yet spilled */
+    size_t bufsize, nbbuf;
+    SortedRun *runs;
+    int nbruns, maxruns;
+    uint64_t nbpostings;
+} SortedIndexBuilder;
+
+/* sink function for the output of a merge, 0 on success */
+typedef int (*sortidx_sink_fn)(void *sink, const SortedPosting *p);
+
+int sortidx_compare_postings(const void *a, const void *b){
+    const SortedPosting *p1 = (const SortedPosting*)a;
+    const SortedPosting *p2 = (const SortedPosting*)b;
+    if (p1->key != p2->key) return (p1->key < p2->key) ? -1 : 1;
+    if (p1->id  != p2->id)  return (p1->id  < p2->id)  ? -1 : 1;
+    if (p1->pos != p2->pos) return (p1->pos < p2->pos) ? -1 : 1;
+    return 0;
+}
+
+uint32_t sortidx_dir_bits(uint64_t expected_keys){
+    /* aim for about 16 keys per bucket, 256 bytes of key entries to search */
+    uint32_t bits = 0;
+    while (bits < 32 && ((uint64_t)1 << bits) < expected_keys) bits++;
+    bits = (bits > 4) ? bits - 4 : 0;
+    if (bits < SORTED_INDEX_MIN_DIR_BITS) bits = SORTED_INDEX_MIN_DIR_BITS;
+    if (bits > SORTED_INDEX_MAX_DIR_BITS) bits = SORTED_INDEX_MAX_DIR_BITS;
+    return bits;
+}
+
+static int write_all(int fd, const void *buf, size_t len){
+    const char *p = (const char*)buf;
+    while (len > 0){
+	ssize_t n = write(fd, p, len);
+	if (n < 0){
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* create an already unlinked file in dir, so nothing is left behind on a crash */
+static int open_anonymous(const char *dir){
+    char path[FILENAME_MAX];
+    int n = snprintf(path, FILENAME_MAX, "%s%saudioindex-XXXXXX", dir, SEPARATOR);
+    if (n < 0 || n >= FILENAME_MAX) return -1;
+    int fd = mkstemp(path);
+    if (fd < 0) return -1;
+    unlink(path);
+    return fd;
+}
+
+/* directory part of a path, "." if none */
+static void dir_of(const char *path, char *dir, size_t len){
+    const char *sep = strrchr(path, '/');
+    if (sep == NULL){
+	snprintf(dir, len, ".");
+    } else if (sep == path){
+	snprintf(dir, len, "/");
+    } else {
+	snprintf(dir, len, "%.*s", (int)(sep - path), path);
+    }
+}
+
+/* ---------------------------- reader ----------------------------------- */
+
+int sortidx_probe(const char *path){
+    uint32_t magic = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, &magic, sizeof(uint32_t));
+    close(fd);
+    return (n == sizeof(uint32_t) && magic == SORTED_INDEX_MAGIC) ? 1 : 0;
+}
+
+/* the sections the header points to are in order and inside a file of size bytes */
+static int check_header(const SortedIndexHeader *hdr, uint64_t size){
+    if (hdr->magic != SORTED_INDEX_MAGIC || hdr->version < 1 || hdr->version > SORTED_INDEX_VERSION\
+	|| hdr->dir_bits < 1 || hdr->dir_bits > SORTED_INDEX_MAX_DIR_BITS\
+	|| hdr->nbkeys > size/sizeof(SortedIndexKey)\
+	|| hdr->postings_offset < sizeof(SortedIndexHeader)\
+	|| hdr->postings_offset > hdr->keys_offset || hdr->keys_offset > size\
+	|| hdr->keys_offset + hdr->nbkeys*sizeof(SortedIndexKey) > size) return -1;
+    return 0;
+}
+
+/* the directory and key entries of a mapped index, so that no search or */
+/* posting list reads outside the file however corrupt it is             */
+static int check_layout(const SortedIndex *idx){
+    const SortedIndexHeader *hdr = idx->header;
+    uint64_t nbbuckets = (uint64_t)1 << hdr->dir_bits, b, i;
+    uint64_t postings_len = hdr->keys_offset - hdr->postings_offset, end = 0;
+    uint64_t min_size = (hdr->flags & SORTED_INDEX_FLAG_PACKED) ? 2 : sizeof(TableValue);
+
+    if (idx->dir[0] != 0 || idx->dir[nbbuckets] != hdr->nbkeys) return -1;
+    for (b = 0;b < nbbuckets;b++){
+	if (idx->dir[b] > idx->dir[b+1]) return -1;
+    }
+    for (i = 0;i < hdr->nbkeys;i++){
+	const SortedIndexKey *k = &(idx->keys[i]);
+	if (i > 0 && k->key <= idx->keys[i-1].key) return -1;
+	if (k->offset < end || k->offset > postings_len) return -1;
+	if ((uint64_t)k->count*min_size > postings_len - k->offset) return -1;
+	end = k->offset + (uint64_t)k->count*min_size;
+    }
+    return 0;
+}
+
+SortedIndex* sortidx_open(const char *path, const AudioIndexOpts *opts){
+    struct stat info;
+    size_t map_len = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(SortedIndexHeader)){
+	close(fd);
+	return NULL;
+    }
+
+    void *map = idxmem_map(fd, info.st_size, opts, &map_len);
+    close(fd);
+    if (map == NULL) return NULL;
+
+    const SortedIndexHeader *hdr = (const SortedIndexHeader*)map;
+    uint64_t dir_size = (hdr->dir_bits <= SORTED_INDEX_MAX_DIR_BITS) ?\
+	(((uint64_t)1 << hdr->dir_bits) + 1)*sizeof(uint64_t) : 0;
+    if (check_header(hdr, info.st_size) < 0 || hdr->file_size != (uint64_t)info.st_size\
+	|| hdr->keys_offset + hdr->nbkeys*sizeof(SortedIndexKey) > hdr->dir_offset\
+	|| hdr->dir_offset > hdr->file_size || dir_size > hdr->file_size - hdr->dir_offset){
+	idxmem_unmap(map, map_len);
+	return NULL;
+    }
+
+    SortedIndex *idx = (SortedIndex*)malloc(sizeof(SortedIndex));
+    if (idx == NULL){
+	idxmem_unmap(map, map_len);
+	return NULL;
+    }
+    idx->magic = SORTED_INDEX_MAGIC;
+    idx->map = map;
+    idx->map_size = info.st_size;
+    idx->map_len = map_len;
+    idx->header = hdr;
+    idx->keys = (const SortedIndexKey*)((const char*)map + hdr->keys_offset);
+    idx->dir = (const uint64_t*)((const char*)map + hdr->dir_offset);
+    idx->postings = (const unsigned char*)map + hdr->postings_offset;
+    idx->deleted = NULL;
+    idx->df = NULL;
+    idx->nbids = 0;
+    uint64_t df_offset = hdr->dir_offset + dir_size;
+    if ((hdr->flags & SORTED_INDEX_FLAG_DF) &&\
+	df_offset + sizeof(uint64_t) + hdr->nbkeys*sizeof(uint32_t) <= hdr->file_size){
+	memcpy(&idx->nbids, (const char*)map + df_offset, sizeof(uint64_t));
+	idx->df = (const uint32_t*)((const char*)map + df_offset + sizeof(uint64_t));
+    }
+    if (check_layout(idx) < 0){
+	idxmem_unmap(map, map_len);
+	free(idx);
+	return NULL;
+    }
+    return idx;
+}
+
+int sortidx_close(SortedIndex *idx){
+    if (idx == NULL || idx->magic != SORTED_INDEX_MAGIC) return -1;
+    idxmem_unmap(idx->map, idx->map_len);
+    idset_close(idx->deleted);
+    idx->magic = 0;
+    free(idx);
+    return 0;
+}
+
+const SortedIndexKey* sortidx_find(const SortedIndex *idx, uint32_t key){
+    uint32_t bucket = key >> (32 - idx->header->dir_bits);
+    uint64_t lo = idx->dir[bucket], hi = idx->dir[bucket+1];
+
+    while (lo < hi){
+	uint64_t mid = lo + (hi - lo)/2;
+	uint32_t midkey = idx->keys[mid].key;
+	if (midkey == key){
+	    return &(idx->keys[mid]);
+	} else if (midkey < key){
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return NULL;
+}
+
+void sortidx_find_batch(const SortedIndex *idx, const uint32_t *keys, uint32_t nbkeys,\
+			const SortedIndexKey **found){
+    uint64_t lo[SORTED_INDEX_FIND_BATCH], hi[SORTED_INDEX_FIND_BATCH];
+    uint32_t shift = 32 - idx->header->dir_bits;
+    uint32_t g, i, n, left;
+
+    for (g = 0;g < nbkeys;g += n){
+	n = (nbkeys - g < SORTED_INDEX_FIND_BATCH) ? nbkeys - g : SORTED_INDEX_FIND_BATCH;
+	for (i = 0;i < n;i++){
+	    __builtin_prefetch(&idx->dir[keys[g+i] >> shift]);
+	}
+	for (i = 0;i < n;i++){
+	    uint32_t bucket = keys[g+i] >> shift;
+	    lo[i] = idx->dir[bucket];
+	    hi[i] = idx->dir[bucket+1];
+	    found[g+i] = NULL;
+	    if (lo[i] < hi[i]) __builtin_prefetch(&idx->keys[lo[i] + (hi[i] - lo[i])/2]);
+	}
+	/* a step of each search per round, by then its probe has come in */
+	do {
+	    left = 0;
+	    for (i = 0;i < n;i++){
+		if (lo[i] >= hi[i]) continue;
+		uint64_t mid = lo[i] + (hi[i] - lo[i])/2;
+		uint32_t midkey = idx->keys[mid].key;
+		if (midkey == keys[g+i]){
+		    found[g+i] = &(idx->keys[mid]);
+		    __builtin_prefetch(idx->postings + idx->keys[mid].offset);
+		    lo[i] = hi[i];
+		    continue;
+		} else if (midkey < keys[g+i]){
+		    lo[i] = mid + 1;
+		} else {
+		    hi[i] = mid;
+		}
+		if (lo[i] < hi[i]){
+		    __builtin_prefetch(&idx->keys[lo[i] + (hi[i] - lo[i])/2]);
+		    left++;
+		}
+	    }
+	} while (left > 0);
+    }
+}
+
+void sortidx_analyze(const SortedIndex *idx, AudioIndexStats *stats){
+    uint64_t b, i, nbbuckets = (uint64_t)1 << idx->header->dir_bits;
+    stats->nbbuckets += nbbuckets;
+    stats->nbbytes += idx->map_size;
+    /* a directory bucket is the range of keys sortidx_find searches */
+    for (b = 0;b < nbbuckets;b++){
+	uint64_t lo = idx->dir[b], hi = idx->dir[b+1];
+	stats_add_chains(stats, hi - lo, 1);
+	for (i = lo;i < hi;i++){
+	    stats_add_key(stats, idx->keys[i].key, idx->keys[i].count,\
+			  stats_search_probes(hi - lo, i - lo));
+	}
+    }
+}
+
+void sortidx_postings(const SortedIndex *idx, const SortedIndexKey *k, SortedPostingList *list){
+    list->ptr = idx->postings + k->offset;
+    list->left = k->count;
+    list->packed = (idx->header->flags & SORTED_INDEX_FLAG_PACKED) ? 1 : 0;
+    list->last.id = 0;
+    list->last.pos = 0;
+}
+
+static size_t pack_varint(unsigned char *buf, uint32_t v){
+    size_t n = 0;
+    while (v >= 0x80){
+	buf[n++] = (unsigned char)(v | 0x80);
+	v >>= 7;
+    }
+    buf[n++] = (unsigned char)v;
+    return n;
+}
+
+size_t sortidx_pack_posting(unsigned char *buf, const TableValue *prev, const TableValue *val){
+    uint32_t delta = val->id - prev->id;
+    size_t n = pack_varint(buf, delta);
+    n += pack_varint(buf + n, (delta) ? val->pos : val->pos - prev->pos);
+    return n;
+}
+
+/* ---------------------------- writer ----------------------------------- */
+
+SortedIndexWriter* sortidx_writer_open(const char *path, uint32_t dir_bits){
+    char dir[FILENAME_MAX];
+    if (path == NULL) return NULL;
+    if (dir_bits < SORTED_INDEX_MIN_DIR_BITS) dir_bits = SORTED_INDEX_MIN_DIR_BITS;
+    if (dir_bits > SORTED_INDEX_MAX_DIR_BITS) dir_bits = SORTED_INDEX_MAX_DIR_BITS;
+
+    SortedIndexWriter *w = (SortedIndexWriter*)calloc(1, sizeof(SortedIndexWriter));
+    if (w == NULL) return NULL;
+    snprintf(w->path, FILENAME_MAX, "%s", path);
+    snprintf(w->part_path, FILENAME_MAX, "%s.part", path);
+    w->dir_bits = dir_bits;
+    w->last_bucket = -1;
+    w->packed = 1;
+
+    w->dir = (uint64_t*)malloc((((size_t)1 << dir_bits) + 1)*sizeof(uint64_t));
+    if (w->dir == NULL){
+	free(w);
+	return NULL;
+    }
+
+    dir_of(path, dir, FILENAME_MAX);
+    int keys_fd = open_anonymous(dir);
+    if (keys_fd < 0 || (w->keys_fp = fdopen(keys_fd, "w+b")) == NULL){
+	if (keys_fd >= 0) close(keys_fd);
+	free(w->dir);
+	free(w);
+	return NULL;
+    }
+    int df_fd = open_anonymous(dir);
+    if (df_fd < 0 || (w->df_fp = fdopen(df_fd, "w+b")) == NULL){
+	if (df_fd >= 0) close(df_fd);
+	fclose(w->keys_fp);
+	free(w->dir);
+	free(w);
+	return NULL;
+    }
+
+    w->fp = fopen(w->part_path, "wb");
+    if (w->fp == NULL){
+	fclose(w->keys_fp);
+	fclose(w->df_fp);
+	free(w->dir);
+	free(w);
+	return NULL;
+    }
+    setvbuf(w->fp, NULL, _IOFBF, SORTED_INDEX_RUN_BUFSIZE);
+
+    /* header is filled in on close */
+    SortedIndexHeader hdr;
+    memset(&hdr, 0, sizeof(SortedIndexHeader));
+    if (fwrite(&hdr, sizeof(SortedIndexHeader), 1, w->fp) != 1){
+	sortidx_writer_abort(w);
+	return NULL;
+    }
+    return w;
+}
+
+static int writer_flush_key(SortedIndexWriter *w){
+    if (!w->have_key) return 0;
+    if (fwrite(&(w->curr), sizeof(SortedIndexKey), 1, w->keys_fp) != 1) return -1;
+    if (fwrite(&(w->curr_df), sizeof(uint32_t), 1, w->df_fp) != 1) return -1;
+    w->nbkeys++;
+    w->have_key = 0;
+    return 0;
+}
+
+/* count id in the distinct ids of the index */
+static int writer_add_id(SortedIndexWriter *w, uint32_t id){
+    uint64_t word = id >> 6;
+    if (word >= w->nbid_words){
+	uint64_t size = (w->nbid_words) ? w->nbid_words : 1024;
+	while (size <= word) size *= 2;
+	uint64_t *ids = (uint64_t*)realloc(w->ids, size*sizeof(uint64_t));
+	if (ids == NULL) return -1;
+	memset(ids + w->nbid_words, 0, (size - w->nbid_words)*sizeof(uint64_t));
+	w->ids = ids;
+	w->nbid_words = size;
+    }
+    if (!(w->ids[word] & ((uint64_t)1 << (id & 63)))){
+	w->ids[word] |= (uint64_t)1 << (id & 63);
+	w->nbids++;
+    }
+    return 0;
+}
+
+int sortidx_writer_add(SortedIndexWriter *w, uint32_t key, uint32_t id, uint32_t pos){
+    unsigned char buf[SORTED_INDEX_MAX_PACKED];
+    TableValue prev, val;
+    size_t len;
+
+    if (w->have_key && key == w->curr.key){
+	if (id == w->last_id && pos == w->last_pos) return 0;
+	if (id < w->last_id || (id == w->last_id && pos < w->last_pos)) return -2;
+	if (w->curr.count == UINT32_MAX) return -3;
+    } else {
+	if (w->have_key && key < w->curr.key) return -2;
+	if (writer_flush_key(w) < 0) return -1;
+
+	int64_t bucket = (int64_t)(key >> (32 - w->dir_bits));
+	while (w->last_bucket < bucket){
+	    w->dir[++w->last_bucket] = w->nbkeys;
+	}
+	w->curr.key = key;
+	w->curr.count = 0;
+	w->curr.offset = w->postings_size;
+	w->curr_df = 0;
+	w->have_key = 1;
+	w->last_id = 0;
+	w->last_pos = 0;
+    }
+
+    val.id = id;
+    val.pos = pos;
+    if (w->packed){
+	prev.id = w->last_id;
+	prev.pos = w->last_pos;
+	len = sortidx_pack_posting(buf, &prev, &val);
+    } else {
+	memcpy(buf, &val, sizeof(TableValue));
+	len = sizeof(TableValue);
+    }
+    if (fwrite(buf, 1, len, w->fp) != len) return -1;
+    if (w->curr.count == 0 || id != w->last_id){
+	if (writer_add_id(w, id) < 0) return -1;
+	w->curr_df++;
+    }
+    w->curr.count++;
+    w->last_id = id;
+    w->last_pos = pos;
+    w->postings_size += len;
+    w->nbpostings++;
+    return 0;
+}
+
+int sortidx_writer_close(SortedIndexWriter *w){
+    SortedIndexHeader hdr;
+    char buf[1<<16];
+    size_t n;
+    int64_t nbbuckets = (int64_t)1 << w->dir_bits;
+
+    if (writer_flush_key(w) < 0) goto fail;
+    while (w->last_bucket < nbbuckets){
+	w->dir[++w->last_bucket] = w->nbkeys;
+    }
+
+    memset(&hdr, 0, sizeof(SortedIndexHeader));
+    hdr.magic = SORTED_INDEX_MAGIC;
+    hdr.version = SORTED_INDEX_VERSION;
+    hdr.flags = ((w->packed) ? SORTED_INDEX_FLAG_PACKED : 0) | SORTED_INDEX_FLAG_DF;
+    hdr.dir_bits = w->dir_bits;
+    hdr.nbkeys = w->nbkeys;
+    hdr.nbpostings = w->nbpostings;
+    hdr.postings_offset = sizeof(SortedIndexHeader);
+    hdr.keys_offset = hdr.postings_offset + w->postings_size;
+    hdr.dir_offset = hdr.keys_offset + w->nbkeys*sizeof(SortedIndexKey);
+    hdr.file_size = hdr.dir_offset + (nbbuckets + 1)*sizeof(uint64_t) +\
+	sizeof(uint64_t) + w->nbkeys*sizeof(uint32_t);
+
+    /* append the spilled key entries and the directory */
+    if (fflush(w->keys_fp) || fseeko(w->keys_fp, 0, SEEK_SET)) goto fail;
+    while ((n = fread(buf, 1, sizeof(buf), w->keys_fp)) > 0){
+	if (fwrite(buf, 1, n, w->fp) != n) goto fail;
+    }
+    if (ferror(w->keys_fp)) goto fail;
+    if (fwrite(w->dir, sizeof(uint64_t), nbbuckets+1, w->fp) != (size_t)(nbbuckets+1)) goto fail;
+
+    /* and the frequencies */
+    if (fwrite(&w->nbids, sizeof(uint64_t), 1, w->fp) != 1) goto fail;
+    if (fflush(w->df_fp) || fseeko(w->df_fp, 0, SEEK_SET)) goto fail;
+    while ((n = fread(buf, 1, sizeof(buf), w->df_fp)) > 0){
+	if (fwrite(buf, 1, n, w->fp) != n) goto fail;
+    }
+    if (ferror(w->df_fp)) goto fail;
+
+    if (fseeko(w->fp, 0, SEEK_SET)) goto fail;
+    if (fwrite(&hdr, sizeof(SortedIndexHeader), 1, w->fp) != 1) goto fail;
+    if (fflush(w->fp) || fsync(fileno(w->fp))) goto fail;
+
+    fclose(w->fp);
+    w->fp = NULL;
+    if (rename(w->part_path, w->path) < 0) goto fail;
+
+    fclose(w->keys_fp);
+    fclose(w->df_fp);
+    free(w->ids);
+    free(w->dir);
+    free(w);
+    return 0;
+
+ fail:
+    sortidx_writer_abort(w);
+    return -1;
+}
+
+void sortidx_writer_abort(SortedIndexWriter *w){
+    if (w == NULL) return;
+    if (w->fp) fclose(w->fp);
+    if (w->keys_fp) fclose(w->keys_fp);
+    if (w->df_fp) fclose(w->df_fp);
+    unlink(w->part_path);
+    free(w->ids);
+    free(w->dir);
+    free(w);
+}
+
+/* ---------------------------- k-way merge ------------------------------ */
+
+static int writer_add_posting(void *sink, const SortedPosting *p){
+    return sortidx_writer_add((SortedIndexWriter*)sink, p->key, p->id, p->pos);
+}
+
+
+/* binary min heap of source indices ordered on their current posting */
+static void heap_down(int *heap, int n, SortedPosting *curr, int i){
+    while (1){
+	int l = 2*i + 1, r = l + 1, m = i;
+	if (l < n && sortidx_compare_postings(&curr[heap[l]], &curr[heap[m]]) < 0) m = l;
+	if (r < n && sortidx_compare_postings(&curr[heap[r]], &curr[heap[m]]) < 0) m = r;
+	if (m == i) break;
+	int tmp = heap[i];
+	heap[i] = heap[m];
+	heap[m] = tmp;
+	i = m;
+    }
+}
+
+/* merge nbsrcs sorted sources into the sink, memory used is one posting per source */
+static int merge_sources(SortedSource *srcs, int nbsrcs, void *sink, sortidx_sink_fn emit){
+    int i, n = 0, err = 0;
+    int *heap = (int*)malloc(nbsrcs*sizeof(int));
+    SortedPosting *curr = (SortedPosting*)malloc(nbsrcs*sizeof(SortedPosting));
+    if (heap == NULL || curr == NULL){
+	free(heap);
+	free(curr);
+	return -1;
+    }
+
+    for (i = 0;i < nbsrcs;i++){
+	err = srcs[i].next(srcs[i].arg, &curr[i]);
+	if (err < 0) goto done;
+	if (err > 0) heap[n++] = i;
+    }
+    for (i = n/2 - 1;i >= 0;i--){
+	heap_down(heap, n, curr, i);
+    }
+
+    err = 0;
+    while (n > 0){
+	int top = heap[0];
+	if (emit(sink, &curr[top]) < 0){
+	    err = -2;
+	    break;
+	}
+	int res = srcs[top].next(srcs[top].arg, &curr[top]);
+	if (res < 0){
+	    err = -1;
+	    break;
+	}
+	if (res == 0) heap[0] = heap[--n];
+	heap_down(heap, n, curr, 0);
+    }
+
+ done:
+    free(heap);
+    free(curr);
+    return (err < 0) ? err : 0;
+}
+
+int sortidx_merge(SortedSource *srcs, int nbsrcs, const char *path, uint32_t dir_bits){
+    SortedIndexWriter *w = sortidx_writer_open(path, dir_bits);
+    if (w == NULL) return -1;
+    if (merge_sources(srcs, nbsrcs, w, writer_add_posting) < 0){
+	sortidx_writer_abort(w);
+	return -2;
+    }
+    return (sortidx_writer_close(w) < 0) ? -3 : 0;
+}
+
+/* ---------------------------- sources ---------------------------------- */
+
+/* read len bytes at offset into buf, 0 on success */
+static int read_at(int fd, void *buf, size_t len, off_t offset){
+    size_t got = 0;
+    while (got < len){
+	ssize_t res = pread(fd, (char*)buf + got, len - got, offset + got);
+	if (res < 0 && errno == EINTR) continue;
+	if (res <= 0) return -1;
+	got += res;
+    }
+    return 0;
+}
+
+SortedIndexCursor* sortidx_cursor_open(const char *path){
+    SortedIndexCursor *c = (SortedIndexCursor*)calloc(1, sizeof(SortedIndexCursor));
+    if (c == NULL) return NULL;
+
+    struct stat info;
+    c->fd = open(path, O_RDONLY);
+    if (c->fd < 0 || fstat(c->fd, &info) < 0\
+	|| read_at(c->fd, &c->header, sizeof(SortedIndexHeader), 0) < 0\
+	|| check_header(&c->header, info.st_size) < 0){
+	if (c->fd >= 0) close(c->fd);
+	free(c);
+	return NULL;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(c->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    c->keys = (SortedIndexKey*)malloc(SORTED_INDEX_CURSOR_BUFSIZE);
+    c->vals = (unsigned char*)malloc(SORTED_INDEX_CURSOR_BUFSIZE);
+    if (c->keys == NULL || c->vals == NULL){
+	sortidx_cursor_close(c);
+	return NULL;
+    }
+    c->keys_offset = c->header.keys_offset;
+    c->vals_offset = c->header.postings_offset;
+    c->keys_left = c->header.nbkeys;
+    c->vals_left = c->header.keys_offset - c->header.postings_offset;
+    return c;
+}
+
+int sortidx_cursor_next(void *src, SortedPosting *p){
+    SortedIndexCursor *c = (SortedIndexCursor*)src;
+
+    while (c->count_left == 0){
+	if (c->curr_key >= c->nbkeys){
+	    if (c->keys_left == 0) return 0;
+	    size_t n = SORTED_INDEX_CURSOR_BUFSIZE/sizeof(SortedIndexKey);
+	    if (n > c->keys_left) n = (size_t)c->keys_left;
+	    if (read_at(c->fd, c->keys, n*sizeof(SortedIndexKey), c->keys_offset) < 0) return -1;
+	    c->keys_offset += n*sizeof(SortedIndexKey);
+	    c->keys_left -= n;
+	    c->nbkeys = n;
+	    c->curr_key = 0;
+	}
+	c->key = c->keys[c->curr_key].key;
+	c->count_left = c->keys[c->curr_key].count;
+	c->curr_key++;
+	c->last.id = 0;
+	c->last.pos = 0;
+    }
+
+    /* keep at least one whole posting in the buffer, moving the tail to the front */
+    if (c->nbvals - c->curr_val < SORTED_INDEX_MAX_PACKED && c->vals_left > 0){
+	size_t tail = c->nbvals - c->curr_val;
+	memmove(c->vals, c->vals + c->curr_val, tail);
+	size_t n = SORTED_INDEX_CURSOR_BUFSIZE - tail;
+	if (n > c->vals_left) n = (size_t)c->vals_left;
+	if (read_at(c->fd, c->vals + tail, n, c->vals_offset) < 0) return -1;
+	c->vals_offset += n;
+	c->vals_left -= n;
+	c->nbvals = tail + n;
+	c->curr_val = 0;
+    }
+
+    SortedPostingList list;
+    list.ptr = c->vals + c->curr_val;
+    list.left = 1;
+    list.packed = (c->header.flags & SORTED_INDEX_FLAG_PACKED) ? 1 : 0;
+    list.last = c->last;
+    if (c->nbvals - c->curr_val < ((list.packed) ? 2 : sizeof(TableValue))) return -1;
+    sortidx_postings_next(&list, &c->last);
+    if (list.ptr > c->vals + c->nbvals) return -1;
+    c->curr_val = list.ptr - c->vals;
+
+    p->key = c->key;
+    p->id = c->last.id;
+    p->pos = c->last.pos;
+    c->count_left--;
+    return 1;
+}
+
+void sortidx_cursor_close(SortedIndexCursor *c){
+    if (c == NULL) return;
+    if (c->fd >= 0) close(c->fd);
+    free(c->keys);
+    free(c->vals);
+    free(c);
+}
+
+int sortidx_array_next(void *src, SortedPosting *p){
+    SortedArray *arr = (SortedArray*)src;
+    if (arr->curr >= arr->nbpostings) return 0;
+    *p = arr->postings[arr->curr++];
+    return 1;
+}
+
+/* ---------------------------- runs ------------------------------------- */
+
+static int runreader_init(SortedRunReader *rdr, SortedRun *run){
+    rdr->fd = run->fd;
+    rdr->offset = 0;
+    rdr->remaining = run->nbpostings;
+    rdr->nbbuf = rdr->curr = 0;
+    rdr->buf = (SortedPosting*)malloc(SORTED_INDEX_RUN_BUFSIZE);
+    return (rdr->buf) ? 0 : -1;
+}
+
+static int runreader_next(void *src, SortedPosting *p){
+    SortedRunReader *rdr = (SortedRunReader*)src;
+    if (rdr->curr >= rdr->nbbuf){
+	if (rdr->remaining == 0) return 0;
+	size_t want = SORTED_INDEX_RUN_BUFSIZE/sizeof(SortedPosting);
+	if (want > rdr->remaining) want = (size_t)rdr->remaining;
+	size_t len = want*sizeof(SortedPosting), got = 0;
+	while (got < len){
+	    ssize_t res = pread(rdr->fd, (char*)rdr->buf + got, len - got, rdr->offset + got);
+	    if (res < 0 && errno == EINTR) continue;
+	    if (res <= 0) return -1;
+	    got += res;
+	}
+	rdr->offset += len;
+	rdr->remaining -= want;
+	rdr->nbbuf = want;
+	rdr->curr = 0;
+    }
+    *p = rdr->buf[rdr->curr++];
+    return 1;
+}
+
+static int runwriter_flush(SortedRunWriter *wr){
+    if (wr->nbbuf == 0) return 0;
+    if (write_all(wr->fd, wr->buf, wr->nbbuf*sizeof(SortedPosting)) < 0) return -1;
+    wr->nbbuf = 0;
+    return 0;
+}
+
+static int runwriter_add(void *sink, const SortedPosting *p){
+    SortedRunWriter *wr = (SortedRunWriter*)sink;
+    wr->buf[wr->nbbuf++] = *p;
+    wr->nbpostings++;
+    if (wr->nbbuf == SORTED_INDEX_RUN_BUFSIZE/sizeof(SortedPosting)){
+	return runwriter_flush(wr);
+    }
+    return 0;
+}
+
+/* merge n runs into one sink, the input runs are closed */
+static int merge_runs(SortedRun *runs, int n, void *sink, sortidx_sink_fn emit){
+    int i, err = 0;
+    SortedRunReader *rdrs = (SortedRunReader*)calloc(n, sizeof(SortedRunReader));
+    SortedSource *srcs = (SortedSource*)malloc(n*sizeof(SortedSource));
+    if (rdrs == NULL || srcs == NULL){
+	free(rdrs);
+	free(srcs);
+	return -1;
+    }
+    for (i = 0;i < n;i++){
+	srcs[i].next = runreader_next;
+	srcs[i].arg = &rdrs[i];
+	if (runreader_init(&rdrs[i], &runs[i]) < 0) err = -1;
+    }
+    if (err == 0){
+	err = merge_sources(srcs, n, sink, emit);
+    }
+    for (i = 0;i < n;i++){
+	free(rdrs[i].buf);
+	close(runs[i].fd);
+    }
+    free(rdrs);
+    free(srcs);
+    return err;
+}
+
+/* collapse the last n runs into a single run one level up */
+static int builder_collapse(SortedIndexBuilder *b, int n){
+    SortedRunWriter wr;
+    int first = b->nbruns - n;
+    int level = b->runs[first].level + 1;
+
+    wr.fd = open_anonymous(b->tmpdir);
+    wr.nbbuf = 0;
+    wr.nbpostings = 0;
+    wr.buf = (SortedPosting*)malloc(SORTED_INDEX_RUN_BUFSIZE);
+    if (wr.fd < 0 || wr.buf == NULL){
+	if (wr.fd >= 0) close(wr.fd);
+	free(wr.buf);
+	return -1;
+    }
+
+    int err = merge_runs(&b->runs[first], n, &wr, runwriter_add);
+    if (err == 0) err = runwriter_flush(&wr);
+    free(wr.buf);
+    b->nbruns = first;
+    if (err < 0){
+	close(wr.fd);
+	return -1;
+    }
+
+    b->runs[b->nbruns].fd = wr.fd;
+    b->runs[b->nbruns].nbpostings = wr.nbpostings;
+    b->runs[b->nbruns].level = level;
+    b->nbruns++;
+    return 0;
+}
+
+/* sort the buffer and write it out as a new level 0 run. */
+/* runs are kept like a counter in base SORTED_INDEX_MAX_FANIN, so every posting */
+/* is rewritten only once per level and the nb of open runs stays small         */
+static int builder_spill(SortedIndexBuilder *b){
+    if (b->nbbuf == 0) return 0;
+    qsort(b->buf, b->nbbuf, sizeof(SortedPosting), sortidx_compare_postings);
+
+    if (b->nbruns == b->maxruns){
+	int maxruns = (b->maxruns) ? 2*b->maxruns : SORTED_INDEX_MAX_FANIN;
+	SortedRun *runs = (SortedRun*)realloc(b->runs, maxruns*sizeof(SortedRun));
+	if (runs == NULL) return -1;
+	b->runs = runs;
+	b->maxruns = maxruns;
+    }
+
+    int fd = open_anonymous(b->tmpdir);
+    if (fd < 0) return -1;
+    if (write_all(fd, b->buf, b->nbbuf*sizeof(SortedPosting)) < 0){
+	close(fd);
+	return -1;
+    }
+    b->runs[b->nbruns].fd = fd;
+    b->runs[b->nbruns].nbpostings = b->nbbuf;
+    b->runs[b->nbruns].level = 0;
+    b->nbruns++;
+    b->nbbuf = 0;
+
+    while (b->nbruns >= SORTED_INDEX_MAX_FANIN){
+	int i, first = b->nbruns - SORTED_INDEX_MAX_FANIN;
+	for (i = first + 1;i < b->nbruns;i++){
+	    if (b->runs[i].level != b->runs[first].level) break;
+	}
+	if (i < b->nbruns) break;
+	if (builder_collapse(b, SORTED_INDEX_MAX_FANIN) < 0) return -1;
+    }
+    return 0;
+}
+
+static void builder_free(SortedIndexBuilder *b){
+    int i;
+    for (i = 0;i < b->nbruns;i++){
+	close(b->runs[i].fd);
+    }
+    free(b->runs);
+    free(b->buf);
+    free(b);
+}
+
+PHASH_EXPORT
+AudioIndexBuilder open_audioindex_builder(const char *tmpdir, unsigned int mem_mb){
+    /* no room in tmpdir for the names of the runs */
+    if (tmpdir && strlen(tmpdir) + strlen("/audioindex-XXXXXX") >= FILENAME_MAX) return NULL;
+    SortedIndexBuilder *b = (SortedIndexBuilder*)calloc(1, sizeof(SortedIndexBuilder));
+    if (b == NULL) return NULL;
+
+    snprintf(b->tmpdir, FILENAME_MAX, "%s", (tmpdir) ? tmpdir : ".");
+    if (mem_mb == 0) mem_mb = 1;
+    b->bufsize = ((size_t)mem_mb << 20)/sizeof(SortedPosting);
+    b->buf = (SortedPosting*)malloc(b->bufsize*sizeof(SortedPosting));
+    if (b->buf == NULL){
+	free(b);
+	return NULL;
+    }
+    return (AudioIndexBuilder)b;
+}
+
+PHASH_EXPORT
+int add_to_audioindex_builder(AudioIndexBuilder builder, uint32_t id, uint32_t *hash, int nbframes){
+    SortedIndexBuilder *b = (SortedIndexBuilder*)builder;
+    int i;
+    if (b == NULL || (hash == NULL && nbframes > 0)) return -1;
+
+    for (i = 0;i < nbframes;i++){
+	if (b->nbbuf == b->bufsize && builder_spill(b) < 0){
+	    return -2;
+	}
+	b->buf[b->nbbuf].key = hash[i];
+	b->buf[b->nbbuf].id  = id;
+	b->buf[b->nbbuf].pos = (uint32_t)i;
+	b->nbbuf++;
+	b->nbpostings++;
+    }
+    return 0;
+}
+
+PHASH_EXPORT
+int close_audioindex_builder(AudioIndexBuilder builder, const char *idx_file){
+    SortedIndexBuilder *b = (SortedIndexBuilder*)builder;
+    size_t i;
+    int err = 0;
+    if (b == NULL) return -1;
+    if (idx_file == NULL){
+	builder_free(b);
+	return 0;
+    }
+
+    SortedIndexWriter *w = sortidx_writer_open(idx_file, sortidx_dir_bits(b->nbpostings));
+    if (w == NULL){
+	builder_free(b);
+	return -2;
+    }
+
+    if (b->nbruns == 0){
+	/* everything fit in memory - no tmp files */
+	qsort(b->buf, b->nbbuf, sizeof(SortedPosting), sortidx_compare_postings);
+	for (i = 0;i < b->nbbuf && err == 0;i++){
+	    err = writer_add_posting(w, &b->buf[i]);
+	}
+    } else {
+	err = builder_spill(b);
+	free(b->buf);
+	b->buf = NULL;
+	while (err == 0 && b->nbruns > SORTED_INDEX_MAX_FANIN){
+	    err = builder_collapse(b, SORTED_INDEX_MAX_FANIN);
+	}
+	if (err == 0){
+	    err = merge_runs(b->runs, b->nbruns, w, writer_add_posting);
+	    b->nbruns = 0;
+	}
+    }
+
+    if (err < 0){
+	sortidx_writer_abort(w);
+	builder_free(b);
+	return -3;
+    }
+    builder_free(b);
+    return (sortidx_writer_close(w) < 0) ? -4 : 0;
+}
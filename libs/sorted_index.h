@@ -0,0 +1,285 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the sorted index file format - not installed */
+
+#ifndef SORTED_INDEX_H
+#define SORTED_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "phash_audio.h"
+
+/* magic number of a sorted index - both on disk and in the in-memory handle.     */
+/* the in-memory handle shares its first field position with the table_t magic,    */
+/* so an AudioIndex ptr can be told apart by looking at its first word.            */
+#define SORTED_INDEX_MAGIC   0x58495341     /* "ASIX" */
+#define SORTED_INDEX_VERSION 2
+
+/* header flags */
+#define SORTED_INDEX_FLAG_PACKED 0x1        /* posting lists are varint packed */
+#define SORTED_INDEX_FLAG_DF     0x2        /* document frequencies follow the directory */
+
+/* bounds on log2 of the number of key directory buckets */
+#define SORTED_INDEX_MIN_DIR_BITS 10
+#define SORTED_INDEX_MAX_DIR_BITS 24
+
+/* max number of runs merged in one pass, each run reader holds a 1MB buffer */
+#define SORTED_INDEX_MAX_FANIN 64
+#define SORTED_INDEX_RUN_BUFSIZE (1<<20)
+
+/* nb keys sortidx_find_batch searches at once */
+#define SORTED_INDEX_FIND_BATCH 16
+
+/*
+ * On disk layout, all values in host byte order:
+ *
+ *    header      - SortedIndexHeader, 64 bytes
+ *    postings    - posting lists of every key, one after another, each sorted by (id, pos)
+ *                  and packed as described below
+ *    keys        - nbkeys SortedIndexKey entries sorted by key
+ *    directory   - (1<<dir_bits)+1 uint64 values, dir[b] is the index of the first key
+ *                  whose top dir_bits bits are >= b
+ *    frequencies - with SORTED_INDEX_FLAG_DF, the uint64 nb of distinct ids in the index,
+ *                  then nbkeys uint32 values, the nb of distinct ids in the list of each key
+ *
+ * Readers that do not know of the frequencies never look past the directory.
+ * The postings are streamed out first so that the whole file can be written in one
+ * sequential pass over a sorted stream of (key, id, pos) triples.
+ *
+ * With SORTED_INDEX_FLAG_PACKED each posting of a list is two LEB128 varints, the id
+ * minus the previous id in the list, then the pos minus the previous pos when the id
+ * delta is 0 or the pos itself when it is not.  The first posting is coded against
+ * (0, 0).  Lists are byte aligned and the key offset is the byte offset of the list.
+ * Without the flag (version 1 files) each posting is a raw TableValue.
+ */
+
+typedef struct sortidx_header_t {
+    uint32_t magic;            /* SORTED_INDEX_MAGIC                   */
+    uint32_t version;          /* SORTED_INDEX_VERSION                 */
+    uint32_t flags;            /* SORTED_INDEX_FLAG_ bits              */
+    uint32_t dir_bits;         /* log2 of nb directory buckets         */
+    uint64_t nbkeys;           /* nb distinct hash values              */
+    uint64_t nbpostings;       /* total nb of (id, pos) postings       */
+    uint64_t postings_offset;  /* file offset of posting lists         */
+    uint64_t keys_offset;      /* file offset of key entries           */
+    uint64_t dir_offset;       /* file offset of key directory         */
+    uint64_t file_size;        /* total size, for sanity checks        */
+} SortedIndexHeader;
+
+typedef struct sortidx_key_t {
+    uint32_t key;              /* hash value                                  */
+    uint32_t count;            /* nb postings in the list                     */
+    uint64_t offset;           /* byte offset of the list from postings start */
+} SortedIndexKey;
+
+/* one element of the sorted stream the index is written from */
+typedef struct sortidx_posting_t {
+    uint32_t key;
+    uint32_t id;
+    uint32_t pos;
+} SortedPosting;
+
+/* mmapped sorted index - the object behind an AudioIndex opened on a sorted file */
+typedef struct sortidx_t {
+    uint32_t magic;                  /* SORTED_INDEX_MAGIC, must be first */
+    const SortedIndexHeader *header;
+    const SortedIndexKey *keys;
+    const uint64_t *dir;
+    const unsigned char *postings;
+    void *map;
+    size_t map_size;                 /* file size                       */
+    size_t map_len;                  /* mapped length, for idxmem_unmap */
+    struct idset_t *deleted;         /* ids deleted since, or NULL      */
+    const uint32_t *df;              /* frequency of each key, or NULL  */
+    uint64_t nbids;                  /* distinct ids, 0 if not known    */
+} SortedIndex;
+
+/* max bytes of one packed posting, two 5 byte varints */
+#define SORTED_INDEX_MAX_PACKED 10
+
+/* reader over the posting list of one key, see sortidx_postings_next */
+typedef struct sortidx_postinglist_t {
+    const unsigned char *ptr;
+    uint32_t left;                   /* nb postings not yet read */
+    int packed;
+    TableValue last;                 /* last posting read        */
+} SortedPostingList;
+
+/* writer for the final index file, fed with postings in (key, id, pos) order */
+typedef struct sortidx_writer_t {
+    FILE *fp;                        /* output, header + postings    */
+    FILE *keys_fp;                   /* anonymous spill of key entries */
+    char path[FILENAME_MAX];         /* final name                   */
+    char part_path[FILENAME_MAX];    /* name written to until closed */
+    uint64_t *dir;
+    uint32_t dir_bits;
+    int64_t last_bucket;
+    SortedIndexKey curr;             /* key entry being accumulated  */
+    int have_key;
+    uint32_t last_id, last_pos;
+    int packed;                      /* write packed posting lists   */
+    uint64_t nbkeys;
+    uint64_t nbpostings;
+    uint64_t postings_size;
+    FILE *df_fp;                     /* anonymous spill of key frequencies */
+    uint32_t curr_df;                /* distinct ids of the key so far */
+    uint64_t *ids;                   /* bitmap of the ids seen */
+    uint64_t nbid_words;
+    uint64_t nbids;
+} SortedIndexWriter;
+
+/* a stream of postings in (key, id, pos) order to be merged.                  */
+/* next returns 1 for a posting, 0 at the end and less than 0 on error          */
+typedef int (*sortidx_next_fn)(void *src, SortedPosting *p);
+
+typedef struct sortidx_source_t {
+    sortidx_next_fn next;
+    void *arg;
+} SortedSource;
+
+/* source reading a sorted index file front to back with two small buffers, */
+/* one over the key entries and one over the posting lists                  */
+#define SORTED_INDEX_CURSOR_BUFSIZE (1<<20)
+
+typedef struct sortidx_cursor_t {
+    int fd;
+    SortedIndexHeader header;
+    SortedIndexKey *keys;
+    unsigned char *vals;
+    size_t nbkeys, curr_key;
+    size_t nbvals, curr_val;         /* in bytes                   */
+    uint64_t keys_offset, vals_offset;
+    uint64_t keys_left, vals_left;   /* keys_left in entries, vals_left in bytes */
+    uint32_t key;                    /* key of the list being read */
+    uint32_t count_left;             /* postings left in the list  */
+    TableValue last;                 /* last posting of the list   */
+} SortedIndexCursor;
+
+/* source over an in-memory array already sorted with sortidx_compare_postings */
+typedef struct sortidx_array_t {
+    SortedPosting *postings;
+    size_t nbpostings, curr;
+} SortedArray;
+
+/* comparison of two postings in (key, id, pos) order, for qsort */
+int sortidx_compare_postings(const void *a, const void *b);
+
+/* choose nb of directory bits for the expected number of keys */
+uint32_t sortidx_dir_bits(uint64_t expected_keys);
+
+/* return 1 if the file starts with a sorted index header, 0 otherwise */
+int sortidx_probe(const char *path);
+
+/* map a sorted index file as the placement options say (NULL for a plain */
+/* mmap), NULL on error                                                    */
+SortedIndex* sortidx_open(const char *path, const AudioIndexOpts *opts);
+
+/* unmap and free, 0 on success */
+int sortidx_close(SortedIndex *idx);
+
+/* find the key entry for a hash value, NULL if not in the index */
+const SortedIndexKey* sortidx_find(const SortedIndex *idx, uint32_t key);
+
+/* sortidx_find for nbkeys keys, found[i] set to the entry of keys[i].  the */
+/* searches are run in step, each prefetching its next probe while the     */
+/* others are being done, so the cache misses of a batch overlap          */
+void sortidx_find_batch(const SortedIndex *idx, const uint32_t *keys, uint32_t nbkeys,\
+			const SortedIndexKey **found);
+
+/* nb of ids with the key in their lists, 0 if the file has no frequencies */
+static inline uint32_t sortidx_df(const SortedIndex *idx, const SortedIndexKey *k){
+    return (idx->df) ? idx->df[k - idx->keys] : 0;
+}
+
+/* least nb of ids, over all the sorted segments of a lookup, for a key to */
+/* be judged too common - a few tracks share most of their keys            */
+#define SORTIDX_STOP_MIN_IDS 100
+
+/* add the key distribution of the index to stats, see analyze_audioindex */
+void sortidx_analyze(const SortedIndex *idx, AudioIndexStats *stats);
+
+/* set up a reader over the posting list of a key entry */
+void sortidx_postings(const SortedIndex *idx, const SortedIndexKey *k, SortedPostingList *list);
+
+/* append the packed form of val following prev in a list to buf, return nb bytes */
+size_t sortidx_pack_posting(unsigned char *buf, const TableValue *prev, const TableValue *val);
+
+static inline const unsigned char* sortidx_unpack_varint(const unsigned char *p, uint32_t *v){
+    uint32_t x = *p++;
+    if (x & 0x80){
+	uint32_t shift = 7, b;
+	x &= 0x7f;
+	do {
+	    b = *p++;
+	    x |= (b & 0x7f) << shift;
+	    shift += 7;
+	} while ((b & 0x80) && shift < 35);
+    }
+    *v = x;
+    return p;
+}
+
+/* read the next posting of a list into val, 1 for a posting and 0 at the end */
+static inline int sortidx_postings_next(SortedPostingList *list, TableValue *val){
+    if (list->left == 0) return 0;
+    list->left--;
+    if (list->packed){
+	uint32_t delta, pos;
+	list->ptr = sortidx_unpack_varint(list->ptr, &delta);
+	list->ptr = sortidx_unpack_varint(list->ptr, &pos);
+	list->last.pos = (delta) ? pos : list->last.pos + pos;
+	list->last.id += delta;
+    } else {
+	memcpy(&list->last, list->ptr, sizeof(TableValue));
+	list->ptr += sizeof(TableValue);
+    }
+    *val = list->last;
+    return 1;
+}
+
+/* open writer on path - the file is written to path.part and renamed on close */
+SortedIndexWriter* sortidx_writer_open(const char *path, uint32_t dir_bits);
+
+/* append a posting, postings must be added in (key, id, pos) order. */
+/* exact duplicates are dropped. 0 on success, less than 0 on error  */
+int sortidx_writer_add(SortedIndexWriter *w, uint32_t key, uint32_t id, uint32_t pos);
+
+/* finish file, sync it and rename into place, frees the writer */
+int sortidx_writer_close(SortedIndexWriter *w);
+
+/* discard the partial file, frees the writer */
+void sortidx_writer_abort(SortedIndexWriter *w);
+
+/* open/read/close a cursor over a sorted index file, next is a sortidx_next_fn */
+SortedIndexCursor* sortidx_cursor_open(const char *path);
+int sortidx_cursor_next(void *src, SortedPosting *p);
+void sortidx_cursor_close(SortedIndexCursor *c);
+
+/* sortidx_next_fn for a SortedArray */
+int sortidx_array_next(void *src, SortedPosting *p);
+
+/* k-way merge of the sources into a new index file at path.  memory used is  */
+/* one posting per source plus the writer, the file is renamed in on success */
+int sortidx_merge(SortedSource *srcs, int nbsrcs, const char *path, uint32_t dir_bits);
+
+#endif /* SORTED_INDEX_H */
@@ -3230,6 +3230,45 @@ int	table_munmap(table_t *table_p)
 #endif
 }
 
+/*
+ * int table_mmap_region
+ *
+ * DESCRIPTION:
+ *
+ * Get the memory region of a table that was mmapped using table_mmap,
+ * so that it can be advised on or placed.
+ *
+ * RETURNS:
+ *
+ * Returns table error codes.
+ *
+ * ARGUMENTS:
+ *
+ * table_p - Mmaped table pointer.
+ *
+ * addr_p - Pointer to a pointer which will be set to the start of the
+ * region.
+ *
+ * size_p - Pointer to an unsigned long which will be set to the size
+ * of the region.
+ */
+int	table_mmap_region(table_t *table_p, void **addr_p, unsigned long *size_p)
+{
+  if (table_p == NULL) {
+    return TABLE_ERROR_ARG_NULL;
+  }
+  if (table_p->ta_magic != TABLE_MAGIC) {
+    return TABLE_ERROR_PNT;
+  }
+  if (table_p->ta_mmap == NULL) {
+    return TABLE_ERROR_PNT;
+  }
+  
+  SET_POINTER(addr_p, (void *)table_p->ta_mmap);
+  SET_POINTER(size_p, table_p->ta_file_size);
+  return TABLE_ERROR_NONE;
+}
+
 /******************************* file routines *******************************/
 
 /*
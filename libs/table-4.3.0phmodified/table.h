@@ -1086,6 +1086,31 @@ table_t		*table_mmap(const char *path, int *error_p);
 extern
 int	table_munmap(table_t *table_p);
 
+/*
+ * int table_mmap_region
+ *
+ * DESCRIPTION:
+ *
+ * Get the memory region of a table that was mmapped using table_mmap,
+ * so that it can be advised on or placed.
+ *
+ * RETURNS:
+ *
+ * Returns table error codes.
+ *
+ * ARGUMENTS:
+ *
+ * table_p - Mmaped table pointer.
+ *
+ * addr_p - Pointer to a pointer which will be set to the start of the
+ * region.
+ *
+ * size_p - Pointer to an unsigned long which will be set to the size
+ * of the region.
+ */
+extern
+int	table_mmap_region(table_t *table_p, void **addr_p, unsigned long *size_p);
+
 /*
  * int table_read
  *
@@ -0,0 +1,99 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include "task_pool.h"
+
+/* take tasks until there are none left, with the mutex held */
+static void run_tasks(TaskPool *pool){
+    while (pool->next < pool->nbtasks){
+	void *task = pool->tasks + (size_t)pool->next++*pool->tasksize;
+	pthread_mutex_unlock(&pool->mutex);
+	pool->fn(task);
+	pthread_mutex_lock(&pool->mutex);
+	if (++pool->nbdone == pool->nbtasks) pthread_cond_signal(&pool->done);
+    }
+}
+
+static void* pool_worker(void *arg){
+    TaskPool *pool = (TaskPool*)arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->quit){
+	run_tasks(pool);
+	if (!pool->quit) pthread_cond_wait(&pool->work, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+TaskPool* pool_create(int nbthreads){
+    TaskPool *pool = (TaskPool*)calloc(1, sizeof(TaskPool));
+    if (pool == NULL) return NULL;
+    pool->threads = (pthread_t*)malloc(((nbthreads > 0) ? nbthreads : 1)*sizeof(pthread_t));
+    if (pool->threads == NULL){
+	free(pool);
+	return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (pool->nbthreads = 0;pool->nbthreads < nbthreads;pool->nbthreads++){
+	if (pthread_create(&pool->threads[pool->nbthreads], NULL, pool_worker, pool)){
+	    pool_destroy(pool);
+	    return NULL;
+	}
+    }
+    return pool;
+}
+
+void pool_run(TaskPool *pool, pool_task_fn fn, void *tasks, size_t tasksize, int nbtasks){
+    pthread_mutex_lock(&pool->mutex);
+    pool->fn = fn;
+    pool->tasks = (char*)tasks;
+    pool->tasksize = tasksize;
+    pool->nbtasks = nbtasks;
+    pool->next = pool->nbdone = 0;
+    pthread_cond_broadcast(&pool->work);
+    run_tasks(pool);
+    while (pool->nbdone < pool->nbtasks){
+	pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pool->tasks = NULL;
+    pool->nbtasks = pool->next = 0;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_destroy(TaskPool *pool){
+    int i;
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0;i < pool->nbthreads;i++){
+	pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,61 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the threads sharing the work of a lookup - not installed */
+
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * A few threads kept waiting for the tasks of one caller at a time.  The
+ * caller hands out a run of tasks and does its share of them, and returns
+ * once all are done - there is no queue, so a pool belongs to one thread,
+ * like the voter it is kept in.
+ */
+
+typedef void (*pool_task_fn)(void *task);
+
+typedef struct task_pool_t {
+    pthread_t *threads;
+    int nbthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;                    /* tasks handed out, or quit */
+    pthread_cond_t done;                    /* the last task is done */
+    pool_task_fn fn;
+    char *tasks;                            /* nbtasks of tasksize bytes */
+    size_t tasksize;
+    int nbtasks, next, nbdone;
+    int quit;
+} TaskPool;
+
+/* pool of nbthreads threads besides the caller, NULL on error */
+TaskPool* pool_create(int nbthreads);
+
+/* run fn on each of the nbtasks tasks of tasksize bytes, some of them */
+/* in the calling thread, and wait for all of them                    */
+void pool_run(TaskPool *pool, pool_task_fn fn, void *tasks, size_t tasksize, int nbtasks);
+
+void pool_destroy(TaskPool *pool);
+
+#endif /* TASK_POOL_H */
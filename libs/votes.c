@@ -0,0 +1,346 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "votes.h"
+
+static inline uint32_t hash_key(uint64_t key){
+    uint32_t h = (uint32_t)key ^ (uint32_t)(key >> 32)*0x9e3779b9;
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}
+
+static float count_score(const AudioVote *vote, int blocksize, void *arg){
+    return (float)vote->count/(float)blocksize;
+}
+
+VoteMap* votemap_create(const AudioVoterOpts *opts){
+    int i;
+    VoteMap *map = (VoteMap*)calloc(1, sizeof(VoteMap));
+    if (map == NULL) return NULL;
+    map->slots = (VoteSlot*)calloc((size_t)1 << VOTE_MIN_SLOT_BITS, sizeof(VoteSlot));
+    map->max_entries = 1 << VOTE_MIN_SLOT_BITS;
+    map->entries = (VoteEntry*)malloc(map->max_entries*sizeof(VoteEntry));
+    if (map->slots == NULL || map->entries == NULL || cands_init(&map->cands) < 0){
+	votemap_destroy(map);
+	return NULL;
+    }
+    map->mask = (1 << VOTE_MIN_SLOT_BITS) - 1;
+    map->stamp = 1;
+    if (opts) map->opts = *opts;
+    if (map->opts.score == NULL) map->opts.score = count_score;
+    if (map->opts.binwidth <= 0) map->opts.binwidth = 1;
+    if (map->opts.sprt_error > 0.0f && map->opts.sprt_error < 0.5f){
+	map->sprt_bound = logf((1.0f - map->opts.sprt_error)/map->opts.sprt_error);
+    } else {
+	map->opts.sprt_error = 0.0f;
+    }
+    if (map->opts.background <= 0.0f) map->opts.background = VOTE_DEFAULT_BACKGROUND;
+    map->blocksize = 1;
+    map->best = map->second = -1;
+    if (map->opts.nbthreads > 1){
+	AudioVoterOpts part_opts = map->opts;
+	part_opts.nbthreads = 0;
+	map->parts = (VoteMap**)calloc(map->opts.nbthreads, sizeof(VoteMap*));
+	for (i = 0;map->parts && i < map->opts.nbthreads;i++){
+	    if ((map->parts[i] = votemap_create(&part_opts)) == NULL) break;
+	}
+	map->pool = (map->parts && i == map->opts.nbthreads) ? pool_create(map->opts.nbthreads - 1) : NULL;
+	if (map->pool == NULL){
+	    votemap_destroy(map);
+	    return NULL;
+	}
+    } else {
+	map->opts.nbthreads = 1;
+    }
+    return map;
+}
+
+void votemap_destroy(VoteMap *map){
+    int i;
+    if (map == NULL) return;
+    pool_destroy(map->pool);
+    for (i = 0;map->parts && i < map->opts.nbthreads;i++){
+	votemap_destroy(map->parts[i]);
+    }
+    free(map->parts);
+    free(map->slots);
+    free(map->entries);
+    cands_free(&map->cands);
+    free(map);
+}
+
+void votemap_clear(VoteMap *map, int blocksize){
+    if (++map->stamp == 0){
+	memset(map->slots, 0, (map->mask + 1)*sizeof(VoteSlot));
+	map->stamp = 1;
+    }
+    map->nbids = 0;
+    map->nbentries = 0;
+    map->blocksize = (blocksize > 0) ? blocksize : 1;
+    map->best = map->second = -1;
+    map->best_score = map->second_score = 0.0f;
+    map->nbframes = 0;
+    map->verdict = VOTE_UNDECIDED;
+}
+
+/* slot of key, or the empty slot it goes in */
+static VoteSlot* find_slot(const VoteMap *map, VoteSlot *slots, uint32_t mask, uint64_t key){
+    uint32_t i = hash_key(key) & mask;
+    while (slots[i].stamp == map->stamp && map->entries[slots[i].entry].key != key){
+	i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+/* double the slots once half of them are in use */
+static int grow_slots(VoteMap *map){
+    uint32_t i, mask = 2*map->mask + 1;
+    VoteSlot *slots = (VoteSlot*)calloc((size_t)mask + 1, sizeof(VoteSlot));
+    if (slots == NULL) return -1;
+    for (i = 0;i <= map->mask;i++){
+	if (map->slots[i].stamp != map->stamp) continue;
+	VoteSlot *slot = find_slot(map, slots, mask, map->entries[map->slots[i].entry].key);
+	*slot = map->slots[i];
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->mask = mask;
+    return 0;
+}
+
+/* a new entry of one vote, not chained yet */
+static int64_t new_entry(VoteMap *map, uint64_t key, uint32_t id, uint32_t pos, int32_t offset){
+    if (map->nbentries == map->max_entries){
+	uint32_t size = 2*map->max_entries;
+	VoteEntry *entries = (VoteEntry*)realloc(map->entries, size*sizeof(VoteEntry));
+	if (entries == NULL) return -1;
+	map->entries = entries;
+	map->max_entries = size;
+    }
+    VoteEntry *e = &map->entries[map->nbentries];
+    e->key = key;
+    e->vote.id = id;
+    e->vote.count = 1;
+    e->vote.first_pos = pos;
+    e->vote.last_pos = pos;
+    e->vote.offset = offset;
+    e->next = 0;
+    e->tail = map->nbentries;
+    return map->nbentries++;
+}
+
+/* entry n got a vote: the first entry to reach a score keeps the lead, */
+/* and the runner up is only ever of another id                         */
+static void update_best(VoteMap *map, int64_t n){
+    float score = map->opts.score(&map->entries[n].vote, map->blocksize, map->opts.arg);
+    if (map->best >= 0 && map->entries[map->best].vote.id == map->entries[n].vote.id){
+	if (score > map->best_score){
+	    map->best = n;
+	    map->best_score = score;
+	}
+    } else if (map->best < 0 || score > map->best_score){
+	map->second = map->best;
+	map->second_score = map->best_score;
+	map->best = n;
+	map->best_score = score;
+    } else if (map->second < 0 || score > map->second_score){
+	map->second = n;
+	map->second_score = score;
+    }
+}
+
+/* the bin of pos - qpos, rounded down */
+static int32_t offset_bin(const VoteMap *map, uint32_t pos, uint32_t qpos){
+    int64_t offset = (int64_t)pos - (int64_t)qpos, width = map->opts.binwidth;
+    return (int32_t)((offset >= 0) ? offset/width : -((-offset + width - 1)/width));
+}
+
+int votemap_vote(VoteMap *map, uint32_t id, uint32_t pos, uint32_t qpos, uint32_t window){
+    int64_t n;
+    uint32_t i;
+    int32_t bin = 0;
+    uint64_t key = id;
+
+    if (map->opts.mode == AUDIO_VOTE_OFFSETS){
+	bin = offset_bin(map, pos, qpos);
+	key |= (uint64_t)(uint32_t)bin << 32;
+    }
+    if (2*(map->nbids + 1) > map->mask + 1 && grow_slots(map) < 0) return -1;
+    VoteSlot *slot = find_slot(map, map->slots, map->mask, key);
+    if (slot->stamp != map->stamp){
+	int32_t offset = (map->opts.mode == AUDIO_VOTE_OFFSETS) ?\
+	    bin*map->opts.binwidth : (int32_t)((int64_t)pos - (int64_t)qpos);
+	if ((n = new_entry(map, key, id, pos, offset)) < 0) return -1;
+	slot->stamp = map->stamp;
+	slot->entry = (uint32_t)n;
+	map->nbids++;
+    } else if (map->opts.mode == AUDIO_VOTE_OFFSETS){
+	AudioVote *v = &map->entries[slot->entry].vote;
+	v->count++;
+	if (pos < v->first_pos) v->first_pos = pos;
+	if (pos > v->last_pos) v->last_pos = pos;
+	n = slot->entry;
+    } else {
+	/* in order of creation, as each track only follows its own */
+	for (i = slot->entry + 1;i != 0;i = map->entries[i-1].next){
+	    AudioVote *v = &map->entries[i-1].vote;
+	    if (pos > v->last_pos && pos <= v->last_pos + window){
+		v->count++;
+		v->last_pos = pos;
+		break;
+	    }
+	}
+	if (i != 0){
+	    n = i - 1;
+	} else {
+	    uint32_t first = slot->entry;
+	    if ((n = new_entry(map, key, id, pos, (int32_t)((int64_t)pos - (int64_t)qpos))) < 0) return -1;
+	    map->entries[map->entries[first].tail].next = (uint32_t)n + 1;
+	    map->entries[first].tail = (uint32_t)n;
+	}
+    }
+    update_best(map, n);
+    return 0;
+}
+
+int votemap_merge(VoteMap *map, const VoteMap *src, uint32_t window){
+    int64_t n;
+    uint32_t i, t;
+
+    for (i = 0;i < src->nbentries;i++){
+	const VoteEntry *e = &src->entries[i];
+	if (2*(map->nbids + 1) > map->mask + 1 && grow_slots(map) < 0) return -1;
+	VoteSlot *slot = find_slot(map, map->slots, map->mask, e->key);
+	if (slot->stamp != map->stamp){
+	    if ((n = new_entry(map, e->key, e->vote.id, 0, 0)) < 0) return -1;
+	    map->entries[n].vote = e->vote;
+	    slot->stamp = map->stamp;
+	    slot->entry = (uint32_t)n;
+	    map->nbids++;
+	} else if (map->opts.mode == AUDIO_VOTE_OFFSETS){
+	    AudioVote *v = &map->entries[slot->entry].vote;
+	    v->count += e->vote.count;
+	    if (e->vote.first_pos < v->first_pos) v->first_pos = e->vote.first_pos;
+	    if (e->vote.last_pos > v->last_pos) v->last_pos = e->vote.last_pos;
+	    n = slot->entry;
+	} else {
+	    /* the first posting of the track goes where votemap_vote would put it */
+	    for (t = slot->entry + 1;t != 0;t = map->entries[t-1].next){
+		AudioVote *v = &map->entries[t-1].vote;
+		if (e->vote.first_pos > v->last_pos && e->vote.first_pos <= v->last_pos + window){
+		    v->count += e->vote.count;
+		    v->last_pos = e->vote.last_pos;
+		    break;
+		}
+	    }
+	    if (t != 0){
+		n = t - 1;
+	    } else {
+		uint32_t first = slot->entry;
+		if ((n = new_entry(map, e->key, e->vote.id, 0, 0)) < 0) return -1;
+		map->entries[n].vote = e->vote;
+		map->entries[map->entries[first].tail].next = (uint32_t)n + 1;
+		map->entries[first].tail = (uint32_t)n;
+	    }
+	}
+	update_best(map, n);
+    }
+    map->nbframes += src->nbframes;
+    return 0;
+}
+
+int votemap_top(const VoteMap *map, AudioVote *votes, int nbvotes){
+    float *scores;
+    uint32_t i;
+    int j, n = 0;
+
+    if (nbvotes <= 0) return 0;
+    scores = (float*)malloc(nbvotes*sizeof(float));
+    if (scores == NULL) return -1;
+    /* insertion into the sorted few kept, ties to the older entry */
+    for (i = 0;i < map->nbentries;i++){
+	float score = map->opts.score(&map->entries[i].vote, map->blocksize, map->opts.arg);
+	if (n == nbvotes && score <= scores[n-1]) continue;
+	j = (n < nbvotes) ? n++ : n - 1;
+	for (;j > 0 && scores[j-1] < score;j--){
+	    scores[j] = scores[j-1];
+	    votes[j] = votes[j-1];
+	}
+	scores[j] = score;
+	votes[j] = map->entries[i].vote;
+    }
+    free(scores);
+    return n;
+}
+
+int votemap_top_ids(const VoteMap *map, AudioMatch *matches, int nbmatches){
+    uint32_t i;
+    int j, n = 0;
+
+    for (i = 0;i < map->nbentries;i++){
+	const AudioVote *vote = &map->entries[i].vote;
+	float score = map->opts.score(vote, map->blocksize, map->opts.arg);
+	/* an id already kept moves up if this is a better entry of it */
+	for (j = 0;j < n && matches[j].id != vote->id;j++);
+	if (j < n){
+	    if (score <= matches[j].cs) continue;
+	} else {
+	    if (n == nbmatches && (n == 0 || score <= matches[n-1].cs)) continue;
+	    j = (n < nbmatches) ? n++ : n - 1;
+	}
+	for (;j > 0 && matches[j-1].cs < score;j--){
+	    matches[j] = matches[j-1];
+	}
+	matches[j].id = vote->id;
+	matches[j].cs = score;
+	matches[j].offset = vote->offset;
+    }
+    return n;
+}
+
+int votemap_frame_done(VoteMap *map){
+    float n, hits, p0, p1 = map->opts.hit_rate, llr;
+
+    map->nbframes++;
+    if (map->opts.sprt_error == 0.0f || map->verdict != VOTE_UNDECIDED) return map->verdict;
+    n = (float)map->nbframes;
+    hits = (map->best < 0) ? 0.0f : (float)map->entries[map->best].vote.count;
+    p0 = (map->second < 0) ? 0.0f : (float)map->entries[map->second].vote.count/n;
+    if (p0 < map->opts.background) p0 = map->opts.background;
+    /* a runner-up as good as a match leaves nothing to tell apart */
+    if (p1 <= p0 || p1 >= 1.0f || p0 >= 1.0f) return VOTE_UNDECIDED;
+    if (hits > n) hits = n;
+
+    llr = hits*logf(p1/p0) + (n - hits)*logf((1.0f - p1)/(1.0f - p0));
+    if (llr >= map->sprt_bound){
+	map->verdict = (map->best >= 0) ? VOTE_MATCH : VOTE_NO_MATCH;
+    } else if (llr <= -map->sprt_bound){
+	map->verdict = VOTE_NO_MATCH;
+    }
+    return map->verdict;
+}
@@ -0,0 +1,148 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the voting of lookups - not installed */
+
+#ifndef VOTES_H
+#define VOTES_H
+
+#include <stdint.h>
+#include "phash_audio.h"
+#include "candidates.h"
+#include "task_pool.h"
+
+/*
+ * Each posting a lookup reads votes for its id.  The votes of an id are
+ * kept in tracks: a posting goes to the first track of its id that it
+ * follows closely enough, or starts a new one.  Tracks are found through
+ * an open addressing map from id to the first track of the id, the other
+ * tracks of the id are chained from it.
+ *
+ * With AUDIO_VOTE_OFFSETS there are no tracks: a posting votes for its id at
+ * its offset from the query frame, and the map is from (id, offset bin) to
+ * the count of the bin.  Either way the map keeps the best entry and the
+ * best one of any other id, to tell how far ahead the best one is.
+ *
+ * The sequential test weighs the votes of the best entry over the frames
+ * read as coming either from a match, voting at the hit rate, or from
+ * chance, voting at the background rate or that of the runner-up.  The
+ * lookup stops once the log likelihood ratio of the two leaves the bounds
+ * of the error rate - above for a match, below for none, as no other entry
+ * has more votes than the best one.
+ *
+ * With opts.nbthreads above 1 the map keeps that many other maps and a pool
+ * of threads to vote into them, each for a run of the blocks of a query.
+ * They are merged back in the order of their runs: a track of a run joins
+ * the track of the same id it follows, as if the postings had been voted
+ * one after the other.
+ *
+ * A map is cleared by bumping the stamp of its slots rather than wiping
+ * them, so one map serves query after query at the cost of the ids each
+ * one touched.  The keys a lookup probes are kept with it for the same
+ * reason.
+ */
+
+#define VOTE_MIN_SLOT_BITS 10
+
+/* background rate of the sequential test if none is given */
+#define VOTE_DEFAULT_BACKGROUND 0.001f
+
+/* outcome of the sequential test */
+#define VOTE_UNDECIDED 0
+#define VOTE_MATCH     1
+#define VOTE_NO_MATCH -1
+
+typedef struct vote_entry_t {
+    AudioVote vote;
+    uint64_t key;                 /* id, and offset bin in the high bits */
+    uint32_t next;                /* next track of the id + 1, 0 for none */
+    uint32_t tail;                /* last track of the id, in the first one */
+} VoteEntry;
+
+typedef struct vote_slot_t {
+    uint32_t stamp;               /* slot in use if equal to the map stamp */
+    uint32_t entry;               /* first track of the id */
+} VoteSlot;
+
+typedef struct vote_map_t {
+    VoteSlot *slots;
+    uint32_t mask;                /* nb slots - 1 */
+    uint32_t stamp;
+    uint32_t nbids;               /* slots in use */
+    VoteEntry *entries;
+    uint32_t nbentries, max_entries;
+    AudioVoterOpts opts;          /* score filled in */
+    int blocksize;                /* of the current query, for score */
+    int64_t best;                 /* entry with the best score, -1 for none */
+    float best_score;
+    int64_t second;               /* best entry of any other id, -1 for none */
+    float second_score;
+    CandBatch cands;              /* keys of the block being looked up */
+    uint32_t nbframes;            /* query frames voted so far */
+    int verdict;                  /* VOTE_ value the lookup stopped on */
+    float sprt_bound;             /* log((1-error)/error) */
+    TaskPool *pool;               /* threads voting into parts, NULL for none */
+    struct vote_map_t **parts;    /* opts.nbthreads maps of runs of blocks */
+} VoteMap;
+
+/* new empty map voting as opts say, NULL for tracks scored by the */
+/* count of a track over the blocksize.  NULL on error              */
+VoteMap* votemap_create(const AudioVoterOpts *opts);
+
+void votemap_destroy(VoteMap *map);
+
+/* forget all votes, for a new query with blocksize */
+void votemap_clear(VoteMap *map, int blocksize);
+
+/* vote for id at pos read for query frame qpos, in the first track of */
+/* the id with its last pos before pos by at most window, or the bin of */
+/* pos - qpos with AUDIO_VOTE_OFFSETS.  0 on success, less than 0 on   */
+/* error                                                                */
+int votemap_vote(VoteMap *map, uint32_t id, uint32_t pos, uint32_t qpos, uint32_t window);
+
+/* add the votes of src, for the blocks following those voted in map, */
+/* tracks joining as in votemap_vote.  0 on success                    */
+int votemap_merge(VoteMap *map, const VoteMap *src, uint32_t window);
+
+/* the best entries, best first - one per bin or track.  return nb */
+/* filled in                                                       */
+int votemap_top(const VoteMap *map, AudioVote *votes, int nbvotes);
+
+/* the best ids, best first - each with the score and offset of its best */
+/* entry.  return nb filled in                                           */
+int votemap_top_ids(const VoteMap *map, AudioMatch *matches, int nbmatches);
+
+/* the best entry leads far enough to stop at the threshold */
+static inline int votemap_dominated(const VoteMap *map, float threshold){
+    return (map->opts.dominance > 0.0f && map->best >= 0 && map->best_score >= threshold &&\
+	    map->best_score >= map->opts.dominance*map->second_score);
+}
+
+/* the votes of another query frame are all in - run the sequential test */
+/* if there is one, return its VOTE_ value                                 */
+int votemap_frame_done(VoteMap *map);
+
+/* the track with the best score, NULL if there are no votes */
+static inline const AudioVote* votemap_best(const VoteMap *map){
+    return (map->best < 0) ? NULL : &map->entries[map->best].vote;
+}
+
+#endif /* VOTES_H */
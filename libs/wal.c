@@ -0,0 +1,444 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "wal.h"
+
+#define WAL_BUFSIZE (1<<16)
+
+/* share of a replay thread, every nbthreads'th record from n */
+typedef struct wal_replay_t {
+    const WalRecord **entries;
+    size_t nbentries;
+    int nbthreads;
+    int n;                                  /* this thread's share */
+    wal_insert_fn insert;
+    void *arg;
+    int err;
+} WalReplay;
+
+/* -1 rather than a truncated path when name is too long */
+static int wal_path(const char *name, uint32_t seqno, char *path){
+    int n = snprintf(path, FILENAME_MAX, "%s.wal.%08u", name, seqno);
+    return (n < 0 || n >= FILENAME_MAX) ? -1 : 0;
+}
+
+/* directory part of a path, "." if none */
+static void dir_of(const char *path, char *dir){
+    const char *sep = strrchr(path, '/');
+    if (sep == NULL){
+	snprintf(dir, FILENAME_MAX, ".");
+    } else if (sep == path){
+	snprintf(dir, FILENAME_MAX, "/");
+    } else {
+	snprintf(dir, FILENAME_MAX, "%.*s", (int)(sep - path), path);
+    }
+}
+
+static int sync_dir(const char *name){
+    char dir[FILENAME_MAX];
+    dir_of(name, dir);
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return -1;
+    int err = fsync(fd);
+    close(fd);
+    return err;
+}
+
+static int compare_seqnos(const void *a, const void *b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* seqnos of the log files of name, oldest first.  nb found, -1 on error */
+static int list_files(const char *name, uint32_t **seqnos){
+    char dir[FILENAME_MAX], prefix[FILENAME_MAX], *end;
+    struct dirent *entry;
+    int n = 0, max = 0;
+    const char *sep = strrchr(name, '/');
+
+    *seqnos = NULL;
+    dir_of(name, dir);
+    snprintf(prefix, FILENAME_MAX, "%s.wal.", (sep) ? sep + 1 : name);
+    size_t prefix_len = strlen(prefix);
+    DIR *d = opendir(dir);
+    if (d == NULL) return -1;
+    while ((entry = readdir(d)) != NULL){
+	if (strncmp(entry->d_name, prefix, prefix_len)) continue;
+	unsigned long seqno = strtoul(entry->d_name + prefix_len, &end, 10);
+	if (end == entry->d_name + prefix_len || *end != '\0') continue;
+	if (n == max){
+	    max = (max) ? 2*max : 16;
+	    uint32_t *tmp = (uint32_t*)realloc(*seqnos, max*sizeof(uint32_t));
+	    if (tmp == NULL){
+		closedir(d);
+		free(*seqnos);
+		*seqnos = NULL;
+		return -1;
+	    }
+	    *seqnos = tmp;
+	}
+	(*seqnos)[n++] = (uint32_t)seqno;
+    }
+    closedir(d);
+    qsort(*seqnos, n, sizeof(uint32_t), compare_seqnos);
+    return n;
+}
+
+static uint32_t record_check(uint32_t id, uint32_t nbframes, const uint32_t *hash){
+    uint32_t i, h = 2166136261u;
+    h = (h ^ id)*16777619u;
+    h = (h ^ nbframes)*16777619u;
+    for (i = 0;i < nbframes;i++){
+	h = (h ^ hash[i])*16777619u;
+    }
+    return h;
+}
+
+static void* replay_worker(void *arg){
+    WalReplay *r = (WalReplay*)arg;
+    size_t i;
+    for (i = r->n;i < r->nbentries;i += r->nbthreads){
+	const WalRecord *rec = r->entries[i];
+	if (r->insert(r->arg, rec->id, (const uint32_t*)(rec + 1), (int)rec->nbframes) < 0){
+	    r->err = -1;
+	    break;
+	}
+    }
+    return NULL;
+}
+
+/* find the whole records of a mapped file, add them to the entries */
+static int scan_file(const char *map, size_t size, const WalRecord ***entries, size_t *n, size_t *max){
+    size_t off = 0;
+    while (off + sizeof(WalRecord) <= size){
+	const WalRecord *rec = (const WalRecord*)(map + off);
+	size_t len = sizeof(WalRecord) + (size_t)rec->nbframes*sizeof(uint32_t);
+	if (rec->magic != WAL_MAGIC || off + len > size ||\
+	    rec->check != record_check(rec->id, rec->nbframes, (const uint32_t*)(rec + 1))){
+	    break;
+	}
+	if (*n == *max){
+	    *max = (*max) ? 2*(*max) : 1024;
+	    const WalRecord **tmp = (const WalRecord**)realloc(*entries, (*max)*sizeof(WalRecord*));
+	    if (tmp == NULL) return -1;
+	    *entries = tmp;
+	}
+	(*entries)[(*n)++] = rec;
+	off += len;
+    }
+    return 0;
+}
+
+/* replay the files in seqnos with nbthreads threads */
+static int replay(const char *name, uint32_t *seqnos, int nbfiles, int nbthreads,\
+		  wal_insert_fn insert, void *arg){
+    char path[FILENAME_MAX];
+    struct stat info;
+    const WalRecord **entries = NULL;
+    size_t nbentries = 0, maxentries = 0;
+    void **maps = (void**)calloc(nbfiles + 1, sizeof(void*));
+    size_t *sizes = (size_t*)calloc(nbfiles + 1, sizeof(size_t));
+    int i, err = 0;
+
+    if (maps == NULL || sizes == NULL) err = -1;
+    for (i = 0;i < nbfiles && err == 0;i++){
+	if (wal_path(name, seqnos[i], path) < 0){
+	    err = -1;
+	    break;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &info) < 0){
+	    if (fd >= 0) close(fd);
+	    err = -1;
+	    break;
+	}
+	if (info.st_size > 0){
+	    maps[i] = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (maps[i] == MAP_FAILED){
+		maps[i] = NULL;
+		err = -1;
+	    } else {
+		sizes[i] = info.st_size;
+		madvise(maps[i], sizes[i], MADV_SEQUENTIAL);
+		if (scan_file((const char*)maps[i], sizes[i], &entries, &nbentries, &maxentries) < 0) err = -1;
+	    }
+	}
+	close(fd);
+    }
+
+    if (err == 0 && nbentries > 0){
+	if (nbthreads < 1) nbthreads = 1;
+	pthread_t *threads = (pthread_t*)malloc(nbthreads*sizeof(pthread_t));
+	WalReplay *replays = (WalReplay*)calloc(nbthreads, sizeof(WalReplay));
+	int started = 0;
+	if (threads == NULL || replays == NULL) err = -1;
+	for (i = 0;i < nbthreads && err == 0;i++){
+	    replays[i].entries = entries;
+	    replays[i].nbentries = nbentries;
+	    replays[i].nbthreads = nbthreads;
+	    replays[i].n = i;
+	    replays[i].insert = insert;
+	    replays[i].arg = arg;
+	}
+	for (i = 0;i < nbthreads && err == 0;i++){
+	    if (pthread_create(&threads[started], NULL, replay_worker, &replays[i])){
+		/* no thread for this share, do it here */
+		replay_worker(&replays[i]);
+		continue;
+	    }
+	    started++;
+	}
+	for (i = 0;i < started;i++){
+	    pthread_join(threads[i], NULL);
+	}
+	for (i = 0;i < nbthreads && err == 0 && replays;i++){
+	    if (replays[i].err < 0) err = -2;
+	}
+	free(threads);
+	free(replays);
+    }
+
+    for (i = 0;i < nbfiles && maps;i++){
+	if (maps[i]) munmap(maps[i], sizes[i]);
+    }
+    free(maps);
+    free(sizes);
+    free(entries);
+    return err;
+}
+
+/* open the file seqno to append to */
+static int open_file(Wal *wal, uint32_t seqno){
+    char path[FILENAME_MAX];
+    if (wal_path(wal->name, seqno, path) < 0) return -1;
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+    if (fd < 0) return -1;
+    if (sync_dir(wal->name) < 0){
+	close(fd);
+	return -1;
+    }
+    wal->fd = fd;
+    wal->seqno = seqno;
+    return 0;
+}
+
+Wal* wal_open(const char *name, int nbthreads, wal_insert_fn insert, void *arg){
+    uint32_t *seqnos = NULL;
+    char path[FILENAME_MAX];
+    if (name == NULL || wal_path(name, UINT32_MAX, path) < 0) return NULL;
+
+    int nbfiles = list_files(name, &seqnos);
+    if (nbfiles < 0) return NULL;
+    if (nbfiles > 0 && insert && replay(name, seqnos, nbfiles, nbthreads, insert, arg) < 0){
+	free(seqnos);
+	return NULL;
+    }
+
+    Wal *wal = (Wal*)calloc(1, sizeof(Wal));
+    if (wal == NULL){
+	free(seqnos);
+	return NULL;
+    }
+    snprintf(wal->name, FILENAME_MAX, "%s", name);
+    wal->buf = (char*)malloc(WAL_BUFSIZE);
+    wal->spare = (char*)malloc(WAL_BUFSIZE);
+    wal->size = wal->spare_size = WAL_BUFSIZE;
+    uint32_t seqno = (nbfiles > 0) ? seqnos[nbfiles-1] + 1 : 0;
+    free(seqnos);
+    if (wal->buf == NULL || wal->spare == NULL || open_file(wal, seqno) < 0){
+	free(wal->buf);
+	free(wal->spare);
+	free(wal);
+	return NULL;
+    }
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->cond, NULL);
+    return wal;
+}
+
+static int write_all(int fd, const char *buf, size_t len){
+    while (len > 0){
+	ssize_t n = write(fd, buf, len);
+	if (n <= 0) return -1;
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* write out and sync the buffer, called with the mutex held and not */
+/* writing.  the mutex is let go of for the io, so appends go on into  */
+/* the spare buffer                                                   */
+static void write_batch(Wal *wal){
+    char *buf = wal->buf;
+    size_t len = wal->len, size = wal->size;
+    uint64_t upto = wal->appended;
+    int fd = wal->fd, err;
+
+    wal->buf = wal->spare;
+    wal->size = wal->spare_size;
+    wal->len = 0;
+    wal->writing = 1;
+    pthread_mutex_unlock(&wal->mutex);
+
+    err = write_all(fd, buf, len);
+    if (err == 0) err = fdatasync(fd);
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->spare = buf;
+    wal->spare_size = size;
+    wal->writing = 0;
+    if (err < 0){
+	wal->error = 1;
+    } else {
+	wal->durable = upto;
+    }
+    pthread_cond_broadcast(&wal->cond);
+}
+
+/* wait until everything appended so far is written, mutex held */
+static void drain(Wal *wal){
+    while (!wal->error && (wal->writing || wal->len > 0)){
+	if (wal->writing){
+	    pthread_cond_wait(&wal->cond, &wal->mutex);
+	} else {
+	    write_batch(wal);
+	}
+    }
+}
+
+int wal_append(Wal *wal, uint32_t id, const uint32_t *hash, int nbframes){
+    WalRecord rec;
+    size_t len = sizeof(WalRecord) + (size_t)nbframes*sizeof(uint32_t);
+    int ret;
+
+    if (wal == NULL || nbframes < 0) return -1;
+    rec.magic = WAL_MAGIC;
+    rec.id = id;
+    rec.nbframes = (uint32_t)nbframes;
+    rec.check = record_check(id, rec.nbframes, hash);
+
+    pthread_mutex_lock(&wal->mutex);
+    if (wal->error){
+	pthread_mutex_unlock(&wal->mutex);
+	return -2;
+    }
+    if (wal->len + len > wal->size){
+	size_t size = 2*wal->size;
+	while (size < wal->len + len) size *= 2;
+	char *tmp = (char*)realloc(wal->buf, size);
+	if (tmp == NULL){
+	    pthread_mutex_unlock(&wal->mutex);
+	    return -3;
+	}
+	wal->buf = tmp;
+	wal->size = size;
+    }
+    memcpy(wal->buf + wal->len, &rec, sizeof(WalRecord));
+    memcpy(wal->buf + wal->len + sizeof(WalRecord), hash, len - sizeof(WalRecord));
+    wal->len += len;
+    uint64_t lsn = ++wal->appended;
+
+    /* the first one in writes the batch, the rest wait for it */
+    while (wal->durable < lsn && !wal->error){
+	if (wal->writing){
+	    pthread_cond_wait(&wal->cond, &wal->mutex);
+	} else {
+	    write_batch(wal);
+	}
+    }
+    ret = (wal->durable >= lsn) ? 0 : -4;
+    pthread_mutex_unlock(&wal->mutex);
+    return ret;
+}
+
+int wal_rotate(Wal *wal, uint32_t *upto){
+    int ret = 0;
+    if (wal == NULL) return -1;
+    pthread_mutex_lock(&wal->mutex);
+    drain(wal);
+    int fd = wal->fd;
+    uint32_t seqno = wal->seqno;
+    if (open_file(wal, seqno + 1) < 0){
+	ret = -2;
+    } else {
+	close(fd);
+	/* a failed write only spoils the old file, the appends */
+	/* it left behind were all failed                       */
+	wal->error = 0;
+	wal->len = 0;
+	wal->durable = wal->appended;
+	*upto = seqno;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return ret;
+}
+
+int wal_trim(Wal *wal, uint32_t upto){
+    char path[FILENAME_MAX];
+    uint32_t *seqnos = NULL;
+    int i, n, err = 0;
+    if (wal == NULL) return -1;
+    n = list_files(wal->name, &seqnos);
+    if (n < 0) return -2;
+    for (i = 0;i < n;i++){
+	if (seqnos[i] > upto || seqnos[i] == wal->seqno) continue;
+	if (wal_path(wal->name, seqnos[i], path) < 0){
+	    err = -4;
+	    continue;
+	}
+	unlink(path);
+    }
+    free(seqnos);
+    if (sync_dir(wal->name) < 0) return -3;
+    return err;
+}
+
+int wal_close(Wal *wal, int trim){
+    int err = 0;
+    if (wal == NULL) return -1;
+    pthread_mutex_lock(&wal->mutex);
+    drain(wal);
+    if (wal->error) err = -2;
+    pthread_mutex_unlock(&wal->mutex);
+    close(wal->fd);
+    if (trim){
+	/* the current file too */
+	char path[FILENAME_MAX];
+	if (wal_trim(wal, wal->seqno) < 0) err = -3;
+	if (wal_path(wal->name, wal->seqno, path) == 0) unlink(path);
+    }
+    pthread_cond_destroy(&wal->cond);
+    pthread_mutex_destroy(&wal->mutex);
+    free(wal->buf);
+    free(wal->spare);
+    free(wal);
+    return err;
+}
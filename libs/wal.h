@@ -0,0 +1,96 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* local definitions for the write-ahead log of inserts - not installed */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Inserts into an in-memory index are appended to a log before they are made,
+ * so they can be replayed after a crash.  The log is a series of files
+ * <name>.wal.<seqno>, each a run of records: a WalRecord followed by nbframes
+ * hash words.  A record that does not add up - the tail of a write cut short
+ * by the crash - ends the replay of its file.
+ *
+ * Commits are grouped: an append adds its record to a buffer and waits for it
+ * to be on disk.  The first waiter writes out the whole buffer and syncs it,
+ * and the appends that came in meanwhile go in the next buffer, so there is one
+ * fdatasync per batch however many threads are appending.
+ *
+ * Once what the index held has been written out some other way the log is cut:
+ * wal_rotate starts a new file and returns the seqno of the last old one, and
+ * after the write wal_trim removes the files up to it.  An insert that lands in
+ * the new file while it was made in the old index is replayed a second time
+ * after a crash, which is harmless - the other way around cannot happen as long
+ * as the log is rotated before the new index is put in place.
+ */
+
+#define WAL_MAGIC 0x4c415741                /* "AWAL" */
+
+typedef struct wal_record_t {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t nbframes;
+    uint32_t check;                         /* of id, nbframes and the hash words */
+} WalRecord;
+
+typedef struct wal_t {
+    char name[FILENAME_MAX];
+    uint32_t seqno;                         /* of the file being appended to */
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                    /* a batch is on disk */
+    char *buf;                              /* records not written yet */
+    size_t len, size;
+    char *spare;                            /* buffer swapped in while one is written */
+    size_t spare_size;
+    uint64_t appended;                      /* nb records appended */
+    uint64_t durable;                       /* nb records on disk */
+    int writing;                            /* a thread is writing a batch */
+    int error;                              /* a write failed, the log is unusable */
+} Wal;
+
+/* callback of wal_open replaying a record, called from many threads at once */
+typedef int (*wal_insert_fn)(void *arg, uint32_t id, const uint32_t *hash, int nbframes);
+
+/* replay the log files of name with nbthreads threads, then start a new */
+/* file after them.  the old files are kept until trimmed.  NULL on error */
+Wal* wal_open(const char *name, int nbthreads, wal_insert_fn insert, void *arg);
+
+/* append a record and return once it is on disk, 0 on success */
+int wal_append(Wal *wal, uint32_t id, const uint32_t *hash, int nbframes);
+
+/* finish the current file and start a new one, *upto set to the seqno */
+/* of the finished file.  0 on success                                 */
+int wal_rotate(Wal *wal, uint32_t *upto);
+
+/* remove the files up to and including seqno upto */
+int wal_trim(Wal *wal, uint32_t upto);
+
+/* close the log, and remove all its files if trim */
+int wal_close(Wal *wal, int trim);
+
+#endif /* WAL_H */
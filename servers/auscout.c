@@ -44,6 +44,7 @@
 #define LOG_IDENT  "auscoutd"
 #define LOCKFILE "auscout.lock"
 #define MAX_TABLES 255
+#define MAX_MATCHES 64      /* most results a query can ask for */
 
 #define WAIT_TIME_SECONDS 5
 #define INPROC_REQUEST_ADDRESS  "inproc://querys"
@@ -306,21 +307,88 @@ void* do_forward(void *arg){
 }
 
 
+/* a match as the tables send it: id, cs and offset in network order */
+typedef struct match_t {
+    uint32_t id;
+    float cs;
+    int32_t offset;
+} Match;
+
+/* read the matches of a results msg, return nb read - less than 0 if there */
+/* is no msg yet                                                             */
+static int recv_matches(void *skt, Match *matches, int nbmatches){
+    uint32_t wire[3];
+    int i, n;
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_recvmsg(skt, &msg, ZMQ_NOBLOCK) < 0){
+	zmq_msg_close(&msg);
+	return -1;
+    }
+    n = zmq_msg_size(&msg)/sizeof(wire);
+    if (n > nbmatches) n = nbmatches;
+    for (i = 0;i < n;i++){
+	memcpy(wire, (char*)zmq_msg_data(&msg) + i*sizeof(wire), sizeof(wire));
+	matches[i].id = nettohost32(wire[0]);
+	memcpy(&matches[i].cs, &wire[1], sizeof(float));
+	matches[i].cs = nettohostf(matches[i].cs);
+	matches[i].offset = (int32_t)nettohost32(wire[2]);
+    }
+    zmq_msg_close(&msg);
+    return n;
+}
+
+/* add match to the n best kept, best first and one per id.  return the */
+/* new nb kept                                                           */
+static int merge_match(Match *matches, int n, int nbmatches, const Match *match){
+    int i;
+    for (i = 0;i < n && matches[i].id != match->id;i++);
+    if (i < n){
+	if (match->cs <= matches[i].cs) return n;
+    } else {
+	if (n == nbmatches && (n == 0 || match->cs <= matches[n-1].cs)) return n;
+	i = (n < nbmatches) ? n++ : n - 1;
+    }
+    for (;i > 0 && matches[i-1].cs < match->cs;i--){
+	matches[i] = matches[i-1];
+    }
+    matches[i] = *match;
+    return n;
+}
+
+/* wait for the first match */
 int waitresults(void *skt, uint32_t *id){
-    int err = 0;
+    Match match;
+    int n;
     time_t curr;
     time(&curr);
 
     *id = 0;
-    zmq_msg_t msg;
-    zmq_msg_init(&msg);
     do {
-	err = zmq_recvmsg(skt, &msg, ZMQ_NOBLOCK);
-    } while (err && time(NULL) < curr + WAIT_TIME_SECONDS);
-    if (err == 0) memcpy(id, zmq_msg_data(&msg), sizeof(uint32_t));
-    zmq_msg_close(&msg);
+	n = recv_matches(skt, &match, 1);
+    } while (n <= 0 && time(NULL) < curr + WAIT_TIME_SECONDS);
+    if (n > 0) *id = match.id;
+
+    return (n > 0) ? 0 : -1;
+}
+
+/* wait for the matches of nbreplies tables and merge them, return the nb */
+/* of matches kept                                                         */
+static int waitmatches(void *skt, int nbreplies, Match *matches, int nbmatches){
+    Match recvd[MAX_MATCHES];
+    int i, n = 0, nbrecvd, count = 0;
+    time_t curr;
+    time(&curr);
 
-    return err;
+    while (count < nbreplies && time(NULL) < curr + WAIT_TIME_SECONDS){
+	nbrecvd = recv_matches(skt, recvd, MAX_MATCHES);
+	if (nbrecvd < 0) continue;
+	for (i = 0;i < nbrecvd;i++){
+	    n = merge_match(matches, n, nbmatches, &recvd[i]);
+	}
+	count++;
+    }
+    return n;
 }
 
 int select_table(){
@@ -334,9 +402,39 @@ int select_table(){
     return table_n;
 }
 
+/* reply to a query for a number of matches: the nb of matches, then the */
+/* metadata, cs and offset of each                                         */
+static void send_matches(void *qskt, AudioDataDB mdata_db, Match *matches, int nbmatches){
+    uint32_t snb = hosttonet32((uint32_t)nbmatches), soffset;
+    char *mdata_inline;
+    float cs;
+    int i;
+
+    if (nbmatches == 0){
+	send_msg_vsm(qskt, &snb, sizeof(uint32_t));
+	return;
+    }
+    sendmore_msg_vsm(qskt, &snb, sizeof(uint32_t));
+    for (i = 0;i < nbmatches;i++){
+	mdata_inline = retrieve_audiodata(mdata_db, matches[i].id);
+	if (mdata_inline == NULL) mdata_inline = strdup(null_str);
+	cs = hosttonetf(matches[i].cs);
+	soffset = hosttonet32((uint32_t)matches[i].offset);
+	sendmore_msg_data(qskt, mdata_inline, strlen(mdata_inline)+1, free_fn, NULL);
+	sendmore_msg_vsm(qskt, &cs, sizeof(float));
+	if (i < nbmatches - 1){
+	    sendmore_msg_vsm(qskt, &soffset, sizeof(uint32_t));
+	} else {
+	    send_msg_vsm(qskt, &soffset, sizeof(uint32_t));
+	}
+    }
+}
+
 int handle_request(uint8_t thrn, void *qskt, void *pushskt, void *rskt, AudioDataDB mdata_db){
-    uint8_t cmd, table_n, perms;
-    uint32_t nb, nb_local, id, sid;
+    uint8_t cmd, query_cmd = 1, table_n, perms;
+    uint32_t nb, nb_local, id, sid, nbwanted = 0;
+    Match matches[MAX_MATCHES];
+    int nbmatches, nbreplies;
     int64_t more;
     size_t more_size = sizeof(int64_t);
     size_t msg_size;
@@ -374,11 +472,35 @@ int handle_request(uint8_t thrn, void *qskt, void *pushskt, void *rskt, AudioDat
     nb_local = nettohost32(nb);
 
     switch (cmd) {
+    case 4:
+	/* query for the best nbwanted matches, nbwanted before the hash */
+	recieve_msg(qskt, &msg_size, &more, &more_size, (void**)&data);
+	if (msg_size != sizeof(uint32_t) || !more){
+	    syslog(LOG_DEBUG,"WORKER%d: inconsistent nb matches msg size=%ld", thrn, msg_size);
+	    flushall_msg_parts(qskt);
+	    free(data);
+	    send_empty_msg(qskt);
+	    return -1;
+	}
+	memcpy(&nbwanted, data, sizeof(uint32_t));
+	free(data);
+	nbwanted = nettohost32(nbwanted);
+	if (nbwanted < 1) nbwanted = 1;
+	if (nbwanted > MAX_MATCHES) nbwanted = MAX_MATCHES;
+	/* fall through */
     case 1:
+	/* the tables are sent the nb of matches wanted in place of the id, */
+	/* 0 for a plain query.  each of them answers a query for matches   */
+	id = hosttonet32(nbwanted);
+	nbreplies = nb_tables;
+
+	/* drop the results of earlier queries that came in too late */
+	while (recv_matches(rskt, matches, MAX_MATCHES) >= 0);
+
 	/* send topic, cmd, nb */
 	topic_str = strdup(query_topic);
 	sendmore_msg_data(pushskt, topic_str , strlen(topic_str), free_fn, NULL);
-	sendmore_msg_vsm(pushskt, &cmd, sizeof(uint8_t));
+	sendmore_msg_vsm(pushskt, &query_cmd, sizeof(uint8_t));
 	sendmore_msg_vsm(pushskt, &nb, sizeof(uint32_t));
 	
 	/* recieve and send hash msg */
@@ -410,6 +532,12 @@ int handle_request(uint8_t thrn, void *qskt, void *pushskt, void *rskt, AudioDat
 	    send_msg_vsm(pushskt, &id, sizeof(uint32_t));
 	    syslog(LOG_DEBUG,"WORKER%d: thrn=%u,id=%u", thrn, id);
 	}
+	if (cmd == 4){
+	    nbmatches = waitmatches(rskt, nbreplies, matches, nbwanted);
+	    syslog(LOG_DEBUG,"WORKER%d: %d matches", thrn, nbmatches);
+	    send_matches(qskt, mdata_db, matches, nbmatches);
+	    break;
+	}
 	waitresults(rskt, &id);
 	
 	/* retrieve metadata */
@@ -462,6 +590,34 @@ int handle_request(uint8_t thrn, void *qskt, void *pushskt, void *rskt, AudioDat
 	syslog(LOG_DEBUG,"WORKER%d: send reply, id = %u", thrn, id);
 	send_msg_vsm(qskt, &sid, sizeof(uint32_t));
 	break;
+    case 3:
+	/* delete by id - every table is sent it, the id may be in any of them */
+	recieve_msg(qskt, &msg_size, &more, &more_size, (void**)&data);
+	sid = 0;
+	if (msg_size == sizeof(uint32_t)){
+	    memcpy(&sid, data, sizeof(uint32_t));
+	    id = nettohost32(sid);
+
+	    /* send topic, cmd, no frames, empty hash, table, id */
+	    nb = 0;
+	    topic_str = strdup(submit_topic);
+	    sendmore_msg_data(pushskt, topic_str, strlen(topic_str), free_fn, NULL);
+	    sendmore_msg_vsm(pushskt, &cmd, sizeof(uint8_t));
+	    sendmore_msg_vsm(pushskt, &nb, sizeof(uint32_t));
+	    sendmore_msg_vsm(pushskt, &nb, 0);
+	    sendmore_msg_vsm(pushskt, &table_n, sizeof(uint8_t));
+	    send_msg_vsm(pushskt, &sid, sizeof(uint32_t));
+	    syslog(LOG_DEBUG,"WORKER%d: delete id = %u", thrn, id);
+	} else {
+	    syslog(LOG_DEBUG,"WORKER%d: inconsistent id msg size=%ld", thrn, msg_size);
+	}
+	free(data);
+	if (more) flushall_msg_parts(qskt);
+
+	/* send id reply once the delete is forwarded - the tables do not ack it, */
+	/* so it says nothing of whether any had the id.  0 for a bad request    */
+	send_msg_vsm(qskt, &sid, sizeof(uint32_t));
+	break;
     default:
 	syslog(LOG_DEBUG,"WORKER%d: unrecognized cmd, %u", thrn, cmd);
 	flushall_msg_parts(qskt);
@@ -554,9 +710,10 @@ void result_listener(void *arg){
 	}
     }
 
-    uint32_t uid;
+    uint32_t uid, matches[3*MAX_MATCHES];
     uint8_t thrnum;
-    float cs;
+    int nbmatches, nbrecvd;
+    float cs, match_cs;
     double cs_double;
     int64_t more;
     size_t msg_size, more_size = sizeof(int64_t);
@@ -599,23 +756,46 @@ void result_listener(void *arg){
 	    free(data);
 	    continue;
 	}
-
-	if (more)flushall_msg_parts(skt);
-
 	memcpy(&cs, data, sizeof(float));
 	free(data);
 	cs_double = cs = nettohostf(cs);
 
-	syslog(LOG_DEBUG,"RESULTLISTENER: thrn=%u, uid=%u,cs=%f",thrnum,uid,cs);
+	/* the list of all the matches, in the same form as they go to the */
+	/* thread - a table that sends none only sends the best one         */
+	nbmatches = 0;
+	if (more){
+	    recieve_msg(skt, &msg_size, &more, &more_size, &data);
+	    nbrecvd = msg_size/(3*sizeof(uint32_t));
+	    for (i = 0;i < nbrecvd && i < MAX_MATCHES;i++){
+		memcpy(&matches[3*nbmatches], (char*)data + 3*i*sizeof(uint32_t), 3*sizeof(uint32_t));
+		memcpy(&match_cs, &matches[3*nbmatches+1], sizeof(float));
+		if (nettohostf(match_cs) >= GlobalArgs.threshold) nbmatches++;
+	    }
+	    free(data);
+	    if (more) flushall_msg_parts(skt);
+	} else {
+	    nbrecvd = -1;
+	    if (cs >= GlobalArgs.threshold){
+		match_cs = hosttonetf(cs);
+		matches[0] = hosttonet32(uid);
+		memcpy(&matches[1], &match_cs, sizeof(float));
+		matches[2] = 0;
+		nbmatches = 1;
+	    }
+	}
+
+	syslog(LOG_DEBUG,"RESULTLISTENER: thrn=%u, uid=%u,cs=%f,%d matches",thrnum,uid,cs,nbmatches);
 	
 	/* send response */ 
 	tmpstr = strdup(resp_str);
 	send_msg_data(skt, tmpstr, strlen(tmpstr)+1, free_fn, NULL);
 
-	if (cs >= GlobalArgs.threshold){
+	/* a query for a number of matches waits for every table, even */
+	/* those with none                                              */
+	if (nbmatches > 0 || nbrecvd >= 0){
 	    /* send result through proper thrn pipe */ 
-	    syslog(LOG_DEBUG,"RESULTLISTENER: send uid=%u to %u thread", uid, thrnum);
-	    send_msg_vsm(rskts[thrnum], &uid, sizeof(uint32_t));
+	    syslog(LOG_DEBUG,"RESULTLISTENER: send %d matches to %u thread", nbmatches, thrnum);
+	    send_msg_vsm(rskts[thrnum], matches, 3*nbmatches*sizeof(uint32_t));
 	}
     }
 
@@ -28,8 +28,11 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <getopt.h>
 #include <syslog.h>
@@ -46,10 +49,17 @@
 #define MAX_INDEX_FILE_SIZE 65
 #define INPROC_PIPE "inproc://pipe"
 #define NB_BUCKETS_TABLE_SIZE (1<<25)
-#define NB_BUCKETS_TMP_TABLE_SIZE (1<<20)
-#define TIME_WAIT_FOR_TMP_INDEX (10*60)
-
-static const char *opt_string = "w:l:s:i:p:b:t:n:vh?";
+#define NB_BUCKETS_TMP_TABLE_SIZE (1<<20)      /* starting size, the live index grows */
+#define TIME_WAIT_FOR_TMP_INDEX (10*60)          /* default secs between merges of tmp into main */
+#define NB_POSTINGS_TMP_INDEX_MERGE (1<<24)      /* default size of tmp that starts a merge */
+#define MAX_MATCHES 64                           /* most results a query can ask for */
+#define MAX_OPT_THREADS 1024                     /* most threads -W and -Q take */
+#define MAX_NUMA_NODE 1023                       /* highest node -N takes */
+#define MAX_BINWIDTH (1<<16)                     /* widest offset bin -O takes, in frames */
+#define VERIFY_SLACK 2                           /* frames off its offset a match is checked at, */
+                                                 /* on top of the width of an offset bin         */
+
+static const char *opt_string = "w:l:s:i:p:b:t:n:H:N:W:LT:M:S:D:O:E:R:F:X:Q:V:vh?";
 static const char *init_str = "INIT";
 static const char *kill_str = "KILL";
 
@@ -62,6 +72,21 @@ static const struct option longOpts[] = {
     { "blocksize", required_argument, NULL, 'b'   },
     { "threshold", required_argument, NULL, 't'   },
     { "threads", required_argument, NULL, 'n'     },
+    { "pages", required_argument, NULL, 'H'       },
+    { "numa", required_argument, NULL, 'N'        },
+    { "warmup", required_argument, NULL, 'W'      },
+    { "lock", no_argument, NULL, 'L'              },
+    { "merge-time", required_argument, NULL, 'T'  },
+    { "merge-size", required_argument, NULL, 'M'  },
+    { "segments", required_argument, NULL, 'S'    },
+    { "snapshots", required_argument, NULL, 'D'   },
+    { "offsets", required_argument, NULL, 'O'     },
+    { "dominance", required_argument, NULL, 'E'   },
+    { "sprt", required_argument, NULL, 'R'        },
+    { "hit-rate", required_argument, NULL, 'F'    },
+    { "max-df", required_argument, NULL, 'X'      },
+    { "query-threads", required_argument, NULL, 'Q' },
+    { "max-ber", required_argument, NULL, 'V'      },
     { "verbose", no_argument, NULL, 'v'           },
     { "help", no_argument, NULL, 'h'              },
     { NULL, no_argument, NULL, 0                  }
@@ -76,6 +101,15 @@ struct globalargs_t {
     int blocksize;         /* block size for lookup on hash */
     float threshold;       /* threshold for look up comparisons */
     int nbthreads;         /* number worker threads to service incoming queries */
+    AudioIndexOpts index_opts; /* placement of the main index */
+    int warmup_threads;    /* threads to fault the main index in with, 0 for none */
+    int lockflag;          /* lock the main index in memory */
+    int merge_time;        /* secs between merges of the tmp index into main, 0 for none */
+    int merge_size;        /* nb postings in the tmp index that starts a merge, 0 for none */
+    int memtable_size;     /* keep submissions in segments, with memtables this big, 0 for none */
+    char *snapshot_dir;    /* dir to put snapshots in on SIGWINCH, NULL for none */
+    AudioVoterOpts voter_opts; /* how lookups vote */
+    float max_ber;         /* bit error rate a match is checked against, 0 for none */
     int verboseflag;
     int helpflag;
 } GlobalArgs;
@@ -89,10 +123,50 @@ void init_options(){
     GlobalArgs.blocksize = 128; 
     GlobalArgs.threshold = 0.050; 
     GlobalArgs.nbthreads = 60;
+    GlobalArgs.index_opts.pages = INDEX_PAGES_DEFAULT;
+    GlobalArgs.index_opts.numa_node = INDEX_NUMA_NONE;
+    GlobalArgs.warmup_threads = 0;
+    GlobalArgs.lockflag = 0;
+    GlobalArgs.merge_time = TIME_WAIT_FOR_TMP_INDEX;
+    GlobalArgs.merge_size = NB_POSTINGS_TMP_INDEX_MERGE;
+    GlobalArgs.memtable_size = 0;
+    GlobalArgs.snapshot_dir = NULL;
+    memset(&GlobalArgs.voter_opts, 0, sizeof(AudioVoterOpts));
+    GlobalArgs.voter_opts.mode = AUDIO_VOTE_TRACKS;
+    GlobalArgs.voter_opts.hit_rate = 0.1f;
+    GlobalArgs.max_ber = 0.0f;
     GlobalArgs.verboseflag = 0;
     GlobalArgs.helpflag = 0;
 }
 
+void tableserver_usage();
+
+/* an option value that does not parse whole or is out of range stops the */
+/* server with the usage text, rather than run it with some other value   */
+static void bad_option(char opt, const char *arg){
+    fprintf(stderr,"bad value for -%c: %s\n\n", opt, arg);
+    tableserver_usage();
+    exit(1);
+}
+
+static int int_option(char opt, const char *arg, long min, long max){
+    char *end;
+    errno = 0;
+    long val = strtol(arg, &end, 10);
+    if (errno || end == arg || *end != '\0' || val < min || val > max) bad_option(opt, arg);
+    return (int)val;
+}
+
+static float float_option(char opt, const char *arg, double min, double max){
+    char *end;
+    errno = 0;
+    double val = strtod(arg, &end);
+    if (errno || end == arg || *end != '\0' || !isfinite(val) || val < min || val > max){
+	bad_option(opt, arg);
+    }
+    return (float)val;
+}
+
 void parse_options(int argc, char **argv){
     int longIndex;
     char opt = getopt_long(argc, argv,opt_string, longOpts, &longIndex);
@@ -125,6 +199,63 @@ void parse_options(int argc, char **argv){
 	case 'n':
 	    GlobalArgs.nbthreads = atoi(optarg);
 	    break;
+	case 'H':
+	    GlobalArgs.index_opts.pages = int_option(opt, optarg, INDEX_PAGES_DEFAULT, INDEX_PAGES_HUGE_1GB);
+	    break;
+	case 'N':
+	    if (!strcmp(optarg, "interleave")){
+		GlobalArgs.index_opts.numa_node = INDEX_NUMA_INTERLEAVE;
+	    } else {
+		GlobalArgs.index_opts.numa_node = int_option(opt, optarg, 0, MAX_NUMA_NODE);
+	    }
+	    break;
+	case 'W':
+	    GlobalArgs.warmup_threads = int_option(opt, optarg, 0, MAX_OPT_THREADS);
+	    break;
+	case 'L':
+	    GlobalArgs.lockflag = 1;
+	    break;
+	case 'T':
+	    GlobalArgs.merge_time = int_option(opt, optarg, 0, INT_MAX);
+	    break;
+	case 'M':
+	    GlobalArgs.merge_size = int_option(opt, optarg, 0, INT_MAX);
+	    break;
+	case 'S':
+	    GlobalArgs.memtable_size = int_option(opt, optarg, 0, INT_MAX);
+	    break;
+	case 'D':
+	    /* room left for the snapshot names under it */
+	    if (optarg[0] == '\0' || strlen(optarg) + 64 >= FILENAME_MAX) bad_option(opt, optarg);
+	    GlobalArgs.snapshot_dir = optarg;
+	    break;
+	case 'O':
+	    GlobalArgs.voter_opts.mode = AUDIO_VOTE_OFFSETS;
+	    GlobalArgs.voter_opts.binwidth = int_option(opt, optarg, 1, MAX_BINWIDTH);
+	    break;
+	case 'E':
+	    /* off, or a ratio over any other id */
+	    GlobalArgs.voter_opts.dominance = float_option(opt, optarg, 0.0, 1e6);
+	    if (GlobalArgs.voter_opts.dominance > 0.0f && GlobalArgs.voter_opts.dominance < 1.0f){
+		bad_option(opt, optarg);
+	    }
+	    break;
+	case 'R':
+	    GlobalArgs.voter_opts.sprt_error = float_option(opt, optarg, 0.0, 0.49);
+	    break;
+	case 'F':
+	    GlobalArgs.voter_opts.hit_rate = float_option(opt, optarg, 0.0, 1.0);
+	    if (GlobalArgs.voter_opts.hit_rate == 0.0f) bad_option(opt, optarg);
+	    break;
+	case 'X':
+	    GlobalArgs.voter_opts.max_df = float_option(opt, optarg, 0.0, 1.0);
+	    break;
+	case 'Q':
+	    GlobalArgs.voter_opts.nbthreads = int_option(opt, optarg, 0, MAX_OPT_THREADS);
+	    break;
+	case 'V':
+	    GlobalArgs.max_ber = float_option(opt, optarg, 0.0, 0.5);
+	    break;
 	case 'h' :
 	    GlobalArgs.helpflag = 1;
 	    break;
@@ -152,6 +283,45 @@ void tableserver_usage(){
     fprintf(stdout," -t <threshold>          threshold for performing lookup, default 0.050\n");
     fprintf(stdout," -n <threads>            number of worker threads, default is 60\n");
     fprintf(stdout," -i <index name>         path and name of index file - mandatory\n");
+    fprintf(stdout," -H <page mode>          memory for the index: 0 mmap (default), 1 mmap with huge pages,\n");
+    fprintf(stdout,"                         2 copy with huge pages, 3 copy into 2MB hugetlb, 4 copy into 1GB hugetlb\n");
+    fprintf(stdout," -N <node|interleave>    bind the index to a NUMA node and pin the workers to it,\n");
+    fprintf(stdout,"                         or interleave it over all nodes\n");
+    fprintf(stdout," -W <threads>            fault the index into memory with this many threads before\n");
+    fprintf(stdout,"                         registering with the main server, default 0 (no warm-up)\n");
+    fprintf(stdout," -L                      lock the index in memory (needs RLIMIT_MEMLOCK)\n");
+    fprintf(stdout," -T <secs>               merge new submissions into the index this often, default 600,\n");
+    fprintf(stdout,"                         0 to only merge on SIGUSR1 or SIGUSR2\n");
+    fprintf(stdout," -M <postings>           also merge once this many hash frames are waiting, default 16M,\n");
+    fprintf(stdout,"                         0 for no limit.  a sorted index is merged as a stream, a table\n");
+    fprintf(stdout,"                         index is read whole - convert it with audioindex combine\n");
+    fprintf(stdout," -S <postings>           keep submissions in segments next to the index instead, written\n");
+    fprintf(stdout,"                         out every <postings> hash frames and merged in the background.\n");
+    fprintf(stdout,"                         -T and -M do not apply\n");
+    fprintf(stdout," -D <dir>                on SIGWINCH put a snapshot of the index and the submissions\n");
+    fprintf(stdout,"                         not merged yet in a new dir under <dir>, hard linking what\n");
+    fprintf(stdout,"                         does not change.  SNAPSHOT_NEW_FILES in it lists the files\n");
+    fprintf(stdout,"                         not in the previous one, and <dir>/latest names it.  the\n");
+    fprintf(stdout,"                         submissions that came after a reload still being merged\n");
+    fprintf(stdout,"                         are in <index>.tmp.next, merged in after <index>.tmp on start\n");
+    fprintf(stdout," -O <frames>             vote on the offset of a match in bins of <frames> frames\n");
+    fprintf(stdout,"                         instead of following tracks\n");
+    fprintf(stdout," -E <ratio>              end a lookup as soon as the best match is over the threshold\n");
+    fprintf(stdout,"                         and <ratio> times the score of any other id, default 0 (off)\n");
+    fprintf(stdout," -R <error rate>         after each frame of a lookup, test whether the best id is a\n");
+    fprintf(stdout,"                         match or there is none, and stop once that is known with this\n");
+    fprintf(stdout,"                         rate of errors, default 0 (off).  a match it accepts is sent\n");
+    fprintf(stdout,"                         whatever its score\n");
+    fprintf(stdout," -F <rate>               fraction of the frames of a match expected to vote for it, for\n");
+    fprintf(stdout,"                         the test of -R, default 0.1\n");
+    fprintf(stdout," -X <fraction>           skip the hash words found in more than this fraction of the\n");
+    fprintf(stdout,"                         tracks of the index, e.g. those of silence, default 0 (off).\n");
+    fprintf(stdout,"                         needs a sorted index written since frequencies were added\n");
+    fprintf(stdout," -Q <threads>            split the blocks of each query over this many threads, which\n");
+    fprintf(stdout,"                         each worker thread keeps, for long queries - default 1\n");
+    fprintf(stdout," -V <bit error rate>     check each match against the hash of its track, kept on insert\n");
+    fprintf(stdout,"                         in <index name>.fph/.fpx, and drop it if more bits than this differ,\n");
+    fprintf(stdout,"                         e.g. 0.35 - the threshold of -t may then be lower. default 0 (off)\n");
 }  
 
 static uint8_t table_number = 0;
@@ -159,70 +329,136 @@ static uint8_t table_number = 0;
 static char indexfile[FILENAME_MAX];
 static char tmpindexfile[FILENAME_MAX];
 
-/* Number currently accessing the index. */
-/* Access this variable through its associated mutex. */
-/* Do not access directly, but through the wait_for/post functions. */
-/* When changing the value, signal on associated condition */
-static int nb_index_access = 0;
-static pthread_mutex_t  access_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t   access_cond = PTHREAD_COND_INITIALIZER;
- 
-/* control access to the main index. */
-/* use wait_for() and post() around access to the main index */
-/* this allows a set nb of lookups to occur in parallel */
-static AudioIndex audioindex = NULL;
-
+/* An index in use is reached through a handle with a count of the threads   */
+/* using it.  A new index is published by swapping the handle in the slot;   */
+/* threads already holding the old handle finish on it, and whoever swapped  */
+/* it out waits for its count to drop to 0 before closing it.  The slot      */
+/* mutex is only held to read the handle and count a reference, so lookups   */
+/* never wait on a reload.                                                   */
+typedef struct index_handle_t {
+    AudioIndex index;
+    int nbrefs;             /* threads using index, under the slot mutex */
+} IndexHandle;
+
+typedef struct index_slot_t {
+    IndexHandle *curr;      /* NULL while no index is open */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    /* signalled when curr changes or a count drops */
+} IndexSlot;
+
+/* main index, for lookups */
+static IndexSlot main_slot = { NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
-/* call when thread is done accessing index */
-void post_main_index(){
-    pthread_mutex_lock(&access_mutex);
-    nb_index_access--;
-    pthread_cond_signal(&access_cond);
-    pthread_mutex_unlock(&access_mutex);
+/* tmp index for new additions */
+/* a live index, so inserts from any number of workers may run at once */
+static IndexSlot tmp_slot = { NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* log of the inserts into the tmp index, replayed into it on start after */
+/* a crash.  cut at each reload once the old tmp index is merged into  */
+/* main, and kept whole on a stop while a reload is left to finish     */
+static AudioWal tmp_wal = NULL;
+static int tmp_wal_trim = 1;
+
+/* whole hashes of the submissions, to check matches against with -V and */
+/* to rebuild the index from.  each is on disk before its insert is logged */
+/* - one kept for an insert that did not make it is harmless, it is kept  */
+/* again as last added if resubmitted.  never closed, workers may be      */
+/* using it up to the exit                                                */
+static AudioHashStore hash_store = NULL;
+
+/* tmp index being merged into main by a reload, still looked up in */
+/* until the main index it is merged into is swapped in             */
+static IndexSlot merging_slot = { NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* read locked by a lookup to take the main, merging and tmp slots at once, */
+/* write locked by a reload to move a tmp index from one slot to the next,  */
+/* so no lookup sees its postings twice, or not at all                      */
+static pthread_rwlock_t view_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* a reload that failed leaves its tmp index in merging_slot, and the next */
+/* one takes it up where it stopped before starting on a new tmp index.    */
+/* pending_upto is the last log file of its submissions.  reload thread only */
+static int reload_pending = 0;
+static int pending_flushed = 0;
+static uint32_t pending_upto = 0;
+
+/* take a reference to the current index of slot, NULL if there is none. */
+/* if wait, wait for one to be published instead                         */
+static IndexHandle* acquire_index(IndexSlot *slot, int wait){
+    IndexHandle *h;
+    pthread_mutex_lock(&slot->mutex);
+    while (wait && slot->curr == NULL){
+	pthread_cond_wait(&slot->cond, &slot->mutex);
+    }
+    h = slot->curr;
+    if (h) h->nbrefs++;
+    pthread_mutex_unlock(&slot->mutex);
+    return h;
 }
 
-/* call when thread about to access index */
-/* waits until the value of 'nb_index_access' variable is below the parameter, nb */
-void waitfor_main_index(int nb){
-  pthread_mutex_lock(&access_mutex);
-  while (nb_index_access > nb) {
-    pthread_cond_wait(&access_cond, &access_mutex);
-  }
-  nb_index_access++;
-  pthread_mutex_unlock(&access_mutex);
+/* drop a reference from acquire_index */
+static void release_index(IndexSlot *slot, IndexHandle *h){
+    pthread_mutex_lock(&slot->mutex);
+    if (--h->nbrefs == 0) pthread_cond_broadcast(&slot->cond);
+    pthread_mutex_unlock(&slot->mutex);
 }
 
+/* handle for an index not published yet, NULL on error */
+static IndexHandle* new_handle(AudioIndex index){
+    IndexHandle *h = (IndexHandle*)malloc(sizeof(IndexHandle));
+    if (h == NULL) return NULL;
+    h->index = index;
+    h->nbrefs = 0;
+    return h;
+}
 
-/* control access to tmp index */
-/* wrap all access to tmp index with waitfor_index()/pos_index() */
-/* native semaphore implementation to allow unlimited access, but the */
-/* ability to unplug the index during updates by waiting for the count to go to zero */
-static int nb_tmp_index_access = 0;
-static pthread_mutex_t tmpaccess_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  tmpaccess_cond  = PTHREAD_COND_INITIALIZER;
-
-/* tmp index for new additions */
-/* sandwich all access with waitfor_tmp()/post_tmp() function calls*/
-static AudioIndex audioindex_tmp = NULL;
+/* make h (may be NULL) the current handle of slot, return the one */
+/* it replaces for retire_index, NULL if there was none            */
+static void publish_handle(IndexSlot *slot, IndexHandle *h, IndexHandle **old){
+    pthread_mutex_lock(&slot->mutex);
+    *old = slot->curr;
+    slot->curr = h;
+    pthread_cond_broadcast(&slot->cond);
+    pthread_mutex_unlock(&slot->mutex);
+}
 
-/* control access to tmp index */
-/* with post_tmp_index()/waitfor_tmp_index() */
-void post_tmp_index(){
-    pthread_mutex_lock(&tmpaccess_mutex);
-    nb_tmp_index_access--;
-    pthread_cond_signal(&tmpaccess_cond);
-    pthread_mutex_unlock(&tmpaccess_mutex);
+/* make index (may be NULL) the current one of slot, return the handle */
+/* it replaces for retire_index, NULL if there was none.  -1 on error   */
+static int publish_index(IndexSlot *slot, AudioIndex index, IndexHandle **old){
+    IndexHandle *h = NULL;
+    if (index && (h = new_handle(index)) == NULL) return -1;
+    publish_handle(slot, h, old);
+    return 0;
 }
 
-void waitfor_tmp_index(int nb){
-  pthread_mutex_lock(&tmpaccess_mutex);
-  while (nb_tmp_index_access > nb) {
-    pthread_cond_wait(&tmpaccess_cond, &tmpaccess_mutex);
-  }
-  nb_tmp_index_access++;
-  pthread_mutex_unlock(&tmpaccess_mutex);
+/* wait for the last user of a handle swapped out by publish_index to */
+/* let go of it, free it and return its index                         */
+static AudioIndex retire_index(IndexSlot *slot, IndexHandle *h){
+    AudioIndex index;
+    if (h == NULL) return NULL;
+    pthread_mutex_lock(&slot->mutex);
+    while (h->nbrefs > 0){
+	pthread_cond_wait(&slot->cond, &slot->mutex);
+    }
+    pthread_mutex_unlock(&slot->mutex);
+    index = h->index;
+    free(h);
+    return index;
 }
 
+/* posted by the signal handlers and by an insert that fills the tmp index, */
+/* waited on by the reload thread.  merge_posted asks for a reload and keeps */
+/* the inserts from posting more than once per merge, snapshot_posted asks   */
+/* for a snapshot, stop_posted for the reload thread to end                 */
+static sem_t reload_sem;
+static int merge_posted = 0;
+static int snapshot_posted = 0;
+static int stop_posted = 0;
+
+/* posted by the SIGTERM handler, waited on by the stop thread, which */
+/* closes the index once the reload thread is done                    */
+static sem_t stop_sem;
+static pthread_t reload_thr;
 
 /* DO NOT USE  - only saved here in order to shut down zmq messaging properly on term signal */
 static void *main_ctx = NULL;
@@ -238,76 +474,142 @@ void handle_signal(int sig){
     switch (sig){
     case SIGUSR1:
     case SIGUSR2:
-      syslog(LOG_DEBUG, "recieved SIGUSR %d", sig);
-      if (kill_server() < 0) { 
-	syslog(LOG_CRIT,"SIGHANDLER: unable to kill server");
-	break;
-      }
-      if (kill_index() < 0) { 
-	syslog(LOG_CRIT,"SIGHANDLER: unable to kill index");
+	/* the reload thread does the work, the server stays registered */
+	__atomic_store_n(&merge_posted, 1, __ATOMIC_SEQ_CST);
+	sem_post(&reload_sem);
 	break;
-      }
-      if (init_index() < 0) {
-	syslog(LOG_CRIT,"SIGHANDLER: unable to init index - index STILL down");
+    case SIGWINCH:
+	__atomic_store_n(&snapshot_posted, 1, __ATOMIC_SEQ_CST);
+	sem_post(&reload_sem);
 	break;
-      }
-      if (init_server(main_ctx) < 0) {
-	syslog(LOG_CRIT,"SIGHANDLER, unable to init server - index up but unknown by main server");
-	break;
-      }
-      break;
     case SIGHUP:
     case SIGTERM:
-	syslog(LOG_DEBUG, "recieved SIGTERM %d", sig);
-	if (kill_server() < 0) syslog(LOG_CRIT,"SIGHANDLER: unable to kill server");
-	if (kill_index() < 0) syslog(LOG_CRIT,"SIGHANDLER: unable to kill index");
-	kill_process();
-	/* should this be called ??? */
-        /* if called, must close sockets in threads */
-        /* before calling                           */
-	/* zmq_term(main_ctx); */
-	exit(0);
+	/* the stop thread does the work, once no reload is under way */
+	__atomic_store_n(&stop_posted, 1, __ATOMIC_SEQ_CST);
+	sem_post(&reload_sem);
+	sem_post(&stop_sem);
+	break;
     }
 }
 
 
-int init_index(){
-    /* init tmp index for new submissions */
-    indexfile[0] = '\0';
-    tmpindexfile[0] = '\0';
-    snprintf(indexfile, FILENAME_MAX, "%s.idx", GlobalArgs.index_name);
-    snprintf(tmpindexfile, FILENAME_MAX, "%s.tmp", GlobalArgs.index_name);
-    syslog(LOG_DEBUG,"init index");
+static void warmup_progress(uint64_t done, uint64_t total, void *arg){
+    syslog(LOG_INFO, "WARMUP: %s, %llu of %llu MB (%d%%)", (char*)arg,\
+	   (unsigned long long)(done >> 20), (unsigned long long)(total >> 20),\
+	   (total) ? (int)(100*done/total) : 100);
+}
 
-    int err;
+/* merge a tmp index file into the main index file, if both are there */
+static int merge_into_main(const char *file){
+    int err = 1;
     struct stat tmpidx_info, idx_info;
-    if (!stat(tmpindexfile, &tmpidx_info) && !stat(indexfile, &idx_info)){
+    if (!stat(file, &tmpidx_info) && !stat(indexfile, &idx_info)){
 	/* if size if greater enough, merge temp into permanent index */
-        syslog(LOG_DEBUG,"merge %s into %s", tmpindexfile, indexfile);
-	err = merge_audioindex(indexfile, tmpindexfile);
+        syslog(LOG_DEBUG,"merge %s into %s", file, indexfile);
+	err = merge_audioindex(indexfile, file);
 	if (err < 0){
-	    syslog(LOG_ERR, "unable to merge %s into %s", tmpindexfile, indexfile);
+	    syslog(LOG_ERR, "unable to merge %s into %s", file, indexfile);
 	} else if (err > 0){
-	    syslog(LOG_DEBUG,"no need to merge %s into %s", tmpindexfile, indexfile);
+	    syslog(LOG_DEBUG,"no need to merge %s into %s", file, indexfile);
 	}
     } 
+    return err;
+}
+
+/* merge the tmp index file into the main index file */
+static int merge_tmp_index(){
+    return merge_into_main(tmpindexfile);
+}
+
+/* open the main index file, warm it up and swap it in for lookups, */
+/* closing the one it replaces once its last lookup is done          */
+/* open the main index and swap it in.  with drop_merging, the tmp index */
+/* merged into it goes out of merging_slot at the same time             */
+static int open_main_index(int drop_merging){
+    int err;
+    IndexHandle *old, *merging = NULL;
 
     syslog(LOG_DEBUG,"open index, %s", indexfile);
-    pthread_mutex_lock(&access_mutex);
-    audioindex = open_audioindex(indexfile, 0, NB_BUCKETS_TABLE_SIZE);
-    if (audioindex) pthread_cond_signal(&access_cond);
-    pthread_mutex_unlock(&access_mutex);
-    if (audioindex == NULL){
+    AudioIndex index = open_audioindex_opts(indexfile, 0, NB_BUCKETS_TABLE_SIZE, &GlobalArgs.index_opts);
+    if (index == NULL){
 	syslog(LOG_CRIT, "unable to open index, %s", indexfile);
 	return -1;
     }
+
+    /* fault the index in before it takes queries, so the first */
+    /* ones do not time out waiting on the disk                 */
+    if (GlobalArgs.warmup_threads > 0 || GlobalArgs.lockflag){
+	time_t start = time(NULL);
+	syslog(LOG_INFO, "WARMUP: %s, %d threads", indexfile, GlobalArgs.warmup_threads);
+	err = warmup_audioindex(index, GlobalArgs.warmup_threads, GlobalArgs.lockflag,\
+				warmup_progress, indexfile);
+	if (err == -2){
+	    syslog(LOG_ERR, "WARMUP: unable to lock %s in memory", indexfile);
+	} else if (err < 0){
+	    syslog(LOG_ERR, "WARMUP: unable to warm up %s", indexfile);
+	}
+	syslog(LOG_INFO, "WARMUP: %s done in %ld s", indexfile, (long)(time(NULL) - start));
+    }
+
+    pthread_rwlock_wrlock(&view_lock);
+    if (publish_index(&main_slot, index, &old) < 0){
+	pthread_rwlock_unlock(&view_lock);
+	syslog(LOG_CRIT, "unable to publish index, %s", indexfile);
+	close_audioindex(index, 0);
+	return -1;
+    }
+    if (drop_merging) publish_handle(&merging_slot, NULL, &merging);
+    pthread_rwlock_unlock(&view_lock);
+
+    index = retire_index(&merging_slot, merging);
+    if (index) close_audioindex(index, 1);
+    if (old){
+	syslog(LOG_DEBUG, "wait on lookups in the old index");
+	if (close_audioindex(retire_index(&main_slot, old), 0) < 0){
+	    syslog(LOG_ERR, "unable to close old index");
+	}
+    }
+    return 0;
+}
+
+int init_index(){
+    /* init tmp index for new submissions */
+    indexfile[0] = '\0';
+    tmpindexfile[0] = '\0';
+    snprintf(indexfile, FILENAME_MAX, "%s.idx", GlobalArgs.index_name);
+    snprintf(tmpindexfile, FILENAME_MAX, "%s.tmp", GlobalArgs.index_name);
+    syslog(LOG_DEBUG,"init index");
+
+    IndexHandle *old;
+    char nextfile[FILENAME_MAX];
+    /* then the submissions after a pending reload, from a snapshot */
+    snprintf(nextfile, FILENAME_MAX, "%s.next", tmpindexfile);
+    if (merge_tmp_index() >= 0) merge_into_main(nextfile);
+
+    if (open_main_index(0) < 0) return -1;
+
+    /* synced on each insert, with the syncs of the workers grouped */
+    if ((hash_store = open_audiohash_store(GlobalArgs.index_name, 1, 1)) == NULL){
+	syslog(LOG_ERR, "unable to open hash store %s, hashes are not kept", GlobalArgs.index_name);
+    }
    
-    syslog(LOG_DEBUG, "open tmp index, %s", tmpindexfile);
-    pthread_mutex_lock(&tmpaccess_mutex);
-    audioindex_tmp = open_audioindex(tmpindexfile, 1, NB_BUCKETS_TMP_TABLE_SIZE);
-    if (audioindex_tmp) pthread_cond_signal(&tmpaccess_cond);
-    pthread_mutex_unlock(&tmpaccess_mutex);
-    if (audioindex_tmp == NULL){
+    AudioIndex index;
+    if (GlobalArgs.memtable_size > 0){
+	syslog(LOG_DEBUG, "open segments, %s", GlobalArgs.index_name);
+	index = open_segmented_audioindex(GlobalArgs.index_name, GlobalArgs.memtable_size,\
+					  &GlobalArgs.index_opts);
+    } else {
+	syslog(LOG_DEBUG, "open tmp index, %s", tmpindexfile);
+	index = open_live_audioindex(tmpindexfile, NB_BUCKETS_TMP_TABLE_SIZE);
+	/* submissions not written out before the last stop */
+	if (index && (tmp_wal = open_audiowal(tmpindexfile, index,\
+					      (int)sysconf(_SC_NPROCESSORS_ONLN))) == NULL){
+	    syslog(LOG_CRIT, "unable to replay log of %s", tmpindexfile);
+	    close_audioindex(index, 1);
+	    return -1;
+	}
+    }
+    if (index == NULL || publish_index(&tmp_slot, index, &old) < 0){
 	syslog(LOG_CRIT, "unable to open index, %s", tmpindexfile);
 	return -1;
     } 
@@ -315,30 +617,336 @@ int init_index(){
     return 0;
 }
 
+/* write out the tmp index left in merging_slot by a reload and merge it */
+/* into main.  on failure it stays there for lookups, and its file and   */
+/* log on disk, to try again from there on the next reload               */
+static int finish_reload(){
+    IndexHandle *h;
+    int err = 0;
+
+    if (!pending_flushed){
+	h = acquire_index(&merging_slot, 0);
+	if (h && flush_audioindex(h->index, tmpindexfile) < 0){
+	    syslog(LOG_CRIT, "RELOAD: unable to flush tmp index to %s, kept for next reload",\
+		   tmpindexfile);
+	    err = -2;
+	}
+	if (h) release_index(&merging_slot, h);
+	if (err < 0){
+	    tmp_wal_trim = 0;
+	    return err;
+	}
+	pending_flushed = 1;
+    }
+
+    /* the file stays where it is until a merge takes it in */
+    if (merge_tmp_index() < 0){
+	syslog(LOG_CRIT, "RELOAD: unable to merge %s, kept for next reload", tmpindexfile);
+	tmp_wal_trim = 0;
+	return -3;
+    }
+
+    /* lookups go on in the old main index and the tmp index until */
+    /* the new main index takes the place of both                  */
+    if (open_main_index(1) < 0){
+	syslog(LOG_CRIT, "RELOAD: old index still in use");
+	tmp_wal_trim = 0;
+	return -4;
+    }
+
+    /* in the main index now, its log is no longer needed.  a crash */
+    /* before the trim replays it once more, which is harmless      */
+    if (trim_audiowal(tmp_wal, pending_upto) < 0){
+	syslog(LOG_ERR, "RELOAD: unable to trim log");
+    }
+    tmp_wal_trim = 1;
+    reload_pending = 0;
+    return 0;
+}
+
+/* fold the submissions so far into the main index and swap it in, */
+/* with lookups and inserts going on all along                     */
+int reload_index(){
+    IndexHandle *old;
+    int err;
+
+    syslog(LOG_DEBUG, "RELOAD: start");
+
+    /* segments look after themselves, only the main index is reopened */
+    if (GlobalArgs.memtable_size > 0){
+	if (open_main_index(0) < 0){
+	    syslog(LOG_CRIT, "RELOAD: old index still in use");
+	    return -4;
+	}
+	return 0;
+    }
+
+    /* the submissions of a failed reload go in first, new ones wait */
+    /* in the tmp index for the next                                 */
+    if (reload_pending){
+	syslog(LOG_DEBUG, "RELOAD: finish the last reload");
+	err = finish_reload();
+	if (err == 0) syslog(LOG_DEBUG, "RELOAD: done");
+	return err;
+    }
+
+    /* its entries go to the tmp file once this one is merged, its deletes */
+    /* to the deletes file of the tmp file from the start                  */
+    AudioIndex index = open_empty_live_audioindex(tmpindexfile, NB_BUCKETS_TMP_TABLE_SIZE);
+    if (index == NULL){
+	syslog(LOG_CRIT, "RELOAD: unable to open new tmp index");
+	return -1;
+    }
+
+    /* the log is cut first, so what lands in the old file is all */
+    /* in the old tmp index by the time it is written out          */
+    if (rotate_audiowal(tmp_wal, &pending_upto) < 0){
+	syslog(LOG_CRIT, "RELOAD: unable to rotate log");
+	close_audioindex(index, 1);
+	return -1;
+    }
+
+    /* send new submissions to a fresh tmp index from here on, and keep */
+    /* the old one visible to lookups in merging_slot - both at once    */
+    IndexHandle *merging = NULL, *h = acquire_index(&tmp_slot, 0);
+    if (h){
+	merging = new_handle(h->index);
+	release_index(&tmp_slot, h);
+    }
+    pthread_rwlock_wrlock(&view_lock);
+    if ((h && merging == NULL) || publish_index(&tmp_slot, index, &old) < 0){
+	pthread_rwlock_unlock(&view_lock);
+	syslog(LOG_CRIT, "RELOAD: unable to publish new tmp index");
+	/* the old tmp index goes on taking submissions */
+	free(merging);
+	close_audioindex(index, 1);
+	return -1;
+    }
+    publish_handle(&merging_slot, merging, &h);
+    pthread_rwlock_unlock(&view_lock);
+
+    /* written out once the inserts in it are done */
+    retire_index(&tmp_slot, old);
+    reload_pending = 1;
+    pending_flushed = 0;
+
+    err = finish_reload();
+    if (err == 0) syslog(LOG_DEBUG, "RELOAD: done");
+    return err;
+}
+
+/* nb postings waiting in the tmp index */
+static int tmp_index_size(){
+    int nbbuckets = 0, nbentries = 0;
+    IndexHandle *h = acquire_index(&tmp_slot, 0);
+    if (h){
+	stat_audioindex(h->index, &nbbuckets, &nbentries);
+	release_index(&tmp_slot, h);
+    }
+    return nbentries;
+}
+
+/* name of the last snapshot under the snapshot dir, from its latest file */
+static void last_snapshot(char *prev){
+    char path[FILENAME_MAX], name[FILENAME_MAX];
+    prev[0] = '\0';
+    snprintf(path, FILENAME_MAX, "%s/latest", GlobalArgs.snapshot_dir);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return;
+    if (fscanf(fp, "%255s", name) == 1){
+	snprintf(prev, FILENAME_MAX, "%s/%s", GlobalArgs.snapshot_dir, name);
+    }
+    fclose(fp);
+}
+
+/* point the latest file at the snapshot name */
+static int set_last_snapshot(const char *name){
+    char path[FILENAME_MAX], part[FILENAME_MAX];
+    int err = 0;
+    snprintf(path, FILENAME_MAX, "%s/latest", GlobalArgs.snapshot_dir);
+    snprintf(part, FILENAME_MAX, "%s.part", path);
+    FILE *fp = fopen(part, "w");
+    if (fp == NULL) return -1;
+    if (fprintf(fp, "%s\n", name) < 0 || fflush(fp) || fsync(fileno(fp))) err = -1;
+    if (fclose(fp)) err = -1;
+    if (err == 0 && rename(part, path) < 0) err = -1;
+    if (err < 0) unlink(part);
+    return err;
+}
+
+/* snapshot of the main index and the tmp index together, and of the tmp */
+/* index a pending reload has yet to merge.  taken in the reload thread, */
+/* so no reload moves them meanwhile                                    */
+static int take_snapshot(){
+    char stamp[32], name[64], dir[FILENAME_MAX], part[FILENAME_MAX], prev[FILENAME_MAX];
+    char nextfile[FILENAME_MAX];
+    AudioIndex indexes[3];
+    const char *names[3];
+    struct stat info;
+    struct tm tm;
+    time_t now = time(NULL);
+    int err, seq;
+
+    if (GlobalArgs.snapshot_dir == NULL){
+	syslog(LOG_ERR, "SNAPSHOT: no snapshot dir, start with -D");
+	return -1;
+    }
+    if (mkdir(GlobalArgs.snapshot_dir, 0755) < 0 && errno != EEXIST){
+	syslog(LOG_ERR, "SNAPSHOT: unable to make %s", GlobalArgs.snapshot_dir);
+	return -1;
+    }
+    /* a sequence number after the time for more than one in a second */
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    for (seq = 0;;seq++){
+	if (seq == 0){
+	    snprintf(name, sizeof(name), "%s", stamp);
+	} else {
+	    snprintf(name, sizeof(name), "%s-%d", stamp, seq);
+	}
+	snprintf(dir, FILENAME_MAX, "%s/%s", GlobalArgs.snapshot_dir, name);
+	snprintf(part, FILENAME_MAX, "%s.part", dir);
+	if (stat(dir, &info) < 0 && stat(part, &info) < 0) break;
+    }
+    last_snapshot(prev);
+
+    /* the tmp index of a pending reload goes where the reload writes it, */
+    /* unless the main index file has it already, and the tmp index      */
+    /* taking submissions since then next to it                          */
+    snprintf(nextfile, FILENAME_MAX, "%s.next", tmpindexfile);
+    IndexHandle *hmain = acquire_index(&main_slot, 0);
+    IndexHandle *hmerging = NULL;
+    if (reload_pending && (!pending_flushed || !stat(tmpindexfile, &info))){
+	hmerging = acquire_index(&merging_slot, 0);
+    }
+    IndexHandle *htmp = acquire_index(&tmp_slot, 0);
+    indexes[0] = (hmain) ? hmain->index : NULL;
+    names[0] = indexfile;
+    indexes[1] = (hmerging) ? hmerging->index : NULL;
+    names[1] = tmpindexfile;
+    indexes[2] = (htmp) ? htmp->index : NULL;
+    if (GlobalArgs.memtable_size > 0){
+	names[2] = GlobalArgs.index_name;
+    } else {
+	names[2] = (hmerging) ? nextfile : tmpindexfile;
+    }
+    err = snapshot_audioindex(indexes, names, 3, dir, (prev[0]) ? prev : NULL);
+    if (htmp) release_index(&tmp_slot, htmp);
+    if (hmerging) release_index(&merging_slot, hmerging);
+    if (hmain) release_index(&main_slot, hmain);
+
+    if (err < 0){
+	syslog(LOG_ERR, "SNAPSHOT: unable to take snapshot %s, err = %d", dir, err);
+	return -2;
+    }
+    if (set_last_snapshot(name) < 0){
+	syslog(LOG_ERR, "SNAPSHOT: unable to record %s as latest", name);
+    }
+    syslog(LOG_INFO, "SNAPSHOT: %s, after %s", dir, (prev[0]) ? prev : "none");
+    return 0;
+}
+
+/* reload thread, runs reload_index() for each SIGUSR1 or SIGUSR2, when   */
+/* the tmp index is full, and every merge_time secs if anything was       */
+/* submitted, and take_snapshot() for each SIGWINCH                        */
+static void* reloader(void *arg){
+    struct timespec deadline;
+    int err, nbentries, wanted;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += GlobalArgs.merge_time;
+    for (;;){
+	if (GlobalArgs.merge_time > 0 && GlobalArgs.memtable_size == 0){
+	    err = sem_timedwait(&reload_sem, &deadline);
+	} else {
+	    err = sem_wait(&reload_sem);
+	}
+	if (err < 0 && errno == EINTR) continue;
+	if (err < 0 && errno != ETIMEDOUT) continue;
+
+	/* posts that came in the mean time are served by this pass */
+	while (sem_trywait(&reload_sem) == 0);
+	if (__atomic_load_n(&stop_posted, __ATOMIC_SEQ_CST)) break;
+	wanted = __atomic_exchange_n(&merge_posted, 0, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&snapshot_posted, 0, __ATOMIC_SEQ_CST)){
+	    take_snapshot();
+	}
+
+	/* the timer only merges what is there, a signal always reloads */
+	nbentries = tmp_index_size();
+	if (wanted || (err < 0 && (nbentries > 0 || reload_pending))){
+	    syslog(LOG_DEBUG, "RELOADER: merge %d postings", nbentries);
+	    if (reload_index() < 0){
+		syslog(LOG_CRIT, "RELOADER: unable to reload index");
+	    }
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += GlobalArgs.merge_time;
+    }
+    syslog(LOG_DEBUG, "RELOADER: stopped");
+    return NULL;
+}
+
+/* stop thread, on SIGTERM waits for the reload thread to finish what it */
+/* is doing, so nothing moves the indexes or their files under it, then  */
+/* closes them and exits                                                 */
+static void* stopper(void *arg){
+    while (sem_wait(&stop_sem) < 0 && errno == EINTR);
+    syslog(LOG_DEBUG, "recieved SIGTERM");
+    if (kill_server() < 0) syslog(LOG_CRIT,"STOPPER: unable to kill server");
+    pthread_join(reload_thr, NULL);
+    if (kill_index() < 0) syslog(LOG_CRIT,"STOPPER: unable to kill index");
+    kill_process();
+    /* should this be called ??? */
+    /* if called, must close sockets in threads */
+    /* before calling                           */
+    /* zmq_term(main_ctx); */
+    exit(0);
+    return NULL;
+}
+
 int kill_index(){
     int err = 0;
+    IndexHandle *old;
+    AudioIndex index;
 
     syslog(LOG_DEBUG,"KILLINDEX: close index");
 
-    /* wait for number accessing the index to be 0 */
-    waitfor_main_index(0);
-    err = close_audioindex(audioindex, 0);
-    audioindex = NULL;
-    post_main_index();
-
-    if (err < 0) {
+    /* wait for lookups on the index to be done */
+    publish_index(&main_slot, NULL, &old);
+    index = retire_index(&main_slot, old);
+    if (index && close_audioindex(index, 0) < 0){
       syslog(LOG_ERR,"KILLINDEX: unable to close index");
       return -1;
     }
 
     syslog(LOG_DEBUG,"KILLINDEX: close tmp audioindex");
 
-    /* wait for tmp index to close and NULL it */
-    waitfor_tmp_index(0);
-    err = flush_audioindex(audioindex_tmp, tmpindexfile);
-    err = close_audioindex(audioindex_tmp, 1);
-    audioindex_tmp = NULL;
-    post_tmp_index();
+    /* wait for inserts in the tmp index to be done */
+    publish_index(&tmp_slot, NULL, &old);
+    index = retire_index(&tmp_slot, old);
+    if (index && reload_pending){
+	/* the log since the failed reload holds it all, replayed on start - */
+	/* the file of the reload is dropped so it is not merged in twice     */
+	if (pending_flushed) unlink(tmpindexfile);
+	close_audioindex(index, 1);
+    } else if (index){
+	/* written aside and renamed in, a crash leaves the last one whole */
+	if (flush_audioindex(index, tmpindexfile) < 0){
+	    syslog(LOG_ERR,"KILLINDEX: unable to flush tmp index to %s", tmpindexfile);
+	    err = -1;
+	}
+	if (close_audioindex(index, 1) < 0) err = -1;
+    }
+    /* the log goes once all it holds is in the tmp file */
+    if (tmp_wal){
+	if (close_audiowal(tmp_wal, err == 0 && tmp_wal_trim && !reload_pending) < 0){
+	    syslog(LOG_ERR,"KILLINDEX: unable to close log");
+	}
+	tmp_wal = NULL;
+    }
 
     if (err < 0) {
       syslog(LOG_ERR,"KILLINDEX: unable to close tmp index, err = %d", err);
@@ -388,6 +996,7 @@ void init_process(){
     signal(SIGTERM, handle_signal);
     signal(SIGUSR1, handle_signal);
     signal(SIGUSR2, handle_signal);
+    signal(SIGWINCH, handle_signal);
 
     syslog(LOG_DEBUG, "INITPROCESS: init completed");
 }
@@ -482,13 +1091,34 @@ void kill_process(){
     closelog();
 }
 
-/* aux function to worker threads for sending the results */
-static int send_results(void *skt, uint8_t threadnb, uint32_t id, float cs){
+/* aux function to worker threads for sending the results: the best id and cs, */
+/* then all the matches as (id, cs, offset) triples, all in network order      */
+static int send_results(void *skt, uint8_t threadnb, AudioMatch *matches, int nbmatches){
+    uint32_t id = 0, *wire;
+    float cs = 0.0f;
+    int i;
 
-    syslog(LOG_DEBUG,"SEND: send thr = %u, id = %u, cs = %f", threadnb, id, cs);
+    if (nbmatches > 0){
+	id = hosttonet32(matches[0].id);
+	cs = hosttonetf(matches[0].cs);
+    }
+    syslog(LOG_DEBUG,"SEND: send thr = %u, %d matches, id = %u, cs = %f", threadnb, nbmatches,\
+	   (nbmatches > 0) ? matches[0].id : 0, (nbmatches > 0) ? matches[0].cs : 0.0f);
+    wire = (uint32_t*)malloc(3*nbmatches*sizeof(uint32_t) + 1);
+    if (wire == NULL){
+	syslog(LOG_ERR,"SEND: mem alloc error");
+	nbmatches = 0;
+    }
+    for (i = 0;i < nbmatches;i++){
+	float match_cs = hosttonetf(matches[i].cs);
+	wire[3*i] = hosttonet32(matches[i].id);
+	memcpy(&wire[3*i+1], &match_cs, sizeof(float));
+	wire[3*i+2] = hosttonet32((uint32_t)matches[i].offset);
+    }
     sendmore_msg_vsm(skt, &threadnb, sizeof(uint8_t));
     sendmore_msg_vsm(skt, &id, sizeof(uint32_t));
-    send_msg_vsm(skt, &cs, sizeof(float));
+    sendmore_msg_vsm(skt, &cs, sizeof(float));
+    send_msg_data(skt, wire, 3*nbmatches*sizeof(uint32_t), free_fn, NULL);
 
     int err =0;
     zmq_msg_t msg;
@@ -565,25 +1195,53 @@ static uint8_t** retrieve_extra(void *pullskt, uint32_t nbframes, uint8_t *perms
 }
 
 /* aux function to worker thread to execute commands */
-static int execute_command(uint8_t thrn, uint8_t cmd, uint32_t* hash,\
+/* a lookup fills in up to *nbmatches matches and sets *nbmatches to the nb found */
+static int execute_command(uint8_t thrn, AudioVoter voter, uint8_t cmd, uint32_t* hash,\
                            uint8_t **toggles, uint8_t perms, uint32_t nbframes,\
-                           uint8_t threadnum, uint32_t *id, float *cs){
-    int err = 0;
+                           uint8_t threadnum, uint32_t *id, AudioMatch *matches, int *nbmatches){
+    int err = 0, tmp_err, main_err;
     uint8_t table_n;
-    *cs = -1.00f;
+    IndexHandle *h, *hmerging, *htmp;
+    AudioIndex segments[3];
 
     switch (cmd){
     case 1:
-	if (audioindex){
-	    waitfor_main_index(GlobalArgs.nbthreads+1);
+	/* vote over the main index and the submissions not merged into it yet */
+	pthread_rwlock_rdlock(&view_lock);
+	h = acquire_index(&main_slot, 0);
+	hmerging = (h) ? acquire_index(&merging_slot, 0) : NULL;
+	htmp = (h) ? acquire_index(&tmp_slot, 0) : NULL;
+	pthread_rwlock_unlock(&view_lock);
+	if (h != NULL){
+	    segments[0] = h->index;
+	    segments[1] = (hmerging) ? hmerging->index : NULL;
+	    segments[2] = (htmp) ? htmp->index : NULL;
 	    syslog(LOG_DEBUG,"WORKER%d: do lookup for hash[%d]", thrn, nbframes);
-	    err = lookupaudiohash(audioindex, (uint32_t*)hash,(uint8_t**)toggles,nbframes,perms,\
-				  GlobalArgs.blocksize, GlobalArgs.threshold, id, cs);
-	    post_main_index();
+	    err = lookupaudiohash_topk(voter, segments, 3, (uint32_t*)hash,(uint8_t**)toggles,nbframes,\
+				       perms, GlobalArgs.blocksize, GlobalArgs.threshold,\
+				       matches, *nbmatches);
+	    if (htmp) release_index(&tmp_slot, htmp);
+	    if (hmerging) release_index(&merging_slot, hmerging);
+	    release_index(&main_slot, h);
 
 	    if (err < 0){
 		syslog(LOG_ERR,"WORKER%d: could not do lookup - err %d", thrn, err);
 		err = -1;
+	    } else {
+		*nbmatches = err;
+		err = 0;
+	    }
+	    /* a match only counts if its hash lines up with that of the track */
+	    if (err == 0 && hash_store && GlobalArgs.max_ber > 0.0f && *nbmatches > 0){
+		int n = verify_audiomatches(hash_store, hash, nbframes, matches, *nbmatches,\
+					    VERIFY_SLACK + GlobalArgs.voter_opts.binwidth,\
+					    GlobalArgs.max_ber, NULL);
+		if (n < 0){
+		    syslog(LOG_ERR,"WORKER%d: could not check matches - err %d", thrn, n);
+		} else {
+		    syslog(LOG_DEBUG,"WORKER%d: %d of %d matches checked out", thrn, n, *nbmatches);
+		    *nbmatches = n;
+		}
 	    }
 	} else {
 	    syslog(LOG_DEBUG,"WORKER%d: index is down, unable to do lookup", thrn);
@@ -593,36 +1251,78 @@ static int execute_command(uint8_t thrn, uint8_t cmd, uint32_t* hash,\
     case 2:
 	table_n = threadnum;
 	if (table_n == table_number) { /* if meant for this table */
-	    waitfor_tmp_index(GlobalArgs.nbthreads+1);
-	    while (audioindex_tmp == NULL){
-		pthread_cond_wait(&tmpaccess_cond, &tmpaccess_mutex);
-	    }
+	    h = acquire_index(&tmp_slot, 1);
 	    syslog(LOG_DEBUG,"WORKER%d: inserting id = %d, hash[%d]", thrn, *id, nbframes);
-	    err = insert_into_audioindex(audioindex_tmp, *id, (uint32_t*)hash, nbframes);
-	    post_tmp_index();
+	    /* on disk before it is in the index - segments keep their own log */
+	    if (hash_store && add_to_audiohash_store(hash_store, *id, (uint32_t*)hash, nbframes) < 0){
+		syslog(LOG_ERR,"WORKER%d: unable to store hash of id = %d", thrn, *id);
+		err = -1;
+	    } else if (tmp_wal && append_audiowal(tmp_wal, *id, (uint32_t*)hash, nbframes) < 0){
+		syslog(LOG_ERR,"WORKER%d: unable to log id = %d", thrn, *id);
+		err = -1;
+	    } else {
+		err = insert_into_audioindex(h->index, *id, (uint32_t*)hash, nbframes);
+	    }
+	    if (err == 0 && GlobalArgs.merge_size > 0 && GlobalArgs.memtable_size == 0){
+		int nbbuckets, nbentries;
+		stat_audioindex(h->index, &nbbuckets, &nbentries);
+		if (nbentries >= GlobalArgs.merge_size &&\
+		    !__atomic_exchange_n(&merge_posted, 1, __ATOMIC_SEQ_CST)){
+		    syslog(LOG_DEBUG,"WORKER%d: tmp index full, %d postings", thrn, nbentries);
+		    sem_post(&reload_sem);
+		}
+	    }
+	    release_index(&tmp_slot, h);
 	    if (err < 0){
 		syslog(LOG_ERR,"WORKER%d: unable to insert hash - err %d", thrn, err);
 		err = -3;
 	    }
 	} 
 	break;
+    case 3:
+	/* delete from the main index, kept in its deletes file, and from the  */
+	/* tmp index, kept in the deletes file of the tmp file.  a main index  */
+	/* opened on a reload may miss a delete that came in while it was      */
+	/* opened, the tmp index covers that until the next reload reads the   */
+	/* file again.  a table main index keeps no deletes (-1), the id is    */
+	/* skipped there for being deleted from the tmp index                  */
+	syslog(LOG_DEBUG,"WORKER%d: deleting id = %u", thrn, *id);
+	tmp_err = -1;
+	if ((htmp = acquire_index(&tmp_slot, 0)) != NULL){
+	    if ((tmp_err = delete_from_audioindex(htmp->index, *id)) < 0){
+		syslog(LOG_ERR,"WORKER%d: unable to delete %u from tmp index", thrn, *id);
+		err = -5;
+	    }
+	    release_index(&tmp_slot, htmp);
+	}
+	if ((h = acquire_index(&main_slot, 0)) != NULL){
+	    main_err = delete_from_audioindex(h->index, *id);
+	    if (main_err < -1 || (main_err == -1 && tmp_err < 0)){
+		syslog(LOG_ERR,"WORKER%d: unable to delete %u from main index", thrn, *id);
+		err = -5;
+	    }
+	    release_index(&main_slot, h);
+	}
+	*id = 0;
+	break;
     default:
 	syslog(LOG_DEBUG, "WORKER%d: cmd not recognized, %u", thrn, cmd);
 	err = -4;
     }
+    if (cmd != 1 || err < 0) *nbmatches = 0;
 
     return err;
 }
 
 /* aux message to worker thread to a message */
-static int pull_message(int thrn, void *pullskt, void *resultskt){
+static int pull_message(int thrn, AudioVoter voter, void *pullskt, void *resultskt){
     uint8_t cmd, perms = 0, threadnum, table_n, **toggles = NULL;
-    uint32_t nbframes, id = 0;
+    uint32_t nbframes, id = 0, nbwanted;
     void *hash = NULL, *data = NULL;
-    int i, err;
+    int i, err, nbmatches;
     int64_t more;
     size_t msg_size, more_size = sizeof(int64_t);
-    float cs = -1.0f;
+    AudioMatch matches[MAX_MATCHES];
 
     /* pull cmd msg part */
     recieve_msg(pullskt, &msg_size, &more, &more_size, &data);
@@ -686,7 +1386,13 @@ static int pull_message(int thrn, void *pullskt, void *resultskt){
 	toggles = retrieve_extra(pullskt, nbframes, &perms); 
     }
 
-    err = execute_command(thrn, cmd, hash, toggles, perms,nbframes, threadnum, &id, &cs);
+    /* for a query the id is the nb of results wanted, 0 for the best one */
+    /* sent back only if there is one                                     */
+    nbwanted = (cmd == 1) ? id : 0;
+    nbmatches = (nbwanted < 1) ? 1 : ((nbwanted > MAX_MATCHES) ? MAX_MATCHES : nbwanted);
+
+    err = execute_command(thrn, voter, cmd, hash, toggles, perms,nbframes, threadnum, &id,\
+			  matches, &nbmatches);
     if (err < 0){
 	syslog(LOG_DEBUG,"WORKER%d: unable to execute command, err=%d", err);
     }
@@ -701,11 +1407,15 @@ static int pull_message(int thrn, void *pullskt, void *resultskt){
     free(hash);
     hash = NULL;
    
-    if (cs >= GlobalArgs.threshold){
-	syslog(LOG_DEBUG,"WORKER%d: %u threadnum, %f cs, %u id", thrn, threadnum, cs, id);
-	id = hosttonet32(id);
-	cs = hosttonetf(cs);
-	send_results(resultskt, threadnum, id, cs);
+    if (nbmatches > 0){
+	syslog(LOG_DEBUG,"WORKER%d: %u threadnum, %d matches, %f cs, %u id at frame %d, %d frames read",\
+	       thrn, threadnum, nbmatches, matches[0].cs, matches[0].id, matches[0].offset,\
+	       audiovoter_frames(voter));
+    }
+    /* a query for a number of results is always answered, so the results */
+    /* of all the tables can be waited for and merged                      */
+    if (cmd == 1 && (nbmatches > 0 || nbwanted > 0)){
+	send_results(resultskt, threadnum, matches, nbmatches);
     }
 
     return 0;
@@ -717,15 +1427,22 @@ void* dowork(void *arg){
     int thr_n  = thread_count++;/* for logging */
     void *ctx = arg;
     
-    /* do not respond to SIGUSR1 or SIGUSR2 */
+    /* do not respond to SIGUSR1, SIGUSR2 or SIGWINCH */
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGUSR1);
     sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGWINCH);
     if (pthread_sigmask(SIG_UNBLOCK, &set, NULL)){
       syslog(LOG_CRIT,"WORKER%d: unable to set sigmask", thr_n);
     }
 
+    /* keep lookups on the node the index is bound to */
+    if (GlobalArgs.index_opts.numa_node >= 0 &&\
+	audioindex_pin_thread(GlobalArgs.index_opts.numa_node) < 0){
+	syslog(LOG_ERR,"WORKER%d: unable to pin to node %d", thr_n, GlobalArgs.index_opts.numa_node);
+    }
+
     /* open socket to main auscoutd server */
     snprintf(addr, 32, "tcp://%s:%d", GlobalArgs.server_address, GlobalArgs.port+3);
     void *result_skt = socket_connect(ctx, ZMQ_REQ, addr);
@@ -740,8 +1457,15 @@ void* dowork(void *arg){
 	exit(1);
     }
 
+    /* votes of the lookups of this worker, kept from one to the next */
+    AudioVoter voter = open_audiovoter_opts(&GlobalArgs.voter_opts);
+    if (!voter){
+	syslog(LOG_CRIT,"WORKER%d: unable to create voter", thr_n);
+	exit(1);
+    }
+
     while (1){
-	int err = pull_message(thr_n, pullskt, result_skt);
+	int err = pull_message(thr_n, voter, pullskt, result_skt);
 	if (err < 0){
 	    syslog(LOG_DEBUG,"WORKER%d: unable to recieve message - err %d, skipping", err,thr_n);
 	}
@@ -881,6 +1605,9 @@ int main(int argc, char **argv){
 	return 0;
     }
 
+    sem_init(&reload_sem, 0, 0);
+    sem_init(&stop_sem, 0, 0);
+
     /* init daemon */ 
     init_process();
  
@@ -898,6 +1625,17 @@ int main(int argc, char **argv){
     /* save to global variable to be used in signal handler */
     main_ctx = ctx;
 
+    /* reloads asked for before now are done once the thread is up */
+    if (pthread_create(&reload_thr, NULL, reloader, NULL)){
+	syslog(LOG_CRIT,"MAIN ERR: unable to start reload thread");
+	exit(1);
+    }
+    pthread_t stop_thr;
+    if (pthread_create(&stop_thr, NULL, stopper, NULL)){
+	syslog(LOG_CRIT,"MAIN ERR: unable to start stop thread");
+	exit(1);
+    }
+
     if (init_server(ctx) < 0){
 	syslog(LOG_CRIT,"MAIN ERR: unable to init server");
 	exit(1);
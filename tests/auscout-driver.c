@@ -66,6 +66,8 @@ struct timespec diff_timespec(struct timespec start, struct timespec end){
 
 static int Arr = 500; /* arrival delta in millisecs */
 
+#define NB_MATCHES 10 /* matches asked for by the queries of cmd 4 */
+
 /* parameter to the query_thread thread */
 typedef struct thread_param {
     void *ctx;
@@ -120,6 +122,50 @@ void* query_thread(void *arg){
                                                        thrn,pnbframes[i],(char*)data, latency);
 	    free(data);
 
+	    /* simulate interarrival */ 
+	    unsigned int pause = Arr; /* = next_arrival(Arr);*/
+	    usleep(1000*pause);
+	}
+    } else if (cmd == 4){ /* queries for the best matches */
+	for (i=0;i<nbfiles;i++){
+	    uint32_t snbmatches = hosttonet32(NB_MATCHES), nbmatches;
+	    clock_gettime(CLOCK_MONOTONIC, &t1_ts);
+
+	    sendmore_msg_vsm(skt, &cmd, sizeof(uint8_t));
+	    uint32_t snbframes = hosttonet32(pnbframes[i]);
+	    sendmore_msg_vsm(skt, &snbframes, sizeof(uint32_t));
+	    sendmore_msg_vsm(skt, &snbmatches, sizeof(uint32_t));
+	    send_msg_data(skt, hashes[i], pnbframes[i]*sizeof(uint32_t), free_fn, NULL);
+
+	    /* nb of matches, then the metadata, cs and offset of each */
+	    recieve_msg(skt, &msg_size, &more, &more_size, &data);
+	    assert(msg_size == sizeof(uint32_t));
+	    memcpy(&nbmatches, data, sizeof(uint32_t));
+	    nbmatches = nettohost32(nbmatches);
+	    free(data);
+
+	    clock_gettime(CLOCK_MONOTONIC, &t2_ts);
+	    diff_ts = diff_timespec(t1_ts, t2_ts);
+	    latency = 1000000000*diff_ts.tv_sec + diff_ts.tv_nsec;
+	    sum_ull += latency;
+
+	    fprintf(stdout,"thrd%d: query %u frames, recv %u matches in %llu nsecs\n",\
+                                                       thrn, pnbframes[i], nbmatches, latency);
+	    for (j=0;j<nbmatches && more;j++){
+		float cs;
+		uint32_t offset;
+		char *mdata;
+		recieve_msg(skt, &msg_size, &more, &more_size, (void**)&mdata);
+		recieve_msg(skt, &msg_size, &more, &more_size, &data);
+		memcpy(&cs, data, sizeof(float));
+		free(data);
+		recieve_msg(skt, &msg_size, &more, &more_size, &data);
+		memcpy(&offset, data, sizeof(uint32_t));
+		free(data);
+		fprintf(stdout,"    %f cs at %d: \"%s\"\n", nettohostf(cs), (int32_t)nettohost32(offset), mdata);
+		free(mdata);
+	    }
+
 	    /* simulate interarrival */ 
 	    unsigned int pause = Arr; /* = next_arrival(Arr);*/
 	    usleep(1000*pause);
@@ -173,7 +219,8 @@ int main(int argc, char **argv){
     if (argc < 8){
 	printf("not enough input args\n");
 	printf("usage: progname <cmd> <nbthreads> <server address> <nbquerys>\n");
-	printf("    cmd            - 1 for query, 2 for file submission\n");
+	printf("    cmd            - 1 for query, 2 for file submission, 4 for query of best %d\n",\
+	       NB_MATCHES);
 	printf("    nbthreads      - number of driver threads\n");
 	printf("    arr            - ave inter-arrival time (millisecs)\n");
 	printf("    server address - address of auscoutd,  e.g. \"localhost\"\n");
@@ -233,7 +280,7 @@ int main(int argc, char **argv){
     metadata_to_inlinestr(&phonymdata, mdata_inlinestr, 512);
    
     int i, err;
-    if (cmd == 1 || cmd == 2){ /* querys */
+    if (cmd == 1 || cmd == 2 || cmd == 4){ /* querys */
 
 	for (i = 0;i < nbquerys;i++){
 	    uint32_t nbframes = rand()%12500;
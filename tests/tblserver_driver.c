@@ -97,6 +97,7 @@ void* result_listener(void *arg){
     uint8_t thrdnum;
     uint32_t uid, count = 0;
     int64_t more;
+    size_t nbmatches;
     float cs;
     size_t msg_size, more_size = sizeof(int64_t);
     void *data;
@@ -104,8 +105,8 @@ void* result_listener(void *arg){
     unsigned long long  item_start, item_end, start_ul=0ULL, end_ul;
     unsigned long long latency, sum = 0ULL, max_latency = 0ULL, min_latency = 9999999ULL;
 
-    /* recieves result messages from table server        */
-    /* in multipart message form [ thrdnum | id | cs ]   */
+    /* recieves result messages from table server                 */
+    /* in multipart message form [ thrdnum | id | cs | matches ]  */
     do {
 	/* start recieving a message */
 	recieve_msg(skt, &msg_size, &more, &more_size, &data);
@@ -125,6 +126,16 @@ void* result_listener(void *arg){
 	cs = nettohostf(cs);
 	free(data);
 
+	/* all the matches as (id, cs, offset) triples, the best one first */
+	nbmatches = 0;
+	if (more){
+	    recieve_msg(skt, &msg_size, &more, &more_size, &data);
+	    assert(msg_size % (3*sizeof(uint32_t)) == 0);
+	    nbmatches = msg_size/(3*sizeof(uint32_t));
+	    if (nbmatches > 0) assert(nettohost32(((uint32_t*)data)[0]) == uid);
+	    free(data);
+	}
+
 	/* respond to table server */
 	send_empty_msg(skt);
 	
@@ -146,8 +157,8 @@ void* result_listener(void *arg){
 	if (latency < min_latency) min_latency = latency;
 	
 
-	fprintf(stdout,"-->Recieve(%d) - %u thrd,%u uid,%f cs in %llu nsecs\n",\
-                                           count+1, thrdnum,uid,cs, latency);
+	fprintf(stdout,"-->Recieve(%d) - %u thrd,%u uid,%f cs,%zu matches in %llu nsecs\n",\
+                                           count+1, thrdnum,uid,cs,nbmatches, latency);
     } while (++count < NumberFiles);
 
     /* get end of time and compute time stats */
@@ -0,0 +1,236 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "phash_audio.h"
+#include "test_helpers.h"
+
+#define TESTNAME "storetest"
+#define NBTHREADS 8
+#define NBHASHES 400
+#define HASHLENGTH 2000
+
+static uint32_t **hashes = NULL;
+static AudioHashStore store = NULL;
+
+void remove_store(){
+    unlink(TESTNAME ".fph");
+    unlink(TESTNAME ".fpx");
+}
+
+/* each thread adds every NBTHREADS'th hash, a frame shorter each time */
+void* adder(void *arg){
+    long n = (long)arg;
+    int i;
+    for (i=n;i<NBHASHES;i+=NBTHREADS){
+	assert(add_to_audiohash_store(store, i+1, hashes[i], HASHLENGTH - i) == 0);
+    }
+    return NULL;
+}
+
+static int nbseen = 0;
+static uint32_t last_id = 0;
+
+/* the hashes are rebuilt into an index, in the order they were added */
+int add_stored(void *arg, uint32_t id, const uint32_t *hash, int nbframes){
+    nbseen++;
+    last_id = id;
+    return add_to_audioindex_builder((AudioIndexBuilder)arg, id, (uint32_t*)hash, nbframes);
+}
+
+int stop_at_ten(void *arg, uint32_t id, const uint32_t *hash, int nbframes){
+    return (++nbseen == 10) ? -7 : 0;
+}
+
+void check_store(int nbhashes){
+    const uint32_t *hash;
+    int i, nbframes;
+    for (i=0;i<nbhashes;i++){
+	hash = get_from_audiohash_store(store, i+1, &nbframes);
+	assert(hash);
+	assert(nbframes == HASHLENGTH - i);
+	assert(!memcmp(hash, hashes[i], nbframes*sizeof(uint32_t)));
+    }
+    assert(get_from_audiohash_store(store, NBHASHES+1, &nbframes) == NULL);
+}
+
+int main(int argc, char **argv){
+    pthread_t adders[NBTHREADS];
+    const uint32_t *hash;
+    struct stat info;
+    off_t words_size;
+    int nbframes, sync;
+    long i;
+
+    generate_hashes(&hashes, NBHASHES, HASHLENGTH);
+
+    /* the synced adds share their syncs */
+    for (sync=1;sync>=0;sync--){
+	printf("concurrent add test, sync %d\n", sync);
+	remove_store();
+	store = open_audiohash_store(TESTNAME, 1, sync);
+	assert(store);
+	for (i=0;i<NBTHREADS;i++){
+	    assert(pthread_create(&adders[i], NULL, adder, (void*)i) == 0);
+	}
+	for (i=0;i<NBTHREADS;i++){
+	    pthread_join(adders[i], NULL);
+	}
+	check_store(NBHASHES);
+	assert(close_audiohash_store(store) == 0);
+    }
+
+    printf("reopen test\n");
+    store = open_audiohash_store(TESTNAME, 0, 0);
+    assert(store);
+    check_store(NBHASHES);
+    assert(add_to_audiohash_store(store, 1, hashes[0], HASHLENGTH) < 0);
+    assert(close_audiohash_store(store) == 0);
+
+    printf("torn entry test\n");
+    int fd = open(TESTNAME ".fpx", O_WRONLY|O_APPEND);
+    assert(fd >= 0);
+    assert(write(fd, hashes[0], 10) == 10);
+    close(fd);
+    store = open_audiohash_store(TESTNAME, 1, 1);
+    assert(store);
+    check_store(NBHASHES);
+    /* added again, read back as last added */
+    assert(add_to_audiohash_store(store, 1, hashes[1], 100) == 0);
+    assert(close_audiohash_store(store) == 0);
+    store = open_audiohash_store(TESTNAME, 0, 0);
+    assert(store);
+    hash = get_from_audiohash_store(store, 1, &nbframes);
+    assert(hash && nbframes == 100);
+    assert(!memcmp(hash, hashes[1], 100*sizeof(uint32_t)));
+    assert(close_audiohash_store(store) == 0);
+
+    printf("torn words test\n");
+    /* words with no entry, as left by an add that failed or was cut */
+    /* short, are cut off on the next open to add to                 */
+    assert(stat(TESTNAME ".fph", &info) == 0);
+    words_size = info.st_size;
+    fd = open(TESTNAME ".fph", O_WRONLY|O_APPEND);
+    assert(fd >= 0);
+    assert(write(fd, hashes[0], 1000) == 1000);
+    close(fd);
+    store = open_audiohash_store(TESTNAME, 1, 0);
+    assert(store);
+    assert(stat(TESTNAME ".fph", &info) == 0);
+    assert(info.st_size == words_size);
+    assert(add_to_audiohash_store(store, 1, hashes[1], 100) == 0);
+    assert(close_audiohash_store(store) == 0);
+    store = open_audiohash_store(TESTNAME, 0, 0);
+    assert(store);
+    hash = get_from_audiohash_store(store, 1, &nbframes);
+    assert(hash && nbframes == 100);
+    assert(!memcmp(hash, hashes[1], 100*sizeof(uint32_t)));
+    assert(stat(TESTNAME ".fph", &info) == 0);
+    assert(info.st_size == words_size + 100*sizeof(uint32_t));
+
+    printf("verify test\n");
+    uint32_t query[500];
+    int compared;
+    /* a few bits off in each frame of a query starting at frame 300 of id 3 */
+    for (i=0;i<500;i++){
+	query[i] = hashes[2][300+i] ^ (1u << (i%32)) ^ (1u << ((i+5)%32));
+    }
+    hash = get_from_audiohash_store(store, 3, &nbframes);
+    assert(hash);
+    assert(audiohash_ber(query, 500, hash, nbframes, 300, &compared) == 2.0f/32.0f);
+    assert(compared == 500);
+    assert(audiohash_ber(query, 500, hash, nbframes, 301, NULL) > 0.4f);
+    /* past the end of the track */
+    assert(audiohash_ber(query, 500, hash, nbframes, nbframes - 100, &compared) > 0.4f);
+    assert(compared == 100);
+    assert(audiohash_ber(query, 500, hash, nbframes, nbframes, &compared) == 1.0f);
+    assert(compared == 0);
+
+    AudioMatch matches[3] = { { 5, 2.0f, 300 }, { 3, 1.0f, 298 }, { NBHASHES + 7, 0.5f, 0 } };
+    float bers[3];
+    /* id 5 is not it, id 3 is two frames off, the last is not in the store */
+    assert(verify_audiomatches(store, query, 500, matches, 3, 0, 0.25f, bers) == 1);
+    assert(matches[0].id == NBHASHES + 7 && bers[0] == -1.0f);
+    matches[0].id = 5;
+    matches[1].id = 3;
+    matches[1].offset = 298;
+    assert(verify_audiomatches(store, query, 500, matches, 2, 2, 0.25f, bers) == 1);
+    assert(matches[0].id == 3 && matches[0].offset == 300);
+    assert(bers[0] == 2.0f/32.0f);
+
+    printf("rebuild test\n");
+    AudioIndexBuilder builder = open_audioindex_builder(".", 16);
+    assert(builder);
+    assert(foreach_audiohash_store(store, add_stored, builder) == 0);
+    assert(nbseen == NBHASHES);
+    assert(last_id == 1);
+    assert(close_audioindex_builder(builder, TESTNAME ".idx") == 0);
+    AudioIndex index = open_audioindex(TESTNAME ".idx", 0, 0);
+    assert(index);
+    uint32_t id;
+    float cs;
+    for (i=1;i<NBHASHES;i+=37){
+	assert(lookupaudiohash(index, hashes[i], NULL, HASHLENGTH - i, 0, 256, 0.5, &id, &cs) == 0);
+	assert(id == i+1);
+    }
+    assert(close_audioindex(index, 0) == 0);
+
+    printf("rebuild with deletes test\n");
+    /* an id deleted from the index is left out of the next rebuild */
+    index = open_audioindex(TESTNAME ".idx", 0, 0);
+    assert(index);
+    assert(delete_from_audioindex(index, 3) == 0);
+    assert(close_audioindex(index, 0) == 0);
+    const char *idx_files[2] = { TESTNAME ".tmp", TESTNAME ".idx" };
+    builder = open_audioindex_builder(".", 16);
+    assert(builder);
+    nbseen = 0;
+    assert(foreach_undeleted_audiohash_store(store, idx_files, 2, add_stored, builder) == 0);
+    assert(nbseen == NBHASHES - 1);
+    assert(close_audioindex_builder(builder, TESTNAME ".idx") == 0);
+    /* gone from the postings, not only hidden by the deletes file */
+    unlink(TESTNAME ".idx.del");
+    index = open_audioindex(TESTNAME ".idx", 0, 0);
+    assert(index);
+    assert(lookupaudiohash(index, hashes[2], NULL, HASHLENGTH - 2, 0, 256, 0.5, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash(index, hashes[3], NULL, HASHLENGTH - 3, 0, 256, 0.5, &id, &cs) == 0);
+    assert(id == 4);
+    assert(close_audioindex(index, 0) == 0);
+    unlink(TESTNAME ".idx");
+    nbseen = 0;
+    assert(foreach_audiohash_store(store, stop_at_ten, NULL) == -7);
+    assert(nbseen == 10);
+    assert(close_audiohash_store(store) == 0);
+
+    remove_store();
+    free_hashes(hashes, NBHASHES);
+    printf("done\n");
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include "test_helpers.h"
+
+void generate_hashes(uint32_t ***hashes, unsigned int nbhashes, unsigned int hashlength){
+    unsigned int i,j;
+    (*hashes) = (uint32_t**)malloc(nbhashes*sizeof(uint32_t*));
+    for (i=0;i<nbhashes;i++){
+	(*hashes)[i] = (uint32_t*)malloc(hashlength*sizeof(uint32_t));
+	for (j=0;j<hashlength;j++){
+	    (*hashes)[i][j] = rand();
+	}
+    }
+}
+
+void free_hashes(uint32_t **hashes, unsigned int nbhashes){
+    unsigned int i;
+    for (i=0;i<nbhashes;i++){
+	free(hashes[i]);
+    }
+    free(hashes);
+}
@@ -0,0 +1,252 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "phash_audio.h"
+#include "test_helpers.h"
+
+#define TESTFILE "liveindextestfile.tmp"
+#define TESTDELFILE "liveindextestfile.tmp.del"
+#define TESTTMPFILE "liveindextestfile-flushed.tmp"
+#define TESTTMPDELFILE "liveindextestfile-flushed.tmp.del"
+#define TESTTABLE "liveindextestfile-table.tmp"
+#define SNAPDIR "liveindextestsnap"
+#define NBTHREADS 8
+#define NBHASHES 400
+#define HASHLENGTH 2000
+
+static uint32_t **hashes = NULL;
+static AudioIndex index_live = NULL;
+static int inserting = 1;
+
+/* each thread inserts every NBTHREADS'th hash */
+void* inserter(void *arg){
+    long n = (long)arg;
+    int i;
+    for (i=n;i<NBHASHES;i+=NBTHREADS){
+	assert(insert_into_audioindex(index_live, i+1, hashes[i], HASHLENGTH) == 0);
+    }
+    return NULL;
+}
+
+/* look up already inserted hashes while the inserts go on */
+void* reader(void *arg){
+    uint32_t id;
+    float cs;
+    int i = 0;
+    while (__atomic_load_n(&inserting, __ATOMIC_ACQUIRE)){
+	assert(lookupaudiohash(index_live, hashes[i], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+	assert(id == 0 || id == i+1);
+	i = (i + 1)%NBHASHES;
+    }
+    return NULL;
+}
+
+/* flush while the inserts go on */
+void* flusher(void *arg){
+    while (__atomic_load_n(&inserting, __ATOMIC_ACQUIRE)){
+	assert(flush_audioindex(index_live, TESTFILE) == 0);
+	usleep(1000);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv){
+    pthread_t inserters[NBTHREADS], reader_thr, flusher_thr;
+    int nbbkts, nbentries;
+    uint32_t id;
+    float cs;
+    long i;
+
+    generate_hashes(&hashes, NBHASHES, HASHLENGTH);
+    unlink(TESTFILE);
+
+    printf("concurrent insert test\n");
+    index_live = open_live_audioindex(TESTFILE, 1<<16);
+    assert(index_live);
+    assert(pthread_create(&reader_thr, NULL, reader, NULL) == 0);
+    assert(pthread_create(&flusher_thr, NULL, flusher, NULL) == 0);
+    for (i=0;i<NBTHREADS;i++){
+	assert(pthread_create(&inserters[i], NULL, inserter, (void*)i) == 0);
+    }
+    for (i=0;i<NBTHREADS;i++){
+	pthread_join(inserters[i], NULL);
+    }
+    __atomic_store_n(&inserting, 0, __ATOMIC_RELEASE);
+    pthread_join(reader_thr, NULL);
+    pthread_join(flusher_thr, NULL);
+
+    stat_audioindex(index_live, &nbbkts, &nbentries);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    for (i=0;i<NBHASHES;i++){
+	assert(lookupaudiohash(index_live, hashes[i], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+	assert(id == i+1);
+    }
+    assert(flush_audioindex(index_live, TESTFILE) == 0);
+    assert(close_audioindex(index_live, 1) == 0);
+
+    printf("flushed file test\n");
+    AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+    assert(index);
+    stat_audioindex(index, &nbbkts, &nbentries);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    assert(close_audioindex(index, 0) == 0);
+
+    printf("reload test\n");
+    index_live = open_live_audioindex(TESTFILE, 1<<16);
+    assert(index_live);
+    stat_audioindex(index_live, &nbbkts, &nbentries);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    assert(lookupaudiohash(index_live, hashes[7], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 8);
+    assert(close_audioindex(index_live, 1) == 0);
+
+    printf("segments test\n");
+    uint32_t *extra = (uint32_t*)malloc(HASHLENGTH*sizeof(uint32_t));
+    for (i=0;i<HASHLENGTH;i++){
+	extra[i] = rand();
+    }
+    AudioIndex segments[2];
+    segments[0] = open_audioindex(TESTFILE, 0, 0);
+    segments[1] = open_live_audioindex(NULL, 1024);
+    assert(segments[0] && segments[1]);
+    assert(insert_into_audioindex(segments[1], NBHASHES+1, extra, HASHLENGTH) == 0);
+    /* one in the main index, one only in the live one */
+    assert(lookupaudiohash_segments(segments, 2, hashes[7], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 8);
+    assert(lookupaudiohash_segments(segments, 2, extra, NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == NBHASHES+1);
+    assert(lookupaudiohash(segments[0], extra, NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+
+    printf("delete test\n");
+    unlink(TESTDELFILE);
+    assert(delete_from_audioindex(segments[0], 8) == 0);
+    assert(delete_from_audioindex(segments[0], NBHASHES+1) == 0);
+    /* gone from the main index, and from the live one through the main one */
+    assert(lookupaudiohash_segments(segments, 2, hashes[7], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash_segments(segments, 2, extra, NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash_segments(segments, 2, hashes[8], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 9);
+    assert(flush_audioindex(segments[1], TESTTMPFILE) == 0);
+    assert(close_audioindex(segments[0], 0) == 0);
+    assert(close_audioindex(segments[1], 1) == 0);
+
+    /* the merge drops the postings of both */
+    assert(merge_audioindex(TESTFILE, TESTTMPFILE) == 0);
+    index = open_audioindex(TESTFILE, 0, 0);
+    assert(index);
+    stat_audioindex(index, &nbbkts, &nbentries);
+    assert(nbentries == (NBHASHES-1)*HASHLENGTH);
+    assert(lookupaudiohash(index, hashes[8], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 9);
+    assert(close_audioindex(index, 0) == 0);
+    unlink(TESTDELFILE);
+
+    printf("table delete test\n");
+    unlink(TESTTABLE);
+    unlink(TESTTMPDELFILE);
+    index = open_audioindex(TESTTABLE, 0, 1024);
+    assert(index);
+    assert(close_audioindex(index, 0) == 0);
+    assert(merge_audioindex(TESTTABLE, TESTFILE) == 0);
+    segments[0] = open_audioindex(TESTTABLE, 0, 0);
+    segments[1] = open_live_audioindex(TESTTMPFILE, 1024);
+    assert(segments[0] && segments[1]);
+    assert(insert_into_audioindex(segments[1], NBHASHES+2, extra, HASHLENGTH) == 0);
+    /* the table keeps no deletes, the live index keeps them for both */
+    assert(delete_from_audioindex(segments[0], 10) == -1);
+    assert(delete_from_audioindex(segments[1], 10) == 0);
+    assert(delete_from_audioindex(segments[1], NBHASHES+2) == 0);
+    assert(lookupaudiohash_segments(segments, 2, hashes[9], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash_segments(segments, 2, extra, NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash_segments(segments, 2, hashes[10], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 11);
+    /* a snapshot keeps them with the live index */
+    const char *snapnames[2] = { TESTTABLE, TESTTMPFILE };
+    assert(snapshot_audioindex(segments, snapnames, 2, SNAPDIR, NULL) == 0);
+    assert(access(SNAPDIR "/" TESTTMPDELFILE, F_OK) == 0);
+    unlink(SNAPDIR "/" TESTTABLE);
+    unlink(SNAPDIR "/" TESTTMPFILE);
+    unlink(SNAPDIR "/" TESTTMPDELFILE);
+    unlink(SNAPDIR "/SNAPSHOT_NEW_FILES");
+    assert(rmdir(SNAPDIR) == 0);
+    assert(close_audioindex(segments[1], 1) == 0);
+
+    /* the deletes outlast the live index, as after a restart that replays the insert */
+    segments[1] = open_empty_live_audioindex(TESTTMPFILE, 1024);
+    assert(segments[1]);
+    assert(insert_into_audioindex(segments[1], NBHASHES+2, extra, HASHLENGTH) == 0);
+    assert(lookupaudiohash_segments(segments, 2, hashes[9], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash_segments(segments, 2, extra, NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(flush_audioindex(segments[1], TESTTMPFILE) == 0);
+    assert(close_audioindex(segments[0], 0) == 0);
+    assert(close_audioindex(segments[1], 1) == 0);
+
+    /* and the postings of the live index are dropped on the way into the table */
+    assert(merge_audioindex(TESTTABLE, TESTTMPFILE) >= 0);
+    index = open_audioindex(TESTTABLE, 0, 0);
+    assert(index);
+    assert(lookupaudiohash(index, extra, NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash(index, hashes[10], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 11);
+    assert(close_audioindex(index, 0) == 0);
+    unlink(TESTTABLE);
+    unlink(TESTTMPDELFILE);
+    free(extra);
+
+    printf("growth test\n");
+    index_live = open_live_audioindex(NULL, 1024);
+    assert(index_live);
+    stat_audioindex(index_live, &nbbkts, &nbentries);
+    assert(nbbkts == 1024);
+    for (i=0;i<NBTHREADS;i++){
+	assert(pthread_create(&inserters[i], NULL, inserter, (void*)i) == 0);
+    }
+    for (i=0;i<NBTHREADS;i++){
+	pthread_join(inserters[i], NULL);
+    }
+    stat_audioindex(index_live, &nbbkts, &nbentries);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    assert(nbbkts >= nbentries/4);
+    for (i=0;i<NBHASHES;i+=13){
+	assert(lookupaudiohash(index_live, hashes[i], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+	assert(id == i+1);
+    }
+    assert(close_audioindex(index_live, 1) == 0);
+
+    free_hashes(hashes, NBHASHES);
+    unlink(TESTFILE);
+    printf("done\n");
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+/* round trip of packed and raw posting lists, with bytes/posting and */
+/* decode ns/posting for both, and ns/probe of key lookups one at a   */
+/* time and in batches.                                               */
+/* usage: TestPostings [nbtracks] [nbframes] [keybits]                */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include "sorted_index.h"
+
+#define RAWFILE    "postingstestfile-raw.idx"
+#define PACKEDFILE "postingstestfile-packed.idx"
+#define CORRUPTFILE "postingstestfile-corrupt.idx"
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+/* nbtracks tracks of nbframes random keys of keybits bits each */
+SortedPosting* generate_postings(unsigned int nbtracks, unsigned int nbframes, unsigned int keybits){
+    size_t i, n = (size_t)nbtracks*nbframes;
+    uint32_t mask = (keybits >= 32) ? 0xffffffff : ((uint32_t)1 << keybits) - 1;
+    SortedPosting *postings = (SortedPosting*)malloc(n*sizeof(SortedPosting));
+    assert(postings);
+    for (i=0;i<n;i++){
+	postings[i].key = (((uint32_t)rand() << 16) ^ (uint32_t)rand()) & mask;
+	postings[i].id = (uint32_t)(i/nbframes) + 1;
+	postings[i].pos = (uint32_t)(i%nbframes);
+    }
+    qsort(postings, n, sizeof(SortedPosting), sortidx_compare_postings);
+    return postings;
+}
+
+void write_index(const char *path, SortedPosting *postings, size_t n, int packed){
+    size_t i;
+    SortedIndexWriter *w = sortidx_writer_open(path, sortidx_dir_bits(n));
+    assert(w);
+    w->packed = packed;
+    for (i=0;i<n;i++){
+	assert(sortidx_writer_add(w, postings[i].key, postings[i].id, postings[i].pos) == 0);
+    }
+    assert(sortidx_writer_close(w) == 0);
+}
+
+/* decode every list, check it against the input and return the time taken */
+double read_index(const char *path, SortedPosting *postings, size_t n, double *bytes){
+    SortedPostingList list;
+    TableValue val;
+    uint64_t i;
+    size_t curr = 0;
+    uint32_t sum = 0;
+
+    SortedIndex *idx = sortidx_open(path, NULL);
+    assert(idx);
+    assert(idx->header->nbpostings <= n);
+    *bytes = (double)(idx->header->keys_offset - idx->header->postings_offset);
+
+    /* page everything in before timing */
+    for (i=0;i<idx->map_size;i+=4096){
+	sum += ((const unsigned char*)idx->map)[i];
+    }
+
+    double start = now_ns();
+    for (i=0;i<idx->header->nbkeys;i++){
+	sortidx_postings(idx, &idx->keys[i], &list);
+	while (sortidx_postings_next(&list, &val)){
+	    sum += val.id + val.pos;
+	}
+    }
+    double elapsed = now_ns() - start;
+
+    /* and the nb of distinct ids of each key and of the index */
+    uint32_t df, previd = 0, maxid = 0;
+    assert(idx->df);
+    for (i=0;i<idx->header->nbkeys;i++){
+	df = 0;
+	sortidx_postings(idx, &idx->keys[i], &list);
+	while (sortidx_postings_next(&list, &val)){
+	    /* skip exact duplicates dropped by the writer */
+	    while (curr > 0 && sortidx_compare_postings(&postings[curr], &postings[curr-1]) == 0) curr++;
+	    assert(postings[curr].key == idx->keys[i].key);
+	    assert(postings[curr].id == val.id && postings[curr].pos == val.pos);
+	    curr++;
+	    if (df == 0 || val.id != previd) df++;
+	    previd = val.id;
+	    if (val.id > maxid) maxid = val.id;
+	}
+	assert(idx->df[i] == df);
+    }
+    assert(idx->nbids == maxid);
+    assert(sortidx_close(idx) == 0);
+    if (sum == 0) printf(" ");
+    return elapsed;
+}
+
+/* look up keys one at a time and in batches, check they agree and */
+/* print the time per probe of each                                */
+void find_index(const char *path, SortedPosting *postings, size_t n, unsigned int keybits){
+    const uint32_t nbprobes = 1 << 20, batch = 1024;
+    uint32_t mask = (keybits >= 32) ? 0xffffffff : ((uint32_t)1 << keybits) - 1;
+    uint32_t i, j, hits = 0, *keys = (uint32_t*)malloc(nbprobes*sizeof(uint32_t));
+    const SortedIndexKey **found = (const SortedIndexKey**)malloc(nbprobes*sizeof(SortedIndexKey*));
+    const SortedIndexKey *k;
+    assert(keys && found);
+
+    /* half of them in the index */
+    for (i=0;i<nbprobes;i++){
+	keys[i] = (i & 1) ? postings[rand()%n].key :\
+	    ((((uint32_t)rand() << 16) ^ (uint32_t)rand()) & mask);
+    }
+    SortedIndex *idx = sortidx_open(path, NULL);
+    assert(idx);
+
+    double start = now_ns();
+    for (i=0;i<nbprobes;i++){
+	k = sortidx_find(idx, keys[i]);
+	if (k) hits += k->count;
+    }
+    double single_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i=0;i<nbprobes;i+=batch){
+	sortidx_find_batch(idx, keys + i, batch, found + i);
+	for (j=0;j<batch;j++){
+	    if (found[i+j]) hits -= found[i+j]->count;
+	}
+    }
+    double batch_ns = now_ns() - start;
+    assert(hits == 0);
+
+    for (i=0;i<nbprobes;i++){
+	assert(found[i] == sortidx_find(idx, keys[i]));
+	assert(found[i] || (i & 1) == 0);
+    }
+    printf("find:   %.2f ns/probe, %.2f ns/probe in batches\n", single_ns/nbprobes, batch_ns/nbprobes);
+
+    assert(sortidx_close(idx) == 0);
+    free(keys);
+    free(found);
+}
+
+/* write size bytes of buf as an index and try to open it */
+static int opens(const unsigned char *buf, size_t size){
+    FILE *fp = fopen(CORRUPTFILE, "w");
+    assert(fp);
+    assert(fwrite(buf, 1, size, fp) == size);
+    assert(fclose(fp) == 0);
+    SortedIndex *idx = sortidx_open(CORRUPTFILE, NULL);
+    if (idx == NULL) return 0;
+    assert(sortidx_close(idx) == 0);
+    return 1;
+}
+
+/* a truncated or corrupt copy of path is refused at open */
+void corrupt_index(const char *path){
+    FILE *fp = fopen(path, "r");
+    assert(fp);
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    rewind(fp);
+    unsigned char *orig = (unsigned char*)malloc(size), *buf = (unsigned char*)malloc(size);
+    assert(orig && buf);
+    assert(fread(orig, 1, size, fp) == size);
+    fclose(fp);
+
+    SortedIndexHeader *hdr = (SortedIndexHeader*)buf;
+    memcpy(buf, orig, size);
+    assert(opens(buf, size));
+    assert(hdr->nbkeys > 1);
+
+    /* truncated, with and without a size to match */
+    assert(!opens(buf, size/2));
+    hdr->file_size = size/2;
+    assert(!opens(buf, size/2));
+
+    /* a key list past the postings */
+    memcpy(buf, orig, size);
+    SortedIndexKey *keys = (SortedIndexKey*)(buf + hdr->keys_offset);
+    keys[hdr->nbkeys-1].offset = hdr->keys_offset;
+    assert(!opens(buf, size));
+
+    /* keys out of order */
+    memcpy(buf, orig, size);
+    keys[0].key = keys[1].key;
+    assert(!opens(buf, size));
+
+    /* a directory bucket past the keys */
+    memcpy(buf, orig, size);
+    uint64_t *dir = (uint64_t*)(buf + hdr->dir_offset);
+    dir[1] = hdr->nbkeys + 1;
+    assert(!opens(buf, size));
+
+    /* keys the cursor would read past the end */
+    memcpy(buf, orig, size);
+    hdr->nbkeys = size/sizeof(SortedIndexKey);
+    assert(!opens(buf, size));
+    assert(sortidx_cursor_open(CORRUPTFILE) == NULL);
+
+    free(orig);
+    free(buf);
+    unlink(CORRUPTFILE);
+}
+
+int main(int argc, char **argv){
+    unsigned int nbtracks = (argc > 1) ? atoi(argv[1]) : 500;
+    unsigned int nbframes = (argc > 2) ? atoi(argv[2]) : 4000;
+    unsigned int keybits  = (argc > 3) ? atoi(argv[3]) : 16;
+    size_t n = (size_t)nbtracks*nbframes;
+    double raw_bytes, packed_bytes;
+
+    printf("%u tracks x %u frames, %u bit keys\n", nbtracks, nbframes, keybits);
+    SortedPosting *postings = generate_postings(nbtracks, nbframes, keybits);
+
+    write_index(RAWFILE, postings, n, 0);
+    write_index(PACKEDFILE, postings, n, 1);
+
+    double raw_ns = read_index(RAWFILE, postings, n, &raw_bytes);
+    double packed_ns = read_index(PACKEDFILE, postings, n, &packed_bytes);
+
+    printf("raw:    %.2f bytes/posting, %.2f ns/posting\n", raw_bytes/n, raw_ns/n);
+    printf("packed: %.2f bytes/posting, %.2f ns/posting\n", packed_bytes/n, packed_ns/n);
+    assert(packed_bytes < raw_bytes);
+    find_index(PACKEDFILE, postings, n, keybits);
+    corrupt_index(PACKEDFILE);
+
+    free(postings);
+    unlink(RAWFILE);
+    unlink(PACKEDFILE);
+    printf("done\n");
+    return 0;
+}
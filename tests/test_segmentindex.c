@@ -0,0 +1,245 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <dirent.h>
+#include "phash_audio.h"
+#include "test_helpers.h"
+
+#define TESTNAME "segmentindextest"
+#define NBTHREADS 8
+#define NBHASHES 400
+#define HASHLENGTH 2000
+#define MEMTABLE_SIZE 20000
+#define SNAPDIR1 "segmentindextest-snap1"
+#define SNAPDIR2 "segmentindextest-snap2"
+
+static uint32_t **hashes = NULL;
+static AudioIndex index_seg = NULL;
+static int inserting = 1;
+
+/* each thread inserts every NBTHREADS'th hash */
+void* inserter(void *arg){
+    long n = (long)arg;
+    int i;
+    for (i=n;i<NBHASHES;i+=NBTHREADS){
+	assert(insert_into_audioindex(index_seg, i+1, hashes[i], HASHLENGTH) == 0);
+    }
+    return NULL;
+}
+
+/* look up while memtables are flushed and segments merged underneath */
+void* reader(void *arg){
+    uint32_t id;
+    float cs;
+    int i = 0;
+    while (__atomic_load_n(&inserting, __ATOMIC_ACQUIRE)){
+	assert(lookupaudiohash(index_seg, hashes[i], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+	assert(id == 0 || id == i+1);
+	i = (i + 1)%NBHASHES;
+    }
+    return NULL;
+}
+
+/* remove the manifest and the segments it names */
+void remove_index(){
+    char path[FILENAME_MAX];
+    unsigned int seqno;
+    FILE *fp = fopen(TESTNAME ".segs", "r");
+    if (fp == NULL) return;
+    while (fscanf(fp, "%u", &seqno) == 1){
+	snprintf(path, FILENAME_MAX, "%s.%08u.seg", TESTNAME, seqno);
+	unlink(path);
+    }
+    fclose(fp);
+    unlink(TESTNAME ".segs");
+}
+
+/* remove a snapshot dir and the files in it */
+void remove_dir(const char *dir){
+    char path[FILENAME_MAX];
+    struct dirent *entry;
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    while ((entry = readdir(d)) != NULL){
+	if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+	snprintf(path, FILENAME_MAX, "%s/%s", dir, entry->d_name);
+	unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/* nb of lines in a file, -1 if there is no such file */
+int count_lines(const char *path){
+    char line[FILENAME_MAX];
+    int n = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    while (fgets(line, FILENAME_MAX, fp)) n++;
+    fclose(fp);
+    return n;
+}
+
+int main(int argc, char **argv){
+    pthread_t inserters[NBTHREADS], reader_thr;
+    int nbsegs, nbbuckets, nbentries;
+    uint32_t id;
+    float cs;
+    long i;
+
+    generate_hashes(&hashes, NBHASHES, HASHLENGTH);
+    remove_index();
+
+    printf("concurrent insert test\n");
+    index_seg = open_segmented_audioindex(TESTNAME, MEMTABLE_SIZE, NULL);
+    assert(index_seg);
+    assert(pthread_create(&reader_thr, NULL, reader, NULL) == 0);
+    for (i=0;i<NBTHREADS;i++){
+	assert(pthread_create(&inserters[i], NULL, inserter, (void*)i) == 0);
+    }
+    for (i=0;i<NBTHREADS;i++){
+	pthread_join(inserters[i], NULL);
+    }
+    __atomic_store_n(&inserting, 0, __ATOMIC_RELEASE);
+    pthread_join(reader_thr, NULL);
+
+    stat_audioindex(index_seg, &nbbuckets, &nbentries);
+    assert(nbbuckets > 0);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    for (i=0;i<NBHASHES;i++){
+	assert(lookupaudiohash(index_seg, hashes[i], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+	assert(id == i+1);
+    }
+
+    printf("compaction test\n");
+    assert(flush_audioindex(index_seg, NULL) == 0);
+    /* 800000 postings in memtables of 20000 - merged down to a few segments, */
+    /* one line each in the manifest                                       */
+    for (i=0;i<100;i++){
+	nbsegs = count_lines(TESTNAME ".segs");
+	if (nbsegs < 4*4) break;
+	usleep(100000);
+    }
+    assert(nbsegs < 4*4);
+    stat_audioindex(index_seg, &nbbuckets, &nbentries);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    assert(close_audioindex(index_seg, 0) == 0);
+
+    printf("reopen test\n");
+    index_seg = open_segmented_audioindex(TESTNAME, MEMTABLE_SIZE, NULL);
+    assert(index_seg);
+    stat_audioindex(index_seg, &nbbuckets, &nbentries);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    for (i=0;i<NBHASHES;i+=7){
+	assert(lookupaudiohash(index_seg, hashes[i], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+	assert(id == i+1);
+    }
+    assert(close_audioindex(index_seg, 0) == 0);
+    remove_index();
+
+    printf("delete test\n");
+    unlink(TESTNAME ".del");
+    index_seg = open_segmented_audioindex(TESTNAME, MEMTABLE_SIZE, NULL);
+    assert(index_seg);
+    assert(insert_into_audioindex(index_seg, 1, hashes[0], HASHLENGTH) == 0);
+    assert(flush_audioindex(index_seg, NULL) == 0);
+    assert(delete_from_audioindex(index_seg, 1) == 0);
+    assert(lookupaudiohash(index_seg, hashes[0], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    /* three more segments of the same size start a merge, which drops id 1 */
+    for (i=1;i<4;i++){
+	assert(insert_into_audioindex(index_seg, i+1, hashes[i], HASHLENGTH) == 0);
+	assert(flush_audioindex(index_seg, NULL) == 0);
+    }
+    for (i=0;i<100;i++){
+	nbsegs = count_lines(TESTNAME ".segs");
+	if (nbsegs == 1) break;
+	usleep(100000);
+    }
+    assert(nbsegs == 1);
+    stat_audioindex(index_seg, &nbbuckets, &nbentries);
+    assert(nbentries == 3*HASHLENGTH);
+    assert(close_audioindex(index_seg, 0) == 0);
+
+    /* still deleted once reopened */
+    index_seg = open_segmented_audioindex(TESTNAME, MEMTABLE_SIZE, NULL);
+    assert(index_seg);
+    assert(insert_into_audioindex(index_seg, 1, hashes[0], HASHLENGTH) == 0);
+    assert(lookupaudiohash(index_seg, hashes[0], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 0);
+    assert(lookupaudiohash(index_seg, hashes[2], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 3);
+    assert(close_audioindex(index_seg, 0) == 0);
+
+    remove_index();
+    unlink(TESTNAME ".del");
+
+    printf("snapshot test\n");
+    remove_dir(SNAPDIR1);
+    remove_dir(SNAPDIR2);
+    index_seg = open_segmented_audioindex(TESTNAME, MEMTABLE_SIZE, NULL);
+    assert(index_seg);
+    /* two segments and two tracks left in the memtable */
+    for (i=0;i<4;i++){
+	assert(insert_into_audioindex(index_seg, i+1, hashes[i], HASHLENGTH) == 0);
+	if (i < 2) assert(flush_audioindex(index_seg, NULL) == 0);
+    }
+    const char *names[1] = { TESTNAME };
+    assert(snapshot_audioindex(&index_seg, names, 1, SNAPDIR1, NULL) == 0);
+    assert(snapshot_audioindex(&index_seg, names, 1, SNAPDIR1, NULL) < 0);
+    /* all files are new to a replica with nothing */
+    assert(count_lines(SNAPDIR1 "/SNAPSHOT_NEW_FILES") == 4);
+
+    assert(insert_into_audioindex(index_seg, 5, hashes[4], HASHLENGTH) == 0);
+    assert(flush_audioindex(index_seg, NULL) == 0);
+    assert(snapshot_audioindex(&index_seg, names, 1, SNAPDIR2, SNAPDIR1) == 0);
+    assert(close_audioindex(index_seg, 0) == 0);
+    remove_index();
+    /* the first two segments are shipped already */
+    assert(count_lines(SNAPDIR2 "/SNAPSHOT_NEW_FILES") == 2);
+
+    index_seg = open_segmented_audioindex(SNAPDIR1 "/" TESTNAME, MEMTABLE_SIZE, NULL);
+    assert(index_seg);
+    assert(count_lines(SNAPDIR1 "/" TESTNAME ".segs") == 3);
+    stat_audioindex(index_seg, &nbbuckets, &nbentries);
+    assert(nbentries == 4*HASHLENGTH);
+    assert(lookupaudiohash(index_seg, hashes[3], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+    assert(id == 4);
+    assert(close_audioindex(index_seg, 0) == 0);
+    index_seg = open_segmented_audioindex(SNAPDIR2 "/" TESTNAME, MEMTABLE_SIZE, NULL);
+    assert(index_seg);
+    stat_audioindex(index_seg, &nbbuckets, &nbentries);
+    assert(nbentries == 5*HASHLENGTH);
+    assert(close_audioindex(index_seg, 0) == 0);
+    remove_dir(SNAPDIR1);
+    remove_dir(SNAPDIR2);
+
+    free_hashes(hashes, NBHASHES);
+    printf("done\n");
+    return 0;
+}
@@ -0,0 +1,631 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "phash_audio.h"
+#include "test_helpers.h"
+
+#define TESTFILE "sortedindextestfile.idx"
+#define TESTFILE2 "sortedindextestfile2.idx"
+
+/* build in memory only, no runs */
+static void warmup_progress(uint64_t done, uint64_t total, void *arg){
+  assert(done <= total);
+  *(uint64_t*)arg = done;
+}
+
+void simple_build_test(){
+  const unsigned int nbhashes = 100, hashlength = 2000;
+  uint32_t **hashes = NULL;
+  unsigned int i;
+  int res;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+
+  AudioIndexBuilder builder = open_audioindex_builder(".", 64);
+  assert(builder);
+  for (i=0;i<nbhashes;i++){
+    res = add_to_audioindex_builder(builder, i+1, hashes[i], hashlength);
+    assert(res == 0);
+  }
+  res = close_audioindex_builder(builder, TESTFILE);
+  assert(res == 0);
+
+  /* read only */
+  assert(open_audioindex(TESTFILE, 1, 0) == NULL);
+
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  uint64_t warmed = 0;
+  res = warmup_audioindex(index, 4, 0, warmup_progress, &warmed);
+  assert(res == 0);
+  assert(warmed > 0);
+
+  int nbbkts, nbentries;
+  stat_audioindex(index, &nbbkts, &nbentries);
+  assert(nbentries == nbhashes*hashlength);
+
+  uint32_t id;
+  float cs;
+  for (i=0;i<nbhashes;i++){
+    res = lookupaudiohash(index, hashes[i], NULL, hashlength, 0, 256, 0.04, &id, &cs);
+    assert(res == 0);
+    assert(id == i+1);
+  }
+
+  res = close_audioindex(index, 0);
+  assert(res == 0);
+  free_hashes(hashes, nbhashes);
+  unlink(TESTFILE);
+}
+
+/* 1MB of sort memory - forces many runs and a collapse of a full level of runs */
+void external_build_test(){
+  const unsigned int nbhashes = 100, hashlength = 60000;
+  uint32_t **hashes = NULL;
+  unsigned int i;
+  int res;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+
+  /* the same hash words in two tracks must both be kept */
+  for (i=0;i<hashlength;i++){
+    hashes[1][i] = hashes[0][i];
+  }
+
+  AudioIndexBuilder builder = open_audioindex_builder(".", 1);
+  assert(builder);
+  for (i=0;i<nbhashes;i++){
+    res = add_to_audioindex_builder(builder, i+1, hashes[i], hashlength);
+    assert(res == 0);
+  }
+  res = close_audioindex_builder(builder, TESTFILE);
+  assert(res == 0);
+
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  int nbbkts, nbentries;
+  stat_audioindex(index, &nbbkts, &nbentries);
+  assert(nbentries == nbhashes*hashlength);
+
+  uint32_t id;
+  float cs;
+  for (i=2;i<nbhashes;i+=7){
+    res = lookupaudiohash(index, hashes[i], NULL, hashlength, 0, 256, 0.04, &id, &cs);
+    assert(res == 0);
+    assert(id == i+1);
+  }
+  res = lookupaudiohash(index, hashes[0], NULL, hashlength, 0, 256, 0.04, &id, &cs);
+  assert(res == 0);
+  assert(id == 1 || id == 2);
+
+  res = close_audioindex(index, 0);
+  assert(res == 0);
+
+  /* copied into anonymous memory, the lookups must not change */
+  AudioIndexOpts opts = { INDEX_PAGES_HUGE_2MB, INDEX_NUMA_NONE };
+  index = open_audioindex_opts(TESTFILE, 0, 0, &opts);
+  assert(index);
+  for (i=2;i<nbhashes;i+=7){
+    res = lookupaudiohash(index, hashes[i], NULL, hashlength, 0, 256, 0.04, &id, &cs);
+    assert(res == 0);
+    assert(id == i+1);
+  }
+  res = close_audioindex(index, 0);
+  assert(res == 0);
+
+  free_hashes(hashes, nbhashes);
+  unlink(TESTFILE);
+}
+
+/* fold two sorted shards and a table into one sorted index */
+void combine_test(){
+  const unsigned int nbhashes = 60, hashlength = 3000;
+  const char *shards[3] = { "shardtestfile1.idx", "shardtestfile2.idx", "shardtestfile3.tmp" };
+  uint32_t **hashes = NULL;
+  unsigned int i;
+  int res;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+
+  AudioIndexBuilder builder1 = open_audioindex_builder(".", 1);
+  AudioIndexBuilder builder2 = open_audioindex_builder(".", 1);
+  AudioIndex table = open_audioindex(shards[2], 1, 1024);
+  assert(builder1 && builder2 && table);
+  for (i=0;i<nbhashes;i++){
+    switch (i%3){
+    case 0:
+      res = add_to_audioindex_builder(builder1, i+1, hashes[i], hashlength);
+      break;
+    case 1:
+      res = add_to_audioindex_builder(builder2, i+1, hashes[i], hashlength);
+      break;
+    default:
+      res = insert_into_audioindex(table, i+1, hashes[i], hashlength);
+    }
+    assert(res == 0);
+  }
+  assert(close_audioindex_builder(builder1, shards[0]) == 0);
+  assert(close_audioindex_builder(builder2, shards[1]) == 0);
+  assert(flush_audioindex(table, shards[2]) == 0);
+  assert(close_audioindex(table, 1) == 0);
+
+  /* first two shards, then fold the table in with a merge */
+  res = combine_audioindex(TESTFILE, shards, 2);
+  assert(res == 0);
+  res = merge_audioindex(TESTFILE, shards[2]);
+  assert(res == 0);
+
+  /* tmp table is left empty */
+  assert(merge_audioindex(TESTFILE, shards[2]) == 1);
+
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  int nbbkts, nbentries;
+  stat_audioindex(index, &nbbkts, &nbentries);
+  assert(nbentries == nbhashes*hashlength);
+
+  uint32_t id;
+  float cs;
+  for (i=0;i<nbhashes;i++){
+    res = lookupaudiohash(index, hashes[i], NULL, hashlength, 0, 256, 0.04, &id, &cs);
+    assert(res == 0);
+    assert(id == i+1);
+  }
+
+  assert(close_audioindex(index, 0) == 0);
+  free_hashes(hashes, nbhashes);
+  for (i=0;i<3;i++){
+    unlink(shards[i]);
+  }
+  unlink(TESTFILE);
+}
+
+/* the same hashes in a sorted, a live and a table index, with */
+/* a run of silence in each hash that makes key 0 hot          */
+void analyze_test(){
+  const unsigned int nbhashes = 40, hashlength = 2000, silence = 100;
+  uint32_t **hashes = NULL;
+  AudioIndexStats stats[3];
+  unsigned int i, j;
+  uint64_t nbchains, nbentries;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+  for (i=0;i<nbhashes;i++){
+    for (j=0;j<silence;j++){
+      hashes[i][j] = 0;
+    }
+  }
+
+  AudioIndexBuilder builder = open_audioindex_builder(".", 1);
+  AudioIndex live = open_live_audioindex(NULL, 1024);
+  AudioIndex table = open_audioindex("analyzetestfile.tmp", 1, 1024);
+  assert(builder && live && table);
+  for (i=0;i<nbhashes;i++){
+    assert(add_to_audioindex_builder(builder, i+1, hashes[i], hashlength) == 0);
+    assert(insert_into_audioindex(live, i+1, hashes[i], hashlength) == 0);
+    assert(insert_into_audioindex(table, i+1, hashes[i], hashlength) == 0);
+  }
+  assert(close_audioindex_builder(builder, TESTFILE) == 0);
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  assert(analyze_audioindex(index, 5, &stats[0]) == 0);
+  assert(analyze_audioindex(live, 5, &stats[1]) == 0);
+  assert(analyze_audioindex(table, 5, &stats[2]) == 0);
+  for (i=0;i<3;i++){
+    nbchains = nbentries = 0;
+    for (j=0;j<AUDIOINDEX_HIST_BINS;j++){
+      nbchains += stats[i].chain_hist[j];
+      nbentries += stats[i].list_hist[j];
+    }
+    assert(nbchains == stats[i].nbbuckets);
+    assert(nbentries == stats[i].nbkeys);
+    assert(stats[i].nbkeys == stats[0].nbkeys);
+    assert(stats[i].nbhot == 5);
+    for (j=1;j<5;j++){
+      assert(stats[i].hot[j-1].count >= stats[i].hot[j].count);
+    }
+    assert(stats[i].key_probes >= stats[i].nbkeys);
+    assert(stats[i].nbbytes > 0);
+  }
+  /* a table keeps one posting per key */
+  for (i=0;i<2;i++){
+    assert(stats[i].nbpostings == nbhashes*hashlength);
+    assert(stats[i].zero_postings == nbhashes*silence);
+    assert(stats[i].hot[0].key == 0);
+    assert(stats[i].hot[0].count == nbhashes*silence);
+    assert(stats[i].max_list == nbhashes*silence);
+    for (j=0;j<AUDIOINDEX_HIST_BINS;j++){
+      assert(stats[i].list_hist[j] == stats[0].list_hist[j]);
+    }
+  }
+  assert(stats[2].nbpostings == stats[2].nbkeys);
+
+  for (i=0;i<3;i++){
+    free_audioindex_stats(&stats[i]);
+  }
+  assert(close_audioindex(index, 0) == 0);
+  assert(close_audioindex(live, 1) == 0);
+  assert(close_audioindex(table, 1) == 0);
+  free_hashes(hashes, nbhashes);
+  unlink("analyzetestfile.tmp");
+  unlink(TESTFILE);
+}
+
+static float weighted_score(const AudioVote *vote, int blocksize, void *arg){
+  return (*(float*)arg)*(float)vote->count/(float)blocksize;
+}
+
+/* more ids share the first block than a lookup used to keep */
+/* results for, the match only shows from the second block   */
+void voter_test(){
+  const unsigned int nbhashes = 300, hashlength = 256, blocksize = 64;
+  uint32_t **hashes = NULL;
+  unsigned int i, j;
+  uint32_t id;
+  float cs, weight = 0.5f;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+  for (i=1;i<nbhashes;i++){
+    for (j=0;j<blocksize;j++){
+      hashes[i][j] = hashes[0][j];
+    }
+  }
+  AudioIndexBuilder builder = open_audioindex_builder(".", 1);
+  assert(builder);
+  for (i=0;i<nbhashes;i++){
+    assert(add_to_audioindex_builder(builder, i+1, hashes[i], hashlength) == 0);
+  }
+  assert(close_audioindex_builder(builder, TESTFILE) == 0);
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  AudioVoter voter = open_audiovoter(NULL, NULL);
+  assert(voter);
+  for (i=0;i<nbhashes;i+=7){
+    assert(lookupaudiohash_voter(voter, &index, 1, hashes[i], NULL, hashlength, 0, blocksize,\
+				 1.5, &id, &cs) == 0);
+    assert(id == i+1);
+    assert(cs == 2.0f);
+  }
+  close_audiovoter(voter);
+
+  voter = open_audiovoter(weighted_score, &weight);
+  assert(voter);
+  assert(lookupaudiohash_voter(voter, &index, 1, hashes[250], NULL, hashlength, 0, blocksize,\
+			       1.5, &id, &cs) == 0);
+  assert(id == 251);
+  assert(cs == 1.5f);
+  close_audiovoter(voter);
+
+  assert(lookupaudiohash(index, hashes[299], NULL, hashlength, 0, blocksize, 1.5, &id, &cs) == 0);
+  assert(id == 300);
+
+  /* the keys of the first block are in every track, skipping them */
+  /* the match only starts in the second block                     */
+  AudioVoterOpts stop_opts = { AUDIO_VOTE_TRACKS, 0, 0.0f, NULL, NULL, 0.0f, 0.0f, 0.0f, 0.5f };
+  AudioVote best;
+  voter = open_audiovoter_opts(&stop_opts);
+  assert(voter);
+  assert(lookupaudiohash_voter(voter, &index, 1, hashes[42], NULL, hashlength, 0, blocksize,\
+			       1.5, &id, &cs) == 0);
+  assert(id == 43);
+  assert(cs == 2.0f);
+  assert(audiovoter_top(voter, &best, 1) == 1);
+  assert(best.id == 43 && best.first_pos == blocksize);
+
+  /* a one track segment next to the index: its keys are rare over both */
+  /* and vote, those of the first block are still too common           */
+  uint32_t **single = NULL;
+  AudioIndex both[2];
+  generate_hashes(&single, 1, hashlength);
+  builder = open_audioindex_builder(".", 1);
+  assert(builder);
+  assert(add_to_audioindex_builder(builder, nbhashes+1, single[0], hashlength) == 0);
+  assert(close_audioindex_builder(builder, TESTFILE2) == 0);
+  both[0] = index;
+  both[1] = open_audioindex(TESTFILE2, 0, 0);
+  assert(both[1]);
+  assert(lookupaudiohash_voter(voter, both, 2, single[0], NULL, hashlength, 0, blocksize,\
+			       1.5, &id, &cs) == 0);
+  assert(id == nbhashes+1);
+  assert(lookupaudiohash_voter(voter, both, 2, hashes[42], NULL, hashlength, 0, blocksize,\
+			       1.5, &id, &cs) == 0);
+  assert(id == 43);
+  assert(audiovoter_top(voter, &best, 1) == 1);
+  assert(best.first_pos == blocksize);
+  /* too few ids on its own to judge any key */
+  assert(lookupaudiohash_voter(voter, &both[1], 1, single[0], NULL, hashlength, 0, blocksize,\
+			       1.5, &id, &cs) == 0);
+  assert(id == nbhashes+1);
+  assert(close_audioindex(both[1], 0) == 0);
+  free_hashes(single, 1);
+  unlink(TESTFILE2);
+  close_audiovoter(voter);
+
+  /* a query cut from the middle of a track matches at its offset in it */
+  AudioVoterOpts opts = { AUDIO_VOTE_OFFSETS, 1, 0.0f, NULL, NULL };
+  AudioVote top[2];
+  voter = open_audiovoter_opts(&opts);
+  assert(voter);
+  assert(lookupaudiohash_voter(voter, &index, 1, hashes[120] + 70, NULL, hashlength - 70, 0,\
+			       blocksize, 0.5, &id, &cs) == 0);
+  assert(id == 121);
+  int nbtop = audiovoter_top(voter, top, 2);
+  assert(nbtop >= 1);
+  assert(top[0].id == 121 && top[0].offset == 70);
+  assert(nbtop == 1 || top[0].count >= top[1].count);
+  close_audiovoter(voter);
+
+  opts.binwidth = 4;
+  opts.dominance = 4.0f;
+  voter = open_audiovoter_opts(&opts);
+  assert(voter);
+  assert(lookupaudiohash_voter(voter, &index, 1, hashes[120] + 70, NULL, hashlength - 70, 0,\
+			       blocksize, 0.5, &id, &cs) == 0);
+  assert(id == 121);
+  assert(audiovoter_top(voter, top, 1) == 1);
+  assert(top[0].offset == 68);
+  /* stopped as soon as it was over the threshold */
+  assert(cs < 0.5 + 1.0/blocksize);
+  close_audiovoter(voter);
+
+  assert(close_audioindex(index, 0) == 0);
+  free_hashes(hashes, nbhashes);
+  unlink(TESTFILE);
+}
+
+/* query frames with bits flipped are found through the toggles, */
+/* a bit listed twice in the toggles is only probed once, and a  */
+/* query made of two tracks finds both with their offsets        */
+void toggles_test(){
+  const unsigned int nbhashes = 20, hashlength = 256, blocksize = 64, P = 4;
+  uint32_t **hashes = NULL, query[256];
+  uint8_t *toggles[256], bits[256][4];
+  unsigned int i;
+  uint32_t id;
+  float cs;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+  AudioIndexBuilder builder = open_audioindex_builder(".", 1);
+  assert(builder);
+  for (i=0;i<nbhashes;i++){
+    assert(add_to_audioindex_builder(builder, i+1, hashes[i], hashlength) == 0);
+  }
+  assert(close_audioindex_builder(builder, TESTFILE) == 0);
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  for (i=0;i<hashlength;i++){
+    bits[i][0] = bits[i][1] = i%32;
+    bits[i][2] = (i+7)%32;
+    bits[i][3] = (i+13)%32;
+    toggles[i] = bits[i];
+    query[i] = hashes[5][i] ^ (0x80000000 >> bits[i][0]) ^ (0x80000000 >> bits[i][3]);
+  }
+  assert(lookupaudiohash(index, query, NULL, hashlength, 0, blocksize, 1.5, &id, &cs) == 0);
+  assert(id == 0);
+  assert(lookupaudiohash(index, query, toggles, hashlength, P, blocksize, 1.5, &id, &cs) == 0);
+  assert(id == 6);
+  assert(cs == 2.0f);
+
+  AudioVoter voter = open_audiovoter(NULL, NULL);
+  assert(voter);
+  for (i=0;i<3;i++){
+    assert(lookupaudiohash_voter(voter, &index, 1, query, toggles, hashlength, P, blocksize,\
+				 1.5, &id, &cs) == 0);
+    assert(id == 6);
+  }
+  close_audiovoter(voter);
+
+  /* a query of the first halves of two tracks matches both */
+  AudioMatch matches[3];
+  for (i=0;i<hashlength/2;i++){
+    query[i] = hashes[3][i];
+    query[i+hashlength/2] = hashes[7][i];
+  }
+  voter = open_audiovoter(NULL, NULL);
+  assert(voter);
+  assert(lookupaudiohash_topk(voter, &index, 1, query, NULL, hashlength, 0, blocksize, 1.5,\
+			      matches, 1) == 1);
+  assert(matches[0].id == 4 && matches[0].cs == 2.0f && matches[0].offset == 0);
+  assert(lookupaudiohash_topk(voter, &index, 1, query, NULL, hashlength, 0, blocksize, 1.5,\
+			      matches, 3) == 2);
+  assert(matches[0].id == 4 && matches[0].cs == 2.0f && matches[0].offset == 0);
+  assert(matches[1].id == 8 && matches[1].cs == 2.0f);
+  assert(matches[1].offset == -(int32_t)hashlength/2);
+  assert(lookupaudiohash_topk(voter, &index, 1, query, NULL, hashlength, 0, blocksize, 2.5,\
+			      matches, 3) == 0);
+  close_audiovoter(voter);
+
+  assert(close_audioindex(index, 0) == 0);
+  free_hashes(hashes, nbhashes);
+  unlink(TESTFILE);
+}
+
+/* a lookup with the sequential test stops within a few frames on */
+/* a track of the index and on a query of none                     */
+void sprt_test(){
+  const unsigned int nbhashes = 20, hashlength = 512, blocksize = 64;
+  uint32_t **hashes = NULL, **noise = NULL;
+  unsigned int i;
+  uint32_t id;
+  float cs;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+  generate_hashes(&noise, 1, hashlength);
+  AudioIndexBuilder builder = open_audioindex_builder(".", 1);
+  assert(builder);
+  for (i=0;i<nbhashes;i++){
+    assert(add_to_audioindex_builder(builder, i+1, hashes[i], hashlength) == 0);
+  }
+  assert(close_audioindex_builder(builder, TESTFILE) == 0);
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  /* without the test a query of noise reads all of it */
+  AudioVoter voter = open_audiovoter(NULL, NULL);
+  assert(voter);
+  assert(lookupaudiohash_voter(voter, &index, 1, noise[0], NULL, hashlength, 0, blocksize,\
+			       1.5, &id, &cs) == 0);
+  assert(id == 0);
+  assert(audiovoter_frames(voter) == (int)hashlength);
+  close_audiovoter(voter);
+
+  AudioVoterOpts opts = { AUDIO_VOTE_TRACKS, 0, 0.0f, NULL, NULL, 0.001f, 0.5f, 0.0f };
+  voter = open_audiovoter_opts(&opts);
+  assert(voter);
+  for (i=0;i<nbhashes;i++){
+    assert(lookupaudiohash_voter(voter, &index, 1, hashes[i], NULL, hashlength, 0, blocksize,\
+				 1.5, &id, &cs) == 0);
+    assert(id == i+1);
+    assert(cs > 0.0f && cs < 1.5f);
+    assert(audiovoter_frames(voter) < 8);
+  }
+  assert(lookupaudiohash_voter(voter, &index, 1, noise[0], NULL, hashlength, 0, blocksize,\
+			       1.5, &id, &cs) == 0);
+  assert(id == 0);
+  assert(audiovoter_frames(voter) < 16);
+
+  /* a miss is given up on for any nb of matches */
+  AudioMatch matches[4];
+  assert(lookupaudiohash_topk(voter, &index, 1, noise[0], NULL, hashlength, 0, blocksize,\
+			      1.5, matches, 4) == 0);
+  assert(audiovoter_frames(voter) < 16);
+  close_audiovoter(voter);
+
+  assert(close_audioindex(index, 0) == 0);
+  free_hashes(hashes, nbhashes);
+  free_hashes(noise, 1);
+  unlink(TESTFILE);
+}
+
+/* a lookup split over threads finds the same matches as one in a */
+/* single thread, with the tracks cut between runs joined again   */
+void parallel_test(){
+  const unsigned int nbhashes = 20, hashlength = 1024, blocksize = 64;
+  uint32_t **hashes = NULL, query[1024];
+  unsigned int i;
+  int n;
+  uint32_t id, par_id;
+  float cs, par_cs;
+
+  generate_hashes(&hashes, nbhashes, hashlength);
+  AudioIndexBuilder builder = open_audioindex_builder(".", 1);
+  assert(builder);
+  for (i=0;i<nbhashes;i++){
+    assert(add_to_audioindex_builder(builder, i+1, hashes[i], hashlength) == 0);
+  }
+  assert(close_audioindex_builder(builder, TESTFILE) == 0);
+  AudioIndex index = open_audioindex(TESTFILE, 0, 0);
+  assert(index);
+
+  for (i=0;i<hashlength/2;i++){
+    query[i] = hashes[3][i];
+    query[i+hashlength/2] = hashes[7][i];
+  }
+  AudioVoterOpts opts = { AUDIO_VOTE_TRACKS, 0, 0.0f, NULL, NULL, 0.0f, 0.0f, 0.0f, 0.0f, 3 };
+  AudioVoter serial = open_audiovoter(NULL, NULL);
+  AudioVoter parallel = open_audiovoter_opts(&opts);
+  assert(serial && parallel);
+
+  /* all of the query is read, as no third id is over the threshold */
+  AudioMatch matches[3], par_matches[3];
+  n = lookupaudiohash_topk(serial, &index, 1, query, NULL, hashlength, 0, blocksize, 1.5,\
+			   matches, 3);
+  assert(n == 2);
+  assert(lookupaudiohash_topk(parallel, &index, 1, query, NULL, hashlength, 0, blocksize, 1.5,\
+			      par_matches, 3) == n);
+  assert(audiovoter_frames(parallel) == (int)hashlength);
+  assert(!memcmp(matches, par_matches, n*sizeof(AudioMatch)));
+  assert(par_matches[0].cs == (float)(hashlength/2)/blocksize);
+  assert(par_matches[1].offset == -(int32_t)hashlength/2);
+
+  /* a single match stops all the runs */
+  for (i=0;i<nbhashes;i+=3){
+    assert(lookupaudiohash_voter(serial, &index, 1, hashes[i], NULL, hashlength, 0, blocksize,\
+				 1.5, &id, &cs) == 0);
+    assert(lookupaudiohash_voter(parallel, &index, 1, hashes[i], NULL, hashlength, 0, blocksize,\
+				 1.5, &par_id, &par_cs) == 0);
+    assert(id == i+1 && par_id == id);
+    assert(par_cs >= cs);
+    assert(audiovoter_frames(parallel) < (int)hashlength);
+  }
+  close_audiovoter(serial);
+  close_audiovoter(parallel);
+
+  /* offset bins add up the same whichever run voted in them */
+  AudioVote top, par_top;
+  opts.mode = AUDIO_VOTE_OFFSETS;
+  opts.binwidth = 1;
+  opts.nbthreads = 0;
+  serial = open_audiovoter_opts(&opts);
+  opts.nbthreads = 4;
+  parallel = open_audiovoter_opts(&opts);
+  assert(serial && parallel);
+  assert(lookupaudiohash_voter(serial, &index, 1, hashes[9] + 70, NULL, hashlength - 70, 0,\
+			       blocksize, 100.0, &id, &cs) == 0);
+  assert(lookupaudiohash_voter(parallel, &index, 1, hashes[9] + 70, NULL, hashlength - 70, 0,\
+			       blocksize, 100.0, &par_id, &par_cs) == 0);
+  assert(id == 0 && par_id == 0);
+  assert(audiovoter_top(serial, &top, 1) == 1);
+  assert(audiovoter_top(parallel, &par_top, 1) == 1);
+  assert(top.id == 10 && top.offset == 70);
+  assert(!memcmp(&top, &par_top, sizeof(AudioVote)));
+  close_audiovoter(serial);
+  close_audiovoter(parallel);
+
+  assert(close_audioindex(index, 0) == 0);
+  free_hashes(hashes, nbhashes);
+  unlink(TESTFILE);
+}
+
+int main(int argc, char **argv){
+
+  printf("simple build test\n");
+  simple_build_test();
+  printf("external build test\n");
+  external_build_test();
+  printf("combine test\n");
+  combine_test();
+  printf("analyze test\n");
+  analyze_test();
+  printf("voter test\n");
+  voter_test();
+  printf("toggles test\n");
+  toggles_test();
+  printf("sprt test\n");
+  sprt_test();
+  printf("parallel test\n");
+  parallel_test();
+  printf("done\n");
+
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+    Audio Scout - audio content indexing software
+    Copyright (C) 2010  D. Grant Starkweather & Evan Klinger
+
+    Audio Scout is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D. Grant Starkweather - dstarkweather@phash.org
+    Evan Klinger          - eklinger@phash.org
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "phash_audio.h"
+#include "test_helpers.h"
+
+#define TESTNAME "waltest"
+#define NBTHREADS 8
+#define NBHASHES 400
+#define HASHLENGTH 2000
+
+static uint32_t **hashes = NULL;
+static AudioWal wal = NULL;
+
+/* each thread logs every NBTHREADS'th hash, the first half of them before */
+/* the log is rotated by the main thread                                   */
+void* appender(void *arg){
+    long n = (long)arg;
+    int i;
+    for (i=n;i<NBHASHES;i+=NBTHREADS){
+	assert(append_audiowal(wal, i+1, hashes[i], HASHLENGTH) == 0);
+    }
+    return NULL;
+}
+
+void remove_wal(){
+    char path[FILENAME_MAX];
+    uint32_t i;
+    for (i=0;i<16;i++){
+	snprintf(path, FILENAME_MAX, "%s.wal.%08u", TESTNAME, i);
+	unlink(path);
+    }
+}
+
+int count_wal(){
+    char path[FILENAME_MAX];
+    uint32_t i;
+    int count = 0;
+    for (i=0;i<16;i++){
+	snprintf(path, FILENAME_MAX, "%s.wal.%08u", TESTNAME, i);
+	if (access(path, F_OK) == 0) count++;
+    }
+    return count;
+}
+
+/* replay the log into a new live index and check all of it is there */
+void check_replay(int nbthreads){
+    int nbbkts, nbentries;
+    uint32_t id;
+    float cs;
+    int i;
+    AudioIndex index = open_live_audioindex(NULL, 1<<16);
+    assert(index);
+    wal = open_audiowal(TESTNAME, index, nbthreads);
+    assert(wal);
+    stat_audioindex(index, &nbbkts, &nbentries);
+    assert(nbentries == NBHASHES*HASHLENGTH);
+    for (i=0;i<NBHASHES;i+=7){
+	assert(lookupaudiohash(index, hashes[i], NULL, HASHLENGTH, 0, 256, 0.04, &id, &cs) == 0);
+	assert(id == i+1);
+    }
+    assert(close_audiowal(wal, 0) == 0);
+    assert(close_audioindex(index, 1) == 0);
+}
+
+int main(int argc, char **argv){
+    pthread_t appenders[NBTHREADS];
+    uint32_t upto;
+    long i;
+
+    generate_hashes(&hashes, NBHASHES, HASHLENGTH);
+    remove_wal();
+
+    printf("concurrent append test\n");
+    wal = open_audiowal(TESTNAME, NULL, 1);
+    assert(wal);
+    for (i=0;i<NBTHREADS;i++){
+	assert(pthread_create(&appenders[i], NULL, appender, (void*)i) == 0);
+    }
+    usleep(1000);
+    assert(rotate_audiowal(wal, &upto) == 0);
+    assert(upto == 0);
+    for (i=0;i<NBTHREADS;i++){
+	pthread_join(appenders[i], NULL);
+    }
+    /* what was not trimmed is kept when closed */
+    assert(close_audiowal(wal, 0) == 0);
+    assert(count_wal() == 2);
+
+    printf("replay test\n");
+    check_replay(1);
+    check_replay(NBTHREADS);
+    /* each open starts a file of its own */
+    assert(count_wal() == 4);
+
+    printf("torn record test\n");
+    char path[FILENAME_MAX];
+    snprintf(path, FILENAME_MAX, "%s.wal.%08u", TESTNAME, 1);
+    int fd = open(path, O_WRONLY|O_APPEND);
+    assert(fd >= 0);
+    /* the head of a record cut short */
+    assert(write(fd, hashes[0], 20) == 20);
+    close(fd);
+    check_replay(NBTHREADS);
+
+    printf("trim test\n");
+    wal = open_audiowal(TESTNAME, NULL, 1);
+    assert(wal);
+    assert(rotate_audiowal(wal, &upto) == 0);
+    assert(upto == 5);
+    assert(trim_audiowal(wal, upto) == 0);
+    assert(count_wal() == 1);
+    assert(close_audiowal(wal, 1) == 0);
+    assert(count_wal() == 0);
+
+    free_hashes(hashes, NBHASHES);
+    printf("done\n");
+    return 0;
+}